@@ -117,7 +117,7 @@ void extractResponse(proxy *theProxy, char *response, char **cat1, char **cat2,
  * name:      populateFinalDiv
  * purpose:   takes the four populated hints and inserts them into the div 
  *            buffer used to display the hints on the page
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
  * effects:   stores the final div buffer in the LLMResponse field
  */
@@ -416,17 +416,17 @@ void formatConnectionsSolution(proxy *theProxy, char *connSol)
  * name:      checkHintRegeneration
  * purpose:   checks if a hint regenerate header was sent from the javascript 
  *            connections code
- * arguments: the proxy, the slot of the table, the index of the bucket
+ * arguments: the proxy, the client's socket descriptor
  * returns:   true if the hint regenerate header was set, false otherwise
  * effects:   sends the CORS response header if the header field isn't set yet
  */
-bool checkHintRegeneration(proxy *theProxy, int slot, int index)
+bool checkHintRegeneration(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: checkHintRegeneration\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
 
         char *hintHeader = "regenerate-hint";
-        char *endStr = strstr(client->msgHeader, hintHeader);
+        char *endStr = strstr(client->details->msgHeader, hintHeader);
         
         // request is not complete, so we can't do anything yet
         if (endStr == NULL) {
@@ -448,15 +448,15 @@ bool checkHintRegeneration(proxy *theProxy, int slot, int index)
  * name:      sendNewlyGeneratedHints
  * purpose:   generates new hints for the user and sends these to the browser 
  *            to be displayed to the user
- * arguments: the proxy, the slot of the table, the index of the bucket
+ * arguments: the proxy, the client's socket descriptor
  * returns:   none
  * effects:   generates new hints and writes to client
  */
-void sendNewlyGeneratedHints(proxy *theProxy, int slot, int index)
+void sendNewlyGeneratedHints(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: sendNewlyGeneratedHints\n");
 
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
 
         char LLMResponse[4096] = "";
         makeProxyRequestLLM("4o-mini", "Please give one descriptive but obscure hint for each one of the following 4 categories. Don't directly mention the category and use this format for your respose: Category 1: [hint]; Category 2: [hint]; Category 3: [hint]; Category 4: [hint]. Please keep each hint around 500 characters.",
@@ -480,5 +480,5 @@ void sendNewlyGeneratedHints(proxy *theProxy, int slot, int index)
                 "%s", responseLength, response);
 
         write(client->clientSD, fullResponse, fullResponseLength);
-        removeClient(theProxy, slot, index);
+        removeClient(theProxy, SD);
 }
\ No newline at end of file
@@ -0,0 +1,281 @@
+/*****************************************************************************
+ *
+ *      certcache.c
+ *
+ *      Isabel Muste (imuste01)
+ *      Marti Zentmaier (mzentm01)
+ *
+ *      11/10/2024
+ *
+ *      CS 112 Final Project
+ *
+ *      Contains the cache of forged certificates shared by the workers.
+ *      Generating a key pair and signing a certificate is the most expensive
+ *      step of a MITM connection, so the certificate and key forged for a
+ *      host are kept, loaded into an SSL context of their own, and the
+ *      client handshakes of the next connections to the same host switch to
+ *      that context. The cache holds a bounded number of hosts and evicts
+ *      the least recently used one when it is full, and an entry is forged
+ *      again shortly before its certificate expires. The contexts are
+ *      reference counted, so an evicted entry stays valid for the
+ *      connections still using it.
+ *
+ *
+ *****************************************************************************/
+
+#include "proxy.h"
+#include "logging.h"
+
+#define CERT_CACHE_SLOTS 256
+#define CERT_CACHE_ITEMS 1024
+#define CERT_RENEW_MARGIN 86400
+
+static certCache *sharedCertCache = NULL;
+static pthread_once_t certCacheOnce = PTHREAD_ONCE_INIT;
+static void createCertCache();
+
+
+
+/*****************************************************************************
+*                             CERT CACHE SETUP
+******************************************************************************/
+
+
+/*
+ * name:      getCertCache
+ * purpose:   gets the certificate cache shared by the workers, creating it
+ *            on first use
+ * arguments: none
+ * returns:   the cache
+ * effects:   none
+ */
+certCache *getCertCache()
+{
+        pthread_once(&certCacheOnce, createCertCache);
+        return sharedCertCache;
+}
+
+
+/*
+ * name:      createCertCache
+ * purpose:   allocates the shared cache and its table
+ * arguments: none
+ * returns:   none
+ * effects:   sets the shared cache
+ */
+static void createCertCache()
+{
+        certCache *cache = malloc(sizeof(certCache));
+        checkFatalNull(cache);
+
+        cache->size = CERT_CACHE_SLOTS;
+        cache->numItems = 0;
+        cache->maxNumItems = CERT_CACHE_ITEMS;
+        cache->hashTable = calloc(cache->size, sizeof(certCacheEntry *));
+        checkFatalNull(cache->hashTable);
+        cache->newest = NULL;
+        cache->oldest = NULL;
+        pthread_mutex_init(&cache->lock, NULL);
+
+        sharedCertCache = cache;
+}
+
+
+
+
+/*****************************************************************************
+*                            CERT CACHE LOOKUPS
+******************************************************************************/
+
+
+/*
+ * name:      getCachedContext
+ * purpose:   looks up the SSL context holding the certificate and key forged 
+ *            for a host name. An entry whose certificate is about to expire 
+ *            counts as a miss and is removed, so the caller forges a new one
+ * arguments: the cache, the host name
+ * returns:   the context, or NULL if the host wasn't cached
+ * effects:   the caller owns a reference to the context
+ */
+SSL_CTX *getCachedContext(certCache *cache, char *hostName)
+{
+        DEBUG_PRINT("FUNCTION: getCachedContext\n");
+        SSL_CTX *context = NULL;
+
+        pthread_mutex_lock(&cache->lock);
+        certCacheEntry *entry = findCertEntry(cache, hostName);
+        if (entry != NULL && time(NULL) >= entry->expireTime) {
+                removeCertEntry(cache, entry);
+                entry = NULL;
+        }
+        if (entry != NULL) {
+                SSL_CTX_up_ref(entry->context);
+                context = entry->context;
+
+                unlinkCertEntry(cache, entry);
+                linkNewestCertEntry(cache, entry);
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        return context;
+}
+
+
+/*
+ * name:      storeCachedContext
+ * purpose:   stores the SSL context of a newly forged certificate for a host 
+ *            name, evicting the least recently used host if the cache is 
+ *            full. If another worker stored the host in the meantime, its 
+ *            entry is kept
+ * arguments: the cache, the host name, the context
+ * returns:   none
+ * effects:   the cache takes its own reference to the context
+ */
+void storeCachedContext(certCache *cache, char *hostName, SSL_CTX *context)
+{
+        DEBUG_PRINT("FUNCTION: storeCachedContext\n");
+        pthread_mutex_lock(&cache->lock);
+        if (findCertEntry(cache, hostName) != NULL) {
+                pthread_mutex_unlock(&cache->lock);
+                return;
+        }
+        if (cache->numItems >= cache->maxNumItems) {
+                removeCertEntry(cache, cache->oldest);
+        }
+
+        certCacheEntry *entry = malloc(sizeof(certCacheEntry));
+        checkFatalNull(entry);
+        entry->hostName = strdup(hostName);
+        checkFatalNull(entry->hostName);
+        SSL_CTX_up_ref(context);
+        entry->context = context;
+        entry->expireTime = 
+                getCertExpireTime(SSL_CTX_get0_certificate(context));
+
+        unsigned int slot = hashHostName(hostName, cache->size);
+        entry->slotNext = cache->hashTable[slot];
+        cache->hashTable[slot] = entry;
+        linkNewestCertEntry(cache, entry);
+        cache->numItems++;
+        pthread_mutex_unlock(&cache->lock);
+}
+
+
+/*
+ * name:      findCertEntry
+ * purpose:   finds the entry of a host name in the cache, the cache lock has
+ *            to be held
+ * arguments: the cache, the host name
+ * returns:   the entry, or NULL if the name isn't cached
+ * effects:   none
+ */
+certCacheEntry *findCertEntry(certCache *cache, char *hostName)
+{
+        certCacheEntry *entry = 
+                cache->hashTable[hashHostName(hostName, cache->size)];
+        while (entry != NULL && strcasecmp(entry->hostName, hostName) != 0) {
+                entry = entry->slotNext;
+        }
+        return entry;
+}
+
+
+/*
+ * name:      getCertExpireTime
+ * purpose:   finds when a cached certificate has to be replaced, a margin
+ *            before its notAfter time so no client is handed a certificate
+ *            that expires during its connection
+ * arguments: the certificate
+ * returns:   the time as seconds since the epoch
+ * effects:   none
+ */
+time_t getCertExpireTime(X509 *cert)
+{
+        int days = 0;
+        int seconds = 0;
+        if (!ASN1_TIME_diff(&days, &seconds, NULL, X509_get0_notAfter(cert))) {
+                return 0;
+        }
+        return time(NULL) + days * 86400L + seconds - CERT_RENEW_MARGIN;
+}
+
+
+
+
+
+/*****************************************************************************
+*                            CERT CACHE EVICTION
+******************************************************************************/
+
+
+/*
+ * name:      linkNewestCertEntry
+ * purpose:   puts an entry at the most recently used end of the cache's
+ *            list, the cache lock has to be held
+ * arguments: the cache, the entry
+ * returns:   none
+ * effects:   none
+ */
+void linkNewestCertEntry(certCache *cache, certCacheEntry *entry)
+{
+        entry->newer = NULL;
+        entry->older = cache->newest;
+        if (cache->newest != NULL) {
+                cache->newest->newer = entry;
+        }
+        cache->newest = entry;
+        if (cache->oldest == NULL) {
+                cache->oldest = entry;
+        }
+}
+
+
+/*
+ * name:      unlinkCertEntry
+ * purpose:   takes an entry out of the cache's list of entries by use, the
+ *            cache lock has to be held
+ * arguments: the cache, the entry
+ * returns:   none
+ * effects:   none
+ */
+void unlinkCertEntry(certCache *cache, certCacheEntry *entry)
+{
+        if (entry->newer != NULL) {
+                entry->newer->older = entry->older;
+        }
+        else {
+                cache->newest = entry->older;
+        }
+        if (entry->older != NULL) {
+                entry->older->newer = entry->newer;
+        }
+        else {
+                cache->oldest = entry->newer;
+        }
+}
+
+
+/*
+ * name:      removeCertEntry
+ * purpose:   removes an entry from the cache and drops the cache's reference
+ *            to its context, the cache lock has to be held
+ * arguments: the cache, the entry
+ * returns:   none
+ * effects:   connections using the context keep their own reference
+ */
+void removeCertEntry(certCache *cache, certCacheEntry *entry)
+{
+        DEBUG_PRINT("FUNCTION: removeCertEntry\n");
+        certCacheEntry **link =
+                &cache->hashTable[hashHostName(entry->hostName, cache->size)];
+        while (*link != entry) {
+                link = &(*link)->slotNext;
+        }
+        *link = entry->slotNext;
+        unlinkCertEntry(cache, entry);
+        cache->numItems--;
+
+        SSL_CTX_free(entry->context);
+        free(entry->hostName);
+        free(entry);
+}
@@ -0,0 +1,517 @@
+/*****************************************************************************
+ *
+ *      certstore.c
+ *
+ *      Isabel Muste (imuste01)
+ *      Marti Zentmaier (mzentm01)
+ *
+ *      11/10/2024
+ *
+ *      CS 112 Final Project
+ *
+ *      Contains the on-disk store of forged certificates, so a restarted
+ *      proxy serves the hosts it knew without forging their certificates
+ *      again. Every certificate that is forged is appended to the store
+ *      file as a record holding the host name, the DER encoded certificate
+ *      and key, and the time the certificate has to be replaced. At startup
+ *      the file is memory mapped and indexed by host name, and a record is
+ *      only decoded once a client asks for its host. The file starts with
+ *      the fingerprint of the root certificate, a store written under a
+ *      different root is discarded. Records of expired certificates and
+ *      records replaced by a later one for the same host are dead, once
+ *      they make up most of the file it is rewritten with only the live
+ *      records. The file is locked, so only one proxy uses it at a time.
+ *
+ *
+ *****************************************************************************/
+
+#include "proxy.h"
+#include "logging.h"
+
+#define CERT_STORE_MAGIC "MIPCERT1"
+#define CERT_STORE_SLOTS 1024
+#define CERT_STORE_MAX_FIELD 65536
+#define CERT_STORE_DEAD_PERCENT 50
+#define CERT_STORE_MIN_COMPACT 65536
+
+
+
+/*****************************************************************************
+*                             CERT STORE SETUP
+******************************************************************************/
+
+
+/*
+ * name:      openCertStore
+ * purpose:   opens and locks the store file, starting a new one if it doesn't
+ *            exist or was written under a different root certificate, and
+ *            indexes the records in it
+ * arguments: the path of the store file, the root certificate
+ * returns:   the store, or NULL if the file can't be used
+ * effects:   none
+ */
+certStore *openCertStore(char *path, X509 *rootCert)
+{
+        DEBUG_PRINT("FUNCTION: openCertStore\n");
+        certStoreHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CERT_STORE_MAGIC, sizeof(header.magic));
+        unsigned int digestLength = 0;
+        if (!X509_digest(rootCert, EVP_sha256(), header.rootDigest,
+                &digestLength)) {
+                ERROR_PRINT("Failed to fingerprint the root certificate\n");
+                return NULL;
+        }
+
+        // the store holds private keys, so only the owner may read it
+        int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (fd == -1) {
+                ERROR_PRINT("Failed to open certificate store %s: %s\n",
+                        path, strerror(errno));
+                return NULL;
+        }
+
+        // two proxies appending to the same file would interleave records
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+                ERROR_PRINT("Certificate store %s is in use by another "
+                        "proxy: %s\n", path, strerror(errno));
+                close(fd);
+                return NULL;
+        }
+
+        certStore *store = malloc(sizeof(certStore));
+        checkFatalNull(store);
+        store->fd = fd;
+        store->mapping = NULL;
+        store->mapSize = 0;
+        store->size = CERT_STORE_SLOTS;
+        store->numItems = 0;
+        store->hashTable = calloc(store->size, sizeof(storeIndexEntry *));
+        checkFatalNull(store->hashTable);
+        pthread_mutex_init(&store->lock, NULL);
+
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        store->fileSize = fileStat.st_size;
+
+        certStoreHeader fileHeader;
+        bool valid = store->fileSize >= (off_t)sizeof(fileHeader) &&
+                pread(fd, &fileHeader, sizeof(fileHeader), 0) ==
+                sizeof(fileHeader) &&
+                memcmp(&fileHeader, &header, sizeof(header)) == 0;
+        if (!valid) {
+                if (store->fileSize > 0) {
+                        INFO_PRINT("Discarding certificate store %s, it was "
+                                "written under a different root\n", path);
+                }
+                if (ftruncate(fd, 0) == -1 ||
+                        write(fd, &header, sizeof(header)) != sizeof(header)) {
+                        ERROR_PRINT("Failed to start certificate store %s\n",
+                                path);
+                        closeCertStore(store);
+                        return NULL;
+                }
+                store->fileSize = sizeof(header);
+        }
+
+        indexCertStore(store);
+        compactCertStore(store, path);
+        INFO_PRINT("Certificate store %s holds %d hosts\n", path,
+                store->numItems);
+        return store;
+}
+
+
+/*
+ * name:      indexCertStore
+ * purpose:   maps the store file and adds every record to the index, later
+ *            records of a host replacing earlier ones. A record cut short by
+ *            a crash ends the file, it is cut off so appends start after the
+ *            last complete record
+ * arguments: the store
+ * returns:   none
+ * effects:   none
+ */
+void indexCertStore(certStore *store)
+{
+        DEBUG_PRINT("FUNCTION: indexCertStore\n");
+        if (!mapCertStore(store)) {
+                return;
+        }
+
+        time_t now = time(NULL);
+        off_t offset = sizeof(certStoreHeader);
+        while (offset + (off_t)sizeof(certRecordHeader) <= store->fileSize) {
+                // records aren't aligned, so the header is copied out
+                certRecordHeader record;
+                memcpy(&record, store->mapping + offset, sizeof(record));
+                if (record.hostLength == 0 ||
+                        record.hostLength > CERT_STORE_MAX_FIELD ||
+                        record.certLength > CERT_STORE_MAX_FIELD ||
+                        record.keyLength > CERT_STORE_MAX_FIELD) {
+                        break;
+                }
+                off_t recordLength = getCertRecordLength(&record);
+                if (offset + recordLength > store->fileSize) {
+                        break;
+                }
+
+                char *hostName = store->mapping + offset + sizeof(record);
+                if (record.expireTime > now) {
+                        addStoreEntry(store, hostName, record.hostLength,
+                                offset, recordLength, record.expireTime);
+                }
+                offset += recordLength;
+        }
+
+        if (offset < store->fileSize) {
+                ERROR_PRINT("Certificate store ends in a partial record\n");
+                if (ftruncate(store->fd, offset) == 0) {
+                        store->fileSize = offset;
+                }
+        }
+}
+
+
+/*
+ * name:      compactCertStore
+ * purpose:   rewrites the store file with only its live records once the
+ *            dead ones make up most of it. The records are written to a new
+ *            file which replaces the old one, so a crash leaves one of the
+ *            two complete
+ * arguments: the store, the path of the store file
+ * returns:   none
+ * effects:   replaces the store's file descriptor and index
+ */
+void compactCertStore(certStore *store, char *path)
+{
+        DEBUG_PRINT("FUNCTION: compactCertStore\n");
+        off_t liveBytes = 0;
+        for (int i = 0; i < store->size; i++) {
+                for (storeIndexEntry *entry = store->hashTable[i];
+                        entry != NULL; entry = entry->slotNext) {
+                        liveBytes += entry->length;
+                }
+        }
+        off_t recordBytes = store->fileSize - sizeof(certStoreHeader);
+        off_t deadBytes = recordBytes - liveBytes;
+        if (store->mapping == NULL || deadBytes < CERT_STORE_MIN_COMPACT ||
+                deadBytes * 100 < recordBytes * CERT_STORE_DEAD_PERCENT) {
+                return;
+        }
+
+        char tempPath[PATH_MAX];
+        snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+        int fd = open(tempPath, O_RDWR | O_CREAT | O_TRUNC | O_APPEND |
+                O_CLOEXEC, 0600);
+        if (fd == -1) {
+                ERROR_PRINT("Failed to compact certificate store: %s\n",
+                        strerror(errno));
+                return;
+        }
+
+        // the new file is locked before it takes the store's place
+        bool written = flock(fd, LOCK_EX | LOCK_NB) == 0 &&
+                write(fd, store->mapping, sizeof(certStoreHeader)) ==
+                sizeof(certStoreHeader);
+        for (int i = 0; i < store->size && written; i++) {
+                for (storeIndexEntry *entry = store->hashTable[i];
+                        entry != NULL && written; entry = entry->slotNext) {
+                        written = write(fd, store->mapping + entry->offset,
+                                entry->length) == entry->length;
+                }
+        }
+        if (!written || fsync(fd) == -1 || rename(tempPath, path) == -1) {
+                ERROR_PRINT("Failed to compact certificate store: %s\n",
+                        strerror(errno));
+                unlink(tempPath);
+                close(fd);
+                return;
+        }
+
+        close(store->fd);
+        store->fd = fd;
+        store->fileSize = sizeof(certStoreHeader) + liveBytes;
+        clearStoreIndex(store);
+        indexCertStore(store);
+        INFO_PRINT("Compacted certificate store %s, dropped %lld bytes\n",
+                path, (long long)deadBytes);
+}
+
+
+/*
+ * name:      mapCertStore
+ * purpose:   maps the whole store file into memory, replacing an earlier
+ *            mapping once records were appended past its end
+ * arguments: the store
+ * returns:   true if the file is mapped, false otherwise
+ * effects:   none
+ */
+bool mapCertStore(certStore *store)
+{
+        if (store->mapping != NULL) {
+                munmap(store->mapping, store->mapSize);
+                store->mapping = NULL;
+                store->mapSize = 0;
+        }
+
+        void *mapping = mmap(NULL, store->fileSize, PROT_READ, MAP_SHARED,
+                store->fd, 0);
+        if (mapping == MAP_FAILED) {
+                ERROR_PRINT("Failed to map certificate store: %s\n",
+                        strerror(errno));
+                return false;
+        }
+        store->mapping = mapping;
+        store->mapSize = store->fileSize;
+        return true;
+}
+
+
+/*
+ * name:      closeCertStore
+ * purpose:   unmaps and closes the store file and frees its index
+ * arguments: the store
+ * returns:   none
+ * effects:   none
+ */
+void closeCertStore(certStore *store)
+{
+        clearStoreIndex(store);
+        if (store->mapping != NULL) {
+                munmap(store->mapping, store->mapSize);
+        }
+        close(store->fd);
+        pthread_mutex_destroy(&store->lock);
+        free(store->hashTable);
+        free(store);
+}
+
+
+
+
+/*****************************************************************************
+*                            CERT STORE RECORDS
+******************************************************************************/
+
+
+/*
+ * name:      loadStoredCertificate
+ * purpose:   reads the certificate and key stored for a host name from the
+ *            store file
+ * arguments: the store (or NULL if there is none), the host name, the
+ *            certificate and key to populate
+ * returns:   true if a certificate that hasn't expired was found, false
+ *            otherwise
+ * effects:   the caller owns the certificate and key
+ */
+bool loadStoredCertificate(certStore *store, char *hostName, X509 **cert,
+        EVP_PKEY **key)
+{
+        DEBUG_PRINT("FUNCTION: loadStoredCertificate\n");
+        if (store == NULL) {
+                return false;
+        }
+
+        pthread_mutex_lock(&store->lock);
+        storeIndexEntry *entry = findStoreEntry(store, hostName);
+        if (entry == NULL || time(NULL) >= entry->expireTime) {
+                pthread_mutex_unlock(&store->lock);
+                return false;
+        }
+
+        // records appended since the file was mapped lie past the mapping
+        if (entry->offset + entry->length > (off_t)store->mapSize && 
+                !mapCertStore(store)) {
+                pthread_mutex_unlock(&store->lock);
+                return false;
+        }
+
+        certRecordHeader record;
+        memcpy(&record, store->mapping + entry->offset, sizeof(record));
+        const unsigned char *certData = (unsigned char *)store->mapping + 
+                entry->offset + sizeof(record) + record.hostLength;
+        const unsigned char *keyData = certData + record.certLength;
+        *cert = d2i_X509(NULL, &certData, record.certLength);
+        *key = d2i_AutoPrivateKey(NULL, &keyData, record.keyLength);
+        pthread_mutex_unlock(&store->lock);
+
+        if (*cert == NULL || *key == NULL) {
+                ERROR_PRINT("Failed to decode stored certificate of %s\n",
+                        hostName);
+                X509_free(*cert);
+                EVP_PKEY_free(*key);
+                *cert = NULL;
+                *key = NULL;
+                return false;
+        }
+        return true;
+}
+
+
+/*
+ * name:      saveStoredCertificate
+ * purpose:   appends a newly forged certificate and its key to the store
+ *            file and indexes it
+ * arguments: the store (or NULL if there is none), the host name, the
+ *            certificate and its key
+ * returns:   none
+ * effects:   none
+ */
+void saveStoredCertificate(certStore *store, char *hostName, X509 *cert,
+        EVP_PKEY *key)
+{
+        DEBUG_PRINT("FUNCTION: saveStoredCertificate\n");
+        if (store == NULL) {
+                return;
+        }
+
+        unsigned char *certData = NULL;
+        unsigned char *keyData = NULL;
+        int certLength = i2d_X509(cert, &certData);
+        int keyLength = i2d_PrivateKey(key, &keyData);
+        int hostLength = strlen(hostName);
+        if (certLength <= 0 || keyLength <= 0 ||
+                certLength > CERT_STORE_MAX_FIELD ||
+                keyLength > CERT_STORE_MAX_FIELD ||
+                hostLength > CERT_STORE_MAX_FIELD) {
+                ERROR_PRINT("Failed to encode certificate of %s\n", hostName);
+                OPENSSL_free(certData);
+                OPENSSL_free(keyData);
+                return;
+        }
+
+        certRecordHeader record;
+        memset(&record, 0, sizeof(record));
+        record.hostLength = hostLength;
+        record.certLength = certLength;
+        record.keyLength = keyLength;
+        record.expireTime = getCertExpireTime(cert);
+
+        struct iovec vectors[4] = {
+                {&record, sizeof(record)},
+                {hostName, hostLength},
+                {certData, certLength},
+                {keyData, keyLength}
+        };
+        off_t recordLength = getCertRecordLength(&record);
+
+        // the whole record is written at once, a short write is undone so
+        // the next record starts in the right place
+        pthread_mutex_lock(&store->lock);
+        ssize_t written = writev(store->fd, vectors, 4);
+        if (written == recordLength) {
+                addStoreEntry(store, hostName, hostLength, store->fileSize,
+                        recordLength, record.expireTime);
+                store->fileSize += recordLength;
+        }
+        else {
+                ERROR_PRINT("Failed to store certificate of %s\n", hostName);
+                if (written > 0 && ftruncate(store->fd, store->fileSize) == -1) {
+                        ERROR_PRINT("Failed to undo a partial record\n");
+                }
+        }
+        pthread_mutex_unlock(&store->lock);
+
+        OPENSSL_free(certData);
+        OPENSSL_free(keyData);
+}
+
+
+/*
+ * name:      getCertRecordLength
+ * purpose:   gets the length of a store record including its header
+ * arguments: the record header
+ * returns:   the length in bytes
+ * effects:   none
+ */
+off_t getCertRecordLength(certRecordHeader *record)
+{
+        return sizeof(certRecordHeader) + (off_t)record->hostLength +
+                record->certLength + record->keyLength;
+}
+
+
+
+
+/*****************************************************************************
+*                            CERT STORE INDEX
+******************************************************************************/
+
+
+/*
+ * name:      addStoreEntry
+ * purpose:   points the index entry of a host name at a record, adding the
+ *            entry if the host has none yet. The store lock has to be held
+ * arguments: the store, the host name and its length, the offset and 
+ *            length of the record, the time its certificate has to be 
+ *            replaced
+ * returns:   none
+ * effects:   none
+ */
+void addStoreEntry(certStore *store, char *hostName, int hostLength,
+        off_t offset, off_t length, time_t expireTime)
+{
+        char *name = strndup(hostName, hostLength);
+        checkFatalNull(name);
+
+        storeIndexEntry *entry = findStoreEntry(store, name);
+        if (entry != NULL) {
+                free(name);
+        }
+        else {
+                entry = malloc(sizeof(storeIndexEntry));
+                checkFatalNull(entry);
+                entry->hostName = name;
+                unsigned int slot = hashHostName(name, store->size);
+                entry->slotNext = store->hashTable[slot];
+                store->hashTable[slot] = entry;
+                store->numItems++;
+        }
+        entry->offset = offset;
+        entry->length = length;
+        entry->expireTime = expireTime;
+}
+
+
+/*
+ * name:      clearStoreIndex
+ * purpose:   frees every entry of the index
+ * arguments: the store
+ * returns:   none
+ * effects:   leaves the index empty
+ */
+void clearStoreIndex(certStore *store)
+{
+        for (int i = 0; i < store->size; i++) {
+                storeIndexEntry *entry = store->hashTable[i];
+                while (entry != NULL) {
+                        storeIndexEntry *next = entry->slotNext;
+                        free(entry->hostName);
+                        free(entry);
+                        entry = next;
+                }
+                store->hashTable[i] = NULL;
+        }
+        store->numItems = 0;
+}
+
+
+/*
+ * name:      findStoreEntry
+ * purpose:   finds the index entry of a host name, the store lock has to be
+ *            held
+ * arguments: the store, the host name
+ * returns:   the entry, or NULL if the host isn't stored
+ * effects:   none
+ */
+storeIndexEntry *findStoreEntry(certStore *store, char *hostName)
+{
+        storeIndexEntry *entry =
+                store->hashTable[hashHostName(hostName, store->size)];
+        while (entry != NULL && strcasecmp(entry->hostName, hostName) != 0) {
+                entry = entry->slotNext;
+        }
+        return entry;
+}
+
@@ -0,0 +1,293 @@
+/*****************************************************************************
+ *
+ *      chain.c
+ *
+ *      Isabel Muste (imuste01)
+ *      Marti Zentmaier (mzentm01)
+ *
+ *      11/10/2024
+ *
+ *      CS 112 Final Project
+ *
+ *      Contains the buffer chains MITM message bodies are collected in. A
+ *      chain is a list of segments pointing into pool buffers, so a read is
+ *      added to the body it belongs to by linking it in rather than by
+ *      copying the body so far into a bigger buffer. Searches run across
+ *      segment boundaries, and text is inserted by splitting a segment, so
+ *      the body is never made contiguous, not even when it is sent.
+ *
+ *
+ *****************************************************************************/
+
+#include "proxy.h"
+#include "logging.h"
+
+
+
+/*****************************************************************************
+*                              CHAIN BUILDING
+******************************************************************************/
+
+
+/*
+ * name:      initializeChain
+ * purpose:   sets up an empty buffer chain
+ * arguments: the chain
+ * returns:   none
+ * effects:   none
+ */
+void initializeChain(bufferChain *chain)
+{
+        chain->head = NULL;
+        chain->tail = NULL;
+        chain->length = 0;
+        chain->numSegments = 0;
+}
+
+
+/*
+ * name:      appendToChain
+ * purpose:   links data to the end of a chain without copying it
+ * arguments: the proxy instance, the chain, the pool buffer holding the data
+ *            (or NULL if the chain shouldn't free it), the data and its length
+ * returns:   none
+ * effects:   takes ownership of the buffer
+ */
+void appendToChain(proxy *theProxy, bufferChain *chain, char *buffer,
+        char *data, int length)
+{
+        chainSegment *segment = allocObject(&theProxy->slabs->chainSegments);
+        segment->buffer = buffer;
+        segment->data = data;
+        segment->length = length;
+        segment->next = NULL;
+
+        if (chain->tail == NULL) {
+                chain->head = segment;
+        }
+        else {
+                chain->tail->next = segment;
+        }
+        chain->tail = segment;
+        chain->length += length;
+        chain->numSegments++;
+}
+
+
+/*
+ * name:      copyToChain
+ * purpose:   copies data that the caller keeps using to the end of a chain
+ * arguments: the proxy instance, the chain, the data and its length
+ * returns:   none
+ * effects:   none
+ */
+void copyToChain(proxy *theProxy, bufferChain *chain, char *data, int length)
+{
+        char *buffer = allocBuffer(theProxy, length);
+        checkFatalNull(buffer);
+        memcpy(buffer, data, length);
+        appendToChain(theProxy, chain, buffer, buffer, length);
+}
+
+
+/*
+ * name:      insertIntoChain
+ * purpose:   inserts a copy of the data at an offset of the chain, splitting
+ *            the segment the offset falls in
+ * arguments: the proxy instance, the chain, the offset, the data and its
+ *            length
+ * returns:   none
+ * effects:   none
+ */
+void insertIntoChain(proxy *theProxy, bufferChain *chain, int offset,
+        char *data, int length)
+{
+        DEBUG_PRINT("FUNCTION: insertIntoChain\n");
+        chainSegment *previous = NULL;
+        chainSegment *segment = chain->head;
+        while (segment != NULL && offset >= segment->length) {
+                offset -= segment->length;
+                previous = segment;
+                segment = segment->next;
+        }
+
+        // the second half borrows the buffer, the first half still frees it
+        if (segment != NULL && offset > 0) {
+                chainSegment *rest =
+                        allocObject(&theProxy->slabs->chainSegments);
+                rest->buffer = NULL;
+                rest->data = segment->data + offset;
+                rest->length = segment->length - offset;
+                rest->next = segment->next;
+                segment->length = offset;
+                segment->next = rest;
+                if (chain->tail == segment) {
+                        chain->tail = rest;
+                }
+                previous = segment;
+                segment = rest;
+                chain->numSegments++;
+        }
+
+        char *buffer = allocBuffer(theProxy, length);
+        checkFatalNull(buffer);
+        memcpy(buffer, data, length);
+
+        chainSegment *inserted = allocObject(&theProxy->slabs->chainSegments);
+        inserted->buffer = buffer;
+        inserted->data = buffer;
+        inserted->length = length;
+        inserted->next = segment;
+        if (previous == NULL) {
+                chain->head = inserted;
+        }
+        else {
+                previous->next = inserted;
+        }
+        if (segment == NULL) {
+                chain->tail = inserted;
+        }
+        chain->length += length;
+        chain->numSegments++;
+}
+
+
+/*
+ * name:      freeChain
+ * purpose:   frees every segment of a chain and the buffers they own
+ * arguments: the proxy instance, the chain
+ * returns:   none
+ * effects:   leaves the chain empty
+ */
+void freeChain(proxy *theProxy, bufferChain *chain)
+{
+        chainSegment *segment = chain->head;
+        while (segment != NULL) {
+                chainSegment *next = segment->next;
+                freeBuffer(theProxy, segment->buffer);
+                freeObject(&theProxy->slabs->chainSegments, segment);
+                segment = next;
+        }
+        initializeChain(chain);
+}
+
+
+
+
+/*****************************************************************************
+*                              CHAIN LOOKUPS
+******************************************************************************/
+
+
+/*
+ * name:      findInChain
+ * purpose:   finds the first occurrence of a string in a chain, including
+ *            ones that span segments
+ * arguments: the chain, the string, the offset to start searching at
+ * returns:   the offset of the string, or -1 if it wasn't found
+ * effects:   none
+ */
+int findInChain(bufferChain *chain, char *needle, int from)
+{
+        int needleLength = strlen(needle);
+        int offset = 0;
+
+        for (chainSegment *segment = chain->head; segment != NULL;
+                segment = segment->next) {
+                int index = (from > offset) ? from - offset : 0;
+                while (index < segment->length) {
+                        char *first = memchr(segment->data + index, needle[0],
+                                segment->length - index);
+                        if (first == NULL) {
+                                break;
+                        }
+                        index = first - segment->data;
+                        if (matchInChain(segment, index, needle, needleLength)) {
+                                return offset + index;
+                        }
+                        index++;
+                }
+                offset += segment->length;
+        }
+        return -1;
+}
+
+
+/*
+ * name:      matchInChain
+ * purpose:   checks if a string starts at a position of a chain
+ * arguments: the segment and the index in it the string would start at, the
+ *            string and its length
+ * returns:   true if the chain holds the string there, false otherwise
+ * effects:   none
+ */
+bool matchInChain(chainSegment *segment, int index, char *needle,
+        int needleLength)
+{
+        int matched = 0;
+        while (segment != NULL && matched < needleLength) {
+                if (index == segment->length) {
+                        segment = segment->next;
+                        index = 0;
+                        continue;
+                }
+                if (segment->data[index] != needle[matched]) {
+                        return false;
+                }
+                index++;
+                matched++;
+        }
+        return matched == needleLength;
+}
+
+
+/*
+ * name:      copyFromChain
+ * purpose:   copies a range of a chain into a contiguous buffer
+ * arguments: the chain, the offset and length of the range, the buffer to
+ *            copy to
+ * returns:   the number of bytes copied, less than the length if the chain
+ *            ends first
+ * effects:   none
+ */
+int copyFromChain(bufferChain *chain, int offset, int length, char *dest)
+{
+        int copied = 0;
+        for (chainSegment *segment = chain->head;
+                segment != NULL && copied < length; segment = segment->next) {
+                if (offset >= segment->length) {
+                        offset -= segment->length;
+                        continue;
+                }
+                int count = segment->length - offset;
+                if (count > length - copied) {
+                        count = length - copied;
+                }
+                memcpy(dest + copied, segment->data + offset, count);
+                copied += count;
+                offset = 0;
+        }
+        return copied;
+}
+
+
+/*
+ * name:      getChainVectors
+ * purpose:   describes the segments of a chain as a vector of buffers, so the 
+ *            chain can be written without joining it into one buffer
+ * arguments: the chain, the vector to fill, which must hold numSegments 
+ *            entries
+ * returns:   the number of entries filled
+ * effects:   none
+ */
+int getChainVectors(bufferChain *chain, struct iovec *vectors)
+{
+        int count = 0;
+        for (chainSegment *segment = chain->head; segment != NULL; 
+                segment = segment->next) {
+                vectors[count].iov_base = segment->data;
+                vectors[count].iov_len = segment->length;
+                count++;
+        }
+        return count;
+}
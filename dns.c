@@ -0,0 +1,1056 @@
+/*****************************************************************************
+ *
+ *      dns.c
+ *
+ *      Isabel Muste (imuste01)
+ *      Marti Zentmaier (mzentm01)
+ *
+ *      11/10/2024
+ *
+ *      CS 112 Final Project
+ *
+ *      Contains the asynchronous resolver used to find the servers'
+ *      addresses. Every worker has a UDP socket connected to the name server
+ *      which is registered with its epoll loop. A lookup sends its A and
+ *      AAAA queries at the same time and the connect to the server starts
+ *      from the response handler, so the worker keeps relaying other
+ *      connections while the lookup is outstanding. The answers are kept 
+ *      in a cache shared by the workers for as long as their TTL allows, 
+ *      and names that are still in use are refreshed before they expire.
+ *
+ *
+ *****************************************************************************/
+
+#include "proxy.h"
+#include "logging.h"
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+#define DNS_PORT 53
+#define DNS_TIMEOUT 5
+#define DNS_RETRY_INTERVAL 1000000000ULL
+#define DNS_RESOLUTION_DELAY 50000000ULL
+#define DNS_PACKET_SIZE 4096
+
+#define DNS_CACHE_SLOTS 1024
+#define DNS_CACHE_ITEMS 4096
+#define DNS_MIN_TTL 1
+#define DNS_MAX_TTL 3600
+#define DNS_NEGATIVE_TTL 10
+#define DNS_FAILURE_TTL 2
+#define DNS_PREFETCH_HITS 2
+#define DNS_PREFETCH_PERCENT 75
+
+static dnsCache *sharedDnsCache = NULL;
+static pthread_once_t dnsCacheOnce = PTHREAD_ONCE_INIT;
+static void createDnsCache();
+
+
+
+/*****************************************************************************
+*                               RESOLVER SETUP
+******************************************************************************/
+
+
+/*
+ * name:      initializeResolver
+ * purpose:   creates the worker's resolver, connects its UDP socket to the
+ *            name server and adds the socket to the event loop
+ * arguments: the proxy instance
+ * returns:   true if a name server can be queried, false if only literal
+ *            addresses and the hosts file can be resolved
+ * effects:   sets the proxy's resolver
+ */
+bool initializeResolver(proxy *theProxy)
+{
+        DEBUG_PRINT("FUNCTION: initializeResolver\n");
+        dnsResolver *resolver = malloc(sizeof(dnsResolver));
+        checkFatalNull(resolver);
+
+        resolver->dnsSD = -1;
+        resolver->timeout = DNS_TIMEOUT;
+        if (theProxy->options != NULL) {
+                resolver->timeout = theProxy->options->dnsTimeout;
+        }
+
+        resolver->maxLookups = 64;
+        resolver->lookups = calloc(resolver->maxLookups, sizeof(dnsLookup));
+        checkFatalNull(resolver->lookups);
+        resolver->numLookups = 0;
+
+        resolver->hosts = NULL;
+        resolver->numHosts = 0;
+        loadHostsFile(resolver);
+        resolver->cache = getDnsCache();
+        theProxy->resolver = resolver;
+
+        struct sockaddr_in nameServer;
+        if (!getNameServer(theProxy->options, &nameServer)) {
+                ERROR_PRINT("No name server found, only resolving hosts file "
+                        "entries\n");
+                return false;
+        }
+
+        int dnsSD = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        checkFatalNegOne(dnsSD);
+        int returnVal = connect(dnsSD, (struct sockaddr *)&nameServer,
+                sizeof(nameServer));
+        checkFatalNegOne(returnVal);
+
+        resolver->dnsSD = dnsSD;
+        addToEventLoop(theProxy, dnsSD, EPOLLIN);
+        return true;
+}
+
+
+/*
+ * name:      getNameServer
+ * purpose:   finds the name server to query, either the one given on the
+ *            command line as ip[:port] or the first IPv4 name server listed
+ *            in /etc/resolv.conf
+ * arguments: the proxy options, the address to populate
+ * returns:   true if a name server was found, false otherwise
+ * effects:   none
+ */
+bool getNameServer(proxyOptions *options, struct sockaddr_in *serverAddress)
+{
+        memset(serverAddress, 0, sizeof(struct sockaddr_in));
+        serverAddress->sin_family = AF_INET;
+        serverAddress->sin_port = htons(DNS_PORT);
+
+        char serverIP[INET_ADDRSTRLEN + 8];
+        serverIP[0] = '\0';
+
+        if (options != NULL && options->dnsServer != NULL) {
+                snprintf(serverIP, sizeof(serverIP), "%s", options->dnsServer);
+                char *portStart = strchr(serverIP, ':');
+                if (portStart != NULL) {
+                        *portStart = '\0';
+                        serverAddress->sin_port = htons(atoi(portStart + 1));
+                }
+        }
+        else {
+                FILE *resolvFile = fopen("/etc/resolv.conf", "r");
+                if (resolvFile == NULL) {
+                        return false;
+                }
+
+                char line[256];
+                while (fgets(line, sizeof(line), resolvFile) != NULL) {
+                        char address[64];
+                        if (sscanf(line, "nameserver %63s", address) == 1 &&
+                                strlen(address) < sizeof(serverIP) &&
+                                inet_pton(AF_INET, address,
+                                        &serverAddress->sin_addr) == 1) {
+                                strcpy(serverIP, address);
+                                break;
+                        }
+                }
+                fclose(resolvFile);
+        }
+
+        return inet_pton(AF_INET, serverIP, &serverAddress->sin_addr) == 1;
+}
+
+
+/*
+ * name:      loadHostsFile
+ * purpose:   reads the host names and addresses from /etc/hosts, since names
+ *            such as localhost are usually not known to the name server
+ * arguments: the resolver
+ * returns:   none
+ * effects:   populates the resolver's hosts entries
+ */
+void loadHostsFile(dnsResolver *resolver)
+{
+        FILE *hostsFile = fopen("/etc/hosts", "r");
+        if (hostsFile == NULL) {
+                return;
+        }
+
+        int maxHosts = 0;
+        char line[512];
+        while (fgets(line, sizeof(line), hostsFile) != NULL) {
+                char *comment = strchr(line, '#');
+                if (comment != NULL) {
+                        *comment = '\0';
+                }
+
+                char *savePtr = NULL;
+                char *token = strtok_r(line, " \t\r\n", &savePtr);
+                struct sockaddr_storage address;
+                memset(&address, 0, sizeof(address));
+                if (token == NULL) {
+                        continue;
+                }
+
+                struct sockaddr_in *address4 = (struct sockaddr_in *)&address;
+                struct sockaddr_in6 *address6 = (struct sockaddr_in6 *)&address;
+                if (inet_pton(AF_INET, token, &address4->sin_addr) == 1) {
+                        address4->sin_family = AF_INET;
+                }
+                else if (inet_pton(AF_INET6, token, &address6->sin6_addr) == 1) {
+                        address6->sin6_family = AF_INET6;
+                }
+                else {
+                        continue;
+                }
+
+                // every name after the address maps to it
+                while ((token = strtok_r(NULL, " \t\r\n", &savePtr)) != NULL) {
+                        if (resolver->numHosts == maxHosts) {
+                                maxHosts = (maxHosts == 0) ? 16 : maxHosts * 2;
+                                resolver->hosts = realloc(resolver->hosts,
+                                        maxHosts * sizeof(hostsEntry));
+                                checkFatalNull(resolver->hosts);
+                        }
+                        hostsEntry *entry = &resolver->hosts[resolver->numHosts];
+                        entry->hostName = strdup(token);
+                        checkFatalNull(entry->hostName);
+                        entry->address = address;
+                        resolver->numHosts++;
+                }
+        }
+        fclose(hostsFile);
+}
+
+
+/*
+ * name:      getLiteralAddress
+ * purpose:   resolves a host name without querying the name server, which
+ *            works if the name is an IP address or listed in the hosts file
+ * arguments: the resolver, the host name, the addresses to populate and 
+ *            their count
+ * returns:   true if the name was resolved, false otherwise
+ * effects:   none
+ */
+bool getLiteralAddress(dnsResolver *resolver, char *hostName,
+        struct sockaddr_storage *addresses, int *numAddresses)
+{
+        memset(&addresses[0], 0, sizeof(struct sockaddr_storage));
+        struct sockaddr_in *address4 = (struct sockaddr_in *)&addresses[0];
+        struct sockaddr_in6 *address6 = (struct sockaddr_in6 *)&addresses[0];
+        *numAddresses = 1;
+
+        if (inet_pton(AF_INET, hostName, &address4->sin_addr) == 1) {
+                address4->sin_family = AF_INET;
+                return true;
+        }
+        if (inet_pton(AF_INET6, hostName, &address6->sin6_addr) == 1) {
+                address6->sin6_family = AF_INET6;
+                return true;
+        }
+
+        // a name can be listed with both an IPv4 and an IPv6 address
+        *numAddresses = 0;
+        for (int i = 0; i < resolver->numHosts; i++) {
+                if (strcasecmp(resolver->hosts[i].hostName, hostName) == 0 && 
+                        *numAddresses < DNS_MAX_ADDRESSES) {
+                        addresses[*numAddresses] = resolver->hosts[i].address;
+                        (*numAddresses)++;
+                }
+        }
+        return *numAddresses > 0;
+}
+
+
+
+/*****************************************************************************
+*                               QUERY HANDLING
+******************************************************************************/
+
+
+/*
+ * name:      startDnsLookup
+ * purpose:   starts resolving a host name for a client by sending its A and
+ *            AAAA queries to the name server
+ * arguments: the proxy instance, the host name, the client socket descriptor
+ * returns:   true if the queries were sent, false otherwise
+ * effects:   finishServerLookup is called once the lookup finishes
+ */
+bool startDnsLookup(proxy *theProxy, char *hostName, int clientSD)
+{
+        DEBUG_PRINT("FUNCTION: startDnsLookup\n");
+        dnsResolver *resolver = theProxy->resolver;
+        unsigned char packet[DNS_PACKET_SIZE];
+        if (resolver->dnsSD == -1 ||
+                buildDnsQuery(packet, 0, hostName, DNS_TYPE_A) == -1) {
+                return false;
+        }
+
+        // find a free lookup, growing the list if all of them are in use
+        if (resolver->numLookups == resolver->maxLookups) {
+                int oldMax = resolver->maxLookups;
+                resolver->maxLookups *= 2;
+                resolver->lookups = realloc(resolver->lookups,
+                        resolver->maxLookups * sizeof(dnsLookup));
+                checkFatalNull(resolver->lookups);
+                memset(&resolver->lookups[oldMax], 0,
+                        oldMax * sizeof(dnsLookup));
+        }
+        dnsLookup *lookup = NULL;
+        for (int i = 0; i < resolver->maxLookups; i++) {
+                if (!resolver->lookups[i].active) {
+                        lookup = &resolver->lookups[i];
+                        break;
+                }
+        }
+
+        unsigned long long now = getCurrTime(theProxy->theCache);
+        lookup->active = true;
+        lookup->clientSD = clientSD;
+        lookup->hostName = strdup(hostName);
+        checkFatalNull(lookup->hostName);
+        lookup->queryID[0] = getDnsQueryID();
+        lookup->queryID[1] = getDnsQueryID();
+        lookup->answered[0] = false;
+        lookup->answered[1] = false;
+        lookup->failed = false;
+        lookup->numAddresses = 0;
+        lookup->ttl = 0;
+        lookup->retryTime = now + DNS_RETRY_INTERVAL;
+        lookup->deadline = now + resolver->timeout * 1000000000ULL;
+        resolver->numLookups++;
+
+        sendDnsQueries(resolver, lookup);
+        return true;
+}
+
+
+/*
+ * name:      sendDnsQueries
+ * purpose:   sends the queries of a lookup that haven't been answered yet
+ * arguments: the resolver, the lookup
+ * returns:   none
+ * effects:   none
+ */
+void sendDnsQueries(dnsResolver *resolver, dnsLookup *lookup)
+{
+        unsigned char packet[DNS_PACKET_SIZE];
+        int queryTypes[2] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+
+        for (int i = 0; i < 2; i++) {
+                if (lookup->answered[i]) {
+                        continue;
+                }
+                int length = buildDnsQuery(packet, lookup->queryID[i],
+                        lookup->hostName, queryTypes[i]);
+                if (send(resolver->dnsSD, packet, length, 0) == -1) {
+                        ERROR_PRINT("Failed to send DNS query for %s\n",
+                                lookup->hostName);
+                }
+        }
+}
+
+
+/*
+ * name:      getDnsQueryID
+ * purpose:   draws a random query ID, so an off-path attacker can't guess 
+ *            the ID a response has to carry
+ * arguments: none
+ * returns:   the query ID
+ * effects:   none
+ */
+unsigned short getDnsQueryID()
+{
+        unsigned short queryID;
+        while (getrandom(&queryID, sizeof(queryID), 0) != sizeof(queryID)) {
+                if (errno != EINTR) {
+                        ERROR_PRINT("Failed to get a random DNS query ID\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        return queryID;
+}
+
+
+/*
+ * name:      buildDnsQuery
+ * purpose:   writes a recursive DNS query for a host name into a packet
+ * arguments: the packet, the query ID, the host name, the record type
+ * returns:   the length of the query, or -1 if the host name is invalid
+ * effects:   none
+ */
+int buildDnsQuery(unsigned char *packet, unsigned short queryID,
+        char *hostName, int queryType)
+{
+        // header: ID, recursion desired, one question
+        memset(packet, 0, 12);
+        packet[0] = queryID >> 8;
+        packet[1] = queryID & 0xFF;
+        packet[2] = 0x01;
+        packet[5] = 1;
+
+        // the name is written as length prefixed labels
+        int offset = 12;
+        const char *label = hostName;
+        while (*label != '\0') {
+                const char *dot = strchr(label, '.');
+                int labelLength = (dot == NULL) ? (int)strlen(label) : dot - label;
+                if (labelLength == 0 || labelLength > 63 || offset + labelLength > 265) {
+                        return -1;
+                }
+
+                packet[offset] = labelLength;
+                memcpy(packet + offset + 1, label, labelLength);
+                offset += labelLength + 1;
+
+                if (dot == NULL) {
+                        break;
+                }
+                label = dot + 1;
+        }
+        if (offset == 12) {
+                return -1;
+        }
+        packet[offset] = 0;
+
+        packet[offset + 1] = queryType >> 8;
+        packet[offset + 2] = queryType & 0xFF;
+        packet[offset + 3] = DNS_CLASS_IN >> 8;
+        packet[offset + 4] = DNS_CLASS_IN & 0xFF;
+        return offset + 5;
+}
+
+
+/*
+ * name:      handleDnsResponses
+ * purpose:   reads every response waiting on the resolver socket and
+ *            finishes the lookups whose queries have all been answered
+ * arguments: the proxy instance
+ * returns:   none
+ * effects:   none
+ */
+void handleDnsResponses(proxy *theProxy)
+{
+        DEBUG_PRINT("FUNCTION: handleDnsResponses\n");
+        dnsResolver *resolver = theProxy->resolver;
+        unsigned char packet[DNS_PACKET_SIZE];
+        int queryTypes[2] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+
+        while (true) {
+                int length = recv(resolver->dnsSD, packet, sizeof(packet), 0);
+                if (length == -1) {
+                        return;
+                }
+                if (length < 12) {
+                        continue;
+                }
+
+                unsigned short responseID = (packet[0] << 8) | packet[1];
+                for (int i = 0; i < resolver->maxLookups; i++) {
+                        dnsLookup *lookup = &resolver->lookups[i];
+                        if (!lookup->active) {
+                                continue;
+                        }
+
+                        int type = -1;
+                        if (lookup->queryID[0] == responseID && !lookup->answered[0]) {
+                                type = 0;
+                        }
+                        else if (lookup->queryID[1] == responseID &&
+                                !lookup->answered[1]) {
+                                type = 1;
+                        }
+                        if (type == -1) {
+                                continue;
+                        }
+
+                        // a response that doesn't repeat the question isn't 
+                        // for this lookup, whatever its ID
+                        if (!parseDnsResponse(lookup, packet, length, 
+                                queryTypes[type])) {
+                                continue;
+                        }
+                        lookup->answered[type] = true;
+                        if (lookup->answered[0] && lookup->answered[1]) {
+                                finishDnsLookup(theProxy, lookup);
+                                break;
+                        }
+
+                        // give the other family a moment, then connect to 
+                        // the addresses that arrived (RFC 8305 section 3)
+                        unsigned long long waitUntil = 
+                                getCurrTime(theProxy->theCache) + 
+                                DNS_RESOLUTION_DELAY;
+                        if (lookup->numAddresses > 0 && 
+                                waitUntil < lookup->retryTime) {
+                                lookup->retryTime = waitUntil;
+                        }
+                        break;
+                }
+        }
+}
+
+
+/*
+ * name:      getDnsWaitTime
+ * purpose:   finds how long the event loop can wait before a lookup has to be
+ *            resent or given up on
+ * arguments: the proxy instance
+ * returns:   the time in milliseconds, or -1 if no lookup is outstanding
+ * effects:   none
+ */
+int getDnsWaitTime(proxy *theProxy)
+{
+        dnsResolver *resolver = theProxy->resolver;
+        if (resolver == NULL || resolver->numLookups == 0) {
+                return -1;
+        }
+
+        unsigned long long now = getCurrTime(theProxy->theCache);
+        unsigned long long earliest = 0;
+        for (int i = 0; i < resolver->maxLookups; i++) {
+                dnsLookup *lookup = &resolver->lookups[i];
+                if (!lookup->active) {
+                        continue;
+                }
+                unsigned long long next = (lookup->retryTime < lookup->deadline) ?
+                        lookup->retryTime : lookup->deadline;
+                if (earliest == 0 || next < earliest) {
+                        earliest = next;
+                }
+        }
+
+        if (earliest <= now) {
+                return 0;
+        }
+        return (int)((earliest - now + 999999) / 1000000);
+}
+
+
+/*
+ * name:      expireDnsLookups
+ * purpose:   resends the unanswered queries of lookups whose retry time
+ *            passed, and finishes lookups that ran out of time. A lookup that
+ *            already got addresses for one query doesn't wait on the other
+ * arguments: the proxy instance
+ * returns:   none
+ * effects:   none
+ */
+void expireDnsLookups(proxy *theProxy)
+{
+        dnsResolver *resolver = theProxy->resolver;
+        if (resolver == NULL || resolver->numLookups == 0) {
+                return;
+        }
+
+        unsigned long long now = getCurrTime(theProxy->theCache);
+        for (int i = 0; i < resolver->maxLookups; i++) {
+                dnsLookup *lookup = &resolver->lookups[i];
+                if (!lookup->active) {
+                        continue;
+                }
+
+                if (now >= lookup->deadline) {
+                        ERROR_PRINT("DNS lookup for %s timed out\n",
+                                lookup->hostName);
+                        finishDnsLookup(theProxy, lookup);
+                }
+                else if (now >= lookup->retryTime) {
+                        if (lookup->numAddresses > 0) {
+                                finishDnsLookup(theProxy, lookup);
+                                continue;
+                        }
+                        sendDnsQueries(resolver, lookup);
+                        lookup->retryTime = now + DNS_RETRY_INTERVAL;
+                }
+        }
+}
+
+
+
+/*****************************************************************************
+*                              RESPONSE PARSING
+******************************************************************************/
+
+
+/*
+ * name:      parseDnsResponse
+ * purpose:   adds the addresses in the answer section of a response to the
+ *            lookup and keeps the lowest TTL of the records
+ * arguments: the lookup, the response packet and its length, the record type
+ *            that was queried
+ * returns:   true if the response answers the lookup's query, even with an 
+ *            error or a malformed answer, false if it has to be ignored 
+ *            because its question isn't the one that was asked
+ * effects:   marks the lookup as failed if the name doesn't exist
+ */
+bool parseDnsResponse(dnsLookup *lookup, unsigned char *packet, int length,
+        int queryType)
+{
+        DEBUG_PRINT("FUNCTION: parseDnsResponse\n");
+        bool isResponse = (packet[2] & 0x80) != 0;
+        int responseCode = packet[3] & 0x0F;
+        if (!isResponse) {
+                return false;
+        }
+
+        int offset = matchDnsQuestion(lookup, packet, length, queryType);
+        if (offset == -1) {
+                return false;
+        }
+        if (responseCode != 0) {
+                // NXDOMAIN means neither query will find an address
+                if (responseCode == 3) {
+                        lookup->failed = true;
+                }
+                return true;
+        }
+
+        int numAnswers = (packet[6] << 8) | packet[7];
+        for (int i = 0; i < numAnswers; i++) {
+                offset = skipDnsName(packet, length, offset);
+                if (offset == -1 || offset + 10 > length) {
+                        return true;
+                }
+
+                int type = (packet[offset] << 8) | packet[offset + 1];
+                unsigned int ttl = ((unsigned int)packet[offset + 4] << 24) |
+                        (packet[offset + 5] << 16) | (packet[offset + 6] << 8) |
+                        packet[offset + 7];
+                int dataLength = (packet[offset + 8] << 8) | packet[offset + 9];
+                offset += 10;
+                if (offset + dataLength > length) {
+                        return true;
+                }
+
+                // CNAME records in the chain are skipped, the resolver
+                // includes the records of the name they point to
+                if (type == queryType && type == DNS_TYPE_A && dataLength == 4) {
+                        addDnsAddress(lookup, AF_INET, packet + offset);
+                }
+                else if (type == queryType && type == DNS_TYPE_AAAA &&
+                        dataLength == 16) {
+                        addDnsAddress(lookup, AF_INET6, packet + offset);
+                }
+                else {
+                        offset += dataLength;
+                        continue;
+                }
+
+                if (lookup->ttl == 0 || ttl < lookup->ttl) {
+                        lookup->ttl = ttl;
+                }
+                offset += dataLength;
+        }
+
+        return true;
+}
+
+
+/*
+ * name:      matchDnsQuestion
+ * purpose:   checks that the question section of a response is the single 
+ *            question of the query, the lookup's host name (ignoring case) 
+ *            with the queried type and class
+ * arguments: the lookup, the response packet and its length, the record type 
+ *            that was queried
+ * returns:   the offset after the question, or -1 if it doesn't match
+ * effects:   none
+ */
+int matchDnsQuestion(dnsLookup *lookup, unsigned char *packet, int length, 
+        int queryType)
+{
+        int numQuestions = (packet[4] << 8) | packet[5];
+        if (numQuestions != 1) {
+                return -1;
+        }
+
+        // the question is the first name in the packet, so it is never 
+        // compressed
+        int offset = 12;
+        const char *label = lookup->hostName;
+        while (offset < length && packet[offset] != 0) {
+                int labelLength = packet[offset];
+                if (labelLength > 63 || offset + 1 + labelLength > length
+                        || (int)strnlen(label, labelLength) != labelLength
+                        || strncasecmp(label, (char *)packet + offset + 1, 
+                        labelLength) != 0) {
+                        return -1;
+                }
+                label += labelLength;
+                if (*label != '.' && *label != '\0') {
+                        return -1;
+                }
+                if (*label == '.') {
+                        label++;
+                }
+                offset += labelLength + 1;
+        }
+        if (offset + 5 > length || *label != '\0') {
+                return -1;
+        }
+        offset++;
+
+        int type = (packet[offset] << 8) | packet[offset + 1];
+        int class = (packet[offset + 2] << 8) | packet[offset + 3];
+        if (type != queryType || class != DNS_CLASS_IN) {
+                return -1;
+        }
+        return offset + 4;
+}
+
+
+/*
+ * name:      skipDnsName
+ * purpose:   finds the end of a possibly compressed name in a DNS packet
+ * arguments: the packet, its length, the offset of the name
+ * returns:   the offset after the name, or -1 if the name is malformed
+ * effects:   none
+ */
+int skipDnsName(unsigned char *packet, int length, int offset)
+{
+        while (offset < length) {
+                int labelLength = packet[offset];
+                if ((labelLength & 0xC0) == 0xC0) {
+                        return (offset + 2 <= length) ? offset + 2 : -1;
+                }
+                if (labelLength == 0) {
+                        return offset + 1;
+                }
+                offset += labelLength + 1;
+        }
+        return -1;
+}
+
+
+/*
+ * name:      addDnsAddress
+ * purpose:   adds an address from an A or AAAA record to a lookup
+ * arguments: the lookup, the address family, the record data
+ * returns:   none
+ * effects:   none
+ */
+void addDnsAddress(dnsLookup *lookup, int family, unsigned char *data)
+{
+        if (lookup->numAddresses == DNS_MAX_ADDRESSES) {
+                return;
+        }
+
+        struct sockaddr_storage *address =
+                &lookup->addresses[lookup->numAddresses];
+        memset(address, 0, sizeof(struct sockaddr_storage));
+        if (family == AF_INET) {
+                struct sockaddr_in *address4 = (struct sockaddr_in *)address;
+                address4->sin_family = AF_INET;
+                memcpy(&address4->sin_addr, data, 4);
+        }
+        else {
+                struct sockaddr_in6 *address6 = (struct sockaddr_in6 *)address;
+                address6->sin6_family = AF_INET6;
+                memcpy(&address6->sin6_addr, data, 16);
+        }
+        lookup->numAddresses++;
+}
+
+
+
+/*****************************************************************************
+*                                 DNS CACHE
+******************************************************************************/
+
+
+/*
+ * name:      getDnsCache
+ * purpose:   gets the cache shared by the workers, creating it the first time
+ * arguments: none
+ * returns:   the DNS cache
+ * effects:   none
+ */
+dnsCache *getDnsCache()
+{
+        pthread_once(&dnsCacheOnce, createDnsCache);
+        return sharedDnsCache;
+}
+
+
+/*
+ * name:      createDnsCache
+ * purpose:   allocates the shared cache and its table
+ * arguments: none
+ * returns:   none
+ * effects:   sets the shared cache
+ */
+static void createDnsCache()
+{
+        dnsCache *cache = malloc(sizeof(dnsCache));
+        checkFatalNull(cache);
+
+        cache->size = DNS_CACHE_SLOTS;
+        cache->numItems = 0;
+        cache->maxNumItems = DNS_CACHE_ITEMS;
+        cache->hashTable = calloc(cache->size, sizeof(dnsCacheSlot));
+        checkFatalNull(cache->hashTable);
+        pthread_mutex_init(&cache->lock, NULL);
+
+        sharedDnsCache = cache;
+}
+
+
+/*
+ * name:      getCachedAddresses
+ * purpose:   looks a host name up in the cache. A name that was used several 
+ *            times and is close to expiring is looked up again in the 
+ *            background, so later clients don't wait on the name server
+ * arguments: the proxy instance, the host name, the addresses to populate 
+ *            and their count
+ * returns:   DNS_CACHE_HIT with the addresses, DNS_CACHE_NEGATIVE if the 
+ *            name recently failed to resolve, DNS_CACHE_MISS otherwise
+ * effects:   may start a lookup which isn't tied to a client
+ */
+int getCachedAddresses(proxy *theProxy, char *hostName, 
+        struct sockaddr_storage *addresses, int *numAddresses)
+{
+        DEBUG_PRINT("FUNCTION: getCachedAddresses\n");
+        dnsCache *cache = theProxy->resolver->cache;
+        unsigned long long now = getDnsTime();
+        bool prefetch = false;
+        int result = DNS_CACHE_MISS;
+        *numAddresses = 0;
+
+        pthread_mutex_lock(&cache->lock);
+        dnsCacheEntry *entry = findCacheEntry(cache, hostName);
+        if (entry != NULL && now < entry->expireTime) {
+                result = entry->negative ? DNS_CACHE_NEGATIVE : DNS_CACHE_HIT;
+                memcpy(addresses, entry->addresses, 
+                        entry->numAddresses * sizeof(struct sockaddr_storage));
+                *numAddresses = entry->numAddresses;
+                entry->hits++;
+
+                unsigned long long refreshTime = entry->storageTime + 
+                        (entry->expireTime - entry->storageTime) * 
+                        DNS_PREFETCH_PERCENT / 100;
+                if (!entry->negative && !entry->refreshing && 
+                        entry->hits >= DNS_PREFETCH_HITS && now >= refreshTime) {
+                        entry->refreshing = true;
+                        prefetch = true;
+                }
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        // the answer is stored by finishDnsLookup, which also clears the 
+        // refreshing flag. A lookup that can't start clears it here, or the 
+        // entry would never be refreshed again nor removed once expired
+        if (prefetch) {
+                DEBUG_PRINT("Prefetching %s\n", hostName);
+                if (!startDnsLookup(theProxy, hostName, -1)) {
+                        pthread_mutex_lock(&cache->lock);
+                        entry = findCacheEntry(cache, hostName);
+                        if (entry != NULL) {
+                                entry->refreshing = false;
+                        }
+                        pthread_mutex_unlock(&cache->lock);
+                }
+        }
+        return result;
+}
+
+
+/*
+ * name:      storeCachedAddresses
+ * purpose:   stores the result of a finished lookup. Addresses are kept for 
+ *            the lowest TTL of their records, names that don't exist or have 
+ *            no addresses for a short while, and lookups that timed out for 
+ *            even less unless a refresh of a valid entry timed out
+ * arguments: the cache, the finished lookup
+ * returns:   none
+ * effects:   none
+ */
+void storeCachedAddresses(dnsCache *cache, dnsLookup *lookup)
+{
+        DEBUG_PRINT("FUNCTION: storeCachedAddresses\n");
+        unsigned long long now = getDnsTime();
+        bool timedOut = lookup->numAddresses == 0 && !lookup->failed && 
+                !(lookup->answered[0] && lookup->answered[1]);
+
+        unsigned int ttl = DNS_NEGATIVE_TTL;
+        if (lookup->numAddresses > 0) {
+                ttl = lookup->ttl;
+                if (ttl < DNS_MIN_TTL) {
+                        ttl = DNS_MIN_TTL;
+                }
+                if (ttl > DNS_MAX_TTL) {
+                        ttl = DNS_MAX_TTL;
+                }
+        }
+        else if (timedOut) {
+                ttl = DNS_FAILURE_TTL;
+        }
+
+        pthread_mutex_lock(&cache->lock);
+        dnsCacheEntry *entry = findCacheEntry(cache, lookup->hostName);
+
+        // keep serving the old addresses if the refresh didn't get an answer
+        if (entry != NULL && timedOut && !entry->negative && 
+                now < entry->expireTime) {
+                entry->refreshing = false;
+                pthread_mutex_unlock(&cache->lock);
+                return;
+        }
+
+        if (entry == NULL) {
+                if (cache->numItems >= cache->maxNumItems) {
+                        removeExpiredEntries(cache, now);
+                }
+                if (cache->numItems >= cache->maxNumItems) {
+                        pthread_mutex_unlock(&cache->lock);
+                        return;
+                }
+
+                dnsCacheSlot *slot = 
+                        &cache->hashTable[hashHostName(lookup->hostName,
+                        cache->size)];
+                if (slot->numSlotItems == slot->maxSlotItems) {
+                        slot->maxSlotItems = (slot->maxSlotItems == 0) ? 
+                                4 : slot->maxSlotItems * 2;
+                        slot->slotArray = realloc(slot->slotArray, 
+                                slot->maxSlotItems * sizeof(dnsCacheEntry));
+                        checkFatalNull(slot->slotArray);
+                }
+                entry = &slot->slotArray[slot->numSlotItems];
+                entry->hostName = strdup(lookup->hostName);
+                checkFatalNull(entry->hostName);
+                slot->numSlotItems++;
+                cache->numItems++;
+        }
+
+        memcpy(entry->addresses, lookup->addresses, 
+                lookup->numAddresses * sizeof(struct sockaddr_storage));
+        entry->numAddresses = lookup->numAddresses;
+        entry->negative = lookup->numAddresses == 0;
+        entry->storageTime = now;
+        entry->expireTime = now + ttl * 1000000000ULL;
+        entry->hits = 0;
+        entry->refreshing = false;
+        pthread_mutex_unlock(&cache->lock);
+}
+
+
+/*
+ * name:      findCacheEntry
+ * purpose:   finds the entry of a host name in the cache, the cache lock has 
+ *            to be held
+ * arguments: the cache, the host name
+ * returns:   the entry, or NULL if the name isn't cached
+ * effects:   none
+ */
+dnsCacheEntry *findCacheEntry(dnsCache *cache, char *hostName)
+{
+        dnsCacheSlot *slot = 
+                &cache->hashTable[hashHostName(hostName, cache->size)];
+        for (int i = 0; i < slot->numSlotItems; i++) {
+                if (strcasecmp(slot->slotArray[i].hostName, hostName) == 0) {
+                        return &slot->slotArray[i];
+                }
+        }
+        return NULL;
+}
+
+
+/*
+ * name:      removeExpiredEntries
+ * purpose:   makes room in a full cache by removing the expired entries, the 
+ *            cache lock has to be held
+ * arguments: the cache, the current time
+ * returns:   none
+ * effects:   none
+ */
+void removeExpiredEntries(dnsCache *cache, unsigned long long now)
+{
+        DEBUG_PRINT("FUNCTION: removeExpiredEntries\n");
+        for (int i = 0; i < cache->size; i++) {
+                dnsCacheSlot *slot = &cache->hashTable[i];
+                int j = 0;
+                while (j < slot->numSlotItems) {
+                        dnsCacheEntry *entry = &slot->slotArray[j];
+                        if (now < entry->expireTime || entry->refreshing) {
+                                j++;
+                                continue;
+                        }
+
+                        // move the last entry of the slot into the gap
+                        free(entry->hostName);
+                        slot->numSlotItems--;
+                        slot->slotArray[j] = slot->slotArray[slot->numSlotItems];
+                        cache->numItems--;
+                }
+        }
+}
+
+
+
+/*
+ * name:      getDnsTime
+ * purpose:   gets the time used for the cache. The workers' HTTP caches each 
+ *            count from their own start, so the shared cache keeps its own 
+ *            monotonic clock
+ * arguments: none
+ * returns:   the time in nanoseconds
+ * effects:   none
+ */
+unsigned long long getDnsTime()
+{
+        struct timespec currTime;
+        clock_gettime(CLOCK_MONOTONIC, &currTime);
+        return currTime.tv_sec * 1000000000ULL + currTime.tv_nsec;
+}
+
+
+
+/*****************************************************************************
+*                              RESET FUNCTIONS
+******************************************************************************/
+
+
+/*
+ * name:      finishDnsLookup
+ * purpose:   caches the result of a lookup, hands it to the waiting client 
+ *            and frees the lookup. Prefetches have no client waiting
+ * arguments: the proxy instance, the lookup
+ * returns:   none
+ * effects:   none
+ */
+void finishDnsLookup(proxy *theProxy, dnsLookup *lookup)
+{
+        DEBUG_PRINT("FUNCTION: finishDnsLookup\n");
+        lookup->active = false;
+        theProxy->resolver->numLookups--;
+
+        storeCachedAddresses(theProxy->resolver->cache, lookup);
+        if (lookup->clientSD != -1) {
+                finishServerLookup(theProxy, lookup);
+        }
+
+        free(lookup->hostName);
+        lookup->hostName = NULL;
+}
+
+
+/*
+ * name:      cancelDnsLookups
+ * purpose:   drops the outstanding lookups of a client that was removed, so
+ *            their answers aren't handed to a reused socket descriptor
+ * arguments: the proxy instance, the client socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void cancelDnsLookups(proxy *theProxy, int clientSD)
+{
+        dnsResolver *resolver = theProxy->resolver;
+        if (resolver == NULL) {
+                return;
+        }
+
+        for (int i = 0; i < resolver->maxLookups; i++) {
+                dnsLookup *lookup = &resolver->lookups[i];
+                if (lookup->active && lookup->clientSD == clientSD) {
+                        lookup->active = false;
+                        free(lookup->hostName);
+                        lookup->hostName = NULL;
+                        resolver->numLookups--;
+                }
+        }
+}
@@ -18,20 +18,36 @@
 #ifndef INCLUDE_H
 #define INCLUDE_H
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <linux/io_uring.h>
+#include <linux/errqueue.h>
 
 #include <limits.h>
 #include <time.h> 
@@ -0,0 +1,180 @@
+/*****************************************************************************
+ *
+ *      keypool.c
+ *
+ *      Isabel Muste (imuste01)
+ *      Marti Zentmaier (mzentm01)
+ *
+ *      11/10/2024
+ *
+ *      CS 112 Final Project
+ *
+ *      Contains the pool of key pairs the forged certificates are made with.
+ *      A background thread generates keys of the configured type until the
+ *      pool is full and wakes up again whenever a worker takes one, so a
+ *      worker forging a certificate only pays for signing it. Keys are
+ *      ECDSA P-256 by default, Ed25519 and RSA-2048 keys can be chosen on
+ *      the command line. The root key signing the certificates is read from
+ *      the certs directory as before, whatever its type.
+ *
+ *
+ *****************************************************************************/
+
+#include "proxy.h"
+#include "logging.h"
+
+#define KEY_POOL_SIZE 64
+
+
+
+/*****************************************************************************
+*                              KEY POOL SETUP
+******************************************************************************/
+
+
+/*
+ * name:      startKeyPool
+ * purpose:   creates the key pool shared by the workers and starts the
+ *            thread that fills it
+ * arguments: the type of key to generate
+ * returns:   the pool
+ * effects:   none
+ */
+keyPool *startKeyPool(int keyType)
+{
+        DEBUG_PRINT("FUNCTION: startKeyPool\n");
+        keyPool *pool = malloc(sizeof(keyPool));
+        checkFatalNull(pool);
+
+        pool->keyType = keyType;
+        pool->numKeys = 0;
+        pool->maxKeys = KEY_POOL_SIZE;
+        pool->keys = malloc(pool->maxKeys * sizeof(EVP_PKEY *));
+        checkFatalNull(pool->keys);
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->keyTaken, NULL);
+
+        pthread_t generatorThread;
+        int returnVal = pthread_create(&generatorThread, NULL,
+                runKeyGenerator, pool);
+        if (returnVal != 0) {
+                ERROR_PRINT("Failed to start the key generator\n");
+                exit(EXIT_FAILURE);
+        }
+        pthread_detach(generatorThread);
+
+        return pool;
+}
+
+
+/*
+ * name:      getLeafKeyType
+ * purpose:   gets the key type from the name given on the command line
+ * arguments: the name of the key type
+ * returns:   the key type, or -1 if the name isn't known
+ * effects:   none
+ */
+int getLeafKeyType(char *name)
+{
+        if (strcmp(name, "ec") == 0) {
+                return LEAF_KEY_EC;
+        }
+        if (strcmp(name, "ed25519") == 0) {
+                return LEAF_KEY_ED25519;
+        }
+        if (strcmp(name, "rsa") == 0) {
+                return LEAF_KEY_RSA;
+        }
+        return -1;
+}
+
+
+
+
+/*****************************************************************************
+*                             KEY GENERATION
+******************************************************************************/
+
+
+/*
+ * name:      runKeyGenerator
+ * purpose:   thread entry point that keeps the key pool full, sleeping while
+ *            it is
+ * arguments: the key pool
+ * returns:   NULL, the thread runs until the program exits
+ * effects:   none
+ */
+void *runKeyGenerator(void *keyPoolArg)
+{
+        keyPool *pool = (keyPool *)keyPoolArg;
+
+        while (true) {
+                pthread_mutex_lock(&pool->lock);
+                while (pool->numKeys == pool->maxKeys) {
+                        pthread_cond_wait(&pool->keyTaken, &pool->lock);
+                }
+                pthread_mutex_unlock(&pool->lock);
+
+                // generate without the lock so workers can take keys meanwhile
+                EVP_PKEY *key = generateLeafKey(pool->keyType);
+                if (key == NULL) {
+                        ERROR_PRINT("Failed to generate a pooled key\n");
+                        sleep(1);
+                        continue;
+                }
+
+                pthread_mutex_lock(&pool->lock);
+                pool->keys[pool->numKeys] = key;
+                pool->numKeys++;
+                pthread_mutex_unlock(&pool->lock);
+        }
+        return NULL;
+}
+
+
+/*
+ * name:      takePooledKey
+ * purpose:   takes a key for a new certificate out of the pool, generating
+ *            one on the spot if the pool ran dry
+ * arguments: the key pool
+ * returns:   the key, or NULL if it couldn't be generated
+ * effects:   the caller owns the key, the generator refills the pool
+ */
+EVP_PKEY *takePooledKey(keyPool *pool)
+{
+        DEBUG_PRINT("FUNCTION: takePooledKey\n");
+        EVP_PKEY *key = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->numKeys > 0) {
+                pool->numKeys--;
+                key = pool->keys[pool->numKeys];
+                pthread_cond_signal(&pool->keyTaken);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (key == NULL) {
+                DEBUG_PRINT("Key pool is empty\n");
+                key = generateLeafKey(pool->keyType);
+        }
+        return key;
+}
+
+
+/*
+ * name:      generateLeafKey
+ * purpose:   generates a key pair of the given type
+ * arguments: the key type
+ * returns:   the key, or NULL if it couldn't be generated
+ * effects:   none
+ */
+EVP_PKEY *generateLeafKey(int keyType)
+{
+        if (keyType == LEAF_KEY_ED25519) {
+                return EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+        }
+        if (keyType == LEAF_KEY_RSA) {
+                return EVP_PKEY_Q_keygen(NULL, NULL, "RSA", (size_t)2048);
+        }
+        return EVP_PKEY_Q_keygen(NULL, NULL, "EC", "P-256");
+}
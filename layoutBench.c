@@ -0,0 +1,448 @@
+/*****************************************************************************
+ *
+ *      layoutBench.c
+ *
+ *      Isabel Muste (imuste01)
+ *      Marti Zentmaier (mzentm01)
+ *
+ *      11/10/2024
+ *
+ *      CS 112 Final Project
+ *
+ *      Contains the microbenchmark the layout of connectionInfo was measured
+ *      with. It keeps 10k live spliced tunnel connections and dispatches
+ *      random read events to them the way facilitateCommunication does:
+ *      looking the struct up, stamping the activity time, checking the
+ *      connect and handshake flags, the read pause and the mode, and picking
+ *      the relay. The relay itself is left out, it is the same for every
+ *      layout. Three layouts are timed:
+ *       -  unsplit: connectionInfo before the split, every field inline and
+ *          the mode and activity stamp in the session
+ *       -  split: the hot record with the connect flag in the details and
+ *          the mode and activity stamp still in the session
+ *       -  hot: the current record, which holds everything dispatch touches
+ *          in its first cache line
+ *      The sessions and details come from arrays of their own, like the
+ *      slabs they are carved from in the proxy.
+ *
+ *      Built and run on its own, it isn't part of the proxy:
+ *       -  gcc -O2 -o layoutBench layoutBench.c
+ *       -  ./layoutBench
+ *
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define NUM_CONNECTIONS 10000
+#define NUM_EVENTS 50000000
+#define NUM_ROUNDS 3
+
+#define TUNNEL 0
+#define EVENT_IN 0x001
+#define EVENT_OUT 0x004
+#define EVENT_ERR 0x008
+#define EVENT_HUP 0x010
+
+
+
+/*****************************************************************************
+*                              BENCHMARK STRUCTS
+******************************************************************************/
+
+
+/*
+ * name:      oldSession struct
+ * purpose:   stores a session the way connSession did while it held the
+ *            mode and the activity stamp
+ */
+typedef struct {
+
+        int refCount;
+        void *client;
+        void *server;
+        bool mode;
+
+        char *serverURL;
+        int serverPort;
+
+        void *clientSSL;
+        void *serverCtx;
+        void *serverSSL;
+
+        unsigned long long lastActivity;
+
+} oldSession;
+
+
+
+/*
+ * name:      hotSession struct
+ * purpose:   stores a session the way connSession does now
+ */
+typedef struct {
+
+        int refCount;
+        void *client;
+        void *server;
+
+        char *serverURL;
+        int serverPort;
+
+        void *clientSSL;
+        void *serverCtx;
+        void *serverSSL;
+
+} hotSession;
+
+
+
+/*
+ * name:      unsplitConnection struct
+ * purpose:   stores a connection the way connectionInfo did before the
+ *            split, with the MITM message and connect phase fields inline
+ */
+typedef struct {
+
+        int clientSD;
+        int serverSD;
+        bool isClient;
+        oldSession *session;
+
+        int bufferSize;
+        int bufferRead;
+        char *readBuffer;
+        int headerSize;
+        int headerRead;
+        char *msgHeader;
+        int contentSize;
+        int contentRead;
+        char *msgContent;
+        int contentEncoding;
+        bool chunkedContent;
+        bool divAdded;
+
+        bool connActive;
+        int pipeRead;
+        int pipeWrite;
+        int pipeBytes;
+        bool zerocopyEnabled;
+        unsigned int zerocopySends;
+        void *zerocopyHead;
+        void *zerocopyTail;
+        void *outputHead;
+        void *outputTail;
+        int outputBytes;
+        bool readPaused;
+        bool writeWaiting;
+        bool closeAfterFlush;
+        uint32_t eventMask;
+
+        bool resolving;
+        void *race;
+        void *exchange;
+        bool connecting;
+        unsigned long long connectDeadline;
+        unsigned long long nextAttemptTime;
+
+} unsplitConnection;
+
+
+
+/*
+ * name:      splitDetails struct
+ * purpose:   stores the cold fields of a split connection, the connect flag
+ *            among them
+ */
+typedef struct {
+
+        int bufferSize;
+        int bufferRead;
+        char *readBuffer;
+        int headerSize;
+        int headerRead;
+        char *msgHeader;
+        int contentSize;
+        int contentRead;
+        char *msgContent[4];
+        int contentEncoding;
+        bool chunkedContent;
+        bool divAdded;
+
+        bool resolving;
+        void *race;
+        void *exchange;
+        bool connecting;
+        unsigned long long connectDeadline;
+        unsigned long long nextAttemptTime;
+        bool handshaking;
+
+} splitDetails;
+
+
+
+/*
+ * name:      splitConnection struct
+ * purpose:   stores a connection the way connectionInfo did right after the
+ *            split
+ */
+typedef struct {
+
+        int clientSD;
+        int serverSD;
+        bool isClient;
+        bool connActive;
+        bool readPaused;
+        bool writeWaiting;
+        bool closeAfterFlush;
+        bool zerocopyEnabled;
+        uint32_t eventMask;
+        unsigned int zerocopySends;
+        oldSession *session;
+        splitDetails *details;
+        char *relayBuffer;
+
+        int pipeRead;
+        int pipeWrite;
+        int pipeBytes;
+        int outputBytes;
+        void *outputHead;
+        void *outputTail;
+
+        void *zerocopyHead;
+        void *zerocopyTail;
+
+} splitConnection;
+
+
+
+/*
+ * name:      hotDetails struct
+ * purpose:   stores the cold fields of a connection the way connDetails
+ *            does now
+ */
+typedef struct {
+
+        int bufferSize;
+        int bufferRead;
+        char *readBuffer;
+        int headerSize;
+        int headerRead;
+        char *msgHeader;
+        int contentSize;
+        int contentRead;
+        char *msgContent[4];
+        int contentEncoding;
+        bool chunkedContent;
+        bool divAdded;
+
+        bool resolving;
+        void *race;
+        void *exchange;
+        unsigned long long connectDeadline;
+        unsigned long long nextAttemptTime;
+
+} hotDetails;
+
+
+
+/*
+ * name:      hotConnection struct
+ * purpose:   stores a connection the way connectionInfo does now
+ */
+typedef struct {
+
+        int clientSD;
+        int serverSD;
+        bool isClient;
+        bool mode;
+        bool connActive;
+        bool connecting;
+        bool handshaking;
+        bool readPaused;
+        bool writeWaiting;
+        bool closeAfterFlush;
+        bool zerocopyEnabled;
+        uint32_t eventMask;
+        int pipeRead;
+        int outputBytes;
+        unsigned long long lastActivity;
+        hotSession *session;
+        hotDetails *details;
+        char *relayBuffer;
+
+        int pipeWrite;
+        int pipeBytes;
+        void *outputHead;
+        void *outputTail;
+
+        unsigned int zerocopySends;
+        void *zerocopyHead;
+        void *zerocopyTail;
+
+} hotConnection;
+
+
+
+/*****************************************************************************
+*                              BENCHMARK FUNCTIONS
+******************************************************************************/
+
+
+/*
+ * name:      getBenchTime
+ * purpose:   gets the time of the monotonic clock
+ * arguments: none
+ * returns:   the time in seconds
+ * effects:   none
+ */
+static double getBenchTime()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+/*
+ * name:      BENCH_LAYOUT
+ * purpose:   sets up the connections of one layout and times dispatching
+ *            random events to them. The accessors name where the layout
+ *            keeps the activity stamp, the connect and handshake flags and
+ *            the mode, and the dispatch follows facilitateCommunication
+ *            branch for branch. It is a macro so every layout gets the same
+ *            inlined loop
+ * arguments: the connection, session and details types, the name printed
+ *            for the layout, the accessors
+ * returns:   none
+ * effects:   prints the size of the struct and the time per event
+ */
+#define BENCH_LAYOUT(connType, sessionType, detailsType, name,                \
+        LAST_ACTIVITY, CONNECTING, HANDSHAKING, MODE)                         \
+{                                                                             \
+        connType *conns = calloc(NUM_CONNECTIONS, sizeof(connType));          \
+        sessionType *sessions = calloc(NUM_CONNECTIONS, sizeof(sessionType)); \
+        detailsType *details = calloc(NUM_CONNECTIONS, sizeof(detailsType));  \
+        connType **table = malloc(NUM_CONNECTIONS * sizeof(connType *));      \
+        if (conns == NULL || sessions == NULL || details == NULL ||           \
+                table == NULL) {                                              \
+                fprintf(stderr, "Failed to allocate connections\n");          \
+                exit(EXIT_FAILURE);                                           \
+        }                                                                     \
+        for (int i = 0; i < NUM_CONNECTIONS; i++) {                           \
+                table[i] = &conns[i];                                         \
+                connType *conn = &conns[i];                                   \
+                conn->clientSD = i;                                           \
+                conn->serverSD = i + 1;                                       \
+                conn->isClient = i & 1;                                       \
+                conn->connActive = true;                                      \
+                conn->session = &sessions[i];                                 \
+                conn->pipeRead = i + 2;                                       \
+                conn->eventMask = EVENT_IN;                                   \
+                SET_DETAILS(conn, &details[i]);                               \
+                MODE(conn) = TUNNEL;                                          \
+        }                                                                     \
+                                                                              \
+        unsigned int seed = 12345;                                            \
+        unsigned long long loopTime = 0;                                      \
+        long sum = 0;                                                         \
+        double start = getBenchTime();                                        \
+        for (long k = 0; k < NUM_EVENTS; k++) {                               \
+                seed = seed * 1103515245 + 12345;                             \
+                uint32_t events = EVENT_IN;                                   \
+                connType *conn = table[(seed >> 8) % NUM_CONNECTIONS];        \
+                LAST_ACTIVITY(conn) = loopTime++;                             \
+                                                                              \
+                if (CONNECTING(conn)) {                                       \
+                        sum += 1;                                             \
+                        continue;                                             \
+                }                                                             \
+                if (HANDSHAKING(conn)) {                                      \
+                        sum += 2;                                             \
+                        continue;                                             \
+                }                                                             \
+                if (events & EVENT_OUT) {                                     \
+                        sum += conn->outputBytes;                             \
+                }                                                             \
+                if (!(events & (EVENT_IN | EVENT_HUP | EVENT_ERR))) {         \
+                        continue;                                             \
+                }                                                             \
+                if (conn->readPaused && !(events & (EVENT_HUP | EVENT_ERR))) {\
+                        continue;                                             \
+                }                                                             \
+                                                                              \
+                if (MODE(conn) == TUNNEL && conn->pipeRead != -1) {           \
+                        sum += conn->pipeRead;                                \
+                }                                                             \
+                else if (MODE(conn) == TUNNEL) {                              \
+                        sum += conn->isClient ? conn->clientSD :              \
+                                conn->serverSD;                               \
+                }                                                             \
+                else {                                                        \
+                        sum -= conn->isClient ? conn->clientSD :              \
+                                conn->serverSD;                               \
+                }                                                             \
+        }                                                                     \
+        double elapsed = getBenchTime() - start;                              \
+                                                                              \
+        printf("%-7s size %3zu: %.2f ns/event (%ld)\n", name,                 \
+                sizeof(connType), elapsed * 1e9 / NUM_EVENTS, sum);           \
+        free(table);                                                          \
+        free(details);                                                        \
+        free(sessions);                                                       \
+        free(conns);                                                          \
+}
+
+
+/*
+ * name:      main
+ * purpose:   times the layouts a few times, alternating between them
+ * arguments: none
+ * returns:   0
+ * effects:   prints the results
+ */
+int main()
+{
+        for (int round = 0; round < NUM_ROUNDS; round++) {
+#define SET_DETAILS(conn, record) (void)(record)
+#define LAST_ACTIVITY(conn) (conn)->session->lastActivity
+#define CONNECTING(conn) (conn)->connecting
+#define HANDSHAKING(conn) false
+#define MODE(conn) (conn)->session->mode
+                BENCH_LAYOUT(unsplitConnection, oldSession, splitDetails,
+                        "unsplit", LAST_ACTIVITY, CONNECTING, HANDSHAKING,
+                        MODE);
+#undef SET_DETAILS
+#undef CONNECTING
+#undef HANDSHAKING
+
+#define SET_DETAILS(conn, record) (conn)->details = (record)
+#define CONNECTING(conn) (conn)->details->connecting
+#define HANDSHAKING(conn) (conn)->details->handshaking
+                BENCH_LAYOUT(splitConnection, oldSession, splitDetails,
+                        "split", LAST_ACTIVITY, CONNECTING, HANDSHAKING,
+                        MODE);
+#undef LAST_ACTIVITY
+#undef CONNECTING
+#undef HANDSHAKING
+#undef MODE
+
+#define LAST_ACTIVITY(conn) (conn)->lastActivity
+#define CONNECTING(conn) (conn)->connecting
+#define HANDSHAKING(conn) (conn)->handshaking
+#define MODE(conn) (conn)->mode
+                BENCH_LAYOUT(hotConnection, hotSession, hotDetails,
+                        "hot", LAST_ACTIVITY, CONNECTING, HANDSHAKING,
+                        MODE);
+#undef SET_DETAILS
+#undef LAST_ACTIVITY
+#undef CONNECTING
+#undef HANDSHAKING
+#undef MODE
+        }
+        return 0;
+}
@@ -1,5 +1,6 @@
 # ! /bin/sh
 
-gcc -DERROR -DDEBUG -DINFO -c proxyDriver.c proxy.c cache.c mitm.c tunnel.c LLM.c
+gcc -DERROR -DDEBUG -DINFO -c proxyDriver.c proxy.c cache.c mitm.c tunnel.c uring.c dns.c pool.c timer.c slab.c chain.c certcache.c certstore.c keypool.c publicsuffix.c LLM.c
 g++ -DERROR -DDEBUG -DINFO -c MurmurHash3.cpp
-g++ -DERROR -DDEBUG -DINFO -o proxy proxyDriver.o proxy.o cache.o MurmurHash3.o LLM.o mitm.o tunnel.o -lssl -lcrypto -lcurl
\ No newline at end of file
+g++ -DERROR -DDEBUG -DINFO -o proxy proxyDriver.o proxy.o cache.o MurmurHash3.o LLM.o mitm.o tunnel.o uring.o dns.o pool.o timer.o slab.o chain.o certcache.o certstore.o keypool.o publicsuffix.o -lssl -lcrypto -lcurl -lpthread
+gcc -O2 -o layoutBench layoutBench.c
\ No newline at end of file
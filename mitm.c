@@ -24,9 +24,12 @@
 #define MITM 1
 #define BR 1
 #define GZIP 2
+#define SSL_RELAY_BUFFER_SIZE 16384
+#define SSL_COALESCE_LIMIT 4096
+#define CERT_NAME_LENGTH 256
 
 
-static long serialNumCounter = 2;
+static atomic_long serialNumCounter = 2;
 
 /*****************************************************************************
 *                               MITM SETUP
@@ -66,6 +69,12 @@ void initializeClientContext(proxy *theProxy)
         }
 
         SSL_CTX_set_cipher_list(theProxy->clientCtx, "DEFAULT");
+
+        // switch each handshake to the context of the host the client asks 
+        // for once its ClientHello arrives
+        SSL_CTX_set_tlsext_servername_callback(theProxy->clientCtx, 
+                selectHostContext);
+        SSL_CTX_set_tlsext_servername_arg(theProxy->clientCtx, theProxy);
 }
 
 
@@ -91,6 +100,8 @@ void initializeRootCert(proxy *theProxy)
         FILE *rootKeyFile = fopen(rootKeyPath, "r");
         theProxy->rootKey = PEM_read_PrivateKey(rootKeyFile, NULL, NULL, NULL);
         fclose(rootKeyFile);
+
+        theProxy->certCache = getCertCache();
 }
 
 
@@ -101,107 +112,308 @@ void initializeRootCert(proxy *theProxy)
 
 
 /*
- * name:      setupServerCertificate
- * purpose:   sets up the certificate for the necessary domain allowing the 
- *            proxy to impersonate the target server
- * arguments: the proxy instance, the slot and index in the table
- * returns:   none
+ * name:      selectHostContext
+ * purpose:   servername callback of the client context, switches the 
+ *            handshake to the SSL context holding the certificate of the 
+ *            CONNECT host. The certificate is only forged here, once the 
+ *            ClientHello arrived, and always for the CONNECT host, so a 
+ *            client can't get certificates forged for names it didn't 
+ *            connect to by sending them in its SNI
+ * arguments: the client's SSL object, the alert to send on failure, the 
+ *            proxy instance
+ * returns:   SSL_TLSEXT_ERR_OK, or SSL_TLSEXT_ERR_ALERT_FATAL if there is no 
+ *            certificate for the host, which fails the handshake
+ * effects:   none
+ */
+int selectHostContext(SSL *clientSSL, int *alert, void *proxyArg)
+{
+        DEBUG_PRINT("FUNCTION: selectHostContext\n");
+        proxy *theProxy = (proxy *)proxyArg;
+        connSession *session = SSL_get_app_data(clientSSL);
+
+        const char *hostName = session->serverURL;
+        const char *requestedName = 
+                SSL_get_servername(clientSSL, TLSEXT_NAMETYPE_host_name);
+        if (requestedName != NULL 
+                && !isSameCertificateHost(theProxy, requestedName, hostName)) {
+                ERROR_PRINT("SNI %s doesn't match CONNECT host %s\n", 
+                        requestedName, hostName);
+        }
+
+        SSL_CTX *hostCtx = getHostContext(theProxy, (char *)hostName);
+        if (hostCtx == NULL) {
+                *alert = SSL_AD_INTERNAL_ERROR;
+                return SSL_TLSEXT_ERR_ALERT_FATAL;
+        }
+
+        // the SSL object takes its own reference to the context
+        SSL_set_SSL_CTX(clientSSL, hostCtx);
+        SSL_CTX_free(hostCtx);
+        return SSL_TLSEXT_ERR_OK;
+}
+
+
+/*
+ * name:      isSameCertificateHost
+ * purpose:   checks if the name a client sent in its ClientHello is its 
+ *            CONNECT host, ignoring case, or is covered by the same forged 
+ *            certificate
+ * arguments: the proxy instance, the requested name, the CONNECT host
+ * returns:   true if the name can be used, false otherwise
  * effects:   none
  */
-bool setupServerCertificate(proxy *theProxy, int slot, int index)
+bool isSameCertificateHost(proxy *theProxy, const char *requestedName, 
+        const char *connectHost)
 {
-        DEBUG_PRINT("FUNCTION: setupServerCertificate");
-
-        const char *domain = 
-                theProxy->clientTable[slot].slotArray[index].serverURL;
-        int clientSD = theProxy->clientTable[slot].slotArray[index].clientSD;
-
-        // create a new key pair using RSA key generation method in OpenSSL
-        EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
-        if (checkNullErrSSL(theProxy, slot, index, pctx, 1)) return false;
-        int returnVal = EVP_PKEY_keygen_init(pctx);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 2)) return false;
-        returnVal = EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, 2048);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 3)) return false;
+        if (strcasecmp(requestedName, connectHost) == 0) {
+                return true;
+        }
+
+        char requestedCert[CERT_NAME_LENGTH];
+        char connectCert[CERT_NAME_LENGTH];
+        getCertificateName(theProxy, (char *)requestedName, requestedCert);
+        getCertificateName(theProxy, (char *)connectHost, connectCert);
+        return strcasecmp(requestedCert, connectCert) == 0;
+}
+
+
+/*
+ * name:      getHostContext
+ * purpose:   gets the SSL context for the certificate of a host. A context 
+ *            built before is taken from the certificate cache, a certificate 
+ *            forged before a restart from the certificate store, and 
+ *            otherwise a certificate is forged
+ * arguments: the proxy instance, the host name
+ * returns:   the context, or NULL if it couldn't be set up
+ * effects:   the caller owns a reference to the context
+ */
+SSL_CTX *getHostContext(proxy *theProxy, char *hostName)
+{
+        DEBUG_PRINT("FUNCTION: getHostContext\n");
+        char domain[CERT_NAME_LENGTH];
+        getCertificateName(theProxy, hostName, domain);
+
+        // reuse the context built for an earlier connection to the host
+        SSL_CTX *hostCtx = getCachedContext(theProxy->certCache, domain);
+        if (hostCtx != NULL) {
+                return hostCtx;
+        }
+
+        X509 *serverCert = NULL;
         EVP_PKEY *serverKey = NULL;
-        returnVal = EVP_PKEY_keygen(pctx, &serverKey);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 4)) return false;
-        EVP_PKEY_CTX_free(pctx);
+        if (!loadStoredCertificate(theProxy->certStore, domain, &serverCert, 
+                &serverKey)) {
+                if (!forgeServerCertificate(theProxy, domain, &serverCert, 
+                        &serverKey)) {
+                        return NULL;
+                }
+                saveStoredCertificate(theProxy->certStore, domain, serverCert, 
+                        serverKey);
+        }
+
+        hostCtx = newHostContext(theProxy, serverCert, serverKey);
+        X509_free(serverCert);
+        EVP_PKEY_free(serverKey);
+        if (hostCtx != NULL) {
+                storeCachedContext(theProxy->certCache, domain, hostCtx);
+        }
+        return hostCtx;
+}
+
+
+/*
+ * name:      forgeServerCertificate
+ * purpose:   forges a certificate for the domain signed by the root 
+ *            certificate, allowing the proxy to impersonate the target server
+ * arguments: the proxy instance, the domain, the certificate and key to 
+ *            populate
+ * returns:   true if the certificate was forged, false otherwise
+ * effects:   the caller owns the certificate and key
+ */
+bool forgeServerCertificate(proxy *theProxy, char *domain, X509 **cert, 
+        EVP_PKEY **key)
+{
+        DEBUG_PRINT("FUNCTION: forgeServerCertificate\n");
+
+        // take a key pair generated in the background, so only signing the 
+        // certificate is left to do on the event loop
+        EVP_PKEY *serverKey = takePooledKey(theProxy->keyPool);
+        if (serverKey == NULL) {
+                ERROR_PRINT("Failed to generate a key for %s\n", domain);
+                return false;
+        }
 
         // create a new X.509 certificate, version 3, serial nr 1
         X509 *serverCert = X509_new();
-        if (checkNullErrSSL(theProxy, slot, index, serverCert, 5)) return false;
-        returnVal = X509_set_version(serverCert, 2);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 6)) return false;
-        returnVal = ASN1_INTEGER_set(X509_get_serialNumber(serverCert), 
-                serialNumCounter++);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 7)) return false;
+        if (serverCert == NULL) {
+                ERROR_PRINT("Failed to create a certificate for %s\n", domain);
+                EVP_PKEY_free(serverKey);
+                return false;
+        }
+        bool success = X509_set_version(serverCert, 2) 
+                && ASN1_INTEGER_set(X509_get_serialNumber(serverCert), 
+                atomic_fetch_add(&serialNumCounter, 1));
 
         // set validity period from now to 1 year from now
-        X509_gmtime_adj(X509_get_notBefore(serverCert), 0);
-        X509_gmtime_adj(X509_get_notAfter(serverCert), 31536000L);
+        success = success 
+                && X509_gmtime_adj(X509_get_notBefore(serverCert), 0) 
+                && X509_gmtime_adj(X509_get_notAfter(serverCert), 31536000L);
 
         // set subject and root issuer
-        X509_NAME *name = X509_get_subject_name(serverCert);
-        if (checkNullErrSSL(theProxy, slot, index, name, 8)) return false;
-        returnVal = X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, 
-                (unsigned char *)domain, -1, -1, 0);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 9)) return false;
-        returnVal = X509_set_issuer_name(serverCert, 
-                X509_get_subject_name(theProxy->rootCert));
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 10)) return false;
-        if (!addSubjectAltName(serverCert, domain)) {
-                return false;
-        }
+        success = success 
+                && X509_NAME_add_entry_by_txt(
+                X509_get_subject_name(serverCert), "CN", MBSTRING_ASC, 
+                (unsigned char *)domain, -1, -1, 0) 
+                && X509_set_issuer_name(serverCert, 
+                X509_get_subject_name(theProxy->rootCert)) 
+                && addSubjectAltName(serverCert, domain);
 
         // set the public key and sign certificate with root key
-        returnVal = X509_set_pubkey(serverCert, serverKey);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 11)) return false;
-        returnVal = X509_sign(serverCert, theProxy->rootKey, EVP_sha256());
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 12)) return false;
+        success = success 
+                && X509_set_pubkey(serverCert, serverKey) 
+                && X509_sign(serverCert, theProxy->rootKey, EVP_sha256()) > 0;
 
-        theProxy->clientTable[slot].slotArray[index].serverCert = serverCert;
-        theProxy->clientTable[slot].slotArray[index].serverKey = serverKey;
+        if (!success) {
+                ERROR_PRINT("Failed to forge a certificate for %s\n", domain);
+                ERR_print_errors_fp(stderr);
+                X509_free(serverCert);
+                EVP_PKEY_free(serverKey);
+                return false;
+        }
 
+        *cert = serverCert;
+        *key = serverKey;
         return true;
 }
 
 
+/*
+ * name:      newHostContext
+ * purpose:   builds the SSL context client handshakes for a host switch to, 
+ *            with its certificate, key and the root certificate as its chain 
+ *            loaded and checked once
+ * arguments: the proxy instance, the certificate and its key
+ * returns:   the context, or NULL if it couldn't be built
+ * effects:   the context takes its own reference to the certificate and key
+ */
+SSL_CTX *newHostContext(proxy *theProxy, X509 *cert, EVP_PKEY *key)
+{
+        DEBUG_PRINT("FUNCTION: newHostContext\n");
+        SSL_CTX *hostCtx = SSL_CTX_new(TLS_server_method());
+        if (hostCtx == NULL 
+                || SSL_CTX_use_certificate(hostCtx, cert) <= 0 
+                || SSL_CTX_use_PrivateKey(hostCtx, key) <= 0 
+                || !SSL_CTX_add1_chain_cert(hostCtx, theProxy->rootCert)) {
+                ERROR_PRINT("Failed to build a context for a certificate\n");
+                ERR_print_errors_fp(stderr);
+                SSL_CTX_free(hostCtx);
+                return NULL;
+        }
+
+        SSL_CTX_set_cipher_list(hostCtx, "DEFAULT");
+        return hostCtx;
+}
+
+
+/*
+ * name:      getCertificateName
+ * purpose:   gets the name a host's certificate is forged and cached under, 
+ *            the host name itself unless wildcard certificates are on. Then 
+ *            a host shares the certificate of its parent domain, 
+ *            "*.example.com" for img1.example.com, and the apex gets that 
+ *            same certificate. A wildcard only matches one label, so the 
+ *            hosts of a deeper subdomain share one of their own. Address 
+ *            literals and public suffixes keep exact names
+ * arguments: the proxy instance, the host name, the buffer for the name, 
+ *            which holds CERT_NAME_LENGTH bytes
+ * returns:   none
+ * effects:   none
+ */
+void getCertificateName(proxy *theProxy, char *hostName, char *certName)
+{
+        int length = strlen(hostName);
+        bool wildcardCerts = false;
+        if (theProxy->options != NULL) {
+                wildcardCerts = theProxy->options->wildcardCerts;
+        }
+
+        struct in_addr address;
+        if (!wildcardCerts || length == 0 
+                || length + 3 > CERT_NAME_LENGTH 
+                || hostName[length - 1] == '.' || strchr(hostName, ':') 
+                || inet_pton(AF_INET, hostName, &address) == 1) {
+                snprintf(certName, CERT_NAME_LENGTH, "%s", hostName);
+                return;
+        }
+
+        // room for the "*." the parent domain gets in front of it
+        char lowerName[CERT_NAME_LENGTH - 2];
+        for (int i = 0; i <= length; i++) {
+                lowerName[i] = tolower((unsigned char)hostName[i]);
+        }
+        char *registrable = getRegistrableDomain(lowerName);
+        if (registrable == NULL) {
+                snprintf(certName, CERT_NAME_LENGTH, "%s", hostName);
+                return;
+        }
+
+        char *parent = lowerName;
+        if (parent != registrable) {
+                parent = strchr(lowerName, '.') + 1;
+        }
+        snprintf(certName, CERT_NAME_LENGTH, "*.%s", parent);
+}
+
+
 /*
  * name:      addSubjectAltName
  * purpose:   sets the SAN field of a certificate, to ensure browser 
- *            compatibility
+ *            compatibility. A wildcard certificate also names the domain the 
+ *            wildcard is under, which the wildcard itself doesn't match
  * arguments: the X509 certificate, the domain name
  * returns:   true if the extension was successful, false otherwise
  * effects:   none
  */
 bool addSubjectAltName(X509 *cert, const char *domain) 
 {
-        GENERAL_NAME *genName = GENERAL_NAME_new();
-        if (genName == NULL) {
-                ERROR_PRINT("Failed to create GENERAL_NAME\n");
-                return false;
-        }
-
-        // Set the SAN to the domain name
-        ASN1_IA5STRING *asn1Str = ASN1_IA5STRING_new();
-        if (!asn1Str || !ASN1_STRING_set(asn1Str, domain, strlen(domain))) {
-                ERROR_PRINT("Failed to set SAN string\n");
-                GENERAL_NAME_free(genName);
-                return false;
-        }
-
-        GENERAL_NAME_set0_value(genName, GEN_DNS, asn1Str);
+        const char *names[2] = { domain, domain + 2 };
+        int numNames = (strncmp(domain, "*.", 2) == 0) ? 2 : 1;
 
         // Create a stack of GENERAL_NAME
         STACK_OF(GENERAL_NAME) *sanList = sk_GENERAL_NAME_new_null();
-        if (!sanList || !sk_GENERAL_NAME_push(sanList, genName)) {
+        if (!sanList) {
                 ERROR_PRINT("Failed to create SAN list\n");
-                GENERAL_NAME_free(genName);
-                if (sanList) sk_GENERAL_NAME_free(sanList);
                 return false;
         }
 
+        for (int i = 0; i < numNames; i++) {
+                GENERAL_NAME *genName = GENERAL_NAME_new();
+                if (genName == NULL) {
+                        ERROR_PRINT("Failed to create GENERAL_NAME\n");
+                        sk_GENERAL_NAME_pop_free(sanList, GENERAL_NAME_free);
+                        return false;
+                }
+
+                // Set the SAN to the domain name
+                ASN1_IA5STRING *asn1Str = ASN1_IA5STRING_new();
+                if (!asn1Str || !ASN1_STRING_set(asn1Str, names[i], 
+                        strlen(names[i]))) {
+                        ERROR_PRINT("Failed to set SAN string\n");
+                        ASN1_IA5STRING_free(asn1Str);
+                        GENERAL_NAME_free(genName);
+                        sk_GENERAL_NAME_pop_free(sanList, GENERAL_NAME_free);
+                        return false;
+                }
+                GENERAL_NAME_set0_value(genName, GEN_DNS, asn1Str);
+
+                if (!sk_GENERAL_NAME_push(sanList, genName)) {
+                        ERROR_PRINT("Failed to create SAN list\n");
+                        GENERAL_NAME_free(genName);
+                        sk_GENERAL_NAME_pop_free(sanList, GENERAL_NAME_free);
+                        return false;
+                }
+        }
+
         // Convert the stack to an X509_EXTENSION
         X509_EXTENSION *sanExt = 
                 X509V3_EXT_i2d(NID_subject_alt_name, 0, sanList);
@@ -225,177 +437,234 @@ bool addSubjectAltName(X509 *cert, const char *domain)
 
 
 /*
- * name:      sendCertificateToClient
- * purpose:   does the TLS handshake with the client using the generated 
- *            certificate and key
- * arguments: the proxy instance, the slot and index in the table
+ * name:      startClientHandshake
+ * purpose:   starts the TLS handshake with the client, which switches to the 
+ *            context of the certificate for the CONNECT host. The handshake 
+ *            runs on the non-blocking socket from the event loop, and the 
+ *            handshake timer limits how long both handshakes can take
+ * arguments: the proxy instance, the client's socket descriptor
  * returns:   none
- * effects:   none
+ * effects:   removes the client if the handshake can't be started or fails
  */
-bool sendCertificateToClient(proxy *theProxy, int slot, int index)
+void startClientHandshake(proxy *theProxy, int SD)
 {
-        DEBUG_PRINT("FUNCTION: sendCertificateToClient\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
-        int clientSD = client->clientSD;
-        X509 *serverCert = client->serverCert;
-        EVP_PKEY *serverKey = client->serverKey;
+        DEBUG_PRINT("FUNCTION: startClientHandshake\n");
+        connectionInfo *client = theProxy->connTable[SD];
+        startTimer(theProxy, client->clientSD, TIMER_HANDSHAKE, 
+                getHandshakeTimeout(theProxy));
 
         // Create the SSL object for the client and attach the socket
         SSL *clientSSL = SSL_new(theProxy->clientCtx);
-        if (checkNullErrSSL(theProxy, slot, index, clientSSL, 13)) return false;
-        client->clientSSL = clientSSL;
+        if (checkNullErrSSL(theProxy, SD, clientSSL, 13)) return;
+        client->session->clientSSL = clientSSL;
+        SSL_set_app_data(clientSSL, client->session);
 
         // Connect the SD to the SSL object
-        int returnVal = SSL_set_fd(clientSSL, clientSD);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 14)) return false;
+        int returnVal = SSL_set_fd(clientSSL, client->clientSD);
+        if (checkNegErrSSL(theProxy, SD, returnVal, 14)) return;
+        SSL_set_accept_state(clientSSL);
 
-        // Use the loaded certificate for the TLS handshake
-        returnVal = SSL_use_certificate(clientSSL, serverCert);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 15)) return false;
-
-        // Use the loaded key for the TLS handshake
-        returnVal = SSL_use_PrivateKey(clientSSL, serverKey);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 16)) return false;
-
-        // Perform the TLS handshake with the client
-        returnVal = SSL_accept(clientSSL);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 17)) return false;
+        // a pooled server has nothing to say until the client's first 
+        // request, so only its hangup is watched for during the handshakes
+        connectionInfo *server = getPeerConnection(theProxy, client);
+        if (server != NULL) {
+                server->readPaused = true;
+                updateEventInterest(theProxy, server);
+        }
 
-        setSDNonBlocking(clientSD);
-        SSL_set_mode(clientSSL, SSL_MODE_ASYNC);
-        
-        return true;
+        client->handshaking = true;
+        continueClientHandshake(theProxy, SD);
 }
 
 
 /*
- * name:      connectToServer
- * purpose:   connects the proxy to the target server
- * arguments: the proxy instance, the slot and index in the table
- * returns:   true if successful, false otherwise
- * effects:   none
+ * name:      continueClientHandshake
+ * purpose:   moves the client's handshake on as far as its socket allows, 
+ *            and starts the server's handshake once it is done
+ * arguments: the proxy instance, the client's socket descriptor
+ * returns:   none
+ * effects:   removes the client if the handshake failed
  */
-bool connectToServer(proxy *theProxy, int slot, int index)
+void continueClientHandshake(proxy *theProxy, int SD)
 {
-        DEBUG_PRINT("FUNCTION: connectToServer\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
-
-        //get host IP address
-        char *hostName = client->serverURL; 
-        struct hostent *hostInfo = gethostbyname(hostName);
-        if (checkNullErrSSL(theProxy, slot, index, hostInfo, 18)) return false;
-
-        //send the file contents to proxy
-        struct sockaddr_in serverAddress;
-
-        int serverSD = socket(AF_INET, SOCK_STREAM, 0);
-        if (checkNegOneErrSSL(theProxy, slot, index, serverSD, 19)) return false;
-        client->serverSD = serverSD;
-
-        //ensure to close the socket and port after termination
-        int opt = 1;
-        int returnVal = 
-                setsockopt(serverSD, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        if (checkNegOneErrSSL(theProxy, slot, index, returnVal, 20)) return false;
-
-        //Client setup to connect the socket to the server and its IP address
-        //this is the setup specifying the server info
-        memset(&serverAddress, 0, sizeof(struct sockaddr_in));
-        serverAddress.sin_family = AF_INET;
-        serverAddress.sin_addr = *(struct in_addr *)hostInfo->h_addr;
-        serverAddress.sin_port = htons(client->serverPort);
-        returnVal = connect(serverSD, (struct sockaddr *)&serverAddress, 
-                sizeof(serverAddress));
-        if (checkNegOneErrSSL(theProxy, slot, index, returnVal, 21)) return false;
-        
-        // add serverSD to the active set for select
-        FD_SET(serverSD, &theProxy->activeFDSet);
-        if (serverSD > theProxy->maxFD) {
-                theProxy->maxFD = serverSD;
+        DEBUG_PRINT("FUNCTION: continueClientHandshake\n");
+        connectionInfo *client = theProxy->connTable[SD];
+        SSL *clientSSL = client->session->clientSSL;
+
+        int returnVal = SSL_accept(clientSSL);
+        if (returnVal != 1) {
+                if (!waitForHandshake(theProxy, client, clientSSL, returnVal)) {
+                        checkNegErrSSL(theProxy, SD, -1, 17);
+                }
+                return;
         }
 
-        return true;
+        client->handshaking = false;
+        SSL_set_mode(clientSSL, SSL_MODE_ASYNC);
+        SSL_set_mode(clientSSL, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+        // there is nowhere to relay the client's data to yet
+        client->readPaused = true;
+        updateEventInterest(theProxy, client);
+        startServerHandshake(theProxy, SD);
 }
 
 
 /*
- * name:      connectToServer
- * purpose:   sets up a TLS connection with the target server allowing for 
- *            message relaying
- * arguments: the proxy instance, the slot and index in the table
+ * name:      startServerHandshake
+ * purpose:   starts the TLS handshake with the target server, unless the 
+ *            connection came from the pool and already finished it
+ * arguments: the proxy instance, the client's socket descriptor
  * returns:   none
- * effects:   none
+ * effects:   removes the client if the handshake can't be started or fails
  */
-void connectServerSSL(proxy *theProxy, int slot, int index)
+void startServerHandshake(proxy *theProxy, int SD)
 {
-        DEBUG_PRINT("FUNCTION: connectServerSSL\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        DEBUG_PRINT("FUNCTION: startServerHandshake\n");
+        connectionInfo *client = theProxy->connTable[SD];
+
+        // a pooled connection already finished its handshake
+        if (client->session->serverSSL != NULL) {
+                finishHandshakes(theProxy, SD);
+                return;
+        }
+
         const SSL_METHOD *method = TLS_client_method();
-        if (checkNullErrSSL(theProxy, slot, index, (void *)method, 22)) return;
+        if (checkNullErrSSL(theProxy, SD, (void *)method, 22)) return;
 
         // Setup new SSL server context
         SSL_CTX *serverCtx = SSL_CTX_new(method);
-        if (checkNullErrSSL(theProxy, slot, index, serverCtx, 23)) return;
-        client->serverCtx = serverCtx;
+        if (checkNullErrSSL(theProxy, SD, serverCtx, 23)) return;
+        client->session->serverCtx = serverCtx;
 
         // Setup new SSL server object
         SSL *serverSSL = SSL_new(serverCtx);
-        if (checkNullErrSSL(theProxy, slot, index, serverSSL, 24)) return;
-        client->serverSSL = serverSSL;
+        if (checkNullErrSSL(theProxy, SD, serverSSL, 24)) return;
+        client->session->serverSSL = serverSSL;
 
         // Attach server socket to SSL object
         int returnVal = SSL_set_fd(serverSSL, client->serverSD);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 25)) return;
+        if (checkNegErrSSL(theProxy, SD, returnVal, 25)) return;
+        SSL_set_connect_state(serverSSL);
 
-        // Perform SSL/TLS handshake with the server
-        returnVal = SSL_connect(serverSSL);
-        if (checkNegErrSSL(theProxy, slot, index, returnVal, 26)) return;
+        // only HTTP/1.1 is relayed, so that's the only protocol offered
+        SSL_set_alpn_protos(serverSSL, (const unsigned char *)"\x08http/1.1", 9);
 
-        if (!populateServerStructSSL(theProxy, client)) {
-                removeClient(theProxy, slot, index);
+        connectionInfo *server = getPeerConnection(theProxy, client);
+        if (server == NULL) {
+                removeClient(theProxy, SD);
+                return;
         }
+        server->handshaking = true;
+        continueServerHandshake(theProxy, client->serverSD);
+}
 
-        setSDNonBlocking(client->serverSD);
+
+/*
+ * name:      continueServerHandshake
+ * purpose:   moves the server's handshake on as far as its socket allows, 
+ *            and starts relaying once it is done
+ * arguments: the proxy instance, the server's socket descriptor
+ * returns:   none
+ * effects:   removes the client and server if the handshake failed
+ */
+void continueServerHandshake(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION: continueServerHandshake\n");
+        connectionInfo *server = theProxy->connTable[SD];
+        SSL *serverSSL = server->session->serverSSL;
+
+        int returnVal = SSL_connect(serverSSL);
+        if (returnVal != 1) {
+                if (!waitForHandshake(theProxy, server, serverSSL, returnVal)) {
+                        checkNegErrSSL(theProxy, SD, -1, 26);
+                }
+                return;
+        }
+
+        server->handshaking = false;
+        server->details->exchange = newHttpExchange();
         SSL_set_mode(serverSSL, SSL_MODE_ASYNC);
+        SSL_set_mode(serverSSL, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+        connectionInfo *client = server->session->client;
+        if (client == NULL) {
+                removeServer(theProxy, SD);
+                return;
+        }
+        finishHandshakes(theProxy, client->clientSD);
+}
+
+
+/*
+ * name:      finishHandshakes
+ * purpose:   starts relaying between the client and server once both 
+ *            handshakes are done
+ * arguments: the proxy instance, the client's socket descriptor
+ * returns:   none
+ * effects:   replaces the handshake timer with the idle timer
+ */
+void finishHandshakes(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION: finishHandshakes\n");
+        connectionInfo *client = theProxy->connTable[SD];
+        startTimer(theProxy, client->clientSD, TIMER_IDLE, 
+                getIdleTimeout(theProxy));
+
+        client->readPaused = false;
+        updateEventInterest(theProxy, client);
+        connectionInfo *server = getPeerConnection(theProxy, client);
+        if (server != NULL) {
+                server->readPaused = false;
+                updateEventInterest(theProxy, server);
+        }
 }
 
 
 /*
- * name:      populateServerStructSSL
- * purpose:   populates the relevant fields in the server struct
- * arguments: the proxy instance, the slot and index in the table
- * returns:   true if successful, false otherwise
+ * name:      continueHandshake
+ * purpose:   moves on the handshake of the connection an event arrived for
+ * arguments: the proxy instance, the connection's socket descriptor
+ * returns:   none
  * effects:   none
  */
-bool populateServerStructSSL(proxy *theProxy, connectionInfo *client)
+void continueHandshake(proxy *theProxy, int SD)
 {
-        DEBUG_PRINT("FUNCTION: populateServerStructSSL\n");
-        int serverSlot = hashTableKey(theProxy, client->serverSD);
-        int serverIndex = theProxy->clientTable[serverSlot].numSlotItems;
-        theProxy->numClients++;
-        theProxy->clientTable[serverSlot].numSlotItems++;
-
-        connectionInfo *server = 
-                &theProxy->clientTable[serverSlot].slotArray[serverIndex];
-
-        server->clientSD = client->clientSD;
-        server->serverSD = client->serverSD;
-        server->isClient = false;
-        server->connActive = true;
-        server->serverPort = client->serverPort;
-        server->serverSSL = client->serverSSL;
-        server->clientSSL = client->clientSSL;
-        server->serverCtx = client->serverCtx;
-        
-        int URLLength = strlen(client->serverURL);
-        server->serverURL = malloc(URLLength + 1);
-        if (checkNullErrSSL(theProxy, serverSlot, serverIndex, 
-                server->serverURL, 1)) {
+        if (theProxy->connTable[SD]->isClient) {
+                continueClientHandshake(theProxy, SD);
+        }
+        else {
+                continueServerHandshake(theProxy, SD);
+        }
+}
+
+
+/*
+ * name:      waitForHandshake
+ * purpose:   registers a connection's socket for the readiness its 
+ *            unfinished handshake is waiting on
+ * arguments: the proxy instance, the connection struct, its SSL object, the 
+ *            return value of the handshake call
+ * returns:   true if the handshake waits on the socket, false if it failed
+ * effects:   none
+ */
+bool waitForHandshake(proxy *theProxy, connectionInfo *conn, SSL *sslObj, 
+        int value)
+{
+        int sslError = SSL_get_error(sslObj, value);
+        uint32_t events = EPOLLIN;
+        if (sslError == SSL_ERROR_WANT_WRITE) {
+                events = EPOLLOUT;
+        }
+        else if (sslError != SSL_ERROR_WANT_READ) {
                 return false;
         }
 
-        memcpy(server->serverURL, client->serverURL, URLLength);
-        server->serverURL[URLLength] = '\0';
+        int SD = conn->isClient ? conn->clientSD : conn->serverSD;
+        if (events != conn->eventMask) {
+                modifyEventLoop(theProxy, SD, events);
+                conn->eventMask = events;
+        }
         return true;
 }
 
@@ -409,104 +678,132 @@ bool populateServerStructSSL(proxy *theProxy, connectionInfo *client)
 /*
  * name:      relayClientToServerSSL
  * purpose:   relays the message from the client to the server 
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
  * effects:   none
  */
-void relayClientToServerSSL(proxy *theProxy, int slot, int index) 
+void relayClientToServerSSL(proxy *theProxy, int SD) 
 {
         DEBUG_PRINT("FUNCTION: relayClientToServerSSL\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
-        if (checkNullErrSSL(theProxy, slot, index, client->clientSSL, 27)) return;
-        int buffSize = 100000;
-        char *readBuffer = malloc(buffSize + 1);
-        if (checkNullErrSSL(theProxy, slot, index, readBuffer, 28)) return;
+        connectionInfo *client = theProxy->connTable[SD];
+        if (checkNullErrSSL(theProxy, SD, client->session->clientSSL, 27)) return;
+
+        // one SSL_read returns at most a single TLS record
+        int buffSize = SSL_RELAY_BUFFER_SIZE;
+        char *readBuffer = getRelayBuffer(theProxy, client, buffSize + 1);
+        if (checkNullErrSSL(theProxy, SD, readBuffer, 28)) return;
 
         // read from the client
-        int bytesRead = readFromClientSSL(theProxy, slot, index, 
-                client->clientSSL, readBuffer, buffSize);
+        int bytesRead = readFromClientSSL(theProxy, SD, 
+                client->session->clientSSL, readBuffer, buffSize);
         if (bytesRead == -1) {
                 return;
         }
         
         // check if the serverSSL is null
-        if (checkNullErrSSL(theProxy, slot, index, client->serverSSL, 29)) return;
+        if (checkNullErrSSL(theProxy, SD, client->session->serverSSL, 29)) return;
 
-        // write to the server
-        int writeReturn = writeToServerSSL(theProxy, slot, index, 
-                client->serverSSL, client->readBuffer, bytesRead);
+        // write to the server, the message handlers may have replaced the data
+        char *readData = readBuffer;
+        if (client->details->readBuffer != NULL) {
+                readData = client->details->readBuffer;
+        }
+        int writeReturn = writeToServerSSL(theProxy, SD, 
+                client->session->serverSSL, readData, bytesRead);
         if (writeReturn == -1) {
                 return;
         }
 
-        if (client->readBuffer != NULL) {
-                free(client->readBuffer);
-                client->readBuffer = NULL;
+        // follow the requests so the connection can be pooled afterwards
+        connectionInfo *server = getPeerConnection(theProxy, client);
+        if (server != NULL && server->details->exchange != NULL) {
+                trackHttpData(server->details->exchange, false, readData, 
+                        bytesRead);
+        }
+
+        if (client->details->readBuffer != NULL) {
+                freeBuffer(theProxy, client->details->readBuffer);
+                client->details->readBuffer = NULL;
+        }
+        client->details->bufferRead = 0;
+        client->details->bufferSize = -1;
+
+        // a read short of a full record emptied the connection
+        if (bytesRead < buffSize) {
+                releaseRelayBuffer(theProxy, client);
         }
-        client->bufferRead = 0;
-        client->bufferSize = -1;
 }
 
 
 /*
  * name:      readFromClientSSL
  * purpose:   reads data from the client and stores this in the buffer 
- * arguments: the proxy instance, the slot and index in the table, the SSL 
+ * arguments: the proxy instance, the connection's socket descriptor, the SSL 
  *            object to read from, the read buffer and bufferSize
  * returns:   number of bytes successfully read, or -1 on error
  * effects:   none
  */
-int readFromClientSSL(proxy *theProxy, int slot, int index, SSL *clientSSL, 
+int readFromClientSSL(proxy *theProxy, int SD, SSL *clientSSL, 
         char *readBuffer, int bufferSize)
 {
         DEBUG_PRINT("FUNCTION: readFromClientSSL\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
 
         int readReturn = SSL_read(clientSSL, readBuffer, bufferSize);
 
+        // nothing was read, the connection has no data waiting
+        if (readReturn <= 0) {
+                releaseRelayBuffer(theProxy, client);
+        }
         if (checkWantReadWrite(theProxy, clientSSL, readReturn, 30)) return -1;        
-        if (checkNegErrSSL(theProxy, slot, index, readReturn, 31)) return -1;
-        if (checkNullErrSSL(theProxy, slot, index, readBuffer, 32)) return -1;
+        if (checkPendingClose(theProxy, SD, readReturn)) return -1;
+        if (checkNegErrSSL(theProxy, SD, readReturn, 31)) return -1;
+        if (checkNullErrSSL(theProxy, SD, readBuffer, 32)) return -1;
         readBuffer[readReturn] = '\0';
+        client->details->bufferSize = readReturn;
 
-        client->readBuffer = readBuffer;
-        client->bufferSize = readReturn;
-
-        if ((strncmp(client->serverURL, "www.nytimes.com", 15) == 0)) {
-                if (!handleClientConnectionsData(theProxy, slot, index)) {
+        // the message handlers replace the buffer, so they get to own it
+        if ((strncmp(client->session->serverURL, "www.nytimes.com", 15) == 0)) {
+                client->details->readBuffer = takeRelayBuffer(client);
+                if (!handleClientConnectionsData(theProxy, SD)) {
                         return -1;
                 }
         }
         
-        return client->bufferSize;
+        return client->details->bufferSize;
 }
 
 
 /*
  * name:      writeToServerSSL
- * purpose:   writes the client data to the server
- * arguments: the proxy instance, the slot and index in the table, the SSL 
+ * purpose:   writes the client data to the server, queuing whatever the 
+ *            server can't take yet
+ * arguments: the proxy instance, the connection's socket descriptor, the SSL 
  *            object to write to, the buffer and bufferSize
- * returns:   number of bytes successfully written, or -1 on error
+ * returns:   number of bytes successfully written or queued, or -1 on error
  * effects:   none
  */
-int writeToServerSSL(proxy *theProxy, int slot, int index, SSL *serverSSL, 
+int writeToServerSSL(proxy *theProxy, int SD, SSL *serverSSL, 
         char *readBuffer, int readReturn)
 {
         DEBUG_PRINT("FUNCTION: writeToServerSSL\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
 
+        // keep the byte order, the data goes behind what is already queued
         int totalSent = 0;
-        while (totalSent < readReturn) {
+        while (client->outputBytes == 0 && totalSent < readReturn) {
                 int writeReturn = SSL_write(serverSSL, readBuffer + totalSent, 
                         readReturn - totalSent);
-                if (checkWantReadWrite(theProxy, serverSSL, writeReturn, 33)) return -1;
-                if (checkNegErrSSL(theProxy, slot, index, writeReturn, 34)) return -1;
+                if (checkWantReadWrite(theProxy, serverSSL, writeReturn, 33)) break;
+                if (checkNegErrSSL(theProxy, SD, writeReturn, 34)) return -1;
 
                 totalSent += writeReturn;
         }
 
-        return totalSent;
+        if (totalSent < readReturn && !queueOutputData(theProxy, SD, 
+                readBuffer + totalSent, readReturn - totalSent)) return -1;
+
+        return readReturn;
 }
 
 
@@ -519,58 +816,71 @@ int writeToServerSSL(proxy *theProxy, int slot, int index, SSL *serverSSL,
 /*
  * name:      relayServerToClientSSL
  * purpose:   relays the message from the server to the client 
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
  * effects:   none
  */
-void relayServerToClientSSL(proxy *theProxy, int slot, int index) 
+void relayServerToClientSSL(proxy *theProxy, int SD) 
 {
         DEBUG_PRINT("FUNCTION: relayServerToClientSSL\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
-        if (checkNullErrSSL(theProxy, slot, index, server->serverSSL, 35)) return;
-        int bufferSize = 100000;
-        char *readBuffer = malloc(bufferSize + 1);
-        if (checkNullErrSSL(theProxy, slot, index, readBuffer, 36)) return;
+        connectionInfo *server = theProxy->connTable[SD];
+        connDetails *details = server->details;
+        if (checkNullErrSSL(theProxy, SD, server->session->serverSSL, 35)) return;
+
+        // one SSL_read returns at most a single TLS record
+        int bufferSize = SSL_RELAY_BUFFER_SIZE;
+        char *readBuffer = getRelayBuffer(theProxy, server, bufferSize + 1);
+        if (checkNullErrSSL(theProxy, SD, readBuffer, 36)) return;
 
         // read from the server
         int readReturn = 
-        readFromServerSSL(theProxy, slot, index, server->serverSSL, 
+        readFromServerSSL(theProxy, SD, server->session->serverSSL, 
                 readBuffer, bufferSize);
         if (readReturn == -1) {
                 return;
         }
         
         // check if the clientSSL is null
-        if (checkNullErrSSL(theProxy, slot, index, server->clientSSL, 37)) return;
-
-        // write to the client
-        int writeReturn = 
-        writeToClientSSL(theProxy, slot, index, server->clientSSL, 
-                server->readBuffer, readReturn);
+        if (checkNullErrSSL(theProxy, SD, server->session->clientSSL, 37)) return;
+
+        // write to the client, a withheld message is sent once it's complete
+        int writeReturn = 0;
+        if (isMessageWithheld(server)) {
+                if (readReturn > 0) {
+                        writeReturn = writeMessageToClientSSL(theProxy, SD, 
+                                server->session->clientSSL);
+                }
+        }
+        else {
+                writeReturn = writeToClientSSL(theProxy, SD, 
+                        server->session->clientSSL, readBuffer, readReturn);
+        }
         if (writeReturn == -1) {
                 return;
         }
 
-        if (server->readBuffer != NULL) {
-                free(server->readBuffer);
-                server->readBuffer = NULL;
+        if (details->readBuffer != NULL) {
+                freeBuffer(theProxy, details->readBuffer);
+                details->readBuffer = NULL;
         }
-        server->bufferRead = 0;
-        server->bufferSize = -1;
+        details->bufferRead = 0;
+        details->bufferSize = -1;
 
-        if (server->contentRead == server->contentSize) {
-                if (server->msgHeader != NULL) {
-                        free(server->msgHeader);
-                        server->msgHeader = NULL;
-                }
-                server->headerRead = 0;
-                server->headerSize = -1;
-                if (server->msgContent != NULL) {
-                        free(server->msgContent);
-                        server->msgContent = NULL;
+        if (details->contentRead == details->contentSize) {
+                if (details->msgHeader != NULL) {
+                        freeBuffer(theProxy, details->msgHeader);
+                        details->msgHeader = NULL;
                 }
-                server->contentRead = 0;
-                server->contentSize = -1;
+                details->headerRead = 0;
+                details->headerSize = -1;
+                freeChain(theProxy, &details->msgContent);
+                details->contentRead = 0;
+                details->contentSize = -1;
+        }
+
+        // a read short of a full record emptied the connection
+        if (readReturn < bufferSize) {
+                releaseRelayBuffer(theProxy, server);
         }
 }
 
@@ -579,71 +889,185 @@ void relayServerToClientSSL(proxy *theProxy, int slot, int index)
 /*
  * name:      readFromServerSSL
  * purpose:   reads data from the server and stores this in the buffer
- * arguments: the proxy instance, the slot and index in the table, the SSL 
+ * arguments: the proxy instance, the connection's socket descriptor, the SSL 
  *            object to read from, the read buffer and bufferSize
  * returns:   number of bytes successfully read, or -1 on error
  * effects:   populates the struct header and content fields
  */
-int readFromServerSSL(proxy *theProxy, int slot, int index, SSL *serverSSL, 
+int readFromServerSSL(proxy *theProxy, int SD, SSL *serverSSL, 
         char *readBuffer, int bufferSize)
 {
         DEBUG_PRINT("FUNCTION: readFromServerSSL\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *server = theProxy->connTable[SD];
+        connDetails *details = server->details;
 
         int readReturn = SSL_read(serverSSL, readBuffer, bufferSize);
+
+        // nothing was read, the connection has no data waiting
+        if (readReturn <= 0) {
+                releaseRelayBuffer(theProxy, server);
+        }
         if (checkWantReadWrite(theProxy, serverSSL, readReturn, 38)) return -1;        
-        if (checkNegErrSSL(theProxy, slot, index, readReturn, 39)) return -1;
-        if (checkNullErrSSL(theProxy, slot, index, readBuffer, 40)) return -1;
+        if (checkPendingClose(theProxy, SD, readReturn)) return -1;
+        if (checkNegErrSSL(theProxy, SD, readReturn, 39)) return -1;
+        if (checkNullErrSSL(theProxy, SD, readBuffer, 40)) return -1;
         readBuffer[readReturn] = '\0';
 
-        server->readBuffer = readBuffer;
-        server->bufferSize = readReturn;
+        details->bufferSize = readReturn;
+        if (details->exchange != NULL) {
+                trackHttpData(details->exchange, true, readBuffer, readReturn);
+        }
 
-        if ((strncmp(server->serverURL, "www.nytimes.com", 15) == 0)) {
-                if (!handleServerConnectionsData(theProxy, slot, index)) {
+        // the message handlers take the buffer, the message is withheld until 
+        // it is complete
+        if (isMessageWithheld(server)) {
+                details->readBuffer = takeRelayBuffer(server);
+                if (!handleServerConnectionsData(theProxy, SD)) {
                         return -1;
                 }
-                if (server->contentRead == server->contentSize) {
-                        char *fullBuffer = malloc(server->headerSize + server->contentSize + 1);
-                        memcpy(fullBuffer, server->msgHeader, server->headerSize);
-                        memcpy(fullBuffer + server->headerSize, server->msgContent, server->contentSize);
-                        free(server->readBuffer);
-                        server->readBuffer = fullBuffer;
-                        server->bufferSize = server->headerSize + server->contentSize;
-                        server->readBuffer[server->headerSize + server->contentSize] = '\0';
-                        return server->bufferSize;
+                if (details->contentRead == details->contentSize) {
+                        return details->headerSize + details->contentSize;
                 }
                 return 0;
         }
 
-        return server->bufferSize;
+        return details->bufferSize;
 }
 
 
 /*
  * name:      writeToClientSSL
- * purpose:   writes the server data to the client
- * arguments: the proxy instance, the slot and index in the table, the SSL 
+ * purpose:   writes the server data to the client, queuing whatever the 
+ *            client can't take yet
+ * arguments: the proxy instance, the connection's socket descriptor, the SSL 
  *            object to write to, the buffer and bufferSize
- * returns:   number of bytes successfully written, or -1 on error
+ * returns:   number of bytes successfully written or queued, or -1 on error
  * effects:   none
  */
-int writeToClientSSL(proxy *theProxy, int slot, int index, SSL *clientSSL, 
+int writeToClientSSL(proxy *theProxy, int SD, SSL *clientSSL, 
         char *readBuffer, int readReturn)
 {
         DEBUG_PRINT("FUNCTION: writeToClientSSL\n");
+        connectionInfo *server = theProxy->connTable[SD];
+
+        // keep the byte order, the data goes behind what is already queued
         int totalSent = 0;
-        while (totalSent < readReturn) {
+        while (server->outputBytes == 0 && totalSent < readReturn) {
                 int writeReturn = SSL_write(clientSSL, readBuffer + totalSent, 
                         readReturn - totalSent);
 
-                if (checkWantReadWrite(theProxy, clientSSL, writeReturn, 41)) return -1;
-                if (checkNegErrSSL(theProxy, slot, index, writeReturn, 42)) return -1;
+                if (checkWantReadWrite(theProxy, clientSSL, writeReturn, 41)) break;
+                if (checkNegErrSSL(theProxy, SD, writeReturn, 42)) return -1;
 
                 totalSent += writeReturn;
         }
 
-        return totalSent;
+        if (totalSent < readReturn && !queueOutputData(theProxy, SD, 
+                readBuffer + totalSent, readReturn - totalSent)) return -1;
+
+        return readReturn;
+}
+
+
+/*
+ * name:      writeMessageToClientSSL
+ * purpose:   writes a complete withheld message to the client straight from 
+ *            its header and the segments of its body
+ * arguments: the proxy instance, the connection's socket descriptor, the SSL 
+ *            object to write to
+ * returns:   number of bytes successfully written or queued, or -1 on error
+ * effects:   none
+ */
+int writeMessageToClientSSL(proxy *theProxy, int SD, SSL *clientSSL)
+{
+        DEBUG_PRINT("FUNCTION: writeMessageToClientSSL\n");
+        connDetails *details = theProxy->connTable[SD]->details;
+        bufferChain *content = &details->msgContent;
+
+        struct iovec *vectors = 
+                malloc((content->numSegments + 1) * sizeof(struct iovec));
+        if (checkNullErrSSL(theProxy, SD, vectors, 54)) return -1;
+        vectors[0].iov_base = details->msgHeader;
+        vectors[0].iov_len = details->headerSize;
+        int count = 1 + getChainVectors(content, vectors + 1);
+
+        int writeReturn = 
+                writeVectorToClientSSL(theProxy, SD, clientSSL, vectors, count);
+        free(vectors);
+        return writeReturn;
+}
+
+
+/*
+ * name:      writeVectorToClientSSL
+ * purpose:   writes data held in several buffers to the client without 
+ *            joining it into one buffer first. Pieces too small to fill a 
+ *            record on their own are gathered into one record, larger pieces 
+ *            are encrypted from where they are
+ * arguments: the proxy instance, the connection's socket descriptor, the SSL 
+ *            object to write to, the buffers and their count
+ * returns:   number of bytes successfully written or queued, or -1 on error
+ * effects:   none
+ */
+int writeVectorToClientSSL(proxy *theProxy, int SD, SSL *clientSSL, 
+        struct iovec *vectors, int count)
+{
+        DEBUG_PRINT("FUNCTION: writeVectorToClientSSL\n");
+        char *record = allocBuffer(theProxy, SSL_RELAY_BUFFER_SIZE);
+        if (checkNullErrSSL(theProxy, SD, record, 55)) return -1;
+        int recordLength = 0;
+        int totalLength = 0;
+
+        for (int i = 0; i < count; i++) {
+                char *data = vectors[i].iov_base;
+                int length = vectors[i].iov_len;
+                totalLength += length;
+
+                // send what was gathered before a piece that doesn't fit
+                bool gather = (length < SSL_COALESCE_LIMIT);
+                if (recordLength > 0 && (!gather || 
+                        recordLength + length > SSL_RELAY_BUFFER_SIZE)) {
+                        if (writeToClientSSL(theProxy, SD, clientSSL, record, 
+                                recordLength) == -1) {
+                                freeBuffer(theProxy, record);
+                                return -1;
+                        }
+                        recordLength = 0;
+                }
+
+                if (gather) {
+                        memcpy(record + recordLength, data, length);
+                        recordLength += length;
+                }
+                else if (writeToClientSSL(theProxy, SD, clientSSL, data, 
+                        length) == -1) {
+                        freeBuffer(theProxy, record);
+                        return -1;
+                }
+        }
+
+        int writeReturn = totalLength;
+        if (recordLength > 0 && writeToClientSSL(theProxy, SD, clientSSL, 
+                record, recordLength) == -1) {
+                writeReturn = -1;
+        }
+        freeBuffer(theProxy, record);
+        return writeReturn;
+}
+
+
+/*
+ * name:      isMessageWithheld
+ * purpose:   checks if the server's responses are collected in full before 
+ *            they are sent to the client, so they can be inspected and edited
+ * arguments: the server's connection struct
+ * returns:   true if the responses are withheld, false if they are relayed 
+ *            as they arrive
+ * effects:   none
+ */
+bool isMessageWithheld(connectionInfo *server)
+{
+        return strncmp(server->session->serverURL, "www.nytimes.com", 15) == 0;
 }
 
 
@@ -659,36 +1083,34 @@ int writeToClientSSL(proxy *theProxy, int slot, int index, SSL *clientSSL,
  * name:      handleClientConnectionsData
  * purpose:   drives the process of retrieving header and content data from the
  *            buffer read by the read call
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   none
  */
-bool handleClientConnectionsData(proxy *theProxy, int slot, int index)
+bool handleClientConnectionsData(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: handleClientConnectionsData\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
-        if (client->headerSize > 0) {
-                if (client->msgHeader != NULL) {
-                        free(client->msgHeader);
-                        client->msgHeader = NULL;
+        connectionInfo *client = theProxy->connTable[SD];
+        connDetails *details = client->details;
+        if (details->headerSize > 0) {
+                if (details->msgHeader != NULL) {
+                        freeBuffer(theProxy, details->msgHeader);
+                        details->msgHeader = NULL;
                 }
-                client->headerRead = 0;
-                client->headerSize = -1;
+                details->headerRead = 0;
+                details->headerSize = -1;
         }
-        if (client->contentRead == client->contentSize) {
-                if (client->msgContent != NULL) {
-                        free(client->msgContent);
-                        client->msgContent = NULL;
-                }
-                client->contentRead = 0;
-                client->contentSize = -1;
+        if (details->contentRead == details->contentSize) {
+                freeChain(theProxy, &details->msgContent);
+                details->contentRead = 0;
+                details->contentSize = -1;
         }
 
-        if (!populateClientRequestFields(theProxy, slot, index)) {
+        if (!populateClientRequestFields(theProxy, SD)) {
                 return false;
         }
 
-        if (!getConnectionGuess(theProxy, slot, index)) {
+        if (!getConnectionGuess(theProxy, SD)) {
                 return false;
         }
 
@@ -701,28 +1123,29 @@ bool handleClientConnectionsData(proxy *theProxy, int slot, int index)
  * purpose:   determines whether the information in the read buffer is for 
  *            a header or data. Gets the content length and removes the 
  *            encoding field when full header is stored
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   none
  */
-bool populateClientRequestFields(proxy *theProxy, int slot, int index)
+bool populateClientRequestFields(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: populateClientRequestFields\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
+        connDetails *details = client->details;
 
         // header field is empty or partially populated
-        if ((client->headerRead <= 0) || (client->headerSize <= 0)) {
-                if (!populateClientHeaderField(theProxy, slot, index)) {
+        if ((details->headerRead <= 0) || (details->headerSize <= 0)) {
+                if (!populateClientHeaderField(theProxy, SD)) {
                         return false;
                 }
-                if (client->headerSize > 0) {
-                        getContentLength(theProxy, slot, index, 
-                                client->msgHeader, client->headerSize);
-                        removeAcceptEncoding(theProxy, slot, index);
+                if (details->headerSize > 0) {
+                        getContentLength(theProxy, SD, 
+                                details->msgHeader, details->headerSize);
+                        removeAcceptEncoding(theProxy, SD);
                 }
         }
-        else if ((client->contentRead < client->contentSize)) {
-                if (!populateClientContentField(theProxy, slot, index)) {
+        else if ((details->contentRead < details->contentSize)) {
+                if (!populateClientContentField(theProxy, SD)) {
                         return false;
                 }
         }
@@ -734,52 +1157,55 @@ bool populateClientRequestFields(proxy *theProxy, int slot, int index)
 /*
  * name:      populateClientHeaderField
  * purpose:   populates the client header fields with the buffer contents
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   populates the header and/or content struct fields
  */
-bool populateClientHeaderField(proxy *theProxy, int slot, int index)
+bool populateClientHeaderField(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: populateClientHeaderField\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
-        int headerSize = checkEndDelimiter(theProxy, slot, index, 
-                client->readBuffer, client->bufferSize);
-        int headerRead = client->headerRead;
+        connectionInfo *client = theProxy->connTable[SD];
+        connDetails *details = client->details;
+        int headerSize = checkEndDelimiter(theProxy, SD, 
+                details->readBuffer, details->bufferSize);
+        int headerRead = details->headerRead;
 
         // header is incomplete
         if (headerSize == -1) {
-                char *completeHeader = malloc(headerRead + client->bufferSize);
-                if (checkNullErrSSL(theProxy, slot, index, completeHeader, 43)) return false;
-                memcpy(completeHeader, client->msgHeader, headerRead);
-                memcpy(completeHeader + headerRead, client->readBuffer, 
-                        client->bufferSize);
-                client->msgHeader = completeHeader;
-                client->headerRead += client->bufferSize;
+                char *completeHeader = allocBuffer(theProxy, 
+                        headerRead + details->bufferSize + 1);
+                if (checkNullErrSSL(theProxy, SD, completeHeader, 43)) return false;
+                memcpy(completeHeader, details->msgHeader, headerRead);
+                memcpy(completeHeader + headerRead, details->readBuffer, 
+                        details->bufferSize);
+                completeHeader[headerRead + details->bufferSize] = '\0';
+                freeBuffer(theProxy, details->msgHeader);
+                details->msgHeader = completeHeader;
+                details->headerRead += details->bufferSize;
                 return true;
         }
 
-        char *completeHeader = malloc(headerRead + headerSize + 1);
-        if (checkNullErrSSL(theProxy, slot, index, completeHeader, 44)) return false;
-        memcpy(completeHeader, client->msgHeader, headerRead);
-        memcpy(completeHeader + headerRead, client->readBuffer, headerSize);
+        char *completeHeader = allocBuffer(theProxy, 
+                headerRead + headerSize + 1);
+        if (checkNullErrSSL(theProxy, SD, completeHeader, 44)) return false;
+        memcpy(completeHeader, details->msgHeader, headerRead);
+        memcpy(completeHeader + headerRead, details->readBuffer, headerSize);
         completeHeader[headerRead + headerSize] = '\0';
 
-        if (client->msgHeader != NULL) {
-                free(client->msgHeader);
-                client->msgHeader = NULL;
+        if (details->msgHeader != NULL) {
+                freeBuffer(theProxy, details->msgHeader);
+                details->msgHeader = NULL;
         }
-        client->msgHeader = completeHeader;
-        client->headerRead = headerRead + headerSize;
-        client->headerSize = headerRead + headerSize;
+        details->msgHeader = completeHeader;
+        details->headerRead = headerRead + headerSize;
+        details->headerSize = headerRead + headerSize;
 
-        // read leftover server content
-        if (headerSize < client->bufferSize) {
-                client->msgContent = malloc(client->bufferSize - headerSize + 1);
-                if (checkNullErrSSL(theProxy, slot, index, client->msgContent, 45)) return false;
-                memcpy(client->msgContent, client->readBuffer + headerSize, 
-                        client->bufferSize - headerSize);
-                client->msgContent[client->bufferSize - headerSize] = '\0';
-                client->contentRead = client->bufferSize - headerSize;
+        // read leftover client content, the read buffer is still forwarded
+        if (headerSize < details->bufferSize) {
+                copyToChain(theProxy, &details->msgContent, 
+                        details->readBuffer + headerSize, 
+                        details->bufferSize - headerSize);
+                details->contentRead = details->bufferSize - headerSize;
         }
 
         return true;
@@ -789,31 +1215,20 @@ bool populateClientHeaderField(proxy *theProxy, int slot, int index)
 /*
  * name:      populateClientContentField
  * purpose:   populates the client content fields with the buffer contents
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   populates the content struct fields
  */
-bool populateClientContentField(proxy *theProxy, int slot, int index)
+bool populateClientContentField(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: populateClientContentField\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
-        int contentRead = client->contentRead;
-        int contentSize = client->contentSize;
+        connectionInfo *client = theProxy->connTable[SD];
+        connDetails *details = client->details;
 
-        char *completeContent = malloc(contentRead + client->bufferSize + 1);
-        if (checkNullErrSSL(theProxy, slot, index, completeContent, 46)) return false;
-
-        if (client->msgContent != NULL) {
-                memcpy(completeContent, client->msgContent, contentRead);
-        }
-        memcpy(completeContent + contentRead, client->readBuffer, client->bufferSize);
-        completeContent[contentRead + client->bufferSize] = '\0';
-        if (client->msgContent != NULL) {
-                free(client->msgContent);
-                client->msgContent = NULL;
-        }
-        client->msgContent = completeContent;
-        client->contentRead += client->bufferSize;
+        // the read buffer is still forwarded, so the chain gets a copy
+        copyToChain(theProxy, &details->msgContent, details->readBuffer, 
+                details->bufferSize);
+        details->contentRead += details->bufferSize;
 
         return true;
 }
@@ -823,34 +1238,37 @@ bool populateClientContentField(proxy *theProxy, int slot, int index)
  * name:      getConnectionGuess
  * purpose:   inspects the content of the client to determine if a connections 
  *            guess was made
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   none
  */
-bool getConnectionGuess(proxy *theProxy, int slot, int index)
+bool getConnectionGuess(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: getConnectionGuess\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
+        connDetails *details = client->details;
 
-        if (client->msgContent == NULL) {
+        if (details->msgContent.length == 0) {
                 return true;
         }
 
         //check if we have found end of header delimiter
         char *guessStart = "r: fail";
         char *guessEnd = "d: null";
-        char *start = strstr(client->msgContent, guessStart);
-        char *end = strstr(client->msgContent, guessEnd);
-        if (start == NULL) {
+        int startPoint = findInChain(&details->msgContent, guessStart, 0);
+        if (startPoint == -1) {
+                return true;
+        }
+        int endPoint = findInChain(&details->msgContent, guessEnd, startPoint);
+        if (endPoint == -1) {
                 return true;
         }
 
-        int startPoint = start - client->msgContent;
-        int guessSize = end - start;
+        int guessSize = endPoint - startPoint;
         char *guess = malloc(guessSize + 1);
-        if (checkNullErrSSL(theProxy, slot, index, guess, 47)) return false;
+        if (checkNullErrSSL(theProxy, SD, guess, 47)) return false;
 
-        memcpy(guess, client->msgContent + startPoint, guessSize);
+        copyFromChain(&details->msgContent, startPoint, guessSize, guess);
         guess[guessSize] = '\0';
         INFO_PRINT("GUESS: %s\n", guess);
         theProxy->connGuess = guess;
@@ -869,24 +1287,24 @@ bool getConnectionGuess(proxy *theProxy, int slot, int index)
  * name:      handleServerConnectionsData
  * purpose:   drives the process of retrieving header and content data from the
  *            buffer read by the read call
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   none
  */
-bool handleServerConnectionsData(proxy *theProxy, int slot, int index)
+bool handleServerConnectionsData(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: handleServerConnectionsData\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *server = theProxy->connTable[SD];
 
-        if (!populateServerResponseFields(theProxy, slot, index)) {
+        if (!populateServerResponseFields(theProxy, SD)) {
                 return false;
         }
-        if (!getConnectionSolution(theProxy, slot, index)) {
+        if (!getConnectionSolution(theProxy, SD)) {
                 return false;
         }
 
-        if (server->contentSize == server->contentRead) {
-                if (!addDivToContent(theProxy, slot, index)) {
+        if (server->details->contentSize == server->details->contentRead) {
+                if (!addDivToContent(theProxy, SD)) {
                         return false;
                 }
         }
@@ -900,29 +1318,30 @@ bool handleServerConnectionsData(proxy *theProxy, int slot, int index)
  * name:      populateServerResponseFields
  * purpose:   populates the server header and/or content fields with data from 
  *            the server read call
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   populates the header and/or content struct fields
  */
-bool populateServerResponseFields(proxy *theProxy, int slot, int index)
+bool populateServerResponseFields(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: populateServerResponseFields\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *server = theProxy->connTable[SD];
+        connDetails *details = server->details;
 
         // header field is empty or partially populated
-        if ((server->headerRead <= 0) || (server->headerSize <= 0)) {
-                if (!populateServerHeaderField(theProxy, slot, index)) {
+        if ((details->headerRead <= 0) || (details->headerSize <= 0)) {
+                if (!populateServerHeaderField(theProxy, SD)) {
                         return false;
                 }
-                if (server->headerSize > 0) {
-                        getContentLength(theProxy, slot, index, 
-                                server->msgHeader, server->headerSize);
+                if (details->headerSize > 0) {
+                        getContentLength(theProxy, SD, 
+                                details->msgHeader, details->headerSize);
                 }
         }
 
         // header field is complete, but content field is (partially empty)
-        else if ((server->contentRead < server->contentSize)) {
-                if (!populateServerContentField(theProxy, slot, index)) {
+        else if ((details->contentRead < details->contentSize)) {
+                if (!populateServerContentField(theProxy, SD)) {
                         return false;
                 }
         }
@@ -933,57 +1352,59 @@ bool populateServerResponseFields(proxy *theProxy, int slot, int index)
 /*
  * name:      populateServerHeaderField
  * purpose:   populates the server header field with data from the read buffer
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   populates the header struct fields
  */
-bool populateServerHeaderField(proxy *theProxy, int slot, int index)
+bool populateServerHeaderField(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: populateServerHeaderField\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
-        int headerSize = checkEndDelimiter(theProxy, slot, index, 
-                server->readBuffer, server->bufferSize);
-        int headerRead = server->headerRead;
+        connectionInfo *server = theProxy->connTable[SD];
+        connDetails *details = server->details;
+        int headerSize = checkEndDelimiter(theProxy, SD, 
+                details->readBuffer, details->bufferSize);
+        int headerRead = details->headerRead;
 
         // header is incomplete
         if (headerSize == -1) {
-                char *completeHeader = malloc(headerRead + server->bufferSize + 1);
-                if (checkNullErrSSL(theProxy, slot, index, completeHeader, 48)) return false;
-                memcpy(completeHeader, server->msgHeader, headerRead);
-                memcpy(completeHeader + headerRead, server->readBuffer, 
-                        server->bufferSize);
-                completeHeader[headerRead + server->bufferSize] = '\0';
-                if (server->msgHeader != NULL) {
-                        free(server->msgHeader);
-                        server->msgHeader = NULL;
+                char *completeHeader = allocBuffer(theProxy, 
+                        headerRead + details->bufferSize + 1);
+                if (checkNullErrSSL(theProxy, SD, completeHeader, 48)) return false;
+                memcpy(completeHeader, details->msgHeader, headerRead);
+                memcpy(completeHeader + headerRead, details->readBuffer, 
+                        details->bufferSize);
+                completeHeader[headerRead + details->bufferSize] = '\0';
+                if (details->msgHeader != NULL) {
+                        freeBuffer(theProxy, details->msgHeader);
+                        details->msgHeader = NULL;
                 }
-                server->msgHeader = completeHeader;
-                server->headerRead += server->bufferSize;
+                details->msgHeader = completeHeader;
+                details->headerRead += details->bufferSize;
                 return true;
         }
 
-        char *completeHeader = malloc(headerRead + headerSize + 1);
-        if (checkNullErrSSL(theProxy, slot, index, completeHeader, 49)) return false;
-        memcpy(completeHeader, server->msgHeader, headerRead);
-        memcpy(completeHeader + headerRead, server->readBuffer, headerSize);
+        char *completeHeader = allocBuffer(theProxy, 
+                headerRead + headerSize + 1);
+        if (checkNullErrSSL(theProxy, SD, completeHeader, 49)) return false;
+        memcpy(completeHeader, details->msgHeader, headerRead);
+        memcpy(completeHeader + headerRead, details->readBuffer, headerSize);
         completeHeader[headerRead + headerSize] = '\0';
 
-        if (server->msgHeader != NULL) {
-                free(server->msgHeader);
-                server->msgHeader = NULL;
+        if (details->msgHeader != NULL) {
+                freeBuffer(theProxy, details->msgHeader);
+                details->msgHeader = NULL;
         }
-        server->msgHeader = completeHeader;
-        server->headerRead = headerRead + headerSize;
-        server->headerSize = headerRead + headerSize;
+        details->msgHeader = completeHeader;
+        details->headerRead = headerRead + headerSize;
+        details->headerSize = headerRead + headerSize;
 
-        // read leftover server content
-        if (headerSize < server->bufferSize) {
-                server->msgContent = malloc(server->bufferSize - headerSize + 1);
-                if (checkNullErrSSL(theProxy, slot, index, server->msgContent, 50)) return false;
-                memcpy(server->msgContent, server->readBuffer + headerSize, 
-                        server->bufferSize - headerSize);
-                server->msgContent[server->bufferSize - headerSize] = '\0';
-                server->contentRead = server->bufferSize - headerSize;
+        // read leftover server content, the chain takes over the read buffer
+        if (headerSize < details->bufferSize) {
+                appendToChain(theProxy, &details->msgContent, 
+                        details->readBuffer, details->readBuffer + headerSize, 
+                        details->bufferSize - headerSize);
+                details->readBuffer = NULL;
+                details->contentRead = details->bufferSize - headerSize;
         }
 
         return true;
@@ -994,19 +1415,19 @@ bool populateServerHeaderField(proxy *theProxy, int slot, int index)
  * name:      populateServerContentField
  * purpose:   populates the server content field either stream wise or chunked 
  *            wise
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   none
  */
-bool populateServerContentField(proxy *theProxy, int slot, int index)
+bool populateServerContentField(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: populateServerContentField\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
-        // if (server->chunkedContent) {
-        //         return readContentChunks(theProxy, slot, index);
+        connectionInfo *server = theProxy->connTable[SD];
+        // if (server->details->chunkedContent) {
+        //         return readContentChunks(theProxy, SD);
         // }
         // else {
-                return readContentStream(theProxy, slot, index);
+                return readContentStream(theProxy, SD);
         // }
 }
 
@@ -1014,11 +1435,11 @@ bool populateServerContentField(proxy *theProxy, int slot, int index)
 /*
  * name:      readContentChunks
  * purpose:   reads the content chunks and populates the struct fields
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   none
  */
-bool readContentChunks(proxy *theProxy, int slot, int index)
+bool readContentChunks(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: readContentChunks\n");
         // handle the case where a part of the chunk was previously read
@@ -1031,31 +1452,22 @@ bool readContentChunks(proxy *theProxy, int slot, int index)
 /*
  * name:      readContentStream
  * purpose:   reads the content stream and populates the struct fields
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   none
  */
-bool readContentStream(proxy *theProxy, int slot, int index)
+bool readContentStream(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: readContentStream\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
-        int contentRead = server->contentRead;
-        int contentSize = server->contentSize;
-
-        char *completeContent = malloc(contentRead + server->bufferSize + 1);
-        if (checkNullErrSSL(theProxy, slot, index, completeContent, 51)) return false;
-
-        if (server->msgContent != NULL) {
-                memcpy(completeContent, server->msgContent, contentRead);
-        }
-        memcpy(completeContent + contentRead, server->readBuffer, server->bufferSize);
-        completeContent[contentRead + server->bufferSize] = '\0';
-        if (server->msgContent != NULL) {
-                free(server->msgContent);
-                server->msgContent = NULL;
-        }
-        server->msgContent = completeContent;
-        server->contentRead += server->bufferSize;
+        connectionInfo *server = theProxy->connTable[SD];
+        connDetails *details = server->details;
+
+        // the response is withheld until complete, so the chain takes the 
+        // read buffer instead of copying it
+        appendToChain(theProxy, &details->msgContent, details->readBuffer, 
+                details->readBuffer, details->bufferSize);
+        details->readBuffer = NULL;
+        details->contentRead += details->bufferSize;
         return true;
 }
 
@@ -1064,34 +1476,37 @@ bool readContentStream(proxy *theProxy, int slot, int index)
  * name:      getConnectionSolution
  * purpose:   determines if the content struct field contains the connections
  *            solution and formats it if so
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   none
  */
-bool getConnectionSolution(proxy *theProxy, int slot, int index)
+bool getConnectionSolution(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: getConnectionSolution\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *server = theProxy->connTable[SD];
+        connDetails *details = server->details;
 
-        if (server->msgContent == NULL) {
+        if (details->msgContent.length == 0) {
                 return true;
         }
 
         // check if we have found end of header delimiter
         char *solStart = "status\":\"OK\"";
         char *solEnd = "}]}]}";
-        char *start = strstr(server->msgContent, solStart);
-        char *end = strstr(server->msgContent, solEnd);
-        if (start == NULL) {
+        int startPoint = findInChain(&details->msgContent, solStart, 0);
+        if (startPoint == -1) {
+                return true;
+        }
+        int endPoint = findInChain(&details->msgContent, solEnd, startPoint);
+        if (endPoint == -1) {
                 return true;
         }
 
-        int startPoint = start - server->msgContent;
-        int solSize = end - start;
+        int solSize = endPoint - startPoint;
         char *solution = malloc(solSize + 1);
-        if (checkNullErrSSL(theProxy, slot, index, solution, 52)) return false;
+        if (checkNullErrSSL(theProxy, SD, solution, 52)) return false;
 
-        memcpy(solution, server->msgContent + startPoint, solSize);
+        copyFromChain(&details->msgContent, startPoint, solSize, solution);
         solution[solSize] = '\0';
         theProxy->connSolution = solution;
         INFO_PRINT("FOUND SOLUTION: %s\n", solution);
@@ -1105,15 +1520,16 @@ bool getConnectionSolution(proxy *theProxy, int slot, int index)
  * name:      addDivToContent
  * purpose:   adds the div with the styling and hints to the content buffer to 
  *            be sent to the browser
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   true if no error occurred, false otherwise
  * effects:   none
  */
-bool addDivToContent(proxy *theProxy, int slot, int index)
+bool addDivToContent(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: addDivToContent\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
-        if (server->msgContent == NULL || server->contentSize < 7) {
+        connectionInfo *server = theProxy->connTable[SD];
+        connDetails *details = server->details;
+        if (details->msgContent.length == 0 || details->contentSize < 7) {
                 return true;
         }
 
@@ -1121,97 +1537,88 @@ bool addDivToContent(proxy *theProxy, int slot, int index)
         char *bodyTag = "</body>";
         char *ourTag = "M+I_Proxy";
         char *htmlTag = "<!DOCTYPE html>";
-        char *start = strstr(server->msgContent, bodyTag);
-        char *divAdded = strstr(server->msgContent, ourTag);
-        char *htmlAdded = strstr(server->msgContent, htmlTag);
-        if (divAdded != NULL || start == NULL || htmlAdded == NULL) {
+        int startPoint = findInChain(&details->msgContent, bodyTag, 0);
+        int divAdded = findInChain(&details->msgContent, ourTag, 0);
+        int htmlAdded = findInChain(&details->msgContent, htmlTag, 0);
+        if (divAdded != -1 || startPoint == -1 || htmlAdded == -1) {
                 return true;
         }
 
         makeLLMCall(theProxy);
 
         // right before end body 
-        int startPoint = start - server->msgContent;
         int finalLength = strlen(theProxy->LLMResponse);
         char *divContent = theProxy->LLMResponse;
 
-        // copy over new div structure into buffer
-        char *newContent = malloc(server->contentSize + finalLength + 1);
-        memcpy(newContent, server->msgContent, startPoint);
-        memcpy(newContent + startPoint, divContent, finalLength);
-        memcpy(newContent + startPoint + finalLength, server->msgContent + startPoint, 
-                server->contentRead - startPoint);
-        newContent[server->contentRead + finalLength] = '\0';
-        
-        free(server->msgContent);
-        server->msgContent = newContent;
-        server->contentRead += finalLength;
+        // link the new div structure in, the content around it stays in place
+        insertIntoChain(theProxy, &details->msgContent, startPoint, 
+                divContent, finalLength);
+        details->contentRead += finalLength;
 
-        setContentLength(theProxy, slot, index, finalLength);
+        setContentLength(theProxy, SD, finalLength);
         return true;
 }
 
 
 
-bool addEmptyDivToContent(proxy *theProxy, int slot, int index)
+bool addEmptyDivToContent(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: addEmptyDivToContent\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
-        if (server->msgContent == NULL) {
+        connectionInfo *server = theProxy->connTable[SD];
+        connDetails *details = server->details;
+        if (details->msgContent.length == 0) {
                 return true;
         }
 
-        char *newBuffer = malloc(server->contentSize + 1);
-        memcpy(newBuffer, server->msgContent, server->contentRead);
-        memset(newBuffer + server->contentRead, ' ', 1000);
-        newBuffer[server->contentSize] = '\0';
-
-        free(server->msgContent);
-        server->msgContent = newBuffer;
-        server->contentRead += 1000;
+        char padding[1000];
+        memset(padding, ' ', 1000);
+        copyToChain(theProxy, &details->msgContent, padding, 1000);
+        details->contentRead += 1000;
         return true;
 }
 
 
 
 
-bool addDivToBuffer(proxy *theProxy, int slot, int index)
+bool addDivToBuffer(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: addDivToBuffer\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
-        if (server->readBuffer == NULL) {
+        connectionInfo *server = theProxy->connTable[SD];
+        connDetails *details = server->details;
+        if (details->readBuffer == NULL) {
                 return true;
         }
 
         // check if we have found end of header delimiter
         char *bodyTag = "</body>";
         char *ourTag = "M+I_Proxy";
-        char *start = strstr(server->readBuffer, bodyTag);
-        char *divAdded = strstr(server->readBuffer, ourTag);
+        char *start = strstr(details->readBuffer, bodyTag);
+        char *divAdded = strstr(details->readBuffer, ourTag);
         if (divAdded != NULL || start == NULL) {
                 return true;
         }
 
         // right before end body 
-        int startPoint = start - server->readBuffer;
-        char *divContent = malloc(1001);
-        if (checkNullErrSSL(theProxy, slot, index, divContent, 53)) return false;
+        int startPoint = start - details->readBuffer;
+        char *divContent = allocBuffer(theProxy, 1001);
+        if (checkNullErrSSL(theProxy, SD, divContent, 53)) return false;
         FILE *file = fopen("divContent.txt", "r");
         size_t bytesRead = fread(divContent, 1, 1000, file);
         divContent[bytesRead] = '\0';
         fclose(file);
 
         // copy over new div structure into buffer
-        char *newContent = malloc(server->bufferSize + 1001);
-        memcpy(newContent, server->readBuffer, startPoint);
+        char *newContent = allocBuffer(theProxy, details->bufferSize + 1001);
+        memcpy(newContent, details->readBuffer, startPoint);
         memcpy(newContent + startPoint, divContent, 1000);
-        memcpy(newContent + startPoint + 1000, server->readBuffer + startPoint, 
-                server->bufferSize - startPoint);
-        newContent[server->bufferSize + 1000] = '\0';
+        memcpy(newContent + startPoint + 1000, details->readBuffer + startPoint, 
+                details->bufferSize - startPoint);
+        newContent[details->bufferSize + 1000] = '\0';
+        freeBuffer(theProxy, divContent);
         
-        free(server->readBuffer);
-        server->readBuffer = newContent;
-        server->bufferSize += 1000;
+        freeBuffer(theProxy, details->readBuffer);
+        details->readBuffer = newContent;
+        details->bufferSize += 1000;
         return true;
 }
 
@@ -1225,13 +1632,13 @@ bool addDivToBuffer(proxy *theProxy, int slot, int index)
 /*
  * name:      checkEndDelimiter
  * purpose:   checks if the end of section delimiter is present in the buffer
- * arguments: the proxy instance, the slot and index in the table, the buffer, 
+ * arguments: the proxy instance, the connection's socket descriptor, the buffer, 
  *            and buffer size
  * returns:   the number of bytes before the delimiter or -1 if no end was 
  *            found
  * effects:   none
  */
-int checkEndDelimiter(proxy *theProxy, int slot, int index, char *buffer, 
+int checkEndDelimiter(proxy *theProxy, int SD, char *buffer, 
         int size)
 {
         DEBUG_PRINT("FUNCTION: checkEndDelimiter\n");
@@ -1259,14 +1666,15 @@ int checkEndDelimiter(proxy *theProxy, int slot, int index, char *buffer,
  * name:      setContentLength
  * purpose:   sets the content length of the server header to reflect the new 
  *            size after adding the div to the content
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
  * effects:   alters the content header and the header size
  */
-void setContentLength(proxy *theProxy, int slot, int index, int length)
+void setContentLength(proxy *theProxy, int SD, int length)
 {
         DEBUG_PRINT("FUNCTION: setContentLength\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
+        connDetails *details = client->details;
         char *startPoint = NULL;
 
         //check if we have found end of header delimiter
@@ -1274,10 +1682,10 @@ void setContentLength(proxy *theProxy, int slot, int index, int length)
         char *lengthHeader2 = "Content-length: ";
         char *lengthHeader3 = "content-length: ";
         char *lengthHeader4 = "content-Length: ";
-        char *header1 = strstr(client->msgHeader, lengthHeader1);
-        char *header2 = strstr(client->msgHeader, lengthHeader2);
-        char *header3 = strstr(client->msgHeader, lengthHeader3);
-        char *header4 = strstr(client->msgHeader, lengthHeader4);
+        char *header1 = strstr(details->msgHeader, lengthHeader1);
+        char *header2 = strstr(details->msgHeader, lengthHeader2);
+        char *header3 = strstr(details->msgHeader, lengthHeader3);
+        char *header4 = strstr(details->msgHeader, lengthHeader4);
         if (header1 != NULL) { startPoint = header1; }
         else if (header2 != NULL) { startPoint = header2; }
         else if (header3 != NULL) { startPoint = header3; }
@@ -1285,63 +1693,63 @@ void setContentLength(proxy *theProxy, int slot, int index, int length)
         else { return; }
 
 
-        int lengthStart = startPoint - client->msgHeader + 16;
-        char *ogEndPoint = strstr(client->msgHeader + lengthStart, "\r\n");
-        int lengthEnd = ogEndPoint - client->msgHeader;
+        int lengthStart = startPoint - details->msgHeader + 16;
+        char *ogEndPoint = strstr(details->msgHeader + lengthStart, "\r\n");
+        int lengthEnd = ogEndPoint - details->msgHeader;
         int ogNumChars = lengthEnd - lengthStart;
         int ogLineSize = ogEndPoint - startPoint + 2;
 
-        client->contentSize += length;
-        char *newSize = malloc(ogNumChars + 10);
-        int newNumChars = snprintf(newSize, ogNumChars + 10, "%d", client->contentSize);
+        details->contentSize += length;
+        char *newSize = allocBuffer(theProxy, ogNumChars + 10);
+        int newNumChars = snprintf(newSize, ogNumChars + 10, "%d", details->contentSize);
         int charDiff = newNumChars - ogNumChars;
 
-        char *newBuffer = malloc(client->headerSize + charDiff + 1);
-        memcpy(newBuffer, client->msgHeader, lengthStart);
+        char *newBuffer = allocBuffer(theProxy, details->headerSize + charDiff + 1);
+        memcpy(newBuffer, details->msgHeader, lengthStart);
         memcpy(newBuffer + lengthStart, newSize, newNumChars);
-        memcpy(newBuffer + lengthStart + newNumChars, client->msgHeader + lengthEnd, client->headerSize - lengthStart - ogNumChars);
-        newBuffer[client->headerSize + charDiff] = '\0';
+        memcpy(newBuffer + lengthStart + newNumChars, details->msgHeader + lengthEnd, details->headerSize - lengthStart - ogNumChars);
+        newBuffer[details->headerSize + charDiff] = '\0';
+        freeBuffer(theProxy, newSize);
 
-        free(client->msgHeader);
-        client->msgHeader = newBuffer;
-        client->headerSize += charDiff;
+        freeBuffer(theProxy, details->msgHeader);
+        details->msgHeader = newBuffer;
+        details->headerSize += charDiff;
 }
 
 
 /*
  * name:      setContentEncoding
  * purpose:   checks what the content encoding field is in the provided buffer
- * arguments: the proxy instance, the slot and index in the table, the buffer, 
+ * arguments: the proxy instance, the connection's socket descriptor, the buffer, 
  *            and buffer size
  * returns:   none
  * effects:   populates the server's contentEncoding struct field
  */
-void setContentEncoding(proxy *theProxy, int slot, int index, char *buffer, 
+void setContentEncoding(proxy *theProxy, int SD, char *buffer, 
         int bufferSize)
 {
         DEBUG_PRINT("FUNCTION: setContentEncoding\n");
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
-        char *currentLine;
+        connectionInfo *server = theProxy->connTable[SD];
+        char *currentLine = allocBuffer(theProxy, bufferSize + 1);
+        checkFatalNull(currentLine);
         
+        server->details->contentEncoding = -1;
         int totalRead = 0;
         while (totalRead < bufferSize) {
-                currentLine = malloc(1000);
                 totalRead = readLine(buffer, currentLine, totalRead);
                 char *encoding = getContentEncodingLine(theProxy, currentLine);
                 if (encoding != NULL) {
                         if (strncmp(encoding, "br", 2) == 0) {
-                                server->contentEncoding = BR;
+                                server->details->contentEncoding = BR;
                         }
                         else if (strncmp(encoding, "gzip", 4) == 0) {
-                                server->contentEncoding = GZIP;
+                                server->details->contentEncoding = GZIP;
                         }
-                        free(currentLine);
-                        return;
-                        
+                        free(encoding);
+                        break;
                 }
-                free(currentLine);
         }
-        server->contentEncoding = -1;
+        freeBuffer(theProxy, currentLine);
 }
 
 
@@ -1394,37 +1802,39 @@ char *getContentEncodingLine(proxy *theProxy, char *currentLine)
 /*
  * name:      getContentLength
  * purpose:   checks what the content length field is in the provided buffer
- * arguments: the proxy instance, the slot and index in the table, the buffer, 
+ * arguments: the proxy instance, the connection's socket descriptor, the buffer, 
  *            and buffer size
  * returns:   none
  * effects:   populates the server's contentSize struct field
  */
-void getContentLength(proxy *theProxy, int slot, int index, char *buffer, 
+void getContentLength(proxy *theProxy, int SD, char *buffer, 
         int bufferSize)
 {
         DEBUG_PRINT("FUNCTION: getContentLength\n");
-        connectionInfo *conn = &theProxy->clientTable[slot].slotArray[index];
-        char *currentLine;
+        connectionInfo *conn = theProxy->connTable[SD];
         bool foundChunked = false;
+        char *currentLine = allocBuffer(theProxy, bufferSize + 1);
+        checkFatalNull(currentLine);
         
         int totalRead = 0;
         while (totalRead < bufferSize) {
-                currentLine = malloc(100000);
                 totalRead = readLine(buffer, currentLine, totalRead);
                 char *length = getLengthLine(theProxy, currentLine);
                 if (length != NULL) {
-                        conn->contentSize = atoi(length);
+                        conn->details->contentSize = atoi(length);
+                        free(length);
+                        freeBuffer(theProxy, currentLine);
                         return;
                 }
                 if (getChunkedLine(theProxy, currentLine)) {
                         foundChunked = true;
                 }
-                free(currentLine);
         }
-        conn->contentSize = -1;
+        freeBuffer(theProxy, currentLine);
+        conn->details->contentSize = -1;
 
         if (foundChunked) {
-                conn->chunkedContent = true;
+                conn->details->chunkedContent = true;
         }
 }
 
@@ -1508,37 +1918,39 @@ bool getChunkedLine(proxy *theProxy, char *currentLine)
  * name:      removeAcceptEncoding
  * purpose:   removes the accept encoding line from the header so the server 
  *            does not send encoded data
- * arguments: the proxy instance, the slot in the table, the bucket index
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
  * effects:   none
  */
-void removeAcceptEncoding(proxy *theProxy, int slot, int index)
+void removeAcceptEncoding(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: removeAcceptEncoding\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
-        char *currentLine;
+        connectionInfo *client = theProxy->connTable[SD];
+        connDetails *details = client->details;
+        char *currentLine = allocBuffer(theProxy, details->bufferSize + 1);
+        checkFatalNull(currentLine);
         
         int currLineEnd = 0;
         int prevLineEnd = 0;
-        while (currLineEnd < client->bufferSize) {
-                currentLine = malloc(10000);
+        while (currLineEnd < details->bufferSize) {
                 prevLineEnd = currLineEnd;
-                currLineEnd = readLine(client->readBuffer, currentLine, currLineEnd);
+                currLineEnd = readLine(details->readBuffer, currentLine, currLineEnd);
                 if (checkAcceptEncodingLine(theProxy, currentLine)) {
                         int lineSize = currLineEnd - prevLineEnd;
-                        char *newBuffer = malloc(client->bufferSize - lineSize + 1);
-                        memcpy(newBuffer, client->readBuffer, prevLineEnd);
-                        memcpy(newBuffer + prevLineEnd, client->readBuffer + 
-                                currLineEnd, client->bufferSize - currLineEnd);
-                        newBuffer[client->bufferSize - lineSize] = '\0';
-                        // free(client->readBuffer);
-                        client->readBuffer = newBuffer;
-                        client->bufferSize = client->bufferSize - lineSize;
-                        free(currentLine);
-                        return;
+                        char *newBuffer = allocBuffer(theProxy, 
+                                details->bufferSize - lineSize + 1);
+                        checkFatalNull(newBuffer);
+                        memcpy(newBuffer, details->readBuffer, prevLineEnd);
+                        memcpy(newBuffer + prevLineEnd, details->readBuffer + 
+                                currLineEnd, details->bufferSize - currLineEnd);
+                        newBuffer[details->bufferSize - lineSize] = '\0';
+                        freeBuffer(theProxy, details->readBuffer);
+                        details->readBuffer = newBuffer;
+                        details->bufferSize = details->bufferSize - lineSize;
+                        break;
                 }
-                free(currentLine);
         }
+        freeBuffer(theProxy, currentLine);
 }
 
 
@@ -1607,20 +2019,20 @@ void checkFatalNullSSL(void *object)
  * name:      checkNullErrSSL
  * purpose:   checks if the given object is NULL and removes the client or 
  *            server if so
- * arguments: the proxy, slot, index, object to check, error number
+ * arguments: the proxy, SD, object to check, error number
  * returns:   true if an error was detected, false if not
  * effects:   removes the client or server if there was an error
  */
-bool checkNullErrSSL(proxy *theProxy, int slot, int index, void *object, int i)
+bool checkNullErrSSL(proxy *theProxy, int SD, void *object, int i)
 {
         if (object == NULL) {
                 ERROR_PRINT("object is NULL at location %d\n", i);
                 ERR_print_errors_fp(stderr);
-                if (theProxy->clientTable[slot].slotArray[index].isClient) {
-                        removeClient(theProxy, slot, index);
+                if (theProxy->connTable[SD]->isClient) {
+                        removeClient(theProxy, SD);
                 }
                 else {
-                        removeServer(theProxy, slot, index);
+                        removeServer(theProxy, SD);
                 }
                 return true;
         }
@@ -1633,20 +2045,20 @@ bool checkNullErrSSL(proxy *theProxy, int slot, int index, void *object, int i)
  * name:      checkNegErrSSL
  * purpose:   checks if the given object is 0 or -1 and removes the client or 
  *            server if so
- * arguments: the proxy, slot, index, value to check, error number
+ * arguments: the proxy, SD, value to check, error number
  * returns:   true if an error was detected, false if not
  * effects:   removes the client or server if there was an error
  */
-bool checkNegErrSSL(proxy *theProxy, int slot, int index, int value, int i)
+bool checkNegErrSSL(proxy *theProxy, int SD, int value, int i)
 {
         if (value == 0) {
                 ERROR_PRINT("value is 0 at location %d\n", i);
                 ERR_print_errors_fp(stderr);
-                if (theProxy->clientTable[slot].slotArray[index].isClient) {
-                        removeClient(theProxy, slot, index);
+                if (theProxy->connTable[SD]->isClient) {
+                        removeClient(theProxy, SD);
                 }
                 else {
-                        removeServer(theProxy, slot, index);
+                        removeServer(theProxy, SD);
                 }
                 
                 return true;
@@ -1654,11 +2066,11 @@ bool checkNegErrSSL(proxy *theProxy, int slot, int index, int value, int i)
         if (value < 0) {
                 ERROR_PRINT("value is -1 at location %d\n", i);
                 ERR_print_errors_fp(stderr);
-                if (theProxy->clientTable[slot].slotArray[index].isClient) {
-                        removeClient(theProxy, slot, index);
+                if (theProxy->connTable[SD]->isClient) {
+                        removeClient(theProxy, SD);
                 }
                 else {
-                        removeServer(theProxy, slot, index);
+                        removeServer(theProxy, SD);
                 }
                 return true;
         }
@@ -1671,20 +2083,20 @@ bool checkNegErrSSL(proxy *theProxy, int slot, int index, int value, int i)
  * name:      checkNegOneErrSSL
  * purpose:   checks if the given object is -1 and removes the client or 
  *            server if so
- * arguments: the proxy, slot, index, value to check, error number
+ * arguments: the proxy, SD, value to check, error number
  * returns:   true if an error was detected, false if not
  * effects:   removes the client or server if there was an error
  */
-bool checkNegOneErrSSL(proxy *theProxy, int slot, int index, int value, int i)
+bool checkNegOneErrSSL(proxy *theProxy, int SD, int value, int i)
 {
         if (value < 0) {
                 ERROR_PRINT("value is -1 at location %d\n", i);
                 ERR_print_errors_fp(stderr);
-                if (theProxy->clientTable[slot].slotArray[index].isClient) {
-                        removeClient(theProxy, slot, index);
+                if (theProxy->connTable[SD]->isClient) {
+                        removeClient(theProxy, SD);
                 }
                 else {
-                        removeServer(theProxy, slot, index);
+                        removeServer(theProxy, SD);
                 }
                 return true;
         }
@@ -1696,7 +2108,7 @@ bool checkNegOneErrSSL(proxy *theProxy, int slot, int index, int value, int i)
 /*
  * name:      checkWantReadWrite
  * purpose:   checks if the return value indicates a want read / write
- * arguments: the proxy, slot, index, value to check, error number
+ * arguments: the proxy, SD, value to check, error number
  * returns:   true if want read / write, false if not
  * effects:   none
  */
@@ -1724,39 +2136,25 @@ bool checkWantReadWrite(proxy *theProxy, SSL *sslObj, int value, int i)
 
 /*
  * name:      freeMITMFields
- * purpose:   frees the MITM related fields of a connection struct
- * arguments: the proxy, table slot, and bucket index
+ * purpose:   frees the SSL objects of a session once neither its client nor 
+ *            its server uses them anymore
+ * arguments: the session
  * returns:   none
  * effects:   clears the MITM related fields
  */
-void freeMITMFields(proxy *theProxy, int slot, int index)
+void freeMITMFields(connSession *session)
 {
         DEBUG_PRINT("FUNCTION: freeMITMFields\n");
-        connectionInfo *conn = &theProxy->clientTable[slot].slotArray[index];
-        if (theProxy->clientTable[slot].slotArray[index].mode == MITM) {
-                if (conn->isClient && conn->connActive) {
-                        if (conn->clientSSL != NULL) {
-                                // SSL_free(conn->clientSSL);
-                                conn->clientSSL = NULL;
-                        }
-                        if (conn->serverCert != NULL) {
-                                X509_free(conn->serverCert);
-                                conn->serverCert = NULL;
-                        }
-                        if (conn->serverKey != NULL) {
-                                EVP_PKEY_free(conn->serverKey);
-                                conn->serverKey = NULL;
-                        }
-                }
-                else if (conn->connActive) {
-                        if (conn->serverSSL != NULL) {
-                                // SSL_free(conn->serverSSL);
-                                conn->serverSSL = NULL;
-                        }
-                        if (conn->serverCtx != NULL) {
-                                SSL_CTX_free(conn->serverCtx); 
-                                conn->serverCtx = NULL;
-                        }
-                }
+        if (session->clientSSL != NULL) {
+                SSL_free(session->clientSSL);
+                session->clientSSL = NULL;
+        }
+        if (session->serverSSL != NULL) {
+                SSL_free(session->serverSSL);
+                session->serverSSL = NULL;
+        }
+        if (session->serverCtx != NULL) {
+                SSL_CTX_free(session->serverCtx); 
+                session->serverCtx = NULL;
         }
 }
\ No newline at end of file
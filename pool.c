@@ -0,0 +1,629 @@
+/*****************************************************************************
+ *
+ *      pool.c
+ *
+ *      Isabel Muste (imuste01)
+ *      Marti Zentmaier (mzentm01)
+ *
+ *      11/10/2024
+ *
+ *      CS 112 Final Project
+ *
+ *      Contains the pool of idle upstream TLS connections used in MITM mode.
+ *      The HTTP/1.1 framing of both directions of an upstream connection is
+ *      followed as the data is relayed, and when its client goes away after
+ *      every request was answered, the connection is kept instead of closed.
+ *      The next client going to the same host, port and ALPN protocol gets
+ *      the connection without a TCP connect or TLS handshake. Idle
+ *      connections are checked for a close from the server before they are
+ *      handed out and periodically while they wait, and expire after a
+ *      while.
+ *
+ *
+ *****************************************************************************/
+
+#include "proxy.h"
+#include "logging.h"
+
+#define TUNNEL 0
+#define MITM 1
+
+#define HTTP_START_LINE 0
+#define HTTP_HEADERS 1
+#define HTTP_BODY 2
+#define HTTP_CHUNK_SIZE 3
+#define HTTP_CHUNK_DATA 4
+#define HTTP_CHUNK_END 5
+#define HTTP_TRAILERS 6
+
+#define HTTP_LINE_MAX 16384
+
+#define POOL_ALPN "http/1.1"
+#define POOL_MAX 64
+#define POOL_MAX_PER_HOST 6
+#define POOL_IDLE_TIMEOUT 30000000000ULL
+#define POOL_CHECK_INTERVAL 5000000000ULL
+
+
+
+/*****************************************************************************
+*                                POOL SETUP
+******************************************************************************/
+
+
+/*
+ * name:      initializePool
+ * purpose:   creates the worker's pool of idle upstream connections
+ * arguments: the proxy instance
+ * returns:   none
+ * effects:   sets the proxy's pool fields
+ */
+void initializePool(proxy *theProxy)
+{
+        DEBUG_PRINT("FUNCTION: initializePool\n");
+        theProxy->maxPooled = POOL_MAX;
+        theProxy->pool = malloc(POOL_MAX * sizeof(pooledConnection));
+        checkFatalNull(theProxy->pool);
+        theProxy->numPooled = 0;
+        theProxy->nextPoolCheck = 0;
+}
+
+
+
+/*****************************************************************************
+*                             EXCHANGE TRACKING
+******************************************************************************/
+
+
+/*
+ * name:      newHttpExchange
+ * purpose:   creates the exchange of a new upstream connection, which is
+ *            reusable until one of its messages says otherwise
+ * arguments: none
+ * returns:   the exchange
+ * effects:   none
+ */
+httpExchange *newHttpExchange()
+{
+        httpExchange *exchange = calloc(1, sizeof(httpExchange));
+        checkFatalNull(exchange);
+        exchange->request.state = HTTP_START_LINE;
+        exchange->response.state = HTTP_START_LINE;
+        exchange->reusable = true;
+        return exchange;
+}
+
+
+/*
+ * name:      trackHttpData
+ * purpose:   advances the parser of one direction over data that was relayed.
+ *            Bodies are skipped by their length, only the start lines,
+ *            headers and chunk sizes are looked at
+ * arguments: the exchange, whether the data came from the server, the data
+ *            and its length
+ * returns:   none
+ * effects:   marks the exchange as not reusable if the framing can't be
+ *            followed
+ */
+void trackHttpData(httpExchange *exchange, bool isResponse, char *data,
+        int length)
+{
+        httpParser *parser = isResponse ? &exchange->response :
+                &exchange->request;
+
+        int offset = 0;
+        while (exchange->reusable && offset < length) {
+                // skip over the body bytes that are left
+                if (parser->state == HTTP_BODY ||
+                        parser->state == HTTP_CHUNK_DATA) {
+                        long long skip = length - offset;
+                        if (skip > parser->remaining) {
+                                skip = parser->remaining;
+                        }
+                        offset += skip;
+                        parser->remaining -= skip;
+                        if (parser->remaining == 0) {
+                                if (parser->state == HTTP_BODY) {
+                                        finishHttpMessage(parser);
+                                }
+                                else {
+                                        parser->state = HTTP_CHUNK_END;
+                                }
+                        }
+                        continue;
+                }
+
+                // everything else is read a line at a time
+                char *lineEnd = memchr(data + offset, '\n', length - offset);
+                int lineLength = (lineEnd == NULL) ? length - offset :
+                        lineEnd - (data + offset);
+                if (!appendHttpLine(exchange, parser, data + offset,
+                        lineLength)) {
+                        return;
+                }
+                if (lineEnd == NULL) {
+                        return;
+                }
+                offset += lineLength + 1;
+
+                // drop the carriage return
+                if (parser->lineLength > 0 &&
+                        parser->line[parser->lineLength - 1] == '\r') {
+                        parser->lineLength--;
+                }
+                parser->line[parser->lineLength] = '\0';
+                processHttpLine(exchange, parser, isResponse);
+                parser->lineLength = 0;
+        }
+}
+
+
+/*
+ * name:      appendHttpLine
+ * purpose:   adds data to the line being read, which may be split across
+ *            several reads
+ * arguments: the exchange, the parser, the data and its length
+ * returns:   true if the data was added, false if the line is too long
+ * effects:   marks the exchange as not reusable if the line is too long
+ */
+bool appendHttpLine(httpExchange *exchange, httpParser *parser, char *data,
+        int length)
+{
+        int needed = parser->lineLength + length + 1;
+        if (needed > HTTP_LINE_MAX) {
+                exchange->reusable = false;
+                return false;
+        }
+        if (needed > parser->lineMax) {
+                int newMax = (parser->lineMax == 0) ? 256 : parser->lineMax;
+                while (newMax < needed) {
+                        newMax *= 2;
+                }
+                parser->line = realloc(parser->line, newMax);
+                checkFatalNull(parser->line);
+                parser->lineMax = newMax;
+        }
+
+        memcpy(parser->line + parser->lineLength, data, length);
+        parser->lineLength += length;
+        return true;
+}
+
+
+/*
+ * name:      processHttpLine
+ * purpose:   handles a complete start line, header line, chunk size or
+ *            trailer line
+ * arguments: the exchange, the parser, whether the line came from the server
+ * returns:   none
+ * effects:   marks the exchange as not reusable if the connection will be
+ *            closed or switches protocols
+ */
+void processHttpLine(httpExchange *exchange, httpParser *parser,
+        bool isResponse)
+{
+        char *line = parser->line;
+
+        switch (parser->state) {
+        case HTTP_START_LINE:
+                // empty lines between messages are allowed
+                if (parser->lineLength == 0) {
+                        return;
+                }
+                parser->contentLength = -1;
+                parser->chunked = false;
+                parser->noBody = false;
+                parser->state = HTTP_HEADERS;
+
+                if (!isResponse) {
+                        // a HEAD response has a length but no body, and a
+                        // CONNECT turns the connection into a tunnel
+                        if (strncmp(line, "HEAD ", 5) == 0 ||
+                                strncmp(line, "CONNECT ", 8) == 0 ||
+                                strstr(line, " HTTP/1.1") == NULL) {
+                                exchange->reusable = false;
+                        }
+                        return;
+                }
+
+                if (strncmp(line, "HTTP/1.1 ", 9) != 0) {
+                        exchange->reusable = false;
+                        return;
+                }
+                parser->statusCode = atoi(line + 9);
+                if (parser->statusCode == 101) {
+                        exchange->reusable = false;
+                }
+                parser->noBody = (parser->statusCode >= 100 &&
+                        parser->statusCode < 200) ||
+                        parser->statusCode == 204 || parser->statusCode == 304;
+                return;
+
+        case HTTP_HEADERS:
+                if (parser->lineLength == 0) {
+                        finishHttpHeaders(exchange, parser, isResponse);
+                }
+                else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                        parser->contentLength = atoll(line + 15);
+                }
+                else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 &&
+                        strcasestr(line + 18, "chunked") != NULL) {
+                        parser->chunked = true;
+                }
+                else if ((strncasecmp(line, "Connection:", 11) == 0 &&
+                        strcasestr(line + 11, "close") != NULL) ||
+                        strncasecmp(line, "Upgrade:", 8) == 0) {
+                        exchange->reusable = false;
+                }
+                return;
+
+        case HTTP_CHUNK_SIZE:
+                parser->remaining = strtoll(line, NULL, 16);
+                parser->state = (parser->remaining == 0) ?
+                        HTTP_TRAILERS : HTTP_CHUNK_DATA;
+                return;
+
+        case HTTP_CHUNK_END:
+                parser->state = HTTP_CHUNK_SIZE;
+                return;
+
+        case HTTP_TRAILERS:
+                if (parser->lineLength == 0) {
+                        finishHttpMessage(parser);
+                }
+                return;
+        }
+}
+
+
+/*
+ * name:      finishHttpHeaders
+ * purpose:   decides how the body of a message ends once its headers were read
+ * arguments: the exchange, the parser, whether the message is a response
+ * returns:   none
+ * effects:   marks the exchange as not reusable if the body only ends when
+ *            the connection closes
+ */
+void finishHttpHeaders(httpExchange *exchange, httpParser *parser,
+        bool isResponse)
+{
+        // interim responses are followed by the real one
+        if (isResponse && parser->statusCode >= 100 && parser->statusCode < 200) {
+                parser->state = HTTP_START_LINE;
+                return;
+        }
+
+        if (parser->noBody) {
+                finishHttpMessage(parser);
+        }
+        else if (parser->chunked) {
+                parser->state = HTTP_CHUNK_SIZE;
+        }
+        else if (parser->contentLength > 0) {
+                parser->state = HTTP_BODY;
+                parser->remaining = parser->contentLength;
+        }
+        else if (parser->contentLength == 0 || !isResponse) {
+                finishHttpMessage(parser);
+        }
+        else {
+                exchange->reusable = false;
+        }
+}
+
+
+/*
+ * name:      finishHttpMessage
+ * purpose:   counts a complete message and waits for the next one
+ * arguments: the parser
+ * returns:   none
+ * effects:   none
+ */
+void finishHttpMessage(httpParser *parser)
+{
+        parser->messages++;
+        parser->state = HTTP_START_LINE;
+        parser->remaining = 0;
+}
+
+
+/*
+ * name:      isExchangeIdle
+ * purpose:   checks if every request sent on the connection was answered in
+ *            full and nothing else was started
+ * arguments: the exchange
+ * returns:   true if the connection can carry a new request, false otherwise
+ * effects:   none
+ */
+bool isExchangeIdle(httpExchange *exchange)
+{
+        return exchange->reusable &&
+                exchange->request.messages > 0 &&
+                exchange->request.messages == exchange->response.messages &&
+                exchange->request.state == HTTP_START_LINE &&
+                exchange->response.state == HTTP_START_LINE &&
+                exchange->request.lineLength == 0 &&
+                exchange->response.lineLength == 0;
+}
+
+
+
+/*****************************************************************************
+*                            CONNECTION POOLING
+******************************************************************************/
+
+
+/*
+ * name:      poolServerConnection
+ * purpose:   keeps the upstream connection of a client that went away if it
+ *            is idle, instead of closing it. The oldest idle connection makes
+ *            room if the pool is full
+ * arguments: the proxy instance, the server's socket descriptor
+ * returns:   true if the connection was pooled, false if it has to be closed
+ * effects:   frees the server struct of a pooled connection
+ */
+bool poolServerConnection(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION: poolServerConnection\n");
+        connectionInfo *server = theProxy->connTable[SD];
+        connSession *session = server->session;
+        httpExchange *exchange = server->details->exchange;
+        if (server->mode != MITM || theProxy->pool == NULL ||
+                session->serverSSL == NULL || exchange == NULL ||
+                server->closeAfterFlush || !isExchangeIdle(exchange)) {
+                return false;
+        }
+
+        pooledConnection candidate;
+        candidate.serverSD = server->serverSD;
+        candidate.serverSSL = session->serverSSL;
+        if (!isPooledConnectionHealthy(&candidate)) {
+                return false;
+        }
+
+        // the ALPN protocol a connection speaks is part of its key, servers
+        // that didn't pick one speak HTTP/1.1
+        const unsigned char *alpn = NULL;
+        unsigned int alpnLength = 0;
+        SSL_get0_alpn_selected(session->serverSSL, &alpn, &alpnLength);
+        if (alpnLength == 0) {
+                alpn = (const unsigned char *)POOL_ALPN;
+                alpnLength = strlen(POOL_ALPN);
+        }
+        if (alpnLength >= sizeof(candidate.alpn)) {
+                return false;
+        }
+
+        int sameHost = 0;
+        int oldest = -1;
+        for (int i = 0; i < theProxy->numPooled; i++) {
+                pooledConnection *pooled = &theProxy->pool[i];
+                if (pooled->port == session->serverPort &&
+                        strcasecmp(pooled->hostName, session->serverURL) == 0) {
+                        sameHost++;
+                }
+                if (oldest == -1 ||
+                        pooled->idleSince < theProxy->pool[oldest].idleSince) {
+                        oldest = i;
+                }
+        }
+        if (sameHost >= POOL_MAX_PER_HOST) {
+                return false;
+        }
+        if (theProxy->numPooled == theProxy->maxPooled) {
+                closePooledConnection(theProxy, oldest);
+        }
+
+        unsigned long long now = getCurrTime(theProxy->theCache);
+        pooledConnection *pooled = &theProxy->pool[theProxy->numPooled];
+        pooled->hostName = strdup(session->serverURL);
+        checkFatalNull(pooled->hostName);
+        pooled->port = session->serverPort;
+        memcpy(pooled->alpn, alpn, alpnLength);
+        pooled->alpn[alpnLength] = '\0';
+        pooled->serverSD = server->serverSD;
+        pooled->serverSSL = session->serverSSL;
+        pooled->serverCtx = session->serverCtx;
+        pooled->idleSince = now;
+        if (theProxy->numPooled == 0) {
+                theProxy->nextPoolCheck = now + POOL_CHECK_INTERVAL;
+        }
+        theProxy->numPooled++;
+
+        // the socket stays open, only the server struct goes away
+        removeFromEventLoop(theProxy, server->serverSD);
+        session->serverSSL = NULL;
+        session->serverCtx = NULL;
+        freeTableSlot(theProxy, SD);
+
+        INFO_PRINT("Pooled connection to %s:%d\n", pooled->hostName,
+                pooled->port);
+        return true;
+}
+
+
+/*
+ * name:      adoptPooledConnection
+ * purpose:   hands the most recently pooled healthy connection to the
+ *            client's host and port to the client, and continues the setup
+ *            as if the connect just finished
+ * arguments: the proxy instance, the client's socket descriptor
+ * returns:   true if a pooled connection was used, false otherwise
+ * effects:   closes the pooled connections to the host that went bad
+ */
+bool adoptPooledConnection(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION: adoptPooledConnection\n");
+        connectionInfo *client = theProxy->connTable[SD];
+        connSession *session = client->session;
+        if (client->mode != MITM || theProxy->numPooled == 0) {
+                return false;
+        }
+
+        while (true) {
+                int newest = -1;
+                for (int i = 0; i < theProxy->numPooled; i++) {
+                        pooledConnection *pooled = &theProxy->pool[i];
+                        if (pooled->port == session->serverPort &&
+                                strcmp(pooled->alpn, POOL_ALPN) == 0 &&
+                                strcasecmp(pooled->hostName,
+                                        session->serverURL) == 0 &&
+                                (newest == -1 || pooled->idleSince >
+                                        theProxy->pool[newest].idleSince)) {
+                                newest = i;
+                        }
+                }
+                if (newest == -1) {
+                        return false;
+                }
+                if (!isPooledConnectionHealthy(&theProxy->pool[newest])) {
+                        closePooledConnection(theProxy, newest);
+                        continue;
+                }
+
+                pooledConnection pooled = theProxy->pool[newest];
+                free(pooled.hostName);
+                theProxy->numPooled--;
+                theProxy->pool[newest] = theProxy->pool[theProxy->numPooled];
+
+                addToEventLoop(theProxy, pooled.serverSD, EPOLLIN);
+                connectionInfo *server = populateServerStruct(theProxy,
+                        pooled.serverSD, client);
+                server->eventMask = EPOLLIN;
+                server->details->exchange = newHttpExchange();
+
+                client->serverSD = pooled.serverSD;
+                session->server = server;
+                session->serverSSL = pooled.serverSSL;
+                session->serverCtx = pooled.serverCtx;
+
+                INFO_PRINT("Reusing pooled connection to %s:%d\n",
+                        session->serverURL, session->serverPort);
+                completeCommunication(theProxy, SD);
+                return true;
+        }
+}
+
+
+/*
+ * name:      isPooledConnectionHealthy
+ * purpose:   checks that the server hasn't closed an idle connection or sent
+ *            anything on it, since an idle connection has nothing to receive
+ * arguments: the pooled connection
+ * returns:   true if the connection can carry a new request, false otherwise
+ * effects:   none
+ */
+bool isPooledConnectionHealthy(pooledConnection *pooled)
+{
+        if (SSL_pending(pooled->serverSSL) > 0) {
+                return false;
+        }
+
+        char byte;
+        int peekReturn = recv(pooled->serverSD, &byte, 1,
+                MSG_PEEK | MSG_DONTWAIT);
+        return peekReturn == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+
+/*
+ * name:      getPoolWaitTime
+ * purpose:   finds how long the event loop can wait before the pooled
+ *            connections are checked again
+ * arguments: the proxy instance
+ * returns:   the time in milliseconds, or -1 if nothing is pooled
+ * effects:   none
+ */
+int getPoolWaitTime(proxy *theProxy)
+{
+        if (theProxy->numPooled == 0) {
+                return -1;
+        }
+
+        unsigned long long now = getCurrTime(theProxy->theCache);
+        if (theProxy->nextPoolCheck <= now) {
+                return 0;
+        }
+        return (int)((theProxy->nextPoolCheck - now + 999999) / 1000000);
+}
+
+
+/*
+ * name:      expirePooledConnections
+ * purpose:   closes the pooled connections that were idle for too long or
+ *            were closed by their server, every few seconds
+ * arguments: the proxy instance
+ * returns:   none
+ * effects:   none
+ */
+void expirePooledConnections(proxy *theProxy)
+{
+        if (theProxy->numPooled == 0) {
+                return;
+        }
+
+        unsigned long long now = getCurrTime(theProxy->theCache);
+        if (now < theProxy->nextPoolCheck) {
+                return;
+        }
+        theProxy->nextPoolCheck = now + POOL_CHECK_INTERVAL;
+
+        int i = theProxy->numPooled - 1;
+        while (i >= 0) {
+                pooledConnection *pooled = &theProxy->pool[i];
+                if (now - pooled->idleSince >= POOL_IDLE_TIMEOUT ||
+                        !isPooledConnectionHealthy(pooled)) {
+                        closePooledConnection(theProxy, i);
+                }
+                i--;
+        }
+}
+
+
+
+/*****************************************************************************
+*                              RESET FUNCTIONS
+******************************************************************************/
+
+
+/*
+ * name:      closePooledConnection
+ * purpose:   closes a pooled connection and removes it from the pool
+ * arguments: the proxy instance, the index of the connection in the pool
+ * returns:   none
+ * effects:   none
+ */
+void closePooledConnection(proxy *theProxy, int poolIndex)
+{
+        DEBUG_PRINT("FUNCTION: closePooledConnection\n");
+        pooledConnection *pooled = &theProxy->pool[poolIndex];
+
+        // the pool owns the only reference to the SSL objects
+        SSL_free(pooled->serverSSL);
+        SSL_CTX_free(pooled->serverCtx);
+        close(pooled->serverSD);
+        free(pooled->hostName);
+
+        theProxy->numPooled--;
+        theProxy->pool[poolIndex] = theProxy->pool[theProxy->numPooled];
+}
+
+
+/*
+ * name:      freeHttpExchange
+ * purpose:   frees the exchange of a connection
+ * arguments: the connection struct
+ * returns:   none
+ * effects:   none
+ */
+void freeHttpExchange(connectionInfo *conn)
+{
+        if (conn->details->exchange == NULL) {
+                return;
+        }
+
+        free(conn->details->exchange->request.line);
+        free(conn->details->exchange->response.line);
+        free(conn->details->exchange);
+        conn->details->exchange = NULL;
+}
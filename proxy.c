@@ -20,6 +20,13 @@
 
 #define TUNNEL 0
 #define MITM 1
+#define ACCEPT_BUDGET 64
+#define OUTPUT_HIGH_WATER 262144
+#define OUTPUT_LOW_WATER 65536
+#define OUTPUT_VECTORS 64
+#define CONNECT_TIMEOUT 10
+#define CONNECT_ATTEMPT_DELAY 250000000ULL
+#define CONNECT_HEADER_MAX 8192
 
 
 
@@ -38,287 +45,1304 @@
 proxy *newProxy(int port, cacheInfo *theCache, int mode)
 {
         DEBUG_PRINT("FUNCTION: newProxy\n");
-        int tabSize = 200;
-
         proxy *theProxy = malloc(sizeof(proxy));
         checkFatalNull(theProxy);
 
-        theProxy->clientTable = (tableSlot *)malloc(tabSize * sizeof(tableSlot));
-        checkFatalNull(theProxy->clientTable);
+        theProxy->maxConnections = 1024;
+        theProxy->connTable = (connectionInfo **)calloc(
+                theProxy->maxConnections, sizeof(connectionInfo *));
+        checkFatalNull(theProxy->connTable);
 
-        for (int i = 0; i < tabSize; i++) {
-                theProxy->clientTable[i].numSlotItems = 0;
+        theProxy->listenSD = -1;
+        theProxy->portNumber = port;
+        theProxy->workerID = 0;
+        theProxy->options = NULL;
+
+        theProxy->epollFD = -1;
+        theProxy->uring = NULL;
+        theProxy->resolver = NULL;
+        theProxy->pool = NULL;
+        theProxy->numPooled = 0;
+        theProxy->maxPooled = 0;
+        theProxy->nextPoolCheck = 0;
+        theProxy->maxEvents = 1024;
+        theProxy->readyEvents = (struct epoll_event *)malloc(
+                theProxy->maxEvents * sizeof(struct epoll_event));
+        checkFatalNull(theProxy->readyEvents);
+        theProxy->numReady = 0;
+        theProxy->currEvent = 0;
+
+        theProxy->timers = NULL;
+        theProxy->loopTime = 0;
+        theProxy->slabs = NULL;
 
-                theProxy->clientTable[i].slotArray = 
-                        (connectionInfo *)malloc(10 * sizeof(connectionInfo));
-                checkFatalNull(theProxy->clientTable[i].slotArray);
+        theProxy->proxyMode = mode;
+        theProxy->theCache = theCache;
+        theProxy->numClients = 0;
+        theProxy->clientCtx = NULL;
+        theProxy->certCache = NULL;
+        theProxy->keyPool = NULL;
+        theProxy->certStore = NULL;
+        theProxy->connSolution = NULL;
+        theProxy->connGuess = NULL;
+        theProxy->LLMResponse = NULL;
+        
+        return theProxy;
+}
 
-                for (int j = 0; j < 10; j++) {
-                        theProxy->clientTable[i].slotArray[j].clientSD = -1;
-                        theProxy->clientTable[i].slotArray[j].serverSD = -1;
-                        theProxy->clientTable[i].slotArray[j].isClient = false;
-                        theProxy->clientTable[i].slotArray[j].mode = mode;
 
-                        theProxy->clientTable[i].slotArray[j].bufferSize = -1;
-                        theProxy->clientTable[i].slotArray[j].bufferRead = 0;
-                        theProxy->clientTable[i].slotArray[j].readBuffer = NULL;
+/*
+ * name:      proxyListening
+ * purpose:   listens for incoming clients and processes their requests either 
+ *            by sending them to the corresponding server or by getting the 
+ *            response from the cache
+ * arguments: the proxy instance
+ * returns:   none
+ * effects:   none
+ */
+void proxyListening(proxy *theProxy)
+{
+        DEBUG_PRINT("FUNCTION: proxyListening\n");
+        //setup the server socket
+        createSocket(theProxy);
 
-                        theProxy->clientTable[i].slotArray[j].headerSize = -1;
-                        theProxy->clientTable[i].slotArray[j].headerRead = 0;
-                        theProxy->clientTable[i].slotArray[j].msgHeader = NULL;
-                        
-                        theProxy->clientTable[i].slotArray[j].contentSize = -1;
-                        theProxy->clientTable[i].slotArray[j].contentRead = 0;
-                        theProxy->clientTable[i].slotArray[j].msgContent = NULL;
+        //listen for incoming connections
+        int returnVal = listen(theProxy->listenSD, 500);
+        checkFatalNegOne(returnVal);
+
+        // create the epoll instance and register the listening socket
+        theProxy->epollFD = epoll_create1(EPOLL_CLOEXEC);
+        checkFatalNegOne(theProxy->epollFD);
+        addToEventLoop(theProxy, theProxy->listenSD, EPOLLIN);
+
+        // tunnels are relayed through io_uring if it was requested
+        if (theProxy->options != NULL && theProxy->options->useUring) {
+                initializeUring(theProxy);
+        }
+        initializeSlabs(theProxy);
+        initializeResolver(theProxy);
+        initializeTimers(theProxy);
+
+        // idle upstream TLS connections are reused by later clients
+        if (theProxy->proxyMode == MITM) {
+                initializePool(theProxy);
+        }
 
-                        theProxy->clientTable[i].slotArray[j].contentEncoding = -1;
-                        theProxy->clientTable[i].slotArray[j].chunkedContent = false;
-                        theProxy->clientTable[i].slotArray[j].divAdded = false;
+        while (true) {
+                pollConnections(theProxy);
+        }
+        close(theProxy->epollFD);
+        close(theProxy->listenSD);
+}
 
-                        theProxy->clientTable[i].slotArray[j].connActive = false;
-                        theProxy->clientTable[i].slotArray[j].timeAdded = -1;
 
-                        theProxy->clientTable[i].slotArray[j].serverURL = NULL;
-                        theProxy->clientTable[i].slotArray[j].serverPort = -1;
+/*
+ * name:      pollConnections
+ * purpose:   waits for socket events using epoll and services every ready 
+ *            descriptor returned by the wakeup
+ * arguments: the proxy instance
+ * returns:   none
+ * effects:   none
+ */
+void pollConnections(proxy *theProxy)
+{
+        DEBUG_PRINT("FUNCTION: pollConnections\n");
+        int numReady = epoll_wait(theProxy->epollFD, theProxy->readyEvents, 
+                        theProxy->maxEvents, getLoopWaitTime(theProxy));
+        if (numReady < 0) {
+                return;
+        }
+        theProxy->numReady = numReady;
+        theProxy->loopTime = getCurrTime(theProxy->theCache);
 
-                        theProxy->clientTable[i].slotArray[j].clientSSL = NULL;
+        for (int i = 0; i < numReady; i++) {
+                theProxy->currEvent = i;
+                int SD = theProxy->readyEvents[i].data.fd;
 
-                        theProxy->clientTable[i].slotArray[j].serverCtx = NULL;
-                        theProxy->clientTable[i].slotArray[j].serverSSL = NULL;
-                        theProxy->clientTable[i].slotArray[j].serverCert = NULL;
-                        theProxy->clientTable[i].slotArray[j].serverKey = NULL;
+                // the descriptor was closed by an earlier event in this batch
+                if (SD == -1) {
+                        continue;
+                }
+                if (SD == theProxy->listenSD) {
+                        acceptClient(theProxy);
+                        continue;
+                }
+                if (theProxy->uring != NULL && SD == theProxy->uring->ringFD) {
+                        reapUringCompletions(theProxy);
+                        continue;
                 }
+                if (theProxy->resolver != NULL && 
+                        SD == theProxy->resolver->dnsSD) {
+                        handleDnsResponses(theProxy);
+                        continue;
+                }
+                processConnection(theProxy, SD);
         }
+        theProxy->numReady = 0;
 
-        theProxy->listenSD = -1;
-        theProxy->portNumber = port;
-        theProxy->maxFD = -1;
-        theProxy->proxyMode = mode;
-        theProxy->theCache = theCache;
-        theProxy->tableSize = tabSize;
-        theProxy->numClients = 0;
-        theProxy->clientCtx = NULL;
-        theProxy->connSolution = NULL;
-        theProxy->connGuess = NULL;
-        theProxy->LLMResponse = NULL;
-        
-        return theProxy;
+        expireTimers(theProxy);
+        expireDnsLookups(theProxy);
+        expirePooledConnections(theProxy);
+}
+
+
+/*
+ * name:      acceptClient
+ * purpose:   drains the listening socket, accepting new non-blocking clients 
+ *            and adding them to the table and the event loop until no 
+ *            connection is left or the per wakeup budget is used up
+ * arguments: the proxy instance
+ * returns:   none
+ * effects:   none
+ */
+void acceptClient(proxy *theProxy)
+{
+        DEBUG_PRINT("FUNCTION: acceptClient\n");
+        for (int i = 0; i < ACCEPT_BUDGET; i++) {
+                struct sockaddr_in clientAddress;
+                socklen_t clientAddressLength = sizeof(clientAddress);
+                int clientSD = accept4(theProxy->listenSD, 
+                        (struct sockaddr *)&clientAddress, &clientAddressLength, 
+                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (clientSD == -1) {
+                        if (errno == EMFILE || errno == ENFILE) {
+                                ERROR_PRINT("Out of descriptors, delaying accept\n");
+                        }
+                        return;
+                }
+                addClient(theProxy, clientSD);
+                addToEventLoop(theProxy, clientSD, EPOLLIN);
+        }
+}
+
+
+/*
+ * name:      addClient
+ * purpose:   adds a new client to the table with a new session, and starts 
+ *            the timer it has to send its CONNECT request in
+ * arguments: the proxy instance, the client socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void addClient(proxy *theProxy, int clientSD)
+{
+        DEBUG_PRINT("FUNCTION: addClient: %d\n", clientSD);
+        connectionInfo *client = addConnection(theProxy, clientSD);
+        client->clientSD = clientSD;
+        client->isClient = true;
+        newSession(theProxy, client);
+
+        startTimer(theProxy, clientSD, TIMER_HEADER, getHeaderTimeout(theProxy));
+}
+
+
+
+
+/*****************************************************************************
+*                             WORKER FUNCTIONS
+******************************************************************************/
+
+
+/*
+ * name:      startProxyWorkers
+ * purpose:   runs every proxy worker on its own thread. Each worker owns its 
+ *            listener, event loop and connection table, so a client and its 
+ *            server always stay on the worker that accepted the client
+ * arguments: the array of worker proxies, the number of workers
+ * returns:   none
+ * effects:   the first worker runs on the calling thread and never returns
+ */
+void startProxyWorkers(proxy **workers, int numWorkers)
+{
+        DEBUG_PRINT("FUNCTION: startProxyWorkers\n");
+        for (int i = 1; i < numWorkers; i++) {
+                pthread_t workerThread;
+                int returnVal = pthread_create(&workerThread, NULL, 
+                        runProxyWorker, workers[i]);
+                if (returnVal != 0) {
+                        ERROR_PRINT("Failed to start proxy worker %d\n", i);
+                        exit(EXIT_FAILURE);
+                }
+                pthread_detach(workerThread);
+        }
+
+        runProxyWorker(workers[0]);
+}
+
+
+/*
+ * name:      runProxyWorker
+ * purpose:   thread entry point that runs the event loop of a single worker
+ * arguments: the worker proxy instance
+ * returns:   NULL
+ * effects:   none
+ */
+void *runProxyWorker(void *workerProxy)
+{
+        proxy *theProxy = (proxy *)workerProxy;
+        INFO_PRINT("Proxy worker %d listening\n", theProxy->workerID);
+        proxyListening(theProxy);
+        return NULL;
+}
+
+
+
+
+/*****************************************************************************
+*                           EVENT LOOP FUNCTIONS
+******************************************************************************/
+
+
+/*
+ * name:      addToEventLoop
+ * purpose:   registers a socket descriptor with the epoll instance
+ * arguments: the proxy instance, the socket descriptor, the epoll events
+ * returns:   none
+ * effects:   none
+ */
+void addToEventLoop(proxy *theProxy, int SD, uint32_t events)
+{
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.events = events;
+        event.data.fd = SD;
+
+        int returnVal = epoll_ctl(theProxy->epollFD, EPOLL_CTL_ADD, SD, &event);
+        if (returnVal < 0) {
+                ERROR_PRINT("Failed to add SD %d to the event loop\n", SD);
+        }
+}
+
+
+/*
+ * name:      modifyEventLoop
+ * purpose:   changes the epoll events a registered socket descriptor waits for
+ * arguments: the proxy instance, the socket descriptor, the epoll events
+ * returns:   none
+ * effects:   none
+ */
+void modifyEventLoop(proxy *theProxy, int SD, uint32_t events)
+{
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.events = events;
+        event.data.fd = SD;
+
+        int returnVal = epoll_ctl(theProxy->epollFD, EPOLL_CTL_MOD, SD, &event);
+        if (returnVal < 0) {
+                ERROR_PRINT("Failed to modify SD %d in the event loop\n", SD);
+        }
+}
+
+
+/*
+ * name:      removeFromEventLoop
+ * purpose:   unregisters a socket descriptor from the epoll instance and drops 
+ *            any of its events still pending in the current batch, so a 
+ *            closed (and possibly reused) descriptor is never serviced
+ * arguments: the proxy instance, the socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void removeFromEventLoop(proxy *theProxy, int SD)
+{
+        if (SD < 0) {
+                return;
+        }
+        epoll_ctl(theProxy->epollFD, EPOLL_CTL_DEL, SD, NULL);
+
+        for (int i = theProxy->currEvent + 1; i < theProxy->numReady; i++) {
+                if (theProxy->readyEvents[i].data.fd == SD) {
+                        theProxy->readyEvents[i].data.fd = -1;
+                }
+        }
+}
+
+
+/*
+ * name:      raiseFileLimit
+ * purpose:   raises the soft limit on open descriptors to the hard limit so 
+ *            the proxy is not capped by the default of 1024
+ * arguments: none
+ * returns:   none
+ * effects:   none
+ */
+void raiseFileLimit()
+{
+        struct rlimit fileLimit;
+        if (getrlimit(RLIMIT_NOFILE, &fileLimit) == -1) {
+                return;
+        }
+
+        fileLimit.rlim_cur = fileLimit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &fileLimit) == -1) {
+                ERROR_PRINT("Failed to raise the open file limit\n");
+        }
+}
+
+
+/*
+ * name:      getCurrentEvents
+ * purpose:   returns the epoll events of the descriptor being serviced
+ * arguments: the proxy instance
+ * returns:   the events, EPOLLIN if no event batch is being serviced
+ * effects:   none
+ */
+uint32_t getCurrentEvents(proxy *theProxy)
+{
+        if (theProxy->numReady == 0) {
+                return EPOLLIN;
+        }
+        return theProxy->readyEvents[theProxy->currEvent].events;
+}
+
+
+/*
+ * name:      getLoopWaitTime
+ * purpose:   finds how long epoll_wait can block before a timer, DNS lookup 
+ *            or pooled connection needs attention
+ * arguments: the proxy instance
+ * returns:   the time in milliseconds, or -1 to wait indefinitely
+ * effects:   none
+ */
+int getLoopWaitTime(proxy *theProxy)
+{
+        int waitTimes[3] = {getTimerWaitTime(theProxy), 
+                getDnsWaitTime(theProxy), getPoolWaitTime(theProxy)};
+
+        int waitTime = -1;
+        for (int i = 0; i < 3; i++) {
+                if (waitTimes[i] != -1 && 
+                        (waitTime == -1 || waitTimes[i] < waitTime)) {
+                        waitTime = waitTimes[i];
+                }
+        }
+        return waitTime;
+}
+
+
+
+
+/*****************************************************************************
+*                           OUTPUT QUEUE FUNCTIONS
+******************************************************************************/
+
+
+/*
+ * name:      queueOutputData
+ * purpose:   copies data that could not be written to the peer yet to the end 
+ *            of the connection's output queue
+ * arguments: the proxy instance, the connection's socket descriptor, the data 
+ *            and its length
+ * returns:   true if the data was queued, false if the connection was removed
+ * effects:   may pause reading from the connection
+ */
+bool queueOutputData(proxy *theProxy, int SD, char *data, 
+        int length)
+{
+        DEBUG_PRINT("FUNCTION: queueOutputData\n");
+        connectionInfo *conn = theProxy->connTable[SD];
+        char *queued = allocBuffer(theProxy, length);
+        if (checkNullErrSSL(theProxy, SD, queued, 9)) return false;
+        memcpy(queued, data, length);
+
+        appendOutputChunk(theProxy, conn, queued, 0, length);
+        setOutputState(theProxy, conn);
+        return true;
+}
+
+
+/*
+ * name:      appendOutputChunk
+ * purpose:   adds a buffer to the end of the connection's output queue
+ * arguments: the proxy instance, the connection struct, the buffer, the 
+ *            offset of the first unwritten byte and the buffer length
+ * returns:   none
+ * effects:   takes ownership of the buffer, which must come from allocBuffer
+ */
+void appendOutputChunk(proxy *theProxy, connectionInfo *conn, char *data, 
+        int offset, int length)
+{
+        outputChunk *chunk = allocObject(&theProxy->slabs->outputChunks);
+        chunk->data = data;
+        chunk->offset = offset;
+        chunk->length = length;
+        chunk->next = NULL;
+
+        if (conn->outputTail == NULL) {
+                conn->outputHead = chunk;
+        }
+        else {
+                conn->outputTail->next = chunk;
+        }
+        conn->outputTail = chunk;
+        conn->outputBytes += length - offset;
+}
+
+
+/*
+ * name:      writeOutputData
+ * purpose:   makes a single non-blocking write of queued data to the peer of 
+ *            the connection it was read from. A tunnel writes as many queued 
+ *            chunks as fit in one writev, a MITM connection writes the first 
+ *            chunk since an SSL write that has to be retried is tied to it
+ * arguments: the connection the data was read from, the peer's socket
+ * returns:   the number of bytes written, 0 if the peer can't take more data 
+ *            right now, or -1 on error
+ * effects:   none
+ */
+int writeOutputData(connectionInfo *source, int writeSD)
+{
+        outputChunk *chunk = source->outputHead;
+        if (source->mode == MITM) {
+                SSL *writeSSL = source->isClient ? source->session->serverSSL : 
+                        source->session->clientSSL;
+                if (writeSSL == NULL) {
+                        return -1;
+                }
+                int writeReturn = SSL_write(writeSSL, 
+                        chunk->data + chunk->offset, chunk->length - chunk->offset);
+                if (writeReturn <= 0) {
+                        int sslError = SSL_get_error(writeSSL, writeReturn);
+                        if (sslError == SSL_ERROR_WANT_WRITE || 
+                                sslError == SSL_ERROR_WANT_READ) {
+                                return 0;
+                        }
+                        return -1;
+                }
+                return writeReturn;
+        }
+
+        struct iovec vectors[OUTPUT_VECTORS];
+        int count = 0;
+        for (; chunk != NULL && count < OUTPUT_VECTORS; chunk = chunk->next) {
+                vectors[count].iov_base = chunk->data + chunk->offset;
+                vectors[count].iov_len = chunk->length - chunk->offset;
+                count++;
+        }
+
+        int writeReturn = writev(writeSD, vectors, count);
+        if (writeReturn == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;
+        }
+        return writeReturn;
+}
+
+
+/*
+ * name:      consumeOutputData
+ * purpose:   removes written data from the front of a connection's output 
+ *            queue, which may span several chunks after a vectored write
+ * arguments: the proxy instance, the connection struct, the number of bytes 
+ *            written
+ * returns:   none
+ * effects:   frees the chunks that were written completely
+ */
+void consumeOutputData(proxy *theProxy, connectionInfo *source, int written)
+{
+        source->outputBytes -= written;
+        while (written > 0) {
+                outputChunk *chunk = source->outputHead;
+                int remaining = chunk->length - chunk->offset;
+                if (written < remaining) {
+                        chunk->offset += written;
+                        return;
+                }
+
+                written -= remaining;
+                source->outputHead = chunk->next;
+                if (source->outputHead == NULL) {
+                        source->outputTail = NULL;
+                }
+                freeBuffer(theProxy, chunk->data);
+                freeObject(&theProxy->slabs->outputChunks, chunk);
+        }
+}
+
+
+/*
+ * name:      flushOutput
+ * purpose:   writes as much of the data queued by a connection (in its splice 
+ *            pipe or its output queue) to the connection's peer as the peer's 
+ *            socket takes without blocking
+ * arguments: the proxy instance, the socket descriptor of the connection 
+ *            being serviced, the connection whose data is flushed
+ * returns:   true if the connection is still open, false if it was removed
+ * effects:   closes the connection once a pending close has been flushed
+ */
+bool flushOutput(proxy *theProxy, int SD, 
+        connectionInfo *source)
+{
+        DEBUG_PRINT("FUNCTION: flushOutput\n");
+        int writeSD = source->isClient ? source->serverSD : source->clientSD;
+        if (checkNegOneErrSSL(theProxy, SD, writeSD, 10)) return false;
+
+        while (source->pipeBytes > 0) {
+                int writeReturn = splice(source->pipeRead, NULL, writeSD, NULL, 
+                        source->pipeBytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (writeReturn == -1 && errno == EAGAIN) {
+                        break;
+                }
+                if (checkNegErrSSL(theProxy, SD, writeReturn, 7)) return false;
+                source->pipeBytes -= writeReturn;
+        }
+
+        while (source->outputHead != NULL) {
+                int writeReturn = writeOutputData(source, writeSD);
+                if (writeReturn == 0) {
+                        break;
+                }
+                if (checkNegErrSSL(theProxy, SD, writeReturn, 11)) return false;
+                consumeOutputData(theProxy, source, writeReturn);
+        }
+
+        // the connection closed while data was queued, close it now it's sent
+        if (source->closeAfterFlush && 
+                source->pipeBytes == 0 && source->outputBytes == 0) {
+                if (theProxy->connTable[SD]->isClient) {
+                        removeClient(theProxy, SD);
+                }
+                else {
+                        removeServer(theProxy, SD);
+                }
+                return false;
+        }
+
+        setOutputState(theProxy, source);
+        return true;
+}
+
+
+/*
+ * name:      checkPendingClose
+ * purpose:   checks if a connection reached the end of its stream while its 
+ *            data is still queued for the peer. The close is then delayed 
+ *            until the queue is flushed so no data is lost
+ * arguments: the proxy instance, the connection's socket descriptor, the return 
+ *            value of the read
+ * returns:   true if the close was delayed, false otherwise
+ * effects:   stops reading from the connection
+ */
+bool checkPendingClose(proxy *theProxy, int SD, int readReturn)
+{
+        connectionInfo *conn = theProxy->connTable[SD];
+        if (readReturn != 0 || (conn->pipeBytes == 0 && conn->outputBytes == 0)) {
+                return false;
+        }
+
+        conn->closeAfterFlush = true;
+        setOutputState(theProxy, conn);
+        return true;
+}
+
+
+/*
+ * name:      setOutputState
+ * purpose:   updates the event loop after a connection's queued data changed. 
+ *            The peer waits for write readiness while data is queued, and 
+ *            reading from the connection stops once its queue passes the high 
+ *            water mark (or its splice pipe holds data) until it drains again
+ * arguments: the proxy instance, the connection whose queue changed
+ * returns:   none
+ * effects:   none
+ */
+void setOutputState(proxy *theProxy, connectionInfo *source)
+{
+        int pending = source->pipeBytes + source->outputBytes;
+        bool pipeFull = (source->pipeRead != -1) && (pending > 0);
+
+        if (source->closeAfterFlush || pipeFull || pending >= OUTPUT_HIGH_WATER) {
+                source->readPaused = true;
+        }
+        else if (pending <= OUTPUT_LOW_WATER) {
+                source->readPaused = false;
+        }
+        updateEventInterest(theProxy, source);
+
+        connectionInfo *peer = getPeerConnection(theProxy, source);
+        if (peer != NULL) {
+                peer->writeWaiting = (pending > 0);
+                updateEventInterest(theProxy, peer);
+        }
+}
+
+
+/*
+ * name:      updateEventInterest
+ * purpose:   registers a connection's socket for reading unless reading is 
+ *            paused, and for writing while its peer has data queued for it
+ * arguments: the proxy instance, the connection struct
+ * returns:   none
+ * effects:   none
+ */
+void updateEventInterest(proxy *theProxy, connectionInfo *conn)
+{
+        int SD = conn->isClient ? conn->clientSD : conn->serverSD;
+        uint32_t events = 0;
+        if (!conn->readPaused) {
+                events |= EPOLLIN;
+        }
+        if (conn->writeWaiting) {
+                events |= EPOLLOUT;
+        }
+
+        if (SD != -1 && events != conn->eventMask) {
+                modifyEventLoop(theProxy, SD, events);
+                conn->eventMask = events;
+        }
+}
+
+
+/*
+ * name:      freeOutputQueue
+ * purpose:   frees all data still queued on a connection
+ * arguments: the proxy instance, the connection struct
+ * returns:   none
+ * effects:   resets the output queue struct fields
+ */
+void freeOutputQueue(proxy *theProxy, connectionInfo *conn)
+{
+        while (conn->outputHead != NULL) {
+                outputChunk *chunk = conn->outputHead;
+                conn->outputHead = chunk->next;
+                freeBuffer(theProxy, chunk->data);
+                freeObject(&theProxy->slabs->outputChunks, chunk);
+        }
+        conn->outputTail = NULL;
+        conn->outputBytes = 0;
+        conn->readPaused = false;
+        conn->writeWaiting = false;
+        conn->closeAfterFlush = false;
+        conn->eventMask = EPOLLIN;
+}
+
+
+
+
+/*****************************************************************************
+*                           PROCESS CONNECTIONS
+******************************************************************************/
+
+
+/*
+ * name:      processConnection
+ * purpose:   checks the type of connection (client / server) and processes it 
+ *            accordingly
+ * arguments: the proxy instance, the socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void processConnection(proxy *theProxy, int SD)
+{       
+        DEBUG_PRINT("FUNCTION: processConnection\n");
+        if (getServer(theProxy, SD) != NULL) {
+                facilitateCommunication(theProxy, SD);
+        }
+        else {
+                processClient(theProxy, SD);
+        }
+}
+
+
+
+/*
+ * name:      processClient
+ * purpose:   processes a client that is either new or existing
+ * arguments: the proxy instance, the client socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void processClient(proxy *theProxy, int clientSD)
+{       
+        DEBUG_PRINT("FUNCTION: processClient\n");
+        connectionInfo *client = getClient(theProxy, clientSD);
+
+        // the client is new, clients are normally added when accepted
+        if (client == NULL) {
+                addClient(theProxy, clientSD);
+                client = theProxy->connTable[clientSD];
+        }
+
+        if (!client->connActive) {
+                if (processConnectRequest(theProxy, clientSD)) {
+                        setupCommunication(theProxy, clientSD);
+                }
+                return;
+        }
+        facilitateCommunication(theProxy, clientSD);
+}
+
+
+/*
+ * name:      setupCommunication
+ * purpose:   does the communication setup for both the tunnel and MITM mode
+ * arguments: the proxy instance, the connection's socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void setupCommunication(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION: setupCommunication\n");
+        connectionInfo *client = theProxy->connTable[SD];
+        connDetails *details = client->details;
+        stopTimer(theProxy, client->clientSD);
+
+        // the rest of the setup happens once the server connection completes
+        resolveServer(theProxy, SD);
+
+        if (details->msgHeader != NULL) {
+                freeBuffer(theProxy, details->msgHeader);
+                details->msgHeader = NULL;
+        }
+        details->headerSize = -1;
+        details->headerRead = 0;
+}
+
+
+
+/*
+ * name:      facilitateCommunication
+ * purpose:   calls the correct functions to relay information between 
+ *            servers and clients
+ * arguments: the proxy instance, the connection's socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void facilitateCommunication(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION: facilitateCommunication\n");
+        connectionInfo *client = theProxy->connTable[SD];
+        uint32_t events = getCurrentEvents(theProxy);
+        client->lastActivity = theProxy->loopTime;
+
+        if (client->connecting) {
+                finishServerConnect(theProxy, SD);
+                return;
+        }
+        if (client->handshaking) {
+                continueHandshake(theProxy, SD);
+                return;
+        }
+
+        // this socket can take more of the data queued by its peer
+        if (events & EPOLLOUT) {
+                connectionInfo *source = getPeerConnection(theProxy, client);
+                if (source != NULL && !flushOutput(theProxy, SD, source)) {
+                        return;
+                }
+        }
+        if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                return;
+        }
+        if (client->readPaused && !(events & (EPOLLHUP | EPOLLERR))) {
+                return;
+        }
+
+        if (client->mode == TUNNEL && client->pipeRead != -1) {
+                relayTunnelSplice(theProxy, SD);
+        }
+        else if (client->mode == TUNNEL) {
+                if (client->isClient) {
+                        relayClientToServer(theProxy, SD);
+                }
+                else {
+                        relayServerToClient(theProxy, SD);
+                }
+        }
+        else {
+                if (client->isClient) {
+                        relayClientToServerSSL(theProxy, SD);
+                }
+                else {
+                        relayServerToClientSSL(theProxy, SD);
+                }
+        }       
+}
+
+
+
+
+
+/*****************************************************************************
+*                          SERVER CONNECT FUNCTIONS
+******************************************************************************/
+
+
+/*
+ * name:      resolveServer
+ * purpose:   finds the address of the server requested by the client. A 
+ *            pooled connection to the server is used if there is one, IP 
+ *            addresses, hosts file entries and cached names connect right 
+ *            away, other names are looked up by the worker's resolver
+ * arguments: the proxy instance, the connection's socket descriptor
+ * returns:   none
+ * effects:   stops reading from the client until the lookup finishes
+ */
+void resolveServer(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION: resolveServer\n");
+        connectionInfo *client = theProxy->connTable[SD];
+        if (adoptPooledConnection(theProxy, SD)) {
+                return;
+        }
+
+        struct sockaddr_storage addresses[DNS_MAX_ADDRESSES];
+        int numAddresses = 0;
+        if (getLiteralAddress(theProxy->resolver, client->session->serverURL, 
+                addresses, &numAddresses)) {
+                connectToResolvedServer(theProxy, SD, addresses, 
+                        numAddresses);
+                return;
+        }
+
+        int cacheResult = getCachedAddresses(theProxy, 
+                client->session->serverURL, addresses, &numAddresses);
+        if (cacheResult != DNS_CACHE_MISS) {
+                connectToResolvedServer(theProxy, SD, addresses, 
+                        numAddresses);
+                return;
+        }
+
+        if (!startDnsLookup(theProxy, client->session->serverURL, 
+                client->clientSD)) {
+                checkNullErrSSL(theProxy, SD, NULL, 18);
+                return;
+        }
+        client->details->resolving = true;
+
+        // there is nowhere to relay the client's data to yet
+        client->readPaused = true;
+        updateEventInterest(theProxy, client);
+}
+
+
+/*
+ * name:      finishServerLookup
+ * purpose:   starts the connect to the server once the lookup of its name 
+ *            finished
+ * arguments: the proxy instance, the finished lookup
+ * returns:   none
+ * effects:   removes the client if the name couldn't be resolved
+ */
+void finishServerLookup(proxy *theProxy, dnsLookup *lookup)
+{
+        DEBUG_PRINT("FUNCTION: finishServerLookup\n");
+        connectionInfo *client = getClient(theProxy, lookup->clientSD);
+        if (client == NULL || !client->details->resolving) {
+                return;
+        }
+        client->details->resolving = false;
+
+        connectToResolvedServer(theProxy, lookup->clientSD, lookup->addresses, 
+                lookup->numAddresses);
+}
+
+
+/*
+ * name:      connectToResolvedServer
+ * purpose:   starts connecting to the addresses the server's name resolved 
+ *            to. The connects race each other in the style of Happy Eyeballs 
+ *            (RFC 8305): a new address is tried whenever the previous 
+ *            attempt failed or hasn't finished after a short delay, and the 
+ *            first attempt to connect is used
+ * arguments: the proxy instance, the connection's socket descriptor, the 
+ *            resolved addresses and how many there are
+ * returns:   none
+ * effects:   removes the client if no address can be connected to
+ */
+void connectToResolvedServer(proxy *theProxy, int SD, 
+        struct sockaddr_storage *addresses, int numAddresses)
+{
+        DEBUG_PRINT("FUNCTION: connectToResolvedServer\n");
+        connectionInfo *client = theProxy->connTable[SD];
+
+        connectRace *race = allocObject(&theProxy->slabs->connectRaces);
+        orderConnectAddresses(race, addresses, numAddresses, 
+                client->session->serverPort);
+        race->numAttempts = 0;
+        client->details->race = race;
+
+        // there is nowhere to relay the client's data to yet
+        client->readPaused = true;
+        updateEventInterest(theProxy, client);
+
+        if (!startNextAttempt(theProxy, SD)) {
+                ERROR_PRINT("Failed to connect to %s\n", 
+                        client->session->serverURL);
+                removeClient(theProxy, SD);
+        }
+}
+
+
+/*
+ * name:      orderConnectAddresses
+ * purpose:   sorts the addresses in the order they are tried, alternating 
+ *            between IPv6 and IPv4 starting with IPv6, so a broken path for 
+ *            one family only delays the connect by one attempt
+ * arguments: the race to populate, the resolved addresses, how many there 
+ *            are, the server port
+ * returns:   none
+ * effects:   sets the port of the ordered addresses
+ */
+void orderConnectAddresses(connectRace *race, 
+        struct sockaddr_storage *addresses, int numAddresses, int port)
+{
+        int next6 = 0, next4 = 0;
+        bool takeIPv6 = true;
+        race->numAddresses = 0;
+        race->nextAddress = 0;
+
+        while (race->numAddresses < numAddresses) {
+                // find the next address of the family whose turn it is
+                int *next = takeIPv6 ? &next6 : &next4;
+                int family = takeIPv6 ? AF_INET6 : AF_INET;
+                while (*next < numAddresses && 
+                        addresses[*next].ss_family != family) {
+                        (*next)++;
+                }
+                takeIPv6 = !takeIPv6;
+                if (*next == numAddresses) {
+                        // only the other family has addresses left
+                        if (next6 == numAddresses && next4 == numAddresses) {
+                                break;
+                        }
+                        continue;
+                }
+
+                struct sockaddr_storage *address = 
+                        &race->addresses[race->numAddresses];
+                *address = addresses[*next];
+                if (family == AF_INET6) {
+                        ((struct sockaddr_in6 *)address)->sin6_port = htons(port);
+                }
+                else {
+                        ((struct sockaddr_in *)address)->sin_port = htons(port);
+                }
+                race->numAddresses++;
+                (*next)++;
+        }
+}
+
+
+/*
+ * name:      startNextAttempt
+ * purpose:   starts a connect to the next address of the client's race, 
+ *            skipping addresses whose connect fails right away
+ * arguments: the proxy instance, the client's socket descriptor
+ * returns:   true if a connect was started, false if no address is left
+ * effects:   none
+ */
+bool startNextAttempt(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION: startNextAttempt\n");
+        connectRace *race = theProxy->connTable[SD]->details->race;
+
+        while (race->nextAddress < race->numAddresses) {
+                struct sockaddr_storage *address = 
+                        &race->addresses[race->nextAddress];
+                race->nextAddress++;
+                if (startServerConnect(theProxy, SD, address)) {
+                        return true;
+                }
+        }
+        return false;
 }
 
 
 /*
- * name:      proxyListening
- * purpose:   listens for incoming clients and processes their requests either 
- *            by sending them to the corresponding server or by getting the 
- *            response from the cache
- * arguments: the proxy instance
- * returns:   none
- * effects:   none
+ * name:      startServerConnect
+ * purpose:   starts a non-blocking connect to one address of the server 
+ *            requested by the client. The server struct is added right away 
+ *            and the socket waits for write readiness, which signals the 
+ *            connect finished
+ * arguments: the proxy instance, the connection's socket descriptor, the 
+ *            address of the server
+ * returns:   true if the connect was started, false otherwise
+ * effects:   adds the socket to the client's race
  */
-void proxyListening(proxy *theProxy)
+bool startServerConnect(proxy *theProxy, int SD, 
+        struct sockaddr_storage *serverAddress)
 {
-        DEBUG_PRINT("FUNCTION: proxyListening\n");
-        //setup the server socket
-        createSocket(theProxy);
+        DEBUG_PRINT("FUNCTION: startServerConnect\n");
+        connectionInfo *client = theProxy->connTable[SD];
+        connectRace *race = client->details->race;
+
+        int serverSD = socket(serverAddress->ss_family, SOCK_STREAM | 
+                SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (serverSD == -1) {
+                ERROR_PRINT("Failed to create server socket: %s\n", 
+                        strerror(errno));
+                return false;
+        }
 
-        //listen for incoming connections
-        int returnVal = listen(theProxy->listenSD, 500);
-        checkFatalNegOne(returnVal);
+        //ensure to close the socket and port after termination
+        int opt = 1;
+        setsockopt(serverSD, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        socklen_t addressLength = (serverAddress->ss_family == AF_INET6) ? 
+                sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+        int returnVal = connect(serverSD, (struct sockaddr *)serverAddress, 
+                addressLength);
+        if (returnVal == -1 && errno != EINPROGRESS) {
+                ERROR_PRINT("Failed to connect to %s: %s\n", 
+                        client->session->serverURL, strerror(errno));
+                close(serverSD);
+                return false;
+        }
 
-        // set timeout value for select call
-        struct timeval timing;
-        timing.tv_sec = 10;
-        timing.tv_usec = 0;
-        
-        struct sockaddr_in clientAddress;
-        socklen_t clientAddressLength;
-        FD_ZERO(&theProxy->activeFDSet);
-        FD_ZERO(&theProxy->readFDSet);
-        FD_SET(theProxy->listenSD, &theProxy->activeFDSet);   
-        theProxy->maxFD = theProxy->listenSD;    
+        // the connect is done when the socket becomes writable
+        addToEventLoop(theProxy, serverSD, EPOLLOUT);
+        connectionInfo *server = populateServerStruct(theProxy, serverSD, client);
+        server->eventMask = EPOLLOUT;
+        server->connecting = true;
 
-        while (true) {
-                selectConnections(theProxy, clientAddress);
+        int timeout = CONNECT_TIMEOUT;
+        if (theProxy->options != NULL) {
+                timeout = theProxy->options->connectTimeout;
         }
-        close(theProxy->listenSD);
+        unsigned long long now = getCurrTime(theProxy->theCache);
+        server->details->connectDeadline = now + timeout * 1000000000ULL;
+        unsigned long long nextCheck = server->details->connectDeadline;
+        if (race->nextAddress < race->numAddresses) {
+                server->details->nextAttemptTime = now + CONNECT_ATTEMPT_DELAY;
+                nextCheck = server->details->nextAttemptTime;
+        }
+        startTimer(theProxy, serverSD, TIMER_CONNECT, nextCheck - now);
+
+        race->attemptSDs[race->numAttempts] = serverSD;
+        race->numAttempts++;
+        return true;
 }
 
 
 /*
- * name:      selectConnections
- * purpose:   get client requests using the select calls
- * arguments: the proxy instance, the clientAddress, the maximum FD
+ * name:      finishServerConnect
+ * purpose:   checks the result of a non-blocking connect once the server 
+ *            socket is ready. The first attempt to connect wins the race, 
+ *            the other attempts are closed and the setup of the connection 
+ *            continues
+ * arguments: the proxy instance, the server's socket descriptor
  * returns:   none
- * effects:   none
+ * effects:   removes the client if the last attempt failed
  */
-void selectConnections(proxy *theProxy, struct sockaddr_in clientAddress)
+void finishServerConnect(proxy *theProxy, int SD)
 {
-        DEBUG_PRINT("FUNCTION: selectConnections\n");
-        theProxy->readFDSet = theProxy->activeFDSet;
-        int returnVal = select(theProxy->maxFD + 1, &theProxy->readFDSet, NULL, 
-                        NULL, NULL);
-        if (returnVal == 0 || returnVal == -1) {
+        DEBUG_PRINT("FUNCTION: finishServerConnect\n");
+        connectionInfo *server = theProxy->connTable[SD];
+
+        int socketError = 0;
+        socklen_t errorLength = sizeof(socketError);
+        getsockopt(server->serverSD, SOL_SOCKET, SO_ERROR, &socketError, 
+                &errorLength);
+        if (socketError != 0) {
+                ERROR_PRINT("Failed to connect to %s: %s\n", 
+                        server->session->serverURL, strerror(socketError));
+                failServerConnect(theProxy, SD);
                 return;
         }
 
-        if (FD_ISSET(theProxy->listenSD, &theProxy->readFDSet)) {
-                socklen_t clientAddressLength = sizeof(clientAddress);
-                int clientSD = accept(theProxy->listenSD, 
-                        (struct sockaddr *)&clientAddress, 
-                        &clientAddressLength);
-                if (clientSD == -1) {
-                        return;
-                }
-                FD_SET(clientSD, &theProxy->activeFDSet);
-                if (clientSD > theProxy->maxFD) {
-                        theProxy->maxFD = clientSD;
-                }
+        connectionInfo *client = getRacingClient(theProxy, server);
+        if (client == NULL) {
+                abandonServerConnect(theProxy, NULL, server->serverSD);
                 return;
         }
-        for (int i = 0; i <= theProxy->maxFD; i++) {
-                if (FD_ISSET(i, &theProxy->readFDSet)) {
-                        processConnection(theProxy, i);
-                        return;
+
+        int serverSD = server->serverSD;
+        server->connecting = false;
+        server->details->nextAttemptTime = 0;
+        stopTimer(theProxy, serverSD);
+        updateEventInterest(theProxy, server);
+
+        // the other attempts lost the race
+        connectRace *race = client->details->race;
+        for (int i = race->numAttempts - 1; i >= 0; i--) {
+                if (race->attemptSDs[i] != serverSD) {
+                        abandonServerConnect(theProxy, race, race->attemptSDs[i]);
                 }
         }
+        freeObject(&theProxy->slabs->connectRaces, race);
+        client->details->race = NULL;
+        client->serverSD = serverSD;
+        client->session->server = server;
+
+        client->readPaused = false;
+        updateEventInterest(theProxy, client);
+        completeCommunication(theProxy, client->clientSD);
 }
 
 
+/*
+ * name:      failServerConnect
+ * purpose:   drops an attempt whose connect failed or timed out and moves on 
+ *            to the next address of the race
+ * arguments: the proxy instance, the server's socket descriptor
+ * returns:   none
+ * effects:   removes the client if no attempt is left
+ */
+void failServerConnect(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION: failServerConnect\n");
+        connectionInfo *server = theProxy->connTable[SD];
 
+        connectionInfo *client = getRacingClient(theProxy, server);
+        if (client == NULL) {
+                abandonServerConnect(theProxy, NULL, server->serverSD);
+                return;
+        }
 
-/*****************************************************************************
-*                           PROCESS CONNECTIONS
-******************************************************************************/
+        abandonServerConnect(theProxy, client->details->race, server->serverSD);
+        if (!startNextAttempt(theProxy, client->clientSD) && 
+                client->details->race->numAttempts == 0) {
+                ERROR_PRINT("Failed to connect to %s\n", 
+                        client->session->serverURL);
+                removeClient(theProxy, client->clientSD);
+        }
+}
 
 
 /*
- * name:      processConnection
- * purpose:   checks the type of connection (client / server) and processes it 
- *            accordingly
- * arguments: the proxy instance, the socket descriptor
- * returns:   none
+ * name:      getRacingClient
+ * purpose:   finds the client a connect attempt belongs to
+ * arguments: the proxy instance, the server struct of the attempt
+ * returns:   the client struct, or NULL if the client is no longer waiting 
+ *            on the attempt
  * effects:   none
  */
-void processConnection(proxy *theProxy, int SD)
-{       
-        DEBUG_PRINT("FUNCTION: processConnection\n");
-        int index = -1;
-        int slot = hashTableKey(theProxy, SD);
-
-        if (getServerAtSlot(theProxy, slot, &index, SD)) {
-                facilitateCommunication(theProxy, slot, index);
+connectionInfo *getRacingClient(proxy *theProxy, connectionInfo *server)
+{
+        connectionInfo *client = server->session->client;
+        if (client == NULL || client->details->race == NULL) {
+                return NULL;
         }
-        else {
-                checkTableExpansion(theProxy);
-                processClient(theProxy, slot, SD);
+        for (int i = 0; i < client->details->race->numAttempts; i++) {
+                if (client->details->race->attemptSDs[i] == server->serverSD) {
+                        return client;
+                }
         }
+        return NULL;
 }
 
 
-
 /*
- * name:      processClient
- * purpose:   processes a client that is either new or existing
- * arguments: the proxy instance, slot in the table of the client, the socket 
- *            descriptor
+ * name:      abandonServerConnect
+ * purpose:   closes a connect attempt and frees its server struct without 
+ *            touching the client, which may still have other attempts
+ * arguments: the proxy instance, the race the attempt belongs to or NULL, 
+ *            the server socket descriptor
  * returns:   none
  * effects:   none
  */
-void processClient(proxy *theProxy, int slot, int clientSD)
-{       
-        DEBUG_PRINT("FUNCTION: processClient\n");
-        int index = -1;
-        bool existClient = getClientAtSlot(theProxy, slot, &index, clientSD);
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
-
-        // the client is new, set SD, increment numClients and slotItems
-        if (!existClient) {
-                client->clientSD = clientSD;
-                client->isClient = true;
-                theProxy->numClients++;
-                theProxy->clientTable[slot].numSlotItems++;
-                if (processConnectRequest(theProxy, slot, index)) {
-                        setupCommunication(theProxy, slot, index);
-                }
-        }
-        else {
-                if (!client->connActive) {
-                        if (processConnectRequest(theProxy, slot, index)) {
-                                setupCommunication(theProxy, slot, index);
+void abandonServerConnect(proxy *theProxy, connectRace *race, int serverSD)
+{
+        DEBUG_PRINT("FUNCTION: abandonServerConnect: %d\n", serverSD);
+        if (race != NULL) {
+                for (int i = 0; i < race->numAttempts; i++) {
+                        if (race->attemptSDs[i] == serverSD) {
+                                race->numAttempts--;
+                                race->attemptSDs[i] = 
+                                        race->attemptSDs[race->numAttempts];
+                                break;
                         }
-                        return;
                 }
-                facilitateCommunication(theProxy, slot, index);
         }
+
+        stopTimer(theProxy, serverSD);
+        if (getServer(theProxy, serverSD) != NULL) {
+                freeTableSlot(theProxy, serverSD);
+        }
+        removeFromEventLoop(theProxy, serverSD);
+        close(serverSD);
 }
 
 
 /*
- * name:      setupCommunication
- * purpose:   does the communication setup for both the tunnel and MITM mode
- * arguments: the proxy instance, the slot and index in the table
+ * name:      cancelConnectRace
+ * purpose:   closes the connect attempts of a client that is being removed
+ * arguments: the proxy instance, the client struct
+ * returns:   none
+ * effects:   frees the client's race
+ */
+void cancelConnectRace(proxy *theProxy, connectionInfo *client)
+{
+        connectRace *race = client->details->race;
+        client->details->race = NULL;
+        while (race->numAttempts > 0) {
+                abandonServerConnect(theProxy, race, race->attemptSDs[0]);
+        }
+        freeObject(&theProxy->slabs->connectRaces, race);
+}
+
+
+/*
+ * name:      completeCommunication
+ * purpose:   tells the client its connect request succeeded and sets up the 
+ *            tunnel or MITM relaying now that the server is connected
+ * arguments: the proxy instance, the client's socket descriptor
  * returns:   none
  * effects:   none
  */
-void setupCommunication(proxy *theProxy, int slot, int index)
+void completeCommunication(proxy *theProxy, int SD)
 {
-        DEBUG_PRINT("FUNCTION: setupCommunication\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        DEBUG_PRINT("FUNCTION: completeCommunication\n");
+        connectionInfo *client = theProxy->connTable[SD];
 
-        if (!sendConnEstablished(theProxy, slot, index)) {
+        if (!sendConnEstablished(theProxy, SD)) {
                 return;
         }
+
         if (client->mode == TUNNEL) {
-                setupTunnelToServer(theProxy, slot, index);
+                startTimer(theProxy, client->clientSD, TIMER_IDLE, 
+                        getIdleTimeout(theProxy));
+                setupTunnelToServer(theProxy, SD);
         }
         else {
-                if (setupServerCertificate(theProxy, slot, index)
-                && sendCertificateToClient(theProxy, slot, index)
-                && connectToServer(theProxy, slot, index)) {
-                        connectServerSSL(theProxy, slot, index);
-                }
-        }
-
-        if (client->msgHeader != NULL) {
-                free(client->msgHeader);
-                client->msgHeader = NULL;
+                startClientHandshake(theProxy, SD);
         }
-        client->headerSize = -1;
-        client->headerRead = 0;
 }
 
 
-
 /*
- * name:      facilitateCommunication
- * purpose:   calls the correct functions to relay information between 
- *            servers and clients
- * arguments: the proxy instance, the slot and index in the table
+ * name:      expireServerConnect
+ * purpose:   handles the timer of a connect attempt. The attempt fails if it 
+ *            didn't finish before the connect timeout, and the next address 
+ *            of the race is tried alongside it if it is taking too long
+ * arguments: the proxy instance, the server socket descriptor
  * returns:   none
- * effects:   none
+ * effects:   restarts the timer of an attempt that is still connecting
  */
-void facilitateCommunication(proxy *theProxy, int slot, int index)
+void expireServerConnect(proxy *theProxy, int serverSD)
 {
-        DEBUG_PRINT("FUNCTION: facilitateCommunication\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
-        if (client->mode == TUNNEL) {
-                if (client->isClient) {
-                        relayClientToServer(theProxy, slot, index);
-                }
-                else {
-                        relayServerToClient(theProxy, slot, index);
-                }
+        DEBUG_PRINT("FUNCTION: expireServerConnect: %d\n", serverSD);
+        connectionInfo *server = getServer(theProxy, serverSD);
+        if (server == NULL || !server->connecting) {
+                return;
         }
-        else {
-                if (client->isClient) {
-                        relayClientToServerSSL(theProxy, slot, index);
-                }
-                else {
-                        relayServerToClientSSL(theProxy, slot, index);
+        connDetails *details = server->details;
+
+        unsigned long long now = theProxy->loopTime;
+        if (details->connectDeadline <= now) {
+                ERROR_PRINT("Connect to %s timed out\n", 
+                        server->session->serverURL);
+                failServerConnect(theProxy, serverSD);
+                return;
+        }
+
+        // the attempt is slow, so race it against the next address
+        if (details->nextAttemptTime != 0 && details->nextAttemptTime <= now) {
+                details->nextAttemptTime = 0;
+                connectionInfo *client = getRacingClient(theProxy, server);
+                if (client != NULL) {
+                        startNextAttempt(theProxy, client->clientSD);
                 }
-        }       
-}
+        }
 
+        unsigned long long nextCheck = details->connectDeadline;
+        if (details->nextAttemptTime != 0 && 
+                details->nextAttemptTime < nextCheck) {
+                nextCheck = details->nextAttemptTime;
+        }
+        startTimer(theProxy, serverSD, TIMER_CONNECT, nextCheck - now);
+}
 
 
 
@@ -331,36 +1355,41 @@ void facilitateCommunication(proxy *theProxy, int slot, int index)
 /*
  * name:      processConnectRequest
  * purpose:   processes the connect request and checks if it has fully arrived
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
  * effects:   none
  */
-bool processConnectRequest(proxy *theProxy, int slot, int index)
+bool processConnectRequest(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: processConnectRequest\n");
         // either read the new connect request, or rest of the previous one
-        if (!readConnectRequest(theProxy, slot, index)) {
-                removeClient(theProxy, slot, index);
+        if (!readConnectRequest(theProxy, SD)) {
+                removeClient(theProxy, SD);
                 return false;
         }
 
-        // check if the connect request is complete
-        if (!checkFullConnectHeader(theProxy, slot, index)) {
-                removeClient(theProxy, slot, index);
+        // wait for the rest of the connect request, the client's header 
+        // timer removes it if the rest never arrives
+        if (!checkFullConnectHeader(theProxy, SD)) {
+                connectionInfo *client = 
+                        theProxy->connTable[SD];
+                if (client->details->headerRead > CONNECT_HEADER_MAX) {
+                        removeClient(theProxy, SD);
+                }
                 return false;
         }
 
         // check if the connect field is valid, otherwise close the connection
-        if (!checkConnectField(theProxy, slot, index)) {
-                if (checkHintRegeneration(theProxy, slot, index)) {
-                        sendNewlyGeneratedHints(theProxy, slot, index);
+        if (!checkConnectField(theProxy, SD)) {
+                if (checkHintRegeneration(theProxy, SD)) {
+                        sendNewlyGeneratedHints(theProxy, SD);
                         return false;
                 }
-                removeClient(theProxy, slot, index);
+                removeClient(theProxy, SD);
                 return false;
         }
-        parseConnectHeader(theProxy, slot, index);
-        // setConnectionMode(theProxy, slot, index);
+        parseConnectHeader(theProxy, SD);
+        // setConnectionMode(theProxy, SD);
 
         return true;
 }
@@ -369,42 +1398,44 @@ bool processConnectRequest(proxy *theProxy, int slot, int index)
 /*
  * name:      readConnectRequest
  * purpose:   performs a read call to get the connect request header
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
  * effects:   none
  */
-bool readConnectRequest(proxy *theProxy, int slot, int index)
+bool readConnectRequest(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: readConnectRequest\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
+        connDetails *details = client->details;
         int bufferSize = 2048;
-        char *readBuffer = malloc(bufferSize + 1);
+        char *readBuffer = allocBuffer(theProxy, bufferSize + 1);
         checkFatalNull(readBuffer);
 
         int returnVal = read(client->clientSD, readBuffer, bufferSize);
         if (returnVal == 0 || returnVal == -1) {
-                free(readBuffer);
+                freeBuffer(theProxy, readBuffer);
                 return false;
         }
         readBuffer[returnVal] = '\0';
 
         // allocate memory for the msgHeader
-        char *connectHeader = malloc(returnVal + client->headerRead + 1);
+        char *connectHeader = allocBuffer(theProxy, 
+                returnVal + details->headerRead + 1);
         checkFatalNull(connectHeader);
 
         // copy whatever was previously read
-        if ((client->headerRead > 0) && (client->msgHeader != NULL)) {
-                memcpy(connectHeader, client->msgHeader, client->headerRead);
-                free(client->msgHeader);
+        if ((details->headerRead > 0) && (details->msgHeader != NULL)) {
+                memcpy(connectHeader, details->msgHeader, details->headerRead);
+                freeBuffer(theProxy, details->msgHeader);
         }
         
         // copy the new data to the connectHeader
-        memcpy(connectHeader + client->headerRead, readBuffer, returnVal);
+        memcpy(connectHeader + details->headerRead, readBuffer, returnVal);
 
-        client->msgHeader = connectHeader;
-        client->headerRead += returnVal;
-        client->msgHeader[client->headerRead] = '\0';
-        free(readBuffer);
+        details->msgHeader = connectHeader;
+        details->headerRead += returnVal;
+        details->msgHeader[details->headerRead] = '\0';
+        freeBuffer(theProxy, readBuffer);
         return true;
 }
 
@@ -413,21 +1444,21 @@ bool readConnectRequest(proxy *theProxy, int slot, int index)
  * name:      sendConnEstablished
  * purpose:   sends a connection established message to the client indicating 
  *            that the connection request was received
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
  * effects:   none
  */
-bool sendConnEstablished(proxy *theProxy, int slot, int index) 
+bool sendConnEstablished(proxy *theProxy, int SD) 
 {
         DEBUG_PRINT("FUNCTION: sendConnEstablished\n");
         char *response = "HTTP/1.1 200 Connection Established\r\n\r\n"; 
 
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
         int clientSD = client->clientSD; 
 
         int returnVal = write(clientSD, response, strlen(response));
         if (returnVal == 0 || returnVal == -1) {
-                removeClient(theProxy, slot, index);
+                removeClient(theProxy, SD);
                 return false;
         }
 
@@ -444,23 +1475,25 @@ bool sendConnEstablished(proxy *theProxy, int slot, int index)
 /*
  * name:      parseConnectHeader
  * purpose:   process the connect header to find the host and port number
- * arguments: the proxy, the client table bucket, the bucket index
+ * arguments: the proxy, the client's socket descriptor
  * returns:   none
  * effects:   none
  */
-void parseConnectHeader(proxy *theProxy, int slot, int index)
+void parseConnectHeader(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: parseConnectHeader\n");
-        int messageLength = theProxy->clientTable[slot].slotArray[index].headerSize;
-        char *clientRequest = theProxy->clientTable[slot].slotArray[index].msgHeader;
-        char *currentLine;
+        int messageLength = theProxy->connTable[SD]->details->headerSize;
+        char *clientRequest = theProxy->connTable[SD]->details->msgHeader;
         char *hostLine = NULL;
         char *connectLine = NULL;
 
+        // a line is never longer than the data read for the header
+        char *currentLine = allocBuffer(theProxy, 
+                theProxy->connTable[SD]->details->headerRead + 1);
+        checkFatalNull(currentLine);
+
         int totalRead = 0;
         while (totalRead < messageLength) {
-                currentLine = malloc(500);
-                checkFatalNull(currentLine);
                 totalRead = readLine(clientRequest, currentLine, totalRead);
                 
                 if (connectLine == NULL) {
@@ -468,18 +1501,19 @@ void parseConnectHeader(proxy *theProxy, int slot, int index)
                 }
                 hostLine = getHostLine(theProxy, currentLine);
                 if (hostLine != NULL) {
-                        free(currentLine);
                         break;
                 }
-                free(currentLine);
         }
+        freeBuffer(theProxy, currentLine);
 
-        theProxy->clientTable[slot].slotArray[index].serverURL = 
+        theProxy->connTable[SD]->session->serverURL = 
                 getHostURL(theProxy, hostLine);
 
         //extract the server port
         int serverPort = getServerPort(theProxy, hostLine, connectLine);
-        theProxy->clientTable[slot].slotArray[index].serverPort = serverPort;
+        theProxy->connTable[SD]->session->serverPort = serverPort;
+        free(hostLine);
+        free(connectLine);
 }
 
 
@@ -586,7 +1620,7 @@ char *getHostLine(proxy *theProxy, char *currentLine)
 char *getHostURL(proxy *theProxy, char *hostMsg)
 {
         DEBUG_PRINT("FUNCTION: getHostURL\n");
-        char *URL = malloc(150);
+        char *URL = allocBuffer(theProxy, 150);
         checkFatalNull(URL);
         int ogLineCtr = 6;
         int URLctr = 0;
@@ -687,14 +1721,14 @@ int getPortFromLine(proxy *theProxy, char *currLine)
 /*
  * name:      checkIfConnect
  * purpose:   checks the first line of the client request is a CONNECT request
- * arguments: the proxy instance, the slot in the list of the client
+ * arguments: the proxy instance, the client's socket descriptor
  * returns:   true if the message contains a connect request, false if not
  * effects:   none
  */
-bool checkConnectField(proxy *theProxy, int slot, int index) 
+bool checkConnectField(proxy *theProxy, int SD) 
 {
         DEBUG_PRINT("FUNCTION: checkConnectField\n");
-        if ((strncmp(theProxy->clientTable[slot].slotArray[index].msgHeader, 
+        if ((strncmp(theProxy->connTable[SD]->details->msgHeader, 
                 "CONNECT", 7)) == 0) {
                 return true;
         }
@@ -705,18 +1739,19 @@ bool checkConnectField(proxy *theProxy, int slot, int index)
 /*
  * name:      checkFullConnectHeader
  * purpose:   checks if the full CONNECT header was received
- * arguments: the proxy instance, the table bucket, the bucket index
+ * arguments: the proxy instance, the client's socket descriptor
  * returns:   true if the full header was received, false if not
  * effects:   none
  */
-bool checkFullConnectHeader(proxy *theProxy, int slot, int index)
+bool checkFullConnectHeader(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: checkFullConnectHeader\n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
+        connDetails *details = client->details;
 
         //check if we have found end of header delimiter, if so client is active
         char *endOfReq = "\r\n\r\n";
-        char *header = client->msgHeader;
+        char *header = details->msgHeader;
         char *endStr = strstr(header, endOfReq);
         
         // request is not complete, so we can't do anything yet
@@ -725,9 +1760,9 @@ bool checkFullConnectHeader(proxy *theProxy, int slot, int index)
         }
 
         // the request is complete, so the client is active and we can continue
-        client->headerSize = endStr - header + 4;
+        details->headerSize = endStr - header + 4;
         client->connActive = true;
-        client->msgHeader[client->headerSize] = '\0';
+        details->msgHeader[details->headerSize] = '\0';
         return true;
 }
 
@@ -770,99 +1805,191 @@ void checkFatalNull(void *object)
 
 
 /******************************************************************************
-*                       HASHING / EXPANDING FUNCTIONS
+*                         CONNECTION TABLE FUNCTIONS
 ******************************************************************************/
 
+
+/*
+ * name:      addConnection
+ * purpose:   gets the table entry of a new connection. The table is indexed 
+ *            by socket descriptor and grows when a descriptor is larger than 
+ *            any seen before, the struct of a descriptor is kept once it is 
+ *            carved from the connection slab, together with its details 
+ *            from the details slab, and reused by the next connection on 
+ *            that descriptor
+ * arguments: the proxy instance, the socket descriptor
+ * returns:   the connection struct, with every field reset
+ * effects:   increments numClients
+ */
+connectionInfo *addConnection(proxy *theProxy, int SD)
+{
+        if (SD >= theProxy->maxConnections) {
+                int newSize = theProxy->maxConnections;
+                while (newSize <= SD) {
+                        newSize *= 2;
+                }
+
+                theProxy->connTable = realloc(theProxy->connTable, 
+                        newSize * sizeof(connectionInfo *));
+                checkFatalNull(theProxy->connTable);
+                memset(theProxy->connTable + theProxy->maxConnections, 0, 
+                        (newSize - theProxy->maxConnections) * 
+                        sizeof(connectionInfo *));
+                theProxy->maxConnections = newSize;
+        }
+
+        if (theProxy->connTable[SD] == NULL) {
+                theProxy->connTable[SD] = 
+                        allocObject(&theProxy->slabs->connections);
+                theProxy->connTable[SD]->details = 
+                        allocObject(&theProxy->slabs->details);
+        }
+        initializeConnection(theProxy->connTable[SD]);
+        theProxy->connTable[SD]->mode = theProxy->proxyMode;
+        theProxy->connTable[SD]->lastActivity = theProxy->loopTime;
+        theProxy->numClients++;
+
+        return theProxy->connTable[SD];
+}
+
+
 /*
- * name:      hash
- * purpose:   hashes the key of an item
- * arguments: cache instance, the key to hash
- * returns:   the hash of the item key
+ * name:      getConnection
+ * purpose:   finds the connection using a socket descriptor
+ * arguments: the proxy instance, the socket descriptor
+ * returns:   the connection struct, or NULL if the descriptor has none
  * effects:   none
  */
-unsigned int hashTableKey(proxy *theProxy, int hashKey)
+connectionInfo *getConnection(proxy *theProxy, int SD)
 {
-        unsigned int hash_output;
-        MurmurHash3_x86_32(&hashKey, sizeof(hashKey), 42, &hash_output);
-        return hash_output % theProxy->tableSize;
+        if (SD < 0 || SD >= theProxy->maxConnections || 
+                theProxy->connTable[SD] == NULL) {
+                return NULL;
+        }
+
+        connectionInfo *conn = theProxy->connTable[SD];
+        int connSD = conn->isClient ? conn->clientSD : conn->serverSD;
+        return (connSD == SD) ? conn : NULL;
 }
 
 
 /*
- * name:      checkTableExpansion
- * purpose:   checks the load factor of the table to see if expansion is 
- *            necessary but doesn't expand if the table size is already 3000
- * arguments: cache instance
- * returns:   true if the table was expanded, false if no expansion is possible
+ * name:      getClient
+ * purpose:   finds the client using its socket descriptor
+ * arguments: the proxy instance, the client socket descriptor
+ * returns:   the client struct, or NULL if the descriptor isn't a client's
  * effects:   none
  */
-bool checkTableExpansion(proxy *theProxy)
-{       
-        if (theProxy->tableSize >= 3000) {
-                return false;
+connectionInfo *getClient(proxy *theProxy, int clientSD)
+{
+        connectionInfo *client = getConnection(theProxy, clientSD);
+        if (client == NULL || !client->isClient) {
+                return NULL;
         }
+        return client;
+}
 
-        double loadFactor = (double)theProxy->numClients / 
-                (double)theProxy->tableSize;
 
-        if (loadFactor >= 0.75) {
-                expandTable(theProxy);
+/*
+ * name:      getServer
+ * purpose:   finds the server using its socket descriptor
+ * arguments: the proxy instance, the server socket descriptor
+ * returns:   the server struct, or NULL if the descriptor isn't a server's
+ * effects:   none
+ */
+connectionInfo *getServer(proxy *theProxy, int serverSD)
+{
+        connectionInfo *server = getConnection(theProxy, serverSD);
+        if (server == NULL || server->isClient) {
+                return NULL;
         }
+        return server;
+}
 
-        return true;
+
+
+
+/******************************************************************************
+*                             SESSION FUNCTIONS
+******************************************************************************/
+
+
+/*
+ * name:      newSession
+ * purpose:   creates the session of a new client, which its server joins 
+ *            once the connection to the server is started
+ * arguments: the proxy instance, the client struct
+ * returns:   the session
+ * effects:   the client holds the first reference to the session
+ */
+connSession *newSession(proxy *theProxy, connectionInfo *client)
+{
+        connSession *session = allocObject(&theProxy->slabs->sessions);
+
+        session->refCount = 1;
+        session->client = client;
+        session->server = NULL;
+
+        session->serverURL = NULL;
+        session->serverPort = -1;
+
+        session->clientSSL = NULL;
+
+        session->serverCtx = NULL;
+        session->serverSSL = NULL;
+
+        client->session = session;
+        return session;
 }
 
 
 /*
- * name:      expandTable
- * purpose:   doubles the hash table if the loadfactor of 0.75 was exceeded
- * arguments: cache instance
+ * name:      joinSession
+ * purpose:   adds a server connection to the session of its client, the 
+ *            server then shares the host and SSL objects of the client 
+ *            instead of copying them
+ * arguments: the server struct, the session
  * returns:   none
- * effects:   none
+ * effects:   takes a reference to the session
  */
-void expandTable(proxy *theProxy)
-{
-        DEBUG_PRINT("FUNCTION: expandTable\n");
-        int oldSize = theProxy->tableSize;
-        int newSize = (oldSize * 2) + 2;
-        tableSlot *newTable = (tableSlot *)malloc(newSize * sizeof(tableSlot));
-        checkFatalNull(newTable);
-
-        for (int i = 0; i < newSize; i++) {
-                newTable[i].numSlotItems = 0;
-                newTable[i].slotArray = 
-                        (connectionInfo *)malloc(10 * sizeof(connectionInfo));
-                checkFatalNull(newTable[i].slotArray);
-                initializeBucketSlots(newTable, i, theProxy->proxyMode);
-        }
-        theProxy->tableSize = newSize;
-
-        // copy over all elements from the old table to the new table
-        // each element is rehashed before being copied
-        for (int i = 0; i < oldSize; i++) {
-                for (int j = 0; j < theProxy->clientTable[i].numSlotItems; j++) {
-                        int slot = -1;
-                        if (theProxy->clientTable[i].slotArray[j].isClient) {
-                                slot = hashTableKey(theProxy, 
-                                theProxy->clientTable[i].slotArray[j].clientSD);
-                        }
-                        else {
-                                slot = hashTableKey(theProxy, 
-                                theProxy->clientTable[i].slotArray[j].serverSD);
-                        }
-                        int items = newTable[slot].numSlotItems;
-                        newTable[slot].slotArray[items] = 
-                                theProxy->clientTable[i].slotArray[j];
-                        newTable[slot].numSlotItems++;
-                }
+void joinSession(connectionInfo *server, connSession *session)
+{
+        session->refCount++;
+        server->session = session;
+}
+
+
+/*
+ * name:      releaseSession
+ * purpose:   drops a connection's reference to its session, the last 
+ *            reference frees the state the client and server shared
+ * arguments: the proxy instance, the connection struct
+ * returns:   none
+ * effects:   unlinks the connection from the session
+ */
+void releaseSession(proxy *theProxy, connectionInfo *conn)
+{
+        connSession *session = conn->session;
+        if (session == NULL) {
+                return;
+        }
+
+        conn->session = NULL;
+        if (session->client == conn) {
+                session->client = NULL;
+        }
+        if (session->server == conn) {
+                session->server = NULL;
         }
 
-        // free the old table
-        for (int i = 0; i < oldSize; i++) {
-                free(theProxy->clientTable[i].slotArray);
+        session->refCount--;
+        if (session->refCount > 0) {
+                return;
         }
-        free(theProxy->clientTable);
-        theProxy->clientTable = newTable;
+
+        freeMITMFields(session);
+        freeBuffer(theProxy, session->serverURL);
+        freeObject(&theProxy->slabs->sessions, session);
 }
 
 
@@ -888,7 +2015,8 @@ void createSocket(proxy *theProxy)
         //socket setup
         struct sockaddr_in serverAddress;
         socklen_t serverAddressLength;
-        int listenSD = socket(AF_INET, SOCK_STREAM, 0);
+        int listenSD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | 
+                SOCK_CLOEXEC, 0);
         checkFatalNegOne(listenSD);
         theProxy->listenSD = listenSD;
 
@@ -898,6 +2026,11 @@ void createSocket(proxy *theProxy)
                         sizeof(opt));
         checkFatalNegOne(returnVal);
 
+        //every worker binds its own listener, the kernel spreads the clients
+        returnVal = setsockopt(listenSD, SOL_SOCKET, SO_REUSEPORT, &opt, 
+                        sizeof(opt));
+        checkFatalNegOne(returnVal);
+
         //setup to bind the socket to port specified port and any IP address
         //this is the setup specifying the Proxy info
         memset(&serverAddress, 0, sizeof(struct sockaddr_in));
@@ -912,68 +2045,34 @@ void createSocket(proxy *theProxy)
 
 
 /*
- * name:      getClientAtSlot
- * purpose:   finds the client at the given hash bucket and returns the 
- *            bucket's index. If the client is not present, returns the next 
- *            available slot
- * arguments: the proxy instance, the client bucket, reference to the slot, 
- *            client socket descriptor
- * returns:   true if the client was found, false otherwise
- * effects:   none
- */
-bool getClientAtSlot(proxy *theProxy, int slot, int *index, int SD)
-{
-        DEBUG_PRINT("FUNCTION: getClientAtSlot\n");
-        // try to find the client in the bucket
-        int slotItems = theProxy->clientTable[slot].numSlotItems;
-        for (int i = 0; i < slotItems; i++) {
-                connectionInfo client = theProxy->clientTable[slot].slotArray[i];
-                if (client.clientSD == SD) {
-                        *index = i;               
-                        return true;
-                }
-        }
-
-        // client wasn't found, so set it's slotIndex to the next free space
-        *index = slotItems;
-        return false;
-}
-
-
-/*
- * name:      getServerAtSlot
- * purpose:   finds the server at the given hash bucket and returns the 
- *            bucket's index
- * arguments: the proxy instance, the server bucket, reference to the slot, 
- *            server socket descriptor
- * returns:   true if the server was found, false otherwise
+ * name:      getPeerConnection
+ * purpose:   finds the struct of the other end of a connection through their 
+ *            session, so the server struct for a client and the client 
+ *            struct for a server
+ * arguments: the proxy instance, the connection struct
+ * returns:   the peer's struct or NULL if it is gone
  * effects:   none
  */
-bool getServerAtSlot(proxy *theProxy, int slot, int *index, int SD)
+connectionInfo *getPeerConnection(proxy *theProxy, connectionInfo *conn)
 {
-        DEBUG_PRINT("FUNCTION: getServerAtSlot\n");
-        int slotItems = theProxy->clientTable[slot].numSlotItems;
-        for (int i = 0; i < slotItems; i++) {
-                connectionInfo server = theProxy->clientTable[slot].slotArray[i];
-                if ((server.serverSD == SD) && (!server.isClient)) {
-                        *index = i;
-                        return true;
-                }
+        DEBUG_PRINT("FUNCTION: getPeerConnection\n");
+        connSession *session = conn->session;
+        if (session == NULL) {
+                return NULL;
         }
-
-        return false;
+        return conn->isClient ? session->server : session->client;
 }
 
 
 
 /*
  * name:      setConnectionMode
- * purpose:   sets the connection mode for a slot to tunnel based on the URL
- * arguments: the bucket slot, the bucket, the slot of the bucket
+ * purpose:   sets the connection mode to tunnel based on the URL
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
  * effects:   none
  */
-void setConnectionMode(proxy *theProxy, int slot, int index)
+void setConnectionMode(proxy *theProxy, int SD)
 {       
         DEBUG_PRINT("FUNCTION: setConnectionMode\n");
         if (theProxy->proxyMode == MITM) {
@@ -981,22 +2080,22 @@ void setConnectionMode(proxy *theProxy, int slot, int index)
                 char *icloudInd = "icloud";
                 char *playInd = "play";
                 char *apiInd = "api";
-                char *URL = theProxy->clientTable[slot].slotArray[index].serverURL;
+                char *URL = theProxy->connTable[SD]->session->serverURL;
                 
                 // this host is not an icloud host, so return
                 char *endStr = strstr(URL, icloudInd);
                 if (endStr != NULL) {
-                        theProxy->clientTable[slot].slotArray[index].mode = TUNNEL;
+                        theProxy->connTable[SD]->mode = TUNNEL;
                         return;
                 }
                 char *endStr1 = strstr(URL, playInd);
                 if (endStr1 != NULL) {
-                        theProxy->clientTable[slot].slotArray[index].mode = TUNNEL;
+                        theProxy->connTable[SD]->mode = TUNNEL;
                         return;
                 }
                 char *endStr2 = strstr(URL, apiInd);
                 if (endStr2 != NULL) {
-                        theProxy->clientTable[slot].slotArray[index].mode = TUNNEL;
+                        theProxy->connTable[SD]->mode = TUNNEL;
                         return;
                 }
         }
@@ -1014,52 +2113,86 @@ void setSDNonBlocking(int socketSD)
 
 
 /*
- * name:      initializeBucketSlots
- * purpose:   initializes all the slots of a bucket in the hash table
- * arguments: the bucket slot, the slot number, the proxy mode
+ * name:      initializeConnection
+ * purpose:   resets every field of a connection struct
+ * arguments: the connection struct
  * returns:   none
  * effects:   none
  */
-void initializeBucketSlots(tableSlot *tableSlot, int slot, bool mode)
+void initializeConnection(connectionInfo *conn)
 {
-        DEBUG_PRINT("FUNCTION: initializeBucketSlots\n");
-        for (int j = 0; j < 10; j++) {
-                connectionInfo *conn = &tableSlot[slot].slotArray[j];
-
-                conn->clientSD = -1;
-                conn->serverSD = -1;
-                conn->isClient = false;
-                conn->mode = mode;
-
-                conn->bufferSize = -1;
-                conn->bufferRead = 0;
-                conn->readBuffer = NULL;
-
-                conn->headerSize = -1;
-                conn->headerRead = 0;
-                conn->msgHeader = NULL;
-                
-                conn->contentSize = -1;
-                conn->contentRead = 0;
-                conn->msgContent = NULL;
-
-                conn->contentEncoding = -1;
-                conn->chunkedContent = false;
-                conn->divAdded = false;
-
-                conn->connActive = false;
-                conn->timeAdded = -1;
-
-                conn->serverURL = NULL;
-                conn->serverPort = -1;
+        DEBUG_PRINT("FUNCTION: initializeConnection\n");
+        connDetails *details = conn->details;
+        conn->clientSD = -1;
+        conn->serverSD = -1;
+        conn->isClient = false;
+        conn->session = NULL;
+        conn->relayBuffer = NULL;
+
+        details->bufferSize = -1;
+        details->bufferRead = 0;
+        details->readBuffer = NULL;
+
+        details->headerSize = -1;
+        details->headerRead = 0;
+        details->msgHeader = NULL;
+        
+        details->contentSize = -1;
+        details->contentRead = 0;
+        initializeChain(&details->msgContent);
+
+        details->contentEncoding = -1;
+        details->chunkedContent = false;
+        details->divAdded = false;
+
+        conn->mode = TUNNEL;
+        conn->connActive = false;
+        conn->connecting = false;
+        conn->handshaking = false;
+        conn->lastActivity = 0;
+
+        conn->pipeRead = -1;
+        conn->pipeWrite = -1;
+        conn->pipeBytes = 0;
+
+        conn->zerocopyEnabled = false;
+        conn->zerocopySends = 0;
+        conn->zerocopyHead = NULL;
+        conn->zerocopyTail = NULL;
+
+        conn->outputHead = NULL;
+        conn->outputTail = NULL;
+        conn->outputBytes = 0;
+        conn->readPaused = false;
+        conn->writeWaiting = false;
+        conn->closeAfterFlush = false;
+        conn->eventMask = EPOLLIN;
+
+        details->connectDeadline = 0;
+        details->resolving = false;
+        details->race = NULL;
+        details->exchange = NULL;
+        details->nextAttemptTime = 0;
+}
 
-                conn->clientSSL = NULL;
 
-                conn->serverCtx = NULL;
-                conn->serverSSL = NULL;
-                conn->serverCert = NULL;
-                conn->serverKey = NULL;
+/*
+ * name:      hashHostName
+ * purpose:   hashes a host name to a slot in a hash table, ignoring case, 
+ *            for the DNS, certificate cache and certificate store tables
+ * arguments: the host name, the number of slots in the table
+ * returns:   the slot
+ * effects:   none
+ */
+unsigned int hashHostName(const char *hostName, unsigned int size)
+{
+        // FNV-1a
+        unsigned int hashVal = 2166136261u;
+        for (const char *c = hostName; *c != '\0'; c++) {
+                hashVal ^= (unsigned char)tolower((unsigned char)*c);
+                hashVal *= 16777619u;
         }
+        return hashVal % size;
 }
 
 
@@ -1071,213 +2204,132 @@ void initializeBucketSlots(tableSlot *tableSlot, int slot, bool mode)
 
 /*
  * name:      removeClient
- * purpose:   removes a client from the clientList
- * arguments: the proxy instance, the table slot, the bucket index
+ * purpose:   removes a client from the connection table
+ * arguments: the proxy instance, the client socket descriptor
  * returns:   none
  * effects:   removes the client's associated data, and closes the connection 
  *            with the client
  */
-void removeClient(proxy *theProxy, int slot, int index)
+void removeClient(proxy *theProxy, int SD)
 {
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
         DEBUG_PRINT("FUNCTION: removeClient: %d\n", client->clientSD);
-        freeMITMFields(theProxy, slot, index);
-
-        FD_CLR(client->clientSD, &theProxy->activeFDSet);
+        removeFromEventLoop(theProxy, client->clientSD);
         close(client->clientSD);
 
-        // resetClientMaxFD(theProxy, slot, index);
-
-        // reset the clientSD / clientSSL / clientCtx field at the server struct
-        int serverSD = theProxy->clientTable[slot].slotArray[index].serverSD;
-        if (serverSD != -1) {
-                int serverSlot = hashTableKey(theProxy, serverSD);
-                int serverIndex = 0;
-                if (getServerAtSlot(theProxy, serverSlot, &serverIndex, serverSD)) {
-                        theProxy->clientTable[serverSlot].slotArray[serverIndex].clientSD = -1;
-                        theProxy->clientTable[serverSlot].slotArray[serverIndex].clientSSL = NULL;
-                        freeTableSlot(theProxy, slot, index);
-                        if (theProxy->clientTable[serverSlot].slotArray[serverIndex].connActive) {
-                                removeServer(theProxy, serverSlot, serverIndex);
-                        }
-                        return;
+        // the server is found through the session, and keeps it alive until 
+        // it is pooled or removed as well
+        connectionInfo *server = client->session->server;
+        if (server != NULL) {
+                // a request the server hasn't fully received keeps the 
+                // connection out of the pool
+                int serverSD = server->serverSD;
+                bool requestQueued = client->outputBytes > 0;
+                server->clientSD = -1;
+                freeTableSlot(theProxy, SD);
+                if (server->connActive && (requestQueued || 
+                        !poolServerConnection(theProxy, serverSD))) {
+                        removeServer(theProxy, serverSD);
                 }
+                return;
         }
 
-        freeTableSlot(theProxy, slot, index);
+        freeTableSlot(theProxy, SD);
 }
 
 
 /*
  * name:      removeServer
- * purpose:   removes a server from the clientList
- * arguments: the proxy instance, the table slot, the bucket index
+ * purpose:   removes a server from the connection table
+ * arguments: the proxy instance, the server socket descriptor
  * returns:   none
  * effects:   removes the server's associated data, and closes the connection 
  *            with the server
  */
-void removeServer(proxy *theProxy, int slot, int index)
+void removeServer(proxy *theProxy, int SD)
 {
-        connectionInfo *server = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *server = theProxy->connTable[SD];
         DEBUG_PRINT("FUNCTION: removeServer: %d\n", server->serverSD);
-        freeMITMFields(theProxy, slot, index);
-
-        FD_CLR(server->serverSD, &theProxy->activeFDSet);
+        removeFromEventLoop(theProxy, server->serverSD);
         close(server->serverSD);
 
-        // resetServerMaxFD(theProxy, slot, index);
-
-        // reset the serverSD / serverSSL / serverCtx field at the client struct
-        int clientSD = theProxy->clientTable[slot].slotArray[index].clientSD;
-        if (clientSD != -1) {
-                int clientSlot = hashTableKey(theProxy, clientSD);
-                int clientIndex = 0;
-                if (getClientAtSlot(theProxy, clientSlot, &clientIndex, clientSD)) {
-                        theProxy->clientTable[clientSlot].slotArray[clientIndex].serverSD = -1;
-                        theProxy->clientTable[clientSlot].slotArray[clientIndex].serverSSL = NULL;
-                        theProxy->clientTable[clientSlot].slotArray[clientIndex].serverCtx = NULL;
-                        freeTableSlot(theProxy, slot, index);
-                        removeClient(theProxy, clientSlot, clientIndex);
-                        return;
-                }
+        // the client is found through the session
+        connectionInfo *client = server->session->client;
+        if (client != NULL) {
+                int clientSD = client->clientSD;
+                client->serverSD = -1;
+                freeTableSlot(theProxy, SD);
+                removeClient(theProxy, clientSD);
+                return;
         }
-        
 
-        freeTableSlot(theProxy, slot, index);
+        freeTableSlot(theProxy, SD);
 }
 
 
 
 /*
  * name:      freeTableSlot
- * purpose:   frees and resets all fields of a connectionInfo struct at a given 
- *            table slot
- * arguments: the proxy instance, the client bucket, the bucket index
+ * purpose:   frees and resets all fields of a connectionInfo struct, the 
+ *            struct itself stays in the table for the descriptor's next use
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
- * effects:   none
+ * effects:   decrements numClients
  */
-void freeTableSlot(proxy *theProxy, int slot, int index)
+void freeTableSlot(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: freeTableSlot: \n");
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
+        connDetails *details = client->details;
+
+        // a pending lookup would hand its answer to a reused descriptor
+        if (details->resolving) {
+                cancelDnsLookups(theProxy, client->clientSD);
+                details->resolving = false;
+        }
+        if (details->race != NULL) {
+                cancelConnectRace(theProxy, client);
+        }
+        stopTimer(theProxy, SD);
         client->clientSD = -1;
         client->serverSD = -1;
         client->isClient = false;
-        client->mode = theProxy->proxyMode;
+        releaseSession(theProxy, client);
 
-        client->bufferSize = -1;
-        client->bufferRead = 0;
-        if (client->readBuffer != NULL) {
-                free(client->readBuffer);
-                client->readBuffer = NULL;
+        details->bufferSize = -1;
+        details->bufferRead = 0;
+        if (details->readBuffer != NULL) {
+                freeBuffer(theProxy, details->readBuffer);
+                details->readBuffer = NULL;
         }
         
-        client->headerSize = -1;
-        client->headerRead = 0;
-        if (client->msgHeader != NULL) {
-                free(client->msgHeader);
-                client->msgHeader = NULL;
+        details->headerSize = -1;
+        details->headerRead = 0;
+        if (details->msgHeader != NULL) {
+                freeBuffer(theProxy, details->msgHeader);
+                details->msgHeader = NULL;
         }
 
-        client->contentSize = -1;
-        client->contentRead = 0;
-        if (client->msgContent != NULL) {
-                free(client->msgContent);
-                client->msgContent = NULL;
-        }
+        details->contentSize = -1;
+        details->contentRead = 0;
+        freeChain(theProxy, &details->msgContent);
 
-        client->contentEncoding = -1;
-        client->chunkedContent = false;
-        client->divAdded = false;
+        details->contentEncoding = -1;
+        details->chunkedContent = false;
+        details->divAdded = false;
         
         client->connActive = false;
-        client->timeAdded = -1;
-
-        if (client->serverURL != NULL) {
-                free(client->serverURL);
-                client->serverURL = NULL;
-        }
 
-        client->serverPort = -1;
-        client->clientSSL = NULL;
+        closeSplicePipe(client);
+        releaseRelayBuffer(theProxy, client);
+        freeZerocopyBuffers(theProxy, client);
+        freeOutputQueue(theProxy, client);
+        freeHttpExchange(client);
 
-        client->serverCtx = NULL;
-        client->serverSSL = NULL;
-        client->serverCert = NULL;
-        client->serverKey = NULL;
+        client->connecting = false;
+        client->handshaking = false;
+        details->connectDeadline = 0;
+        details->nextAttemptTime = 0;
 
-        theProxy->clientTable[slot].numSlotItems--;
         theProxy->numClients--;
 }
-
-
-/*
- * name:      resetClientMaxFD
- * purpose:   resets the maxFD to the highest FD of the active sockets
- * arguments: the proxy instance, the table slot, the bucket index
- * returns:   none
- * effects:   none
- */
-void resetClientMaxFD(proxy *theProxy, int slot, int index)
-{
-        connectionInfo *conn = &theProxy->clientTable[slot].slotArray[index];
-
-        if (conn->clientSD != theProxy->maxFD) {
-                return;
-        }
-
-        theProxy->maxFD = -1;
-        for (int i = 0; i < theProxy->tableSize; i++) {
-                for (int j = 0; j < theProxy->clientTable[i].numSlotItems; j++) {
-                        connectionInfo *curr = &theProxy->clientTable[i].slotArray[j];
-                        if (!curr->connActive) {
-                                continue;
-                        }
-                        if (curr->isClient) {
-                                if (curr->clientSD > theProxy->maxFD) {
-                                        theProxy->maxFD = curr->clientSD;
-                                }
-                        } 
-                        else {
-                                if (curr->serverSD > theProxy->maxFD) {
-                                        theProxy->maxFD = curr->serverSD;
-                                }
-                        }        
-                }
-        }
-}
-
-
-/*
- * name:      resetServerMaxFD
- * purpose:   resets the maxFD to the highest FD of the active sockets
- * arguments: the proxy instance, the table slot, the bucket index
- * returns:   none
- * effects:   none
- */
-void resetServerMaxFD(proxy *theProxy, int slot, int index)
-{
-        connectionInfo *conn = &theProxy->clientTable[slot].slotArray[index];
-
-        if (conn->serverSD != theProxy->maxFD) {
-                return;
-        }
-
-        theProxy->maxFD = -1;
-        for (int i = 0; i < theProxy->tableSize; i++) {
-                for (int j = 0; j < theProxy->clientTable[i].numSlotItems; j++) {
-                        connectionInfo *curr = &theProxy->clientTable[i].slotArray[j];
-
-                        if (curr->isClient) {
-                                if (curr->clientSD > theProxy->maxFD) {
-                                        theProxy->maxFD = curr->clientSD;
-                                }
-                        } 
-                        else {
-                                if (curr->serverSD > theProxy->maxFD) {
-                                        theProxy->maxFD = curr->serverSD;
-                                }
-                        }         
-                }
-        }
-}
\ No newline at end of file
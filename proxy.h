@@ -20,19 +20,201 @@
 #include "include.h"
 #include "cache.h"
 
+#define DNS_MAX_ADDRESSES 8
+
+#define DNS_CACHE_MISS 0
+#define DNS_CACHE_HIT 1
+#define DNS_CACHE_NEGATIVE 2
+
+#define TIMER_NONE 0
+#define TIMER_HEADER 1
+#define TIMER_CONNECT 2
+#define TIMER_IDLE 3
+#define TIMER_HANDSHAKE 4
+
+#define BUFFER_CLASSES 10
+
+#define LEAF_KEY_EC 0
+#define LEAF_KEY_ED25519 1
+#define LEAF_KEY_RSA 2
+
 
 
 /*
- * name:      connectionInfo struct
- * purpose:   stores information about a client such as the socket descriptor,
- *            the last read message, etc.
+ * name:      zerocopyBuffer struct
+ * purpose:   stores a buffer handed to the kernel with MSG_ZEROCOPY which 
+ *            can only be freed once the kernel reports the last send using it 
+ *            as completed
+ */
+typedef struct zerocopyBuffer {
+
+        char *buffer;
+        unsigned int lastSend;
+        struct zerocopyBuffer *next;
+
+} zerocopyBuffer;
+
+
+
+/*
+ * name:      outputChunk struct
+ * purpose:   stores data read from a connection that could not be written to 
+ *            its peer yet, the chunk is written from offset to length
+ */
+typedef struct outputChunk {
+
+        char *data;
+        int offset;
+        int length;
+        struct outputChunk *next;
+
+} outputChunk;
+
+
+
+/*
+ * name:      chainSegment struct
+ * purpose:   stores one piece of a buffer chain, the data points into the 
+ *            pool buffer the segment frees, or into a buffer an earlier 
+ *            segment frees if buffer is NULL
+ */
+typedef struct chainSegment {
+
+        char *buffer;
+        char *data;
+        int length;
+        struct chainSegment *next;
+
+} chainSegment;
+
+
+
+/*
+ * name:      bufferChain struct
+ * purpose:   stores a message body as the list of buffers it was read into, 
+ *            so it can grow without being copied
  */
 typedef struct {
 
-        int clientSD;
-        int serverSD; 
-        bool isClient;
-        bool mode;
+        chainSegment *head;
+        chainSegment *tail;
+        int length;
+        int numSegments;
+
+} bufferChain;
+
+
+
+/*
+ * name:      httpParser struct
+ * purpose:   follows the framing of the HTTP/1.1 messages sent in one 
+ *            direction of a MITM connection, so the proxy knows when a 
+ *            message ends without buffering it
+ */
+typedef struct {
+
+        int state;
+        long long remaining;
+        long long contentLength;
+        bool chunked;
+        bool noBody;
+        int statusCode;
+        int messages;
+
+        char *line;
+        int lineLength;
+        int lineMax;
+
+} httpParser;
+
+
+
+/*
+ * name:      httpExchange struct
+ * purpose:   stores the request and response parsers of an upstream MITM 
+ *            connection and whether the connection can be reused once every 
+ *            request was answered
+ */
+typedef struct {
+
+        httpParser request;
+        httpParser response;
+        bool reusable;
+
+} httpExchange;
+
+
+
+/*
+ * name:      pooledConnection struct
+ * purpose:   stores an idle upstream TLS connection that can be handed to the 
+ *            next client going to the same host, port and ALPN protocol
+ */
+typedef struct {
+
+        char *hostName;
+        int port;
+        char alpn[16];
+
+        int serverSD;
+        SSL *serverSSL;
+        SSL_CTX *serverCtx;
+        unsigned long long idleSince;
+
+} pooledConnection;
+
+
+
+/*
+ * name:      connectRace struct
+ * purpose:   stores the addresses a client's server resolved to, in the 
+ *            order they are tried, and the connects racing each other
+ */
+typedef struct {
+
+        struct sockaddr_storage addresses[DNS_MAX_ADDRESSES];
+        int numAddresses;
+        int nextAddress;
+
+        int attemptSDs[DNS_MAX_ADDRESSES];
+        int numAttempts;
+
+} connectRace;
+
+
+
+/*
+ * name:      connSession struct
+ * purpose:   stores the state a client and its server share, such as the 
+ *            host and the SSL objects, once for both halves of the 
+ *            connection. Each half holds a reference, and the session is 
+ *            freed when the last one lets go
+ */
+typedef struct {
+
+        int refCount;
+        struct connectionInfo *client;
+        struct connectionInfo *server;
+
+        char *serverURL;
+        int serverPort;
+
+        SSL *clientSSL;
+
+        SSL_CTX *serverCtx;
+        SSL *serverSSL;
+
+} connSession;
+
+
+
+/*
+ * name:      connDetails struct
+ * purpose:   stores the fields of a connection that are only used while it 
+ *            is set up or torn down, and the MITM message being assembled, 
+ *            apart from the fields every event touches
+ */
+typedef struct {
 
         int bufferSize;
         int bufferRead;
@@ -44,39 +226,477 @@ typedef struct {
 
         int contentSize;
         int contentRead;
-        char *msgContent;
+        bufferChain msgContent;
 
         int contentEncoding;
         bool chunkedContent;
         bool divAdded;
 
-        bool connActive;
-        unsigned long long timeAdded;
+        bool resolving;
+        connectRace *race;
+        httpExchange *exchange;
+        unsigned long long connectDeadline;
+        unsigned long long nextAttemptTime;
 
-        char *serverURL;
-        int serverPort;
+} connDetails;
 
-        SSL *clientSSL;
 
-        SSL_CTX *serverCtx;
-        SSL *serverSSL;
-        X509 *serverCert;
-        EVP_PKEY *serverKey;
+
+/*
+ * name:      connectionInfo struct
+ * purpose:   stores the fields of a connection that event dispatch and the 
+ *            relays touch on every event. The fields looked at for every 
+ *            event, the dispatch flags and the activity stamp among them, 
+ *            come first so they share the first cache line, and everything 
+ *            else is kept in the connection's details
+ */
+typedef struct connectionInfo {
+
+        int clientSD;
+        int serverSD; 
+        bool isClient;
+        bool mode;
+        bool connActive;
+        bool connecting;
+        bool handshaking;
+        bool readPaused;
+        bool writeWaiting;
+        bool closeAfterFlush;
+        bool zerocopyEnabled;
+        uint32_t eventMask;
+        int pipeRead;
+        int outputBytes;
+        unsigned long long lastActivity;
+        connSession *session;
+        connDetails *details;
+        char *relayBuffer;
+
+        int pipeWrite;
+        int pipeBytes;
+        outputChunk *outputHead;
+        outputChunk *outputTail;
+
+        unsigned int zerocopySends;
+        zerocopyBuffer *zerocopyHead;
+        zerocopyBuffer *zerocopyTail;
 
 } connectionInfo;
 
 
 /*
- * name:      cacheSlot struct
- * purpose:   stores an array of cacheElements for a specific hash table 
- *            bucket as well as the number of items in the array
+ * name:      proxyOptions struct
+ * purpose:   stores the optional startup settings given on the command line 
+ *            which are shared by every proxy worker
+ */
+typedef struct {
+
+        int numWorkers;
+        bool useUring;
+        int connectTimeout;
+        char *dnsServer;
+        int dnsTimeout;
+        int headerTimeout;
+        int handshakeTimeout;
+        int idleTimeout;
+        int leafKeyType;
+        char *certStorePath;
+        bool wildcardCerts;
+        bool useZerocopy;
+
+} proxyOptions;
+
+
+
+/*
+ * name:      uringConn struct
+ * purpose:   stores the io_uring relay state of one tunnel socket such as its 
+ *            peer, the in-flight operations and the queue of received 
+ *            buffers waiting to be sent to this socket
+ */
+typedef struct {
+
+        int peerSD;
+        bool isClient;
+        bool active;
+        bool closing;
+
+        bool recvArmed;
+        bool starved;
+        bool sending;
+        int pendingOps;
+
+        bool readDone;
+        bool peerReadDone;
+        bool writeDone;
+
+        int queueHead;
+        int queueTail;
+        unsigned long long lastActivity;
+
+} uringConn;
+
+
+
+/*
+ * name:      uringInfo struct
+ * purpose:   stores the io_uring instance of a worker: the mapped submission 
+ *            and completion rings, the registered buffer ring used by the 
+ *            multishot receives, and the per socket relay state
+ */
+typedef struct {
+
+        int ringFD;
+        bool recvSupported;
+
+        unsigned *sqHead;
+        unsigned *sqTail;
+        unsigned sqMask;
+        unsigned sqEntries;
+        unsigned *sqArray;
+        struct io_uring_sqe *sqes;
+        int pendingSubmit;
+
+        unsigned *cqHead;
+        unsigned *cqTail;
+        unsigned cqMask;
+        struct io_uring_cqe *cqes;
+
+        struct io_uring_buf_ring *bufRing;
+        char *bufBase;
+        int numBufs;
+        int bufSize;
+        int *bufLength;
+        int *bufOffset;
+        int *bufNext;
+
+        uringConn *conns;
+        int numConns;
+
+        int *starvedList;
+        int numStarved;
+
+} uringInfo;
+
+
+
+/*
+ * name:      dnsLookup struct
+ * purpose:   stores an outstanding resolution of a host name for a client: 
+ *            the IDs of its A and AAAA queries, the addresses answered so far 
+ *            and when to resend or give up on the queries
+ */
+typedef struct {
+
+        bool active;
+        int clientSD;
+        char *hostName;
+
+        unsigned short queryID[2];
+        bool answered[2];
+        bool failed;
+
+        struct sockaddr_storage addresses[DNS_MAX_ADDRESSES];
+        int numAddresses;
+        unsigned int ttl;
+
+        unsigned long long retryTime;
+        unsigned long long deadline;
+
+} dnsLookup;
+
+
+
+/*
+ * name:      hostsEntry struct
+ * purpose:   stores a host name and address read from /etc/hosts
+ */
+typedef struct {
+
+        char *hostName;
+        struct sockaddr_storage address;
+
+} hostsEntry;
+
+
+
+/*
+ * name:      dnsCacheEntry struct
+ * purpose:   stores the addresses a host name resolved to, or that it failed 
+ *            to resolve, until the entry expires. The hits since the entry 
+ *            was stored decide whether it is refreshed before it expires
  */
 typedef struct {
 
+        char *hostName;
+        struct sockaddr_storage addresses[DNS_MAX_ADDRESSES];
+        int numAddresses;
+        bool negative;
+
+        unsigned long long storageTime;
+        unsigned long long expireTime;
+        int hits;
+        bool refreshing;
+
+} dnsCacheEntry;
+
+
+
+/*
+ * name:      dnsCacheSlot struct
+ * purpose:   stores the entries of one slot in the DNS cache
+ */
+typedef struct {
+
+        dnsCacheEntry *slotArray;
         int numSlotItems;
-        connectionInfo *slotArray;
+        int maxSlotItems;
+
+} dnsCacheSlot;
+
+
+
+/*
+ * name:      dnsCache struct
+ * purpose:   stores the host name cache shared by all the workers, the lock 
+ *            is held for every access to the table
+ */
+typedef struct {
+
+        dnsCacheSlot *hashTable;
+        int size;
+        int numItems;
+        int maxNumItems;
+        pthread_mutex_t lock;
+
+} dnsCache;
+
+
+
+/*
+ * name:      dnsResolver struct
+ * purpose:   stores the asynchronous resolver of a worker: the UDP socket 
+ *            connected to the name server, the outstanding lookups and the 
+ *            entries of the hosts file
+ */
+typedef struct {
+
+        int dnsSD;
+        int timeout;
+
+        dnsLookup *lookups;
+        int maxLookups;
+        int numLookups;
+
+        hostsEntry *hosts;
+        int numHosts;
+
+        dnsCache *cache;
+
+} dnsResolver;
+
+
+
+/*
+ * name:      timerEntry struct
+ * purpose:   stores the timer of a socket: the phase of the connection it 
+ *            times, the tick it expires on and its neighbours in its slot of 
+ *            the timer wheel
+ */
+typedef struct {
+
+        int phase;
+        unsigned long long expireTick;
+        int slot;
+        int prev;
+        int next;
 
-} tableSlot;
+} timerEntry;
+
+
+
+/*
+ * name:      timerWheel struct
+ * purpose:   stores the hierarchical timer wheel of a worker: the first 
+ *            timer of every slot of every level, the timers indexed by 
+ *            socket descriptor and the tick the wheel is at
+ */
+typedef struct {
+
+        int *slots;
+        timerEntry *timers;
+        int maxTimers;
+        int numTimers;
+        unsigned long long currTick;
+
+} timerWheel;
+
+
+
+/*
+ * name:      objectSlab struct
+ * purpose:   stores the free objects of one size a worker carves from blocks 
+ *            of SLAB_OBJECTS objects, linked through their first bytes
+ */
+typedef struct {
+
+        size_t objectSize;
+        void *freeList;
+        int numBlocks;
+
+} objectSlab;
+
+
+
+/*
+ * name:      slabAllocator struct
+ * purpose:   stores the slabs of a worker's connection objects and its free 
+ *            read buffers grouped by power of two size class
+ */
+typedef struct {
+
+        objectSlab connections;
+        objectSlab details;
+        objectSlab sessions;
+        objectSlab outputChunks;
+        objectSlab zerocopyBuffers;
+        objectSlab connectRaces;
+        objectSlab chainSegments;
+
+        char *freeBuffers[BUFFER_CLASSES];
+        int numFreeBuffers[BUFFER_CLASSES];
+        char *freeMappedBuffers;
+        int numFreeMapped;
+
+} slabAllocator;
+
+
+
+/*
+ * name:      certCacheEntry struct
+ * purpose:   stores the SSL context holding the certificate and key forged 
+ *            for a host name, linked into its hash slot and into the cache's 
+ *            list of entries from the most to the least recently used
+ */
+typedef struct certCacheEntry {
+
+        char *hostName;
+        SSL_CTX *context;
+        time_t expireTime;
+
+        struct certCacheEntry *slotNext;
+        struct certCacheEntry *newer;
+        struct certCacheEntry *older;
+
+} certCacheEntry;
+
+
+
+/*
+ * name:      certCache struct
+ * purpose:   stores the forged certificate cache shared by all the workers, 
+ *            the lock is held for every access to the table and the list
+ */
+typedef struct {
+
+        certCacheEntry **hashTable;
+        int size;
+        int numItems;
+        int maxNumItems;
+        certCacheEntry *newest;
+        certCacheEntry *oldest;
+        pthread_mutex_t lock;
+
+} certCache;
+
+
+
+/*
+ * name:      keyPool struct
+ * purpose:   stores the key pairs generated ahead of time for the forged 
+ *            certificates, shared by all the workers. The generator thread 
+ *            waits on keyTaken while the pool is full
+ */
+typedef struct {
+
+        EVP_PKEY **keys;
+        int numKeys;
+        int maxKeys;
+        int keyType;
+        pthread_mutex_t lock;
+        pthread_cond_t keyTaken;
+
+} keyPool;
+
+
+
+/*
+ * name:      certStoreHeader struct
+ * purpose:   stores the start of the certificate store file, which ties the 
+ *            records after it to the root certificate that signed them
+ */
+typedef struct {
+
+        char magic[8];
+        unsigned char rootDigest[32];
+
+} certStoreHeader;
+
+
+
+/*
+ * name:      certRecordHeader struct
+ * purpose:   stores the start of a record in the certificate store file, 
+ *            which is followed by the host name, the DER encoded certificate 
+ *            and the DER encoded key
+ */
+typedef struct {
+
+        uint32_t hostLength;
+        uint32_t certLength;
+        uint32_t keyLength;
+        uint32_t reserved;
+        int64_t expireTime;
+
+} certRecordHeader;
+
+
+
+/*
+ * name:      storeIndexEntry struct
+ * purpose:   stores where the latest record of a host name is in the 
+ *            certificate store file
+ */
+typedef struct storeIndexEntry {
+
+        char *hostName;
+        off_t offset;
+        off_t length;
+        time_t expireTime;
+        struct storeIndexEntry *slotNext;
+
+} storeIndexEntry;
+
+
+
+/*
+ * name:      certStore struct
+ * purpose:   stores the open certificate store file shared by all the 
+ *            workers, its memory mapping and the index of its records, the 
+ *            lock is held for every access
+ */
+typedef struct {
+
+        int fd;
+        off_t fileSize;
+        char *mapping;
+        size_t mapSize;
+
+        storeIndexEntry **hashTable;
+        int size;
+        int numItems;
+        pthread_mutex_t lock;
+
+} certStore;
 
 
 
@@ -89,21 +709,40 @@ typedef struct {
 
         int listenSD;
         int portNumber;
-        fd_set activeFDSet;
-        fd_set readFDSet;
-        int maxFD;
+        int workerID;
+        proxyOptions *options;
+
+        int epollFD;
+        uringInfo *uring;
+        dnsResolver *resolver;
+
+        pooledConnection *pool;
+        int numPooled;
+        int maxPooled;
+        unsigned long long nextPoolCheck;
+        struct epoll_event *readyEvents;
+        int maxEvents;
+        int numReady;
+        int currEvent;
+
+        timerWheel *timers;
+        unsigned long long loopTime;
+        slabAllocator *slabs;
 
         int proxyMode;
 
-        tableSlot *clientTable;
+        connectionInfo **connTable;
         cacheInfo *theCache;
 
-        int tableSize;
+        int maxConnections;
         int numClients;
 
         SSL_CTX *clientCtx;
         X509 *rootCert;
         EVP_PKEY *rootKey;
+        certCache *certCache;
+        keyPool *keyPool;
+        certStore *certStore;
 
         char *connSolution;
         char *connGuess;
@@ -117,24 +756,74 @@ typedef struct {
 ******************************************************************************/
 proxy *newProxy(int port, cacheInfo *theCache, int mode);
 void proxyListening(proxy *theProxy);
-void selectConnections(proxy *theProxy, struct sockaddr_in clientAddress);
+void pollConnections(proxy *theProxy);
+void acceptClient(proxy *theProxy);
+void addClient(proxy *theProxy, int clientSD);
+
+
+// Worker Functions
+void startProxyWorkers(proxy **workers, int numWorkers);
+void *runProxyWorker(void *workerProxy);
+
+
+// Event Loop Functions
+void addToEventLoop(proxy *theProxy, int SD, uint32_t events);
+void modifyEventLoop(proxy *theProxy, int SD, uint32_t events);
+void removeFromEventLoop(proxy *theProxy, int SD);
+void raiseFileLimit();
+uint32_t getCurrentEvents(proxy *theProxy);
+int getLoopWaitTime(proxy *theProxy);
+
+
+// Output Queue Functions
+bool queueOutputData(proxy *theProxy, int SD, char *data, 
+        int length);
+void appendOutputChunk(proxy *theProxy, connectionInfo *conn, char *data, 
+        int offset, int length);
+int writeOutputData(connectionInfo *source, int writeSD);
+void consumeOutputData(proxy *theProxy, connectionInfo *source, int written);
+bool flushOutput(proxy *theProxy, int SD, 
+        connectionInfo *source);
+bool checkPendingClose(proxy *theProxy, int SD, int readReturn);
+void setOutputState(proxy *theProxy, connectionInfo *source);
+void updateEventInterest(proxy *theProxy, connectionInfo *conn);
+void freeOutputQueue(proxy *theProxy, connectionInfo *conn);
 
 
 // Connection Processing
 void processConnection(proxy *theProxy, int SD);
-void processClient(proxy *theProxy, int slot, int clientSD);
-void setupCommunication(proxy *theProxy, int slot, int index);
-void facilitateCommunication(proxy *theProxy, int slot, int index);
+void processClient(proxy *theProxy, int clientSD);
+void setupCommunication(proxy *theProxy, int SD);
+void facilitateCommunication(proxy *theProxy, int SD);
+
+
+// Server Connect Functions
+void resolveServer(proxy *theProxy, int SD);
+void finishServerLookup(proxy *theProxy, dnsLookup *lookup);
+void connectToResolvedServer(proxy *theProxy, int SD, 
+        struct sockaddr_storage *addresses, int numAddresses);
+void orderConnectAddresses(connectRace *race, 
+        struct sockaddr_storage *addresses, int numAddresses, int port);
+bool startNextAttempt(proxy *theProxy, int SD);
+bool startServerConnect(proxy *theProxy, int SD, 
+        struct sockaddr_storage *serverAddress);
+void finishServerConnect(proxy *theProxy, int SD);
+void failServerConnect(proxy *theProxy, int SD);
+connectionInfo *getRacingClient(proxy *theProxy, connectionInfo *server);
+void abandonServerConnect(proxy *theProxy, connectRace *race, int serverSD);
+void cancelConnectRace(proxy *theProxy, connectionInfo *client);
+void completeCommunication(proxy *theProxy, int SD);
+void expireServerConnect(proxy *theProxy, int serverSD);
 
 
 // Initial Connect Handling
-bool processConnectRequest(proxy *theProxy, int slot, int index);
-bool readConnectRequest(proxy *theProxy, int slot, int index);
-bool sendConnEstablished(proxy *theProxy, int slot, int index); 
+bool processConnectRequest(proxy *theProxy, int SD);
+bool readConnectRequest(proxy *theProxy, int SD);
+bool sendConnEstablished(proxy *theProxy, int SD); 
 
 
 // Parsing Functions
-void parseConnectHeader(proxy *theProxy, int slot, int index);
+void parseConnectHeader(proxy *theProxy, int SD);
 int readLine(char *messageBuffer, char *lineBuffer, int totalRead);
 char *getConnectLine(proxy *theProxy, char *currentLine);
 char *getHostLine(proxy *theProxy, char *currentLine);
@@ -144,33 +833,247 @@ int getPortFromLine(proxy *theProxy, char *currLine);
 
 
 // Checking Functions
-bool checkConnectField(proxy *theProxy, int slot, int index);
-bool checkFullConnectHeader(proxy *theProxy, int slot, int index);
+bool checkConnectField(proxy *theProxy, int SD);
+bool checkFullConnectHeader(proxy *theProxy, int SD);
 void checkFatalNegOne(int returnVal);
 void checkFatalNull(void *object);
 
 
-// Hashing Function
-unsigned int hashTableKey(proxy *theProxy, int hashKey);
-bool checkTableExpansion(proxy *theProxy);
-void expandTable(proxy *theProxy);
+// Connection Table Functions
+connectionInfo *addConnection(proxy *theProxy, int SD);
+connectionInfo *getConnection(proxy *theProxy, int SD);
+connectionInfo *getClient(proxy *theProxy, int clientSD);
+connectionInfo *getServer(proxy *theProxy, int serverSD);
+
+
+// Session Functions
+connSession *newSession(proxy *theProxy, connectionInfo *client);
+void joinSession(connectionInfo *server, connSession *session);
+void releaseSession(proxy *theProxy, connectionInfo *conn);
 
 
 // Helper Functions
 void createSocket(proxy *theProxy);
-bool getClientAtSlot(proxy *theProxy, int slot, int *index, int SD);
-bool getServerAtSlot(proxy *theProxy, int slot, int *index, int SD);
-void setConnectionMode(proxy *theProxy, int slot, int index);
+connectionInfo *getPeerConnection(proxy *theProxy, connectionInfo *conn);
+void setConnectionMode(proxy *theProxy, int SD);
 void setSDNonBlocking(int socketSD);
-void initializeBucketSlots(tableSlot *tableSlot, int slot, bool mode);
+void initializeConnection(connectionInfo *conn);
+unsigned int hashHostName(const char *hostName, unsigned int size);
+
+
+// Reset Functions
+void removeClient(proxy *theProxy, int SD);
+void removeServer(proxy *theProxy, int SD);
+void freeTableSlot(proxy *theProxy, int SD);
+
+
+
+
+/******************************************************************************
+*                         DNS FUNCTION DECLARATIONS
+******************************************************************************/
+bool initializeResolver(proxy *theProxy);
+bool getNameServer(proxyOptions *options, struct sockaddr_in *serverAddress);
+void loadHostsFile(dnsResolver *resolver);
+bool getLiteralAddress(dnsResolver *resolver, char *hostName, 
+        struct sockaddr_storage *addresses, int *numAddresses);
+
+
+// Query Handling
+bool startDnsLookup(proxy *theProxy, char *hostName, int clientSD);
+void sendDnsQueries(dnsResolver *resolver, dnsLookup *lookup);
+unsigned short getDnsQueryID();
+int buildDnsQuery(unsigned char *packet, unsigned short queryID, 
+        char *hostName, int queryType);
+void handleDnsResponses(proxy *theProxy);
+int getDnsWaitTime(proxy *theProxy);
+void expireDnsLookups(proxy *theProxy);
+
+
+// Response Parsing
+bool parseDnsResponse(dnsLookup *lookup, unsigned char *packet, int length, 
+        int queryType);
+int matchDnsQuestion(dnsLookup *lookup, unsigned char *packet, int length, 
+        int queryType);
+int skipDnsName(unsigned char *packet, int length, int offset);
+void addDnsAddress(dnsLookup *lookup, int family, unsigned char *data);
+
+
+// DNS Cache
+dnsCache *getDnsCache();
+int getCachedAddresses(proxy *theProxy, char *hostName, 
+        struct sockaddr_storage *addresses, int *numAddresses);
+void storeCachedAddresses(dnsCache *cache, dnsLookup *lookup);
+dnsCacheEntry *findCacheEntry(dnsCache *cache, char *hostName);
+void removeExpiredEntries(dnsCache *cache, unsigned long long now);
+unsigned long long getDnsTime();
 
 
 // Reset Functions
-void removeClient(proxy *theProxy, int slot, int index);
-void removeServer(proxy *theProxy, int slot, int index);
-void freeTableSlot(proxy *theProxy, int slot, int index);
-void resetClientMaxFD(proxy *theProxy, int slot, int index);
-void resetServerMaxFD(proxy *theProxy, int slot, int index);
+void finishDnsLookup(proxy *theProxy, dnsLookup *lookup);
+void cancelDnsLookups(proxy *theProxy, int clientSD);
+
+
+
+
+/******************************************************************************
+*                       IO_URING FUNCTION DECLARATIONS
+******************************************************************************/
+bool initializeUring(proxy *theProxy);
+bool setupUringBuffers(uringInfo *uring);
+
+
+// Ring Access
+struct io_uring_sqe *getUringSQE(uringInfo *uring);
+void submitUring(uringInfo *uring);
+void reapUringCompletions(proxy *theProxy);
+
+
+// Tunnel Relaying
+void startUringRelay(proxy *theProxy, int clientSD, int serverSD);
+uringConn *getUringConn(uringInfo *uring, int SD);
+bool armUringRecv(uringInfo *uring, int SD);
+bool sendNextUringBuffer(uringInfo *uring, int SD);
+void handleUringRecv(proxy *theProxy, int SD, struct io_uring_cqe *cqe);
+void handleUringEOF(proxy *theProxy, int SD);
+void shutdownUringWrite(proxy *theProxy, int SD);
+void handleUringSend(proxy *theProxy, int SD, int bufID, 
+        struct io_uring_cqe *cqe);
+
+
+// Buffer Handling
+void recycleUringBuffer(uringInfo *uring, int bufID);
+void rearmStarvedUringConns(uringInfo *uring);
+
+
+// Reset Functions
+void closeUringRelay(proxy *theProxy, int SD);
+void finishUringRelay(proxy *theProxy, int SD);
+void returnUringConnToEpoll(proxy *theProxy, int SD);
+
+
+
+
+/******************************************************************************
+*                        TIMER FUNCTION DECLARATIONS
+******************************************************************************/
+void initializeTimers(proxy *theProxy);
+timerEntry *getTimer(timerWheel *wheel, int SD);
+
+
+// Starting / Stopping
+void startTimer(proxy *theProxy, int SD, int phase, unsigned long long delay);
+void stopTimer(proxy *theProxy, int SD);
+void linkTimer(timerWheel *wheel, int SD);
+void unlinkTimer(timerWheel *wheel, int SD);
+
+
+// Running Timers
+void expireTimers(proxy *theProxy);
+void cascadeTimers(timerWheel *wheel, int level);
+void handleTimer(proxy *theProxy, int SD, int phase);
+int getTimerWaitTime(proxy *theProxy);
+
+
+// Phase Timeouts
+void expireConnectHeader(proxy *theProxy, int clientSD);
+void expireIdleConnection(proxy *theProxy, int clientSD);
+void expireHandshake(proxy *theProxy, int clientSD);
+unsigned long long getLastActivity(proxy *theProxy, connectionInfo *client);
+unsigned long long getHeaderTimeout(proxy *theProxy);
+unsigned long long getIdleTimeout(proxy *theProxy);
+unsigned long long getHandshakeTimeout(proxy *theProxy);
+
+
+
+
+/******************************************************************************
+*                        SLAB FUNCTION DECLARATIONS
+******************************************************************************/
+void initializeSlabs(proxy *theProxy);
+void initializeObjectSlab(objectSlab *slab, size_t objectSize);
+
+
+// Object Slabs
+void *allocObject(objectSlab *slab);
+void freeObject(objectSlab *slab, void *object);
+void growObjectSlab(objectSlab *slab);
+
+
+// Buffer Pool
+char *allocBuffer(proxy *theProxy, int size);
+void freeBuffer(proxy *theProxy, char *buffer);
+void dropBuffer(char *buffer);
+char *allocMappedBuffer(proxy *theProxy, int size);
+void freeMappedBuffer(proxy *theProxy, char *buffer);
+int getBufferClass(int size);
+int getBufferClassSize(int sizeClass);
+int getBufferClassLimit(int sizeClass);
+
+
+// Relay Buffers
+char *getRelayBuffer(proxy *theProxy, connectionInfo *conn, int size);
+char *getMappedRelayBuffer(proxy *theProxy, connectionInfo *conn, int size);
+bool isMappedBuffer(char *buffer);
+char *takeRelayBuffer(connectionInfo *conn);
+void releaseRelayBuffer(proxy *theProxy, connectionInfo *conn);
+
+
+
+
+/******************************************************************************
+*                        CHAIN FUNCTION DECLARATIONS
+******************************************************************************/
+void initializeChain(bufferChain *chain);
+void appendToChain(proxy *theProxy, bufferChain *chain, char *buffer, 
+        char *data, int length);
+void copyToChain(proxy *theProxy, bufferChain *chain, char *data, int length);
+void insertIntoChain(proxy *theProxy, bufferChain *chain, int offset, 
+        char *data, int length);
+void freeChain(proxy *theProxy, bufferChain *chain);
+
+
+// Chain Lookups
+int findInChain(bufferChain *chain, char *needle, int from);
+bool matchInChain(chainSegment *segment, int index, char *needle, 
+        int needleLength);
+int copyFromChain(bufferChain *chain, int offset, int length, char *dest);
+int getChainVectors(bufferChain *chain, struct iovec *vectors);
+
+
+
+
+/******************************************************************************
+*                        POOL FUNCTION DECLARATIONS
+******************************************************************************/
+void initializePool(proxy *theProxy);
+
+
+// Exchange Tracking
+httpExchange *newHttpExchange();
+void trackHttpData(httpExchange *exchange, bool isResponse, char *data, 
+        int length);
+void processHttpLine(httpExchange *exchange, httpParser *parser, 
+        bool isResponse);
+void finishHttpHeaders(httpExchange *exchange, httpParser *parser, 
+        bool isResponse);
+void finishHttpMessage(httpParser *parser);
+bool appendHttpLine(httpExchange *exchange, httpParser *parser, char *data, 
+        int length);
+bool isExchangeIdle(httpExchange *exchange);
+
+
+// Connection Pooling
+bool poolServerConnection(proxy *theProxy, int SD);
+bool adoptPooledConnection(proxy *theProxy, int SD);
+bool isPooledConnectionHealthy(pooledConnection *pooled);
+int getPoolWaitTime(proxy *theProxy);
+void expirePooledConnections(proxy *theProxy);
+
+
+// Reset Functions
+void closePooledConnection(proxy *theProxy, int poolIndex);
+void freeHttpExchange(connectionInfo *conn);
 
 
 
@@ -183,89 +1086,196 @@ void initializeRootCert(proxy *theProxy);
 
 
 // SSL Client / Server Setup
-bool setupServerCertificate(proxy *theProxy, int slot, int index);
+int selectHostContext(SSL *clientSSL, int *alert, void *proxyArg);
+bool isSameCertificateHost(proxy *theProxy, const char *requestedName, 
+        const char *connectHost);
+SSL_CTX *getHostContext(proxy *theProxy, char *hostName);
+bool forgeServerCertificate(proxy *theProxy, char *domain, X509 **cert, 
+        EVP_PKEY **key);
+SSL_CTX *newHostContext(proxy *theProxy, X509 *cert, EVP_PKEY *key);
+void getCertificateName(proxy *theProxy, char *hostName, char *certName);
 bool addSubjectAltName(X509 *cert, const char *domain);
-bool sendCertificateToClient(proxy *theProxy, int slot, int index);
-bool connectToServer(proxy *theProxy, int slot, int index);
-void connectServerSSL(proxy *theProxy, int slot, int index);
-bool populateServerStructSSL(proxy *theProxy, connectionInfo *client);
+void startClientHandshake(proxy *theProxy, int SD);
+void continueClientHandshake(proxy *theProxy, int SD);
+void startServerHandshake(proxy *theProxy, int SD);
+void continueServerHandshake(proxy *theProxy, int SD);
+void finishHandshakes(proxy *theProxy, int SD);
+void continueHandshake(proxy *theProxy, int SD);
+bool waitForHandshake(proxy *theProxy, connectionInfo *conn, SSL *sslObj, 
+        int value);
 
 
 // SSL Client To Server Relaying
-void relayClientToServerSSL(proxy *theProxy, int slot, int index);
-int readFromClientSSL(proxy *theProxy, int slot, int index, SSL *clientSSL, 
+void relayClientToServerSSL(proxy *theProxy, int SD);
+int readFromClientSSL(proxy *theProxy, int SD, SSL *clientSSL, 
         char *readBuffer, int bufferSize);
-int writeToServerSSL(proxy *theProxy, int slot, int index, SSL *serverSSL, 
+int writeToServerSSL(proxy *theProxy, int SD, SSL *serverSSL, 
         char *readBuffer, int readReturn);
 
 
 // SSL Server To Client Relaying
-void relayServerToClientSSL(proxy *theProxy, int slot, int index);
-int readFromServerSSL(proxy *theProxy, int slot, int index, SSL *serverSSL, 
+void relayServerToClientSSL(proxy *theProxy, int SD);
+int readFromServerSSL(proxy *theProxy, int SD, SSL *serverSSL, 
         char *readBuffer, int bufferSize);
-int writeToClientSSL(proxy *theProxy, int slot, int index, SSL *clientSSL, 
+int writeToClientSSL(proxy *theProxy, int SD, SSL *clientSSL, 
         char *readBuffer, int readReturn);
+int writeMessageToClientSSL(proxy *theProxy, int SD, SSL *clientSSL);
+int writeVectorToClientSSL(proxy *theProxy, int SD, SSL *clientSSL, 
+        struct iovec *vectors, int count);
+bool isMessageWithheld(connectionInfo *server);
 
 
 // Populate Client Header / Content Fields
-bool handleClientConnectionsData(proxy *theProxy, int slot, int index);
-bool populateClientRequestFields(proxy *theProxy, int slot, int index);
-bool populateClientHeaderField(proxy *theProxy, int slot, int index);
-bool populateClientContentField(proxy *theProxy, int slot, int index);
-bool getConnectionGuess(proxy *theProxy, int slot, int index);
+bool handleClientConnectionsData(proxy *theProxy, int SD);
+bool populateClientRequestFields(proxy *theProxy, int SD);
+bool populateClientHeaderField(proxy *theProxy, int SD);
+bool populateClientContentField(proxy *theProxy, int SD);
+bool getConnectionGuess(proxy *theProxy, int SD);
 
 
 // Populate Server Header / Content Fields
-bool handleServerConnectionsData(proxy *theProxy, int slot, int index);
-bool populateServerResponseFields(proxy *theProxy, int slot, int index);
-bool populateServerHeaderField(proxy *theProxy, int slot, int index);
-bool populateServerContentField(proxy *theProxy, int slot, int index);
-bool readContentChunks(proxy *theProxy, int slot, int index);
-bool readContentStream(proxy *theProxy, int slot, int index);
-bool getConnectionSolution(proxy *theProxy, int slot, int index);
-bool addDivToContent(proxy *theProxy, int slot, int index);
-bool addEmptyDivToContent(proxy *theProxy, int slot, int index);
-bool addDivToBuffer(proxy *theProxy, int slot, int index);
+bool handleServerConnectionsData(proxy *theProxy, int SD);
+bool populateServerResponseFields(proxy *theProxy, int SD);
+bool populateServerHeaderField(proxy *theProxy, int SD);
+bool populateServerContentField(proxy *theProxy, int SD);
+bool readContentChunks(proxy *theProxy, int SD);
+bool readContentStream(proxy *theProxy, int SD);
+bool getConnectionSolution(proxy *theProxy, int SD);
+bool addDivToContent(proxy *theProxy, int SD);
+bool addEmptyDivToContent(proxy *theProxy, int SD);
+bool addDivToBuffer(proxy *theProxy, int SD);
 
 
 // Header / Content Parsing Functions
-int checkEndDelimiter(proxy *theProxy, int slot, int index, char *buffer, 
+int checkEndDelimiter(proxy *theProxy, int SD, char *buffer, 
         int size);
 
-void setContentLength(proxy *theProxy, int slot, int index, int length);
-void setContentEncoding(proxy *theProxy, int slot, int index, char *buffer, 
+void setContentLength(proxy *theProxy, int SD, int length);
+void setContentEncoding(proxy *theProxy, int SD, char *buffer, 
         int bufferSize);
 char *getContentEncodingLine(proxy *theProxy, char *currentLine);
-void getContentLength(proxy *theProxy, int slot, int index, char *buffer, 
+void getContentLength(proxy *theProxy, int SD, char *buffer, 
         int bufferSize);
 char *getLengthLine(proxy *theProxy, char *currentLine);
 bool getChunkedLine(proxy *theProxy, char *currentLine);
-void removeAcceptEncoding(proxy *theProxy, int slot, int index);
+void removeAcceptEncoding(proxy *theProxy, int SD);
 bool checkAcceptEncodingLine(proxy *theProxy, char *currentLine);
 
 
 // Error Checking Functions
 void checkFatalNullSSL(void *object);
-bool checkNullErrSSL(proxy *theProxy, int slot, int index, void *object, int i);
-bool checkNegErrSSL(proxy *theProxy, int slot, int index, int value, int i);
-bool checkNegOneErrSSL(proxy *theProxy, int slot, int index, int value, int i);
+bool checkNullErrSSL(proxy *theProxy, int SD, void *object, int i);
+bool checkNegErrSSL(proxy *theProxy, int SD, int value, int i);
+bool checkNegOneErrSSL(proxy *theProxy, int SD, int value, int i);
 bool checkWantReadWrite(proxy *theProxy, SSL *sslObj, int value, int i);
 
 
 // Reset Functions
-void freeMITMFields(proxy *theProxy, int slot, int index);
+void freeMITMFields(connSession *session);
+
+
+
+
+
+/******************************************************************************
+*                     CERT CACHE FUNCTION DECLARATIONS
+******************************************************************************/
+certCache *getCertCache();
+
+
+// Cert Cache Lookups
+SSL_CTX *getCachedContext(certCache *cache, char *hostName);
+void storeCachedContext(certCache *cache, char *hostName, SSL_CTX *context);
+certCacheEntry *findCertEntry(certCache *cache, char *hostName);
+time_t getCertExpireTime(X509 *cert);
+
+
+// Cert Cache Eviction
+void linkNewestCertEntry(certCache *cache, certCacheEntry *entry);
+void unlinkCertEntry(certCache *cache, certCacheEntry *entry);
+void removeCertEntry(certCache *cache, certCacheEntry *entry);
+
+
 
 
+/******************************************************************************
+*                     CERT STORE FUNCTION DECLARATIONS
+******************************************************************************/
+certStore *openCertStore(char *path, X509 *rootCert);
+void indexCertStore(certStore *store);
+void compactCertStore(certStore *store, char *path);
+bool mapCertStore(certStore *store);
+void closeCertStore(certStore *store);
+
+
+// Cert Store Records
+bool loadStoredCertificate(certStore *store, char *hostName, X509 **cert, 
+        EVP_PKEY **key);
+void saveStoredCertificate(certStore *store, char *hostName, X509 *cert, 
+        EVP_PKEY *key);
+off_t getCertRecordLength(certRecordHeader *record);
+
+
+// Cert Store Index
+void addStoreEntry(certStore *store, char *hostName, int hostLength, 
+        off_t offset, off_t length, time_t expireTime);
+void clearStoreIndex(certStore *store);
+storeIndexEntry *findStoreEntry(certStore *store, char *hostName);
+
+
+
+
+/******************************************************************************
+*                      KEY POOL FUNCTION DECLARATIONS
+******************************************************************************/
+keyPool *startKeyPool(int keyType);
+int getLeafKeyType(char *name);
+
+
+// Key Generation
+void *runKeyGenerator(void *keyPoolArg);
+EVP_PKEY *takePooledKey(keyPool *pool);
+EVP_PKEY *generateLeafKey(int keyType);
+
+
+
+
+/******************************************************************************
+*                    PUBLIC SUFFIX FUNCTION DECLARATIONS
+******************************************************************************/
+char *getRegistrableDomain(char *hostName);
+char *getPublicSuffix(char *hostName);
+bool hasSuffixRule(const char *prefix, char *suffix);
+
 
 
 
 /******************************************************************************
 *                       TUNNEL FUNCTION DECLARATIONS
 ******************************************************************************/
-void setupTunnelToServer(proxy *theProxy, int slot, int index);
-void populateServerStruct(proxy *theProxy, int serverSD, connectionInfo *client);
-void relayClientToServer(proxy *theProxy, int slot, int index);
-void relayServerToClient(proxy *theProxy, int slot, int index);
+void setupTunnelToServer(proxy *theProxy, int SD);
+connectionInfo *populateServerStruct(proxy *theProxy, int serverSD, 
+        connectionInfo *client);
+bool setupSplicePipe(connectionInfo *conn);
+void relayTunnelSplice(proxy *theProxy, int SD);
+void relayClientToServer(proxy *theProxy, int SD);
+void relayServerToClient(proxy *theProxy, int SD);
+
+
+// Zero Copy Sending
+void enableZerocopy(connectionInfo *conn, int SD);
+char *getTunnelBuffer(proxy *theProxy, connectionInfo *conn, int size);
+bool writeTunnelData(proxy *theProxy, int SD, int writeSD, 
+        char *buffer, int length);
+bool checkZerocopyEvent(proxy *theProxy, int SD);
+bool reapZerocopyCompletions(proxy *theProxy, connectionInfo *conn, int SD);
+void releaseZerocopyBuffers(proxy *theProxy, connectionInfo *conn, 
+        unsigned int lastDone);
+
+
+// Reset Functions
+void closeSplicePipe(connectionInfo *conn);
+void freeZerocopyBuffers(proxy *theProxy, connectionInfo *conn);
 
 
 
@@ -282,8 +1292,8 @@ void populateFinalDiv(proxy *theProxy, char *cat1, char *cat2, char *cat3,
 size_t writeCallbackLLM(void *ptr, size_t size, size_t nmemb, char *data);
 void makeProxyRequestLLM(char *model, char *system, char *query, char *response);
 void formatConnectionsSolution(proxy *theProxy, char *connSol);
-bool checkHintRegeneration(proxy *theProxy, int slot, int index);
-void sendNewlyGeneratedHints(proxy *theProxy, int slot, int index);
+bool checkHintRegeneration(proxy *theProxy, int SD);
+void sendNewlyGeneratedHints(proxy *theProxy, int SD);
 
 
 #endif
\ No newline at end of file
@@ -17,9 +17,14 @@
 #include "include.h"
 #include "proxy.h"
 #include "logging.h"
+#include <curl/curl.h>
+
+#define TUNNEL 0
+#define MITM 1
 
 
 int getProxyMode(char *modeCommand);
+void getProxyOptions(proxyOptions *options, int argc, char *argv[]);
 void printUsage();
 
 
@@ -39,23 +44,52 @@ int main(int argc, char *argv[])
         int port = atoi(argv[1]);
         int mode = getProxyMode(argv[2]);
 
+        proxyOptions options;
+        getProxyOptions(&options, argc, argv);
+
         OpenSSL_add_all_algorithms();
         ERR_load_crypto_strings();
         SSL_library_init();
         SSL_load_error_strings();
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+
+        raiseFileLimit();
 
         cacheInfo *thisCache = newCache(100);
-        proxy *thisProxy = newProxy(port, thisCache, mode);
+        proxy **workers = malloc(options.numWorkers * sizeof(proxy *));
+        checkFatalNull(workers);
+        keyPool *leafKeys = NULL;
+        if (mode == MITM) {
+                leafKeys = startKeyPool(options.leafKeyType);
+        }
 
+        for (int i = 0; i < options.numWorkers; i++) {
+                workers[i] = newProxy(port, thisCache, mode);
+                workers[i]->workerID = i;
+                workers[i]->options = &options;
+                workers[i]->keyPool = leafKeys;
 
-        initializeClientContext(thisProxy);
-        initializeRootCert(thisProxy);
-        initializeCategories(thisProxy);
-        proxyListening(thisProxy);
+                initializeClientContext(workers[i]);
+                initializeRootCert(workers[i]);
+                initializeCategories(workers[i]);
+        }
+
+        // the store is shared, every worker loaded the same root certificate
+        if (mode == MITM) {
+                certStore *store = openCertStore(options.certStorePath, 
+                        workers[0]->rootCert);
+                for (int i = 0; i < options.numWorkers; i++) {
+                        workers[i]->certStore = store;
+                }
+        }
+        startProxyWorkers(workers, options.numWorkers);
 
         // freeMemory(thisCache);
-        X509_free(thisProxy->rootCert);
-        EVP_PKEY_free(thisProxy->rootKey);
+        for (int i = 0; i < options.numWorkers; i++) {
+                X509_free(workers[i]->rootCert);
+                EVP_PKEY_free(workers[i]->rootKey);
+        }
+        free(workers);
 
 
         return EXIT_SUCCESS;
@@ -95,6 +129,105 @@ int getProxyMode(char *modeCommand)
 }
 
 
+/*
+ * name:      getProxyOptions
+ * purpose:   gets the optional settings that follow the mode on the command 
+ *            line
+ * arguments: the options to populate, argc, argv
+ * returns:   none
+ * effects:   exits the program if an option is not recognized
+ */
+void getProxyOptions(proxyOptions *options, int argc, char *argv[])
+{
+        options->numWorkers = 1;
+        options->useUring = false;
+        options->connectTimeout = 10;
+        options->dnsServer = NULL;
+        options->dnsTimeout = 5;
+        options->headerTimeout = 10;
+        options->handshakeTimeout = 10;
+        options->idleTimeout = 300;
+        options->leafKeyType = LEAF_KEY_EC;
+        options->certStorePath = "certs/forged.store";
+        options->wildcardCerts = false;
+        options->useZerocopy = false;
+
+        for (int i = 3; i < argc; i++) {
+                if (strncmp(argv[i], "--threads=", 10) == 0) {
+                        options->numWorkers = atoi(argv[i] + 10);
+                        if (options->numWorkers < 1) {
+                                printf("Invalid number of threads.\n");
+                                printUsage();
+                        }
+                } 
+                else if (strcmp(argv[i], "--io=uring") == 0) {
+                        options->useUring = true;
+                }
+                else if (strcmp(argv[i], "--io=epoll") == 0) {
+                        options->useUring = false;
+                }
+                else if (strcmp(argv[i], "--zerocopy") == 0) {
+                        options->useZerocopy = true;
+                }
+                else if (strncmp(argv[i], "--connect-timeout=", 18) == 0) {
+                        options->connectTimeout = atoi(argv[i] + 18);
+                        if (options->connectTimeout < 1) {
+                                printf("Invalid connect timeout.\n");
+                                printUsage();
+                        }
+                }
+                else if (strncmp(argv[i], "--dns=", 6) == 0) {
+                        options->dnsServer = argv[i] + 6;
+                }
+                else if (strncmp(argv[i], "--dns-timeout=", 14) == 0) {
+                        options->dnsTimeout = atoi(argv[i] + 14);
+                        if (options->dnsTimeout < 1) {
+                                printf("Invalid DNS timeout.\n");
+                                printUsage();
+                        }
+                }
+                else if (strncmp(argv[i], "--header-timeout=", 17) == 0) {
+                        options->headerTimeout = atoi(argv[i] + 17);
+                        if (options->headerTimeout < 1) {
+                                printf("Invalid header timeout.\n");
+                                printUsage();
+                        }
+                }
+                else if (strncmp(argv[i], "--handshake-timeout=", 20) == 0) {
+                        options->handshakeTimeout = atoi(argv[i] + 20);
+                        if (options->handshakeTimeout < 1) {
+                                printf("Invalid handshake timeout.\n");
+                                printUsage();
+                        }
+                }
+                else if (strncmp(argv[i], "--idle-timeout=", 15) == 0) {
+                        options->idleTimeout = atoi(argv[i] + 15);
+                        if (options->idleTimeout < 1) {
+                                printf("Invalid idle timeout.\n");
+                                printUsage();
+                        }
+                }
+                else if (strncmp(argv[i], "--leaf-key=", 11) == 0) {
+                        options->leafKeyType = getLeafKeyType(argv[i] + 11);
+                        if (options->leafKeyType == -1) {
+                                printf("Invalid leaf key type.\n");
+                                printUsage();
+                        }
+                }
+                else if (strncmp(argv[i], "--cert-store=", 13) == 0) {
+                        options->certStorePath = argv[i] + 13;
+                }
+                else if (strcmp(argv[i], "--wildcard-certs") == 0) {
+                        options->wildcardCerts = true;
+                }
+                else {
+                        printf("Invalid option %s.\n", argv[i]);
+                        printUsage();
+                }
+        }
+}
+
+
 /*
  * name:      printUsage
  * purpose:   prints the usage when the user enters the wrong commands
@@ -104,10 +237,33 @@ int getProxyMode(char *modeCommand)
  */
 void printUsage()
 {
-        printf("\nUsage: ./proxy port --mode=<mode>\n");
+        printf("\nUsage: ./proxy port --mode=<mode> [options]\n");
         printf("Available modes: \n");
         printf("  tunnel: the proxy won't decrypt any requests\n");
-        printf("  MITM: the proxy will decrypt all traffic\n\n");
+        printf("  MITM: the proxy will decrypt all traffic\n");
+        printf("Available options: \n");
+        printf("  --threads=<n>: number of worker threads (default 1)\n");
+        printf("  --io=<epoll|uring>: I/O backend for tunnels (default epoll)\n");
+        printf("  --zerocopy: relay epoll tunnels through buffers and send "
+                "large writes with MSG_ZEROCOPY instead of splicing\n");
+        printf("  --connect-timeout=<s>: seconds to wait for a server to "
+                "accept the connection (default 10)\n");
+        printf("  --dns=<ip[:port]>: name server to query (default from "
+                "/etc/resolv.conf)\n");
+        printf("  --dns-timeout=<s>: seconds to wait for a name to resolve "
+                "(default 5)\n");
+        printf("  --header-timeout=<s>: seconds a client has to send its "
+                "CONNECT request (default 10)\n");
+        printf("  --handshake-timeout=<s>: seconds the TLS handshakes of a "
+                "MITM connection can take (default 10)\n");
+        printf("  --idle-timeout=<s>: seconds a connection can go without "
+                "traffic (default 300)\n");
+        printf("  --leaf-key=<ec|ed25519|rsa>: key type of the forged "
+                "certificates in MITM mode (default ec)\n");
+        printf("  --cert-store=<path>: file the forged certificates are kept "
+                "in across restarts (default certs/forged.store)\n");
+        printf("  --wildcard-certs: forge one wildcard certificate per "
+                "domain in MITM mode instead of one per host\n\n");
         exit(EXIT_FAILURE);
 }
 
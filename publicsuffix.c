@@ -0,0 +1,161 @@
+/*****************************************************************************
+ *
+ *      publicsuffix.c
+ *
+ *      Isabel Muste (imuste01)
+ *      Marti Zentmaier (mzentm01)
+ *
+ *      11/10/2024
+ *
+ *      CS 112 Final Project
+ *
+ *      Contains the public suffix list used to find the registrable domain
+ *      of a host, the part of its name that one owner controls (example.com
+ *      for img1.example.com, example.co.uk for www.example.co.uk). With
+ *      wildcard certificates, the hosts of a site share one forged
+ *      certificate, which must never be issued for a public suffix itself.
+ *      The list embeds the rules of the public suffix list for the suffixes
+ *      most hosts fall under, in the same format: "*." rules match any one
+ *      label and "!" rules are exceptions to them. Any top level domain that
+ *      isn't listed is a public suffix of its own.
+ *
+ *
+ *****************************************************************************/
+
+#include "proxy.h"
+#include "logging.h"
+
+#define SUFFIX_RULE_LENGTH 256
+
+// sorted, so a rule can be found with a binary search
+static const char *suffixRules[] = {
+        "!www.ck", "*.bd", "*.ck", "*.compute.amazonaws.com", "*.er", "*.fk",
+        "*.jm", "*.kh", "*.mm", "*.np", "*.pg", "ac.id", "ac.il", "ac.in",
+        "ac.jp", "ac.kr", "ac.nz", "ac.th", "ac.uk", "ac.za", "ad.jp",
+        "appspot.com", "asn.au", "azurewebsites.net", "blogspot.com",
+        "cloudapp.net", "cloudfront.net", "co.id", "co.il", "co.in", "co.jp",
+        "co.ke", "co.kr", "co.nz", "co.th", "co.uk", "co.ve", "co.za",
+        "com.ar", "com.au", "com.br", "com.cn", "com.co", "com.eg", "com.es",
+        "com.hk", "com.mx", "com.my", "com.ng", "com.pe", "com.ph", "com.pk",
+        "com.pl", "com.ru", "com.sa", "com.sg", "com.tr", "com.tw", "com.ua",
+        "com.ve", "com.vn", "ed.jp", "edu.au", "edu.br", "edu.cn", "edu.eg",
+        "edu.hk", "edu.in", "edu.mx", "edu.sa", "edu.sg", "edu.tr", "edu.tw",
+        "firebaseapp.com", "firm.in", "geek.nz", "gen.in", "gen.nz",
+        "github.io", "githubusercontent.com", "gitlab.io", "go.id", "go.jp",
+        "go.kr", "go.th", "gob.ar", "gob.mx", "gov.au", "gov.br", "gov.cn",
+        "gov.eg", "gov.hk", "gov.il", "gov.in", "gov.sa", "gov.sg", "gov.tr",
+        "gov.tw", "gov.uk", "gov.za", "govt.nz", "gr.jp", "herokuapp.com",
+        "id.au", "in.th", "ind.in", "lg.jp", "ltd.uk", "me.uk", "ne.jp",
+        "ne.kr", "net.ar", "net.au", "net.br", "net.cn", "net.co", "net.hk",
+        "net.in", "net.mx", "net.my", "net.nz", "net.ph", "net.pk", "net.pl",
+        "net.sg", "net.tr", "net.tw", "net.ua", "net.uk", "net.vn", "net.za",
+        "netlify.app", "nhs.uk", "or.id", "or.jp", "or.ke", "or.kr", "or.th",
+        "org.ar", "org.au", "org.br", "org.cn", "org.co", "org.es", "org.hk",
+        "org.il", "org.in", "org.mx", "org.my", "org.ng", "org.nz", "org.pe",
+        "org.ph", "org.pk", "org.pl", "org.sg", "org.tr", "org.tw", "org.ua",
+        "org.uk", "org.vn", "org.za", "pages.dev", "plc.uk", "police.uk",
+        "s3.amazonaws.com", "sch.uk", "school.nz", "vercel.app", "web.app",
+        "workers.dev"
+};
+
+static const int numSuffixRules = sizeof(suffixRules) / sizeof(char *);
+static int compareSuffixRule(const void *key, const void *rule);
+
+
+
+/*****************************************************************************
+*                            REGISTRABLE DOMAINS
+******************************************************************************/
+
+
+/*
+ * name:      getRegistrableDomain
+ * purpose:   finds the registrable domain of a host name, the public suffix
+ *            the name ends in plus the label before it
+ * arguments: the host name, in lower case
+ * returns:   a pointer to the registrable domain within the host name, or
+ *            NULL if the name is a public suffix itself
+ * effects:   none
+ */
+char *getRegistrableDomain(char *hostName)
+{
+        char *suffix = getPublicSuffix(hostName);
+        if (suffix == hostName) {
+                return NULL;
+        }
+
+        // step back over the dot and the label before the suffix
+        char *domain = suffix - 1;
+        while (domain > hostName && *(domain - 1) != '.') {
+                domain--;
+        }
+        if (domain == suffix - 1) {
+                return NULL;
+        }
+        return domain;
+}
+
+
+/*
+ * name:      getPublicSuffix
+ * purpose:   finds the longest public suffix a host name ends in. Exception
+ *            rules take precedence, and a name no rule matches ends in its
+ *            top level domain
+ * arguments: the host name, in lower case
+ * returns:   a pointer to the public suffix within the host name
+ * effects:   none
+ */
+char *getPublicSuffix(char *hostName)
+{
+        char *topLevel = strrchr(hostName, '.');
+        topLevel = (topLevel == NULL) ? hostName : topLevel + 1;
+
+        // try the suffixes from the whole name down, the first match is the
+        // longest
+        for (char *suffix = hostName; suffix < topLevel;
+                suffix = strchr(suffix, '.') + 1) {
+                char *parent = strchr(suffix, '.') + 1;
+                if (hasSuffixRule("!", suffix)) {
+                        return parent;
+                }
+                if (hasSuffixRule("", suffix)
+                        || hasSuffixRule("*.", parent)) {
+                        return suffix;
+                }
+        }
+        return topLevel;
+}
+
+
+/*
+ * name:      hasSuffixRule
+ * purpose:   checks if the list holds a rule for a suffix
+ * arguments: the kind of rule ("" for exact rules, "*." for wildcard rules
+ *            and "!" for exceptions), the suffix
+ * returns:   true if the rule is in the list, false otherwise
+ * effects:   none
+ */
+bool hasSuffixRule(const char *prefix, char *suffix)
+{
+        char rule[SUFFIX_RULE_LENGTH];
+        int length = snprintf(rule, sizeof(rule), "%s%s", prefix, suffix);
+        if (length >= (int)sizeof(rule)) {
+                return false;
+        }
+        return bsearch(rule, suffixRules, numSuffixRules, sizeof(char *),
+                compareSuffixRule) != NULL;
+}
+
+
+/*
+ * name:      compareSuffixRule
+ * purpose:   compares a rule to an entry of the list for the binary search
+ * arguments: the rule, a pointer to the entry
+ * returns:   less than, equal to or greater than 0 as the rule sorts before,
+ *            the same as or after the entry
+ * effects:   none
+ */
+static int compareSuffixRule(const void *key, const void *rule)
+{
+        return strcmp((const char *)key, *(const char **)rule);
+}
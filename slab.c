@@ -0,0 +1,457 @@
+/*****************************************************************************
+ *
+ *      slab.c
+ *
+ *      Isabel Muste (imuste01)
+ *      Marti Zentmaier (mzentm01)
+ *
+ *      11/10/2024
+ *
+ *      CS 112 Final Project
+ *
+ *      Contains the memory recycling of a worker. The fixed size objects of
+ *      a connection (its struct and details, its session, output chunks,
+ *      zerocopy and connect race records) are carved from slabs and kept on a
+ *      free list when released, and the buffers data is read into are handed
+ *      out from power of two size classes and kept for the next read once 
+ *      they are freed. A worker that keeps the same number of connections 
+ *      open thus stops calling malloc and free once it has warmed up. 
+ *      Buffers sent with MSG_ZEROCOPY are mapped separately, so the pages of 
+ *      one the kernel may still send from are never reused by malloc.
+ *
+ *
+ *****************************************************************************/
+
+#include "proxy.h"
+#include "logging.h"
+
+#define SLAB_OBJECTS 64
+
+#define BUFFER_HEADER 16
+#define BUFFER_MIN_SHIFT 8
+#define BUFFER_OVERSIZE -1
+#define BUFFER_MAPPED -2
+#define MAPPED_BUFFER_LIMIT 64
+#define BUFFER_CLASS_BYTES (4 * 1024 * 1024)
+#define BUFFER_CLASS_MIN_FREE 8
+
+
+
+/*****************************************************************************
+*                                SLAB SETUP
+******************************************************************************/
+
+
+/*
+ * name:      initializeSlabs
+ * purpose:   creates the slabs and the empty buffer pool of a worker
+ * arguments: the proxy instance
+ * returns:   none
+ * effects:   sets the proxy's slabs field
+ */
+void initializeSlabs(proxy *theProxy)
+{
+        DEBUG_PRINT("FUNCTION: initializeSlabs\n");
+        slabAllocator *slabs = malloc(sizeof(slabAllocator));
+        checkFatalNull(slabs);
+
+        initializeObjectSlab(&slabs->connections, sizeof(connectionInfo));
+        initializeObjectSlab(&slabs->details, sizeof(connDetails));
+        initializeObjectSlab(&slabs->sessions, sizeof(connSession));
+        initializeObjectSlab(&slabs->outputChunks, sizeof(outputChunk));
+        initializeObjectSlab(&slabs->zerocopyBuffers, sizeof(zerocopyBuffer));
+        initializeObjectSlab(&slabs->connectRaces, sizeof(connectRace));
+        initializeObjectSlab(&slabs->chainSegments, sizeof(chainSegment));
+
+        for (int i = 0; i < BUFFER_CLASSES; i++) {
+                slabs->freeBuffers[i] = NULL;
+                slabs->numFreeBuffers[i] = 0;
+        }
+        slabs->freeMappedBuffers = NULL;
+        slabs->numFreeMapped = 0;
+
+        theProxy->slabs = slabs;
+}
+
+
+/*
+ * name:      initializeObjectSlab
+ * purpose:   sets up an empty slab for objects of one size
+ * arguments: the slab, the size of its objects
+ * returns:   none
+ * effects:   none
+ */
+void initializeObjectSlab(objectSlab *slab, size_t objectSize)
+{
+        // a free object stores the next free object in its first bytes
+        if (objectSize < sizeof(void *)) {
+                objectSize = sizeof(void *);
+        }
+        slab->objectSize = (objectSize + sizeof(void *) - 1) &
+                ~(sizeof(void *) - 1);
+        slab->freeList = NULL;
+        slab->numBlocks = 0;
+}
+
+
+
+
+/*****************************************************************************
+*                               OBJECT SLABS
+******************************************************************************/
+
+
+/*
+ * name:      allocObject
+ * purpose:   takes an object off the free list of a slab, carving a new
+ *            block of objects when the list is empty
+ * arguments: the slab
+ * returns:   the object, its contents are left undefined
+ * effects:   none
+ */
+void *allocObject(objectSlab *slab)
+{
+        if (slab->freeList == NULL) {
+                growObjectSlab(slab);
+        }
+
+        void *object = slab->freeList;
+        slab->freeList = *(void **)object;
+        return object;
+}
+
+
+/*
+ * name:      freeObject
+ * purpose:   puts an object back on the free list of its slab
+ * arguments: the slab, the object
+ * returns:   none
+ * effects:   none
+ */
+void freeObject(objectSlab *slab, void *object)
+{
+        if (object == NULL) {
+                return;
+        }
+        *(void **)object = slab->freeList;
+        slab->freeList = object;
+}
+
+
+/*
+ * name:      growObjectSlab
+ * purpose:   allocates a block of objects at once and links all of them onto
+ *            the free list, so neighbouring connections sit next to each
+ *            other in memory
+ * arguments: the slab
+ * returns:   none
+ * effects:   the block is never freed, the slab keeps its peak size
+ */
+void growObjectSlab(objectSlab *slab)
+{
+        DEBUG_PRINT("FUNCTION: growObjectSlab\n");
+        char *block = malloc(SLAB_OBJECTS * slab->objectSize);
+        checkFatalNull(block);
+        slab->numBlocks++;
+
+        for (int i = SLAB_OBJECTS - 1; i >= 0; i--) {
+                void *object = block + i * slab->objectSize;
+                *(void **)object = slab->freeList;
+                slab->freeList = object;
+        }
+}
+
+
+
+
+/*****************************************************************************
+*                               BUFFER POOL
+******************************************************************************/
+
+
+/*
+ * name:      allocBuffer
+ * purpose:   hands out a buffer of at least the given size from the free
+ *            list of its size class. Sizes above the largest class are
+ *            allocated directly
+ * arguments: the proxy instance, the size needed in bytes
+ * returns:   the buffer, or NULL if it couldn't be allocated
+ * effects:   none
+ */
+char *allocBuffer(proxy *theProxy, int size)
+{
+        int sizeClass = getBufferClass(size);
+        slabAllocator *slabs = theProxy->slabs;
+
+        char *block = NULL;
+        if (sizeClass != BUFFER_OVERSIZE &&
+                slabs->freeBuffers[sizeClass] != NULL) {
+                block = slabs->freeBuffers[sizeClass];
+                slabs->freeBuffers[sizeClass] = *(char **)block;
+                slabs->numFreeBuffers[sizeClass]--;
+        }
+        else {
+                int blockSize = (sizeClass == BUFFER_OVERSIZE) ? size :
+                        getBufferClassSize(sizeClass);
+                block = malloc(BUFFER_HEADER + blockSize);
+                if (block == NULL) {
+                        return NULL;
+                }
+        }
+
+        *(int *)block = sizeClass;
+        return block + BUFFER_HEADER;
+}
+
+
+/*
+ * name:      freeBuffer
+ * purpose:   returns a buffer to the free list of its size class for the
+ *            next read, unless the class already keeps enough free buffers
+ * arguments: the proxy instance, the buffer
+ * returns:   none
+ * effects:   none
+ */
+void freeBuffer(proxy *theProxy, char *buffer)
+{
+        if (buffer == NULL) {
+                return;
+        }
+
+        char *block = buffer - BUFFER_HEADER;
+        int sizeClass = *(int *)block;
+        slabAllocator *slabs = theProxy->slabs;
+        if (sizeClass == BUFFER_MAPPED) {
+                freeMappedBuffer(theProxy, buffer);
+                return;
+        }
+        if (sizeClass == BUFFER_OVERSIZE || slabs->numFreeBuffers[sizeClass] >= 
+                getBufferClassLimit(sizeClass)) {
+                free(block);
+                return;
+        }
+
+        *(char **)block = slabs->freeBuffers[sizeClass];
+        slabs->freeBuffers[sizeClass] = block;
+        slabs->numFreeBuffers[sizeClass]++;
+}
+
+
+/*
+ * name:      dropBuffer
+ * purpose:   frees a buffer without keeping it for reuse, for buffers whose
+ *            memory the kernel may still read from. Only mapped buffers are
+ *            sent with MSG_ZEROCOPY, and unmapping one leaves its pages to
+ *            the kernel until it is done with them
+ * arguments: the buffer
+ * returns:   none
+ * effects:   none
+ */
+void dropBuffer(char *buffer)
+{
+        if (buffer == NULL) {
+                return;
+        }
+
+        char *block = buffer - BUFFER_HEADER;
+        if (*(int *)block == BUFFER_MAPPED) {
+                munmap(block, *(size_t *)(block + sizeof(char *)));
+                return;
+        }
+        free(block);
+}
+
+
+/*
+ * name:      allocMappedBuffer
+ * purpose:   hands out a buffer with pages of its own for MSG_ZEROCOPY sends,
+ *            reusing one the kernel reported as sent if it is large enough
+ * arguments: the proxy instance, the size needed in bytes
+ * returns:   the buffer, or NULL if it couldn't be mapped
+ * effects:   none
+ */
+char *allocMappedBuffer(proxy *theProxy, int size)
+{
+        slabAllocator *slabs = theProxy->slabs;
+        size_t length = BUFFER_HEADER + size;
+
+        // a free mapped buffer keeps its length behind the free list link
+        char *block = slabs->freeMappedBuffers;
+        if (block != NULL && *(size_t *)(block + sizeof(char *)) >= length) {
+                slabs->freeMappedBuffers = *(char **)block;
+                slabs->numFreeMapped--;
+                length = *(size_t *)(block + sizeof(char *));
+        }
+        else {
+                block = mmap(NULL, length, PROT_READ | PROT_WRITE, 
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (block == MAP_FAILED) {
+                        return NULL;
+                }
+        }
+
+        *(int *)block = BUFFER_MAPPED;
+        *(size_t *)(block + sizeof(char *)) = length;
+        return block + BUFFER_HEADER;
+}
+
+
+/*
+ * name:      freeMappedBuffer
+ * purpose:   keeps a mapped buffer the kernel is done with for the next 
+ *            zerocopy read, or unmaps it if enough are kept already
+ * arguments: the proxy instance, the buffer
+ * returns:   none
+ * effects:   none
+ */
+void freeMappedBuffer(proxy *theProxy, char *buffer)
+{
+        slabAllocator *slabs = theProxy->slabs;
+        char *block = buffer - BUFFER_HEADER;
+        if (slabs->numFreeMapped >= MAPPED_BUFFER_LIMIT) {
+                munmap(block, *(size_t *)(block + sizeof(char *)));
+                return;
+        }
+
+        *(char **)block = slabs->freeMappedBuffers;
+        slabs->freeMappedBuffers = block;
+        slabs->numFreeMapped++;
+}
+
+
+/*
+ * name:      getBufferClass
+ * purpose:   finds the smallest size class a buffer of the given size fits in
+ * arguments: the size in bytes
+ * returns:   the size class, or BUFFER_OVERSIZE if no class is large enough
+ * effects:   none
+ */
+int getBufferClass(int size)
+{
+        for (int i = 0; i < BUFFER_CLASSES; i++) {
+                if (size <= getBufferClassSize(i)) {
+                        return i;
+                }
+        }
+        return BUFFER_OVERSIZE;
+}
+
+
+/*
+ * name:      getBufferClassSize
+ * purpose:   gets the size of the buffers in a size class
+ * arguments: the size class
+ * returns:   the size in bytes
+ * effects:   none
+ */
+int getBufferClassSize(int sizeClass)
+{
+        return 1 << (BUFFER_MIN_SHIFT + sizeClass);
+}
+
+
+/*
+ * name:      getBufferClassLimit
+ * purpose:   gets how many free buffers a size class keeps, so the pool of
+ *            each class holds at most a few megabytes once connections close
+ * arguments: the size class
+ * returns:   the number of free buffers
+ * effects:   none
+ */
+int getBufferClassLimit(int sizeClass)
+{
+        int limit = BUFFER_CLASS_BYTES / getBufferClassSize(sizeClass);
+        return (limit < BUFFER_CLASS_MIN_FREE) ? BUFFER_CLASS_MIN_FREE : limit;
+}
+
+
+
+
+/*****************************************************************************
+*                              RELAY BUFFERS
+******************************************************************************/
+
+
+/*
+ * name:      getRelayBuffer
+ * purpose:   gets the buffer a connection reads relayed data into. The 
+ *            connection keeps the buffer between reads while data keeps 
+ *            arriving, and only takes one from the buffer pool after it 
+ *            went idle or handed its last buffer on
+ * arguments: the proxy instance, the connection struct, the size needed
+ * returns:   the buffer, or NULL if it couldn't be allocated
+ * effects:   none
+ */
+char *getRelayBuffer(proxy *theProxy, connectionInfo *conn, int size)
+{
+        if (conn->relayBuffer == NULL) {
+                conn->relayBuffer = allocBuffer(theProxy, size);
+        }
+        return conn->relayBuffer;
+}
+
+
+/*
+ * name:      getMappedRelayBuffer
+ * purpose:   gets the buffer a connection reads relayed data into when its 
+ *            peer is sent to with MSG_ZEROCOPY, which has to be a mapped 
+ *            buffer
+ * arguments: the proxy instance, the connection struct, the size needed
+ * returns:   the buffer, or NULL if it couldn't be allocated
+ * effects:   replaces a relay buffer from the buffer pool
+ */
+char *getMappedRelayBuffer(proxy *theProxy, connectionInfo *conn, int size)
+{
+        if (conn->relayBuffer != NULL && !isMappedBuffer(conn->relayBuffer)) {
+                releaseRelayBuffer(theProxy, conn);
+        }
+        if (conn->relayBuffer == NULL) {
+                conn->relayBuffer = allocMappedBuffer(theProxy, size);
+        }
+        return conn->relayBuffer;
+}
+
+
+/*
+ * name:      isMappedBuffer
+ * purpose:   checks if a buffer was mapped for zerocopy sends
+ * arguments: the buffer
+ * returns:   true if it was, false if it came from the buffer pool
+ * effects:   none
+ */
+bool isMappedBuffer(char *buffer)
+{
+        return *(int *)(buffer - BUFFER_HEADER) == BUFFER_MAPPED;
+}
+
+
+/*
+ * name:      takeRelayBuffer
+ * purpose:   detaches the relay buffer from its connection, for when the 
+ *            data in it has to outlive the read, such as when it is queued
+ * arguments: the connection struct
+ * returns:   the buffer, which the caller now owns
+ * effects:   the next read takes a new buffer from the pool
+ */
+char *takeRelayBuffer(connectionInfo *conn)
+{
+        char *buffer = conn->relayBuffer;
+        conn->relayBuffer = NULL;
+        return buffer;
+}
+
+
+/*
+ * name:      releaseRelayBuffer
+ * purpose:   returns a connection's relay buffer to the buffer pool once the 
+ *            connection has no more data waiting, so idle connections don't 
+ *            hold on to a buffer each
+ * arguments: the proxy instance, the connection struct
+ * returns:   none
+ * effects:   none
+ */
+void releaseRelayBuffer(proxy *theProxy, connectionInfo *conn)
+{
+        freeBuffer(theProxy, conn->relayBuffer);
+        conn->relayBuffer = NULL;
+}
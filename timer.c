@@ -0,0 +1,546 @@
+/*****************************************************************************
+ *
+ *      timer.c
+ *
+ *      Isabel Muste (imuste01)
+ *      Marti Zentmaier (mzentm01)
+ *
+ *      11/10/2024
+ *
+ *      CS 112 Final Project
+ *
+ *      Contains the hierarchical timer wheel of a worker. Every socket has
+ *      at most one timer, indexed by its descriptor, which times the phase
+ *      the connection is in: the client sending its CONNECT request, a
+ *      connect to the server, the TLS handshakes of a MITM connection or
+ *      the relaying of an established connection.
+ *      Starting and stopping a timer only links or unlinks it from a wheel
+ *      slot, and timers far in the future sit on the higher levels of the
+ *      wheel until they are cascaded down as the time they expire at nears,
+ *      so the event loop never scans every connection.
+ *
+ *
+ *****************************************************************************/
+
+#include "proxy.h"
+#include "logging.h"
+
+#define TIMER_TICK 10000000ULL
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS 64
+#define TIMER_SLOT_MASK 63
+
+#define HEADER_TIMEOUT 10
+#define IDLE_TIMEOUT 300
+#define HANDSHAKE_TIMEOUT 10
+
+
+
+/*****************************************************************************
+*                               TIMER SETUP
+******************************************************************************/
+
+
+/*
+ * name:      initializeTimers
+ * purpose:   creates the timer wheel of the worker, with every slot empty
+ *            and the wheel set to the current time
+ * arguments: the proxy instance
+ * returns:   none
+ * effects:   sets the proxy's timers field
+ */
+void initializeTimers(proxy *theProxy)
+{
+        DEBUG_PRINT("FUNCTION: initializeTimers\n");
+        timerWheel *wheel = malloc(sizeof(timerWheel));
+        checkFatalNull(wheel);
+
+        wheel->slots = malloc(TIMER_LEVELS * TIMER_SLOTS * sizeof(int));
+        checkFatalNull(wheel->slots);
+        for (int i = 0; i < TIMER_LEVELS * TIMER_SLOTS; i++) {
+                wheel->slots[i] = -1;
+        }
+
+        wheel->timers = NULL;
+        wheel->maxTimers = 0;
+        wheel->numTimers = 0;
+
+        theProxy->loopTime = getCurrTime(theProxy->theCache);
+        wheel->currTick = theProxy->loopTime / TIMER_TICK;
+        theProxy->timers = wheel;
+}
+
+
+/*
+ * name:      getTimer
+ * purpose:   gets the timer of a socket, growing the table of timers if the
+ *            descriptor is larger than any seen before
+ * arguments: the timer wheel, the socket descriptor
+ * returns:   the timer of the socket
+ * effects:   none
+ */
+timerEntry *getTimer(timerWheel *wheel, int SD)
+{
+        if (SD >= wheel->maxTimers) {
+                int newSize = (wheel->maxTimers == 0) ? 1024 : wheel->maxTimers;
+                while (newSize <= SD) {
+                        newSize *= 2;
+                }
+
+                wheel->timers = realloc(wheel->timers,
+                        newSize * sizeof(timerEntry));
+                checkFatalNull(wheel->timers);
+                for (int i = wheel->maxTimers; i < newSize; i++) {
+                        wheel->timers[i].phase = TIMER_NONE;
+                        wheel->timers[i].slot = -1;
+                }
+                wheel->maxTimers = newSize;
+        }
+
+        return &wheel->timers[SD];
+}
+
+
+
+
+/*****************************************************************************
+*                            STARTING / STOPPING
+******************************************************************************/
+
+
+/*
+ * name:      startTimer
+ * purpose:   starts the timer of a socket for a phase of its connection,
+ *            replacing the timer it had running
+ * arguments: the proxy instance, the socket descriptor, the phase, the time
+ *            from now until the timer expires in nanoseconds
+ * returns:   none
+ * effects:   none
+ */
+void startTimer(proxy *theProxy, int SD, int phase, unsigned long long delay)
+{
+        timerWheel *wheel = theProxy->timers;
+        if (wheel == NULL || SD < 0) {
+                return;
+        }
+        stopTimer(theProxy, SD);
+
+        // round up so the timer never expires before its time
+        timerEntry *timer = getTimer(wheel, SD);
+        timer->phase = phase;
+        timer->expireTick = (getCurrTime(theProxy->theCache) + delay +
+                TIMER_TICK - 1) / TIMER_TICK;
+        if (timer->expireTick <= wheel->currTick) {
+                timer->expireTick = wheel->currTick + 1;
+        }
+        linkTimer(wheel, SD);
+        wheel->numTimers++;
+}
+
+
+/*
+ * name:      stopTimer
+ * purpose:   stops the timer of a socket if it has one running
+ * arguments: the proxy instance, the socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void stopTimer(proxy *theProxy, int SD)
+{
+        timerWheel *wheel = theProxy->timers;
+        if (wheel == NULL || SD < 0 || SD >= wheel->maxTimers ||
+                wheel->timers[SD].slot == -1) {
+                return;
+        }
+
+        unlinkTimer(wheel, SD);
+        wheel->timers[SD].phase = TIMER_NONE;
+        wheel->numTimers--;
+}
+
+
+/*
+ * name:      linkTimer
+ * purpose:   adds a timer to the slot of the wheel it expires in. The level
+ *            is picked by how far away the timer expires, each level's slots
+ *            covering 64 slots of the level below, and timers beyond the last
+ *            level wait in its furthest slot
+ * arguments: the timer wheel, the socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void linkTimer(timerWheel *wheel, int SD)
+{
+        timerEntry *timer = &wheel->timers[SD];
+        unsigned long long expireTick = timer->expireTick;
+        if (expireTick < wheel->currTick) {
+                expireTick = wheel->currTick;
+        }
+
+        unsigned long long delta = expireTick - wheel->currTick;
+        unsigned long long wheelSpan = 1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS);
+        if (delta >= wheelSpan) {
+                expireTick = wheel->currTick + wheelSpan - 1;
+                delta = wheelSpan - 1;
+        }
+
+        int level = 0;
+        while (delta >= (1ULL << (TIMER_SLOT_BITS * (level + 1)))) {
+                level++;
+        }
+        int slot = level * TIMER_SLOTS +
+                ((expireTick >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK);
+
+        timer->slot = slot;
+        timer->prev = -1;
+        timer->next = wheel->slots[slot];
+        if (timer->next != -1) {
+                wheel->timers[timer->next].prev = SD;
+        }
+        wheel->slots[slot] = SD;
+}
+
+
+/*
+ * name:      unlinkTimer
+ * purpose:   removes a timer from its slot of the wheel
+ * arguments: the timer wheel, the socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void unlinkTimer(timerWheel *wheel, int SD)
+{
+        timerEntry *timer = &wheel->timers[SD];
+        if (timer->prev != -1) {
+                wheel->timers[timer->prev].next = timer->next;
+        }
+        else {
+                wheel->slots[timer->slot] = timer->next;
+        }
+        if (timer->next != -1) {
+                wheel->timers[timer->next].prev = timer->prev;
+        }
+        timer->slot = -1;
+}
+
+
+
+
+/*****************************************************************************
+*                              RUNNING TIMERS
+******************************************************************************/
+
+
+/*
+ * name:      expireTimers
+ * purpose:   moves the wheel forward to the current time one tick at a time,
+ *            cascading the slots of the higher levels whenever the level
+ *            below wraps around, and handles the timers that expired
+ * arguments: the proxy instance
+ * returns:   none
+ * effects:   updates the proxy's loop time
+ */
+void expireTimers(proxy *theProxy)
+{
+        timerWheel *wheel = theProxy->timers;
+        if (wheel == NULL) {
+                return;
+        }
+        theProxy->loopTime = getCurrTime(theProxy->theCache);
+        unsigned long long nowTick = theProxy->loopTime / TIMER_TICK;
+
+        while (wheel->currTick < nowTick) {
+                // nothing left to expire, so skip the ticks in between
+                if (wheel->numTimers == 0) {
+                        wheel->currTick = nowTick;
+                        return;
+                }
+                wheel->currTick++;
+
+                for (int level = 1; level < TIMER_LEVELS; level++) {
+                        unsigned long long levelMask =
+                                (1ULL << (TIMER_SLOT_BITS * level)) - 1;
+                        if ((wheel->currTick & levelMask) != 0) {
+                                break;
+                        }
+                        cascadeTimers(wheel, level);
+                }
+
+                int slot = wheel->currTick & TIMER_SLOT_MASK;
+                while (wheel->slots[slot] != -1) {
+                        int SD = wheel->slots[slot];
+                        timerEntry *timer = &wheel->timers[SD];
+                        unlinkTimer(wheel, SD);
+                        if (timer->expireTick > wheel->currTick) {
+                                linkTimer(wheel, SD);
+                                continue;
+                        }
+
+                        int phase = timer->phase;
+                        timer->phase = TIMER_NONE;
+                        wheel->numTimers--;
+                        handleTimer(theProxy, SD, phase);
+                }
+        }
+}
+
+
+/*
+ * name:      cascadeTimers
+ * purpose:   moves the timers of the current slot of a level to the levels
+ *            below, now that they expire within that level's reach
+ * arguments: the timer wheel, the level
+ * returns:   none
+ * effects:   none
+ */
+void cascadeTimers(timerWheel *wheel, int level)
+{
+        int slot = level * TIMER_SLOTS + ((wheel->currTick >>
+                (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK);
+
+        int SD = wheel->slots[slot];
+        wheel->slots[slot] = -1;
+        while (SD != -1) {
+                int nextSD = wheel->timers[SD].next;
+                linkTimer(wheel, SD);
+                SD = nextSD;
+        }
+}
+
+
+/*
+ * name:      handleTimer
+ * purpose:   handles an expired timer according to the phase it timed
+ * arguments: the proxy instance, the socket descriptor, the phase
+ * returns:   none
+ * effects:   none
+ */
+void handleTimer(proxy *theProxy, int SD, int phase)
+{
+        DEBUG_PRINT("FUNCTION: handleTimer: %d\n", SD);
+        if (phase == TIMER_HEADER) {
+                expireConnectHeader(theProxy, SD);
+        }
+        else if (phase == TIMER_CONNECT) {
+                expireServerConnect(theProxy, SD);
+        }
+        else if (phase == TIMER_IDLE) {
+                expireIdleConnection(theProxy, SD);
+        }
+        else if (phase == TIMER_HANDSHAKE) {
+                expireHandshake(theProxy, SD);
+        }
+}
+
+
+/*
+ * name:      getTimerWaitTime
+ * purpose:   finds how long the event loop can wait before the wheel has to
+ *            move, which is the first tick with a timer in its slot or the
+ *            first cascade of a higher level slot holding timers
+ * arguments: the proxy instance
+ * returns:   the time in milliseconds, or -1 if no timer is running
+ * effects:   none
+ */
+int getTimerWaitTime(proxy *theProxy)
+{
+        timerWheel *wheel = theProxy->timers;
+        if (wheel == NULL || wheel->numTimers == 0) {
+                return -1;
+        }
+
+        unsigned long long nextTick = 0;
+        for (int level = 0; level < TIMER_LEVELS; level++) {
+                int shift = TIMER_SLOT_BITS * level;
+                unsigned long long position = wheel->currTick >> shift;
+                for (int i = 1; i <= TIMER_SLOTS; i++) {
+                        int slot = level * TIMER_SLOTS +
+                                ((position + i) & TIMER_SLOT_MASK);
+                        if (wheel->slots[slot] != -1) {
+                                unsigned long long tick = (position + i) << shift;
+                                if (nextTick == 0 || tick < nextTick) {
+                                        nextTick = tick;
+                                }
+                                break;
+                        }
+                }
+        }
+
+        unsigned long long now = getCurrTime(theProxy->theCache);
+        unsigned long long nextTime = nextTick * TIMER_TICK;
+        if (nextTime <= now) {
+                return 0;
+        }
+        // round up so the loop doesn't wake just before the tick
+        return (int)((nextTime - now + 999999) / 1000000);
+}
+
+
+
+
+/*****************************************************************************
+*                              PHASE TIMEOUTS
+******************************************************************************/
+
+
+/*
+ * name:      expireConnectHeader
+ * purpose:   removes a client that didn't send its full CONNECT request in
+ *            time after it was accepted
+ * arguments: the proxy instance, the client socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void expireConnectHeader(proxy *theProxy, int clientSD)
+{
+        connectionInfo *client = getClient(theProxy, clientSD);
+        if (client == NULL || client->connActive) {
+                return;
+        }
+        ERROR_PRINT("Client %d didn't send its CONNECT request in time\n",
+                clientSD);
+        removeClient(theProxy, clientSD);
+}
+
+
+/*
+ * name:      expireIdleConnection
+ * purpose:   closes a relayed connection when neither its client nor its
+ *            server sent or took any data for the idle timeout. Activity
+ *            only stamps the connection, so a timer that expires on a
+ *            connection that was used since is started again for the rest of
+ *            the timeout instead
+ * arguments: the proxy instance, the client socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void expireIdleConnection(proxy *theProxy, int clientSD)
+{
+        connectionInfo *client = getClient(theProxy, clientSD);
+        if (client == NULL) {
+                return;
+        }
+
+        unsigned long long idleTimeout = getIdleTimeout(theProxy);
+        unsigned long long lastActivity = getLastActivity(theProxy, client);
+        if (theProxy->loopTime - lastActivity < idleTimeout) {
+                startTimer(theProxy, clientSD, TIMER_IDLE,
+                        lastActivity + idleTimeout - theProxy->loopTime);
+                return;
+        }
+
+        INFO_PRINT("Closing idle connection to %s\n",
+                client->session->serverURL);
+        if (theProxy->uring != NULL &&
+                getUringConn(theProxy->uring, clientSD)->active) {
+                closeUringRelay(theProxy, clientSD);
+                return;
+        }
+        removeClient(theProxy, clientSD);
+}
+
+
+/*
+ * name:      expireHandshake
+ * purpose:   removes a MITM client whose TLS handshakes with it and its
+ *            server didn't both finish within the handshake timeout
+ * arguments: the proxy instance, the client socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void expireHandshake(proxy *theProxy, int clientSD)
+{
+        connectionInfo *client = getClient(theProxy, clientSD);
+        if (client == NULL) {
+                return;
+        }
+        ERROR_PRINT("TLS handshakes for %s timed out\n",
+                client->session->serverURL);
+        removeClient(theProxy, clientSD);
+}
+
+
+/*
+ * name:      getLastActivity
+ * purpose:   finds the last time either end of a client's connection was
+ *            serviced by the event loop or by io_uring
+ * arguments: the proxy instance, the client struct
+ * returns:   the time of the last activity
+ * effects:   none
+ */
+unsigned long long getLastActivity(proxy *theProxy, connectionInfo *client)
+{
+        unsigned long long lastActivity = client->lastActivity;
+        connectionInfo *server = client->session->server;
+        if (server != NULL && server->lastActivity > lastActivity) {
+                lastActivity = server->lastActivity;
+        }
+
+        if (theProxy->uring != NULL &&
+                getUringConn(theProxy->uring, client->clientSD)->active) {
+                uringConn *clientConn =
+                        getUringConn(theProxy->uring, client->clientSD);
+                uringConn *serverConn =
+                        getUringConn(theProxy->uring, clientConn->peerSD);
+                if (clientConn->lastActivity > lastActivity) {
+                        lastActivity = clientConn->lastActivity;
+                }
+                if (serverConn->lastActivity > lastActivity) {
+                        lastActivity = serverConn->lastActivity;
+                }
+        }
+        return lastActivity;
+}
+
+
+/*
+ * name:      getHeaderTimeout
+ * purpose:   gets how long a client has to send its CONNECT request
+ * arguments: the proxy instance
+ * returns:   the timeout in nanoseconds
+ * effects:   none
+ */
+unsigned long long getHeaderTimeout(proxy *theProxy)
+{
+        int timeout = HEADER_TIMEOUT;
+        if (theProxy->options != NULL) {
+                timeout = theProxy->options->headerTimeout;
+        }
+        return timeout * 1000000000ULL;
+}
+
+
+/*
+ * name:      getIdleTimeout
+ * purpose:   gets how long a relayed connection can go without traffic
+ * arguments: the proxy instance
+ * returns:   the timeout in nanoseconds
+ * effects:   none
+ */
+unsigned long long getIdleTimeout(proxy *theProxy)
+{
+        int timeout = IDLE_TIMEOUT;
+        if (theProxy->options != NULL) {
+                timeout = theProxy->options->idleTimeout;
+        }
+        return timeout * 1000000000ULL;
+}
+
+
+/*
+ * name:      getHandshakeTimeout
+ * purpose:   gets how long the TLS handshakes of a MITM connection with its
+ *            client and server can take together
+ * arguments: the proxy instance
+ * returns:   the timeout in nanoseconds
+ * effects:   none
+ */
+unsigned long long getHandshakeTimeout(proxy *theProxy)
+{
+        int timeout = HANDSHAKE_TIMEOUT;
+        if (theProxy->options != NULL) {
+                timeout = theProxy->options->handshakeTimeout;
+        }
+        return timeout * 1000000000ULL;
+}
@@ -20,6 +20,8 @@
 
 #define TUNNEL 0
 #define MITM 1
+#define RELAY_BUFFER_SIZE 65536
+#define ZEROCOPY_THRESHOLD 16384
 
 
 /*****************************************************************************
@@ -28,77 +30,83 @@
 
 /*
  * name:      setupTunnelToServer
- * purpose:   sets up the tunnel to the server by connecting to the server and 
- *            populating the appropriate struct fieds
- * arguments: the proxy, the client slot and index of the table
+ * purpose:   sets up the relaying of the tunnel once the connection to the 
+ *            server is established
+ * arguments: the proxy, the client's socket descriptor
  * returns:   none
  * effects:   none
  */
-void setupTunnelToServer(proxy *theProxy, int slot, int index)
+void setupTunnelToServer(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION: setupTunnelToServer\n");
 
-        connectionInfo *client = &theProxy->clientTable[slot].slotArray[index];
+        connectionInfo *client = theProxy->connTable[SD];
+        connectionInfo *server = getPeerConnection(theProxy, client);
+        if (checkNullErrSSL(theProxy, SD, server, 1)) return;
 
-        //get host IP address from hostname
-        struct hostent *hostInfo;
-        hostInfo = gethostbyname(client->serverURL);
-        if (checkNullErrSSL(theProxy, slot, index, hostInfo, 1)) return;
-
-        int serverSD = socket(AF_INET, SOCK_STREAM, 0);
-        client->serverSD = serverSD;
-
-        //ensure to close the socket and port after termination
-        int opt = 1;
-        int returnVal = setsockopt(serverSD, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        if (checkNegOneErrSSL(theProxy, slot, index, returnVal, 3)) return;
-
-        //Client setup to connect the socket to the server and its IP address
-        //this is the setup specifying the server info
-        struct sockaddr_in serverAddress;
-        memset(&serverAddress, 0, sizeof(struct sockaddr_in));
-        serverAddress.sin_family = AF_INET;
-        serverAddress.sin_addr = *(struct in_addr *)hostInfo->h_addr;
-        serverAddress.sin_port = htons(client->serverPort);
-        returnVal = connect(serverSD, (struct sockaddr *)&serverAddress, sizeof(serverAddress));
-        if (checkNegOneErrSSL(theProxy, slot, index, returnVal, 4)) return;
-
-        // add serverSD to the active set for select
-        FD_SET(serverSD, &theProxy->activeFDSet);
-        if (serverSD > theProxy->maxFD) {
-                theProxy->maxFD = serverSD;
-        }
-
-        populateServerStruct(theProxy, serverSD, client);
+        // hand the tunnel to io_uring if the worker runs that backend, 
+        // relay it through buffers sent with MSG_ZEROCOPY if asked to, and 
+        // otherwise with splice through a pipe per direction, copying 
+        // through buffers if the pipes can't be made
+        if (theProxy->uring != NULL && theProxy->uring->recvSupported) {
+                startUringRelay(theProxy, client->clientSD, client->serverSD);
+        }
+        else if (theProxy->options != NULL && 
+                theProxy->options->useZerocopy) {
+                enableZerocopy(client, client->clientSD);
+                enableZerocopy(server, server->serverSD);
+        }
+        else if (!setupSplicePipe(client) || !setupSplicePipe(server)) {
+                closeSplicePipe(client);
+                closeSplicePipe(server);
+        }
 }
 
 
 /*
  * name:      populateServerStruct
- * purpose:   populates the relevant fields in the server struct
- * arguments: the proxy instance, the slot and index in the table
- * returns:   none
+ * purpose:   adds the server to the connection table and to the session of 
+ *            its client
+ * arguments: the proxy instance, the server socket descriptor, the client
+ * returns:   the server struct
  * effects:   none
  */
-void populateServerStruct(proxy *theProxy, int serverSD, connectionInfo *client)
+connectionInfo *populateServerStruct(proxy *theProxy, int serverSD, 
+        connectionInfo *client)
 {
-        int serverSlot = hashTableKey(theProxy, serverSD);
-        int serverIndex = theProxy->clientTable[serverSlot].numSlotItems;
-        theProxy->numClients++;
-        theProxy->clientTable[serverSlot].numSlotItems++;
-
-        connectionInfo *server = 
-                &theProxy->clientTable[serverSlot].slotArray[serverIndex];
+        connectionInfo *server = addConnection(theProxy, serverSD);
         server->isClient = false;
         server->serverSD = serverSD;
         server->clientSD = client->clientSD;
         server->connActive = true;
-        server->serverPort = client->serverPort;
-        server->mode = TUNNEL;
+        server->mode = client->mode;
+        joinSession(server, client->session);
+
+        return server;
+}
+
+
+/*
+ * name:      setupSplicePipe
+ * purpose:   creates the pipe used to splice the data read from this 
+ *            connection's socket to its peer without copying it to userspace
+ * arguments: the connection struct
+ * returns:   true if the pipe was created, false otherwise
+ * effects:   populates the pipe struct fields
+ */
+bool setupSplicePipe(connectionInfo *conn)
+{
+        DEBUG_PRINT("FUNCTION: setupSplicePipe\n");
+        int pipeSD[2];
+        if (pipe2(pipeSD, O_NONBLOCK | O_CLOEXEC) == -1) {
+                ERROR_PRINT("Failed to create splice pipe, copying instead\n");
+                return false;
+        }
 
-        int URLLength = strlen(client->serverURL);
-        server->serverURL = malloc(URLLength);
-        memcpy(server->serverURL, client->serverURL, URLLength);
+        conn->pipeRead = pipeSD[0];
+        conn->pipeWrite = pipeSD[1];
+        conn->pipeBytes = 0;
+        return true;
 }
 
 
@@ -108,74 +116,419 @@ void populateServerStruct(proxy *theProxy, int serverSD, connectionInfo *client)
 ******************************************************************************/
 
 
+/*
+ * name:      relayTunnelSplice
+ * purpose:   moves the data waiting on this connection's socket to its peer 
+ *            by splicing it socket -> pipe -> socket, so the bytes never 
+ *            leave the kernel
+ * arguments: the proxy instance, the connection's socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void relayTunnelSplice(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION relayTunnelSplice\n");
+        connectionInfo *conn = theProxy->connTable[SD];
+        int readSD = conn->isClient ? conn->clientSD : conn->serverSD;
+
+        int readReturn = splice(readSD, NULL, conn->pipeWrite, NULL, 65536, 
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (readReturn == -1 && errno == EAGAIN) return;
+        if (checkPendingClose(theProxy, SD, readReturn)) return;
+        if (checkNegErrSSL(theProxy, SD, readReturn, 5)) return;
+        conn->pipeBytes += readReturn;
+
+        // whatever the peer can't take stays in the pipe until it's writable
+        flushOutput(theProxy, SD, conn);
+}
+
+
 /*
  * name:      relayClientToServer
  * purpose:   reads a message from the server and forwards this to the client
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
  * effects:   none
  */
-void relayClientToServer(proxy *theProxy, int slot, int index)
+void relayClientToServer(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION relayClientToServer\n");
+        if (checkZerocopyEvent(theProxy, SD)) return;
+
+        connectionInfo *conn = theProxy->connTable[SD];
 
-        int bufferSize = 4096;
-        char *readBuffer = malloc(bufferSize + 1);
-        if (checkNullErrSSL(theProxy, slot, index, readBuffer, 1)) return;
+        // leave room for the terminator inside the buffer's size class
+        int bufferSize = RELAY_BUFFER_SIZE - 1;
+        char *readBuffer = getTunnelBuffer(theProxy, conn, bufferSize + 1);
+        if (checkNullErrSSL(theProxy, SD, readBuffer, 1)) return;
 
-        int clientSD = theProxy->clientTable[slot].slotArray[index].clientSD;
-        int serverSD = theProxy->clientTable[slot].slotArray[index].serverSD;
+        int clientSD = conn->clientSD;
+        int serverSD = conn->serverSD;
 
         int readReturn = read(clientSD, readBuffer, bufferSize);
-        if (checkNegErrSSL(theProxy, slot, index, readReturn, 2)) return;
+        if ((readReturn == -1 && errno == EAGAIN) || 
+                checkPendingClose(theProxy, SD, readReturn)) {
+                releaseRelayBuffer(theProxy, conn);
+                return;
+        }
+        if (checkNegErrSSL(theProxy, SD, readReturn, 2)) return;
 
         readBuffer[readReturn] = '\0';
-        if (checkNegOneErrSSL(theProxy, slot, index, serverSD, 3)) return;
+        if (checkNegOneErrSSL(theProxy, SD, serverSD, 3)) return;
 
-        int totalSent = 0;
-        while (totalSent < readReturn) {
-                int writeReturn = write(serverSD, readBuffer + totalSent, 
-                        readReturn - totalSent);
-                if (checkNegErrSSL(theProxy, slot, index, writeReturn, 4)) return;
-                totalSent += writeReturn;
+        if (!writeTunnelData(theProxy, SD, serverSD, readBuffer, 
+                readReturn)) return;
+
+        // a read that didn't fill the buffer emptied the socket
+        if (readReturn < bufferSize) {
+                releaseRelayBuffer(theProxy, conn);
         }
 
         DEBUG_PRINT("Sent client message to server\n");
-        free(readBuffer);
 }
 
 
 /*
  * name:      relayServerToClient
  * purpose:   reads a message from the client and forwards this to the server
- * arguments: the proxy instance, the slot and index in the table
+ * arguments: the proxy instance, the connection's socket descriptor
  * returns:   none
  * effects:   none
  */
-void relayServerToClient(proxy *theProxy, int slot, int index)
+void relayServerToClient(proxy *theProxy, int SD)
 {
         DEBUG_PRINT("FUNCTION relayServerToClient\n");
+        if (checkZerocopyEvent(theProxy, SD)) return;
+
+        connectionInfo *conn = theProxy->connTable[SD];
 
-        int bufferSize = 4096;
-        char *readBuffer = malloc(bufferSize + 1);
-        if (checkNullErrSSL(theProxy, slot, index, readBuffer, 1)) return;
+        // leave room for the terminator inside the buffer's size class
+        int bufferSize = RELAY_BUFFER_SIZE - 1;
+        char *readBuffer = getTunnelBuffer(theProxy, conn, bufferSize + 1);
+        if (checkNullErrSSL(theProxy, SD, readBuffer, 1)) return;
 
-        int clientSD = theProxy->clientTable[slot].slotArray[index].clientSD;
-        int serverSD = theProxy->clientTable[slot].slotArray[index].serverSD;
+        int clientSD = conn->clientSD;
+        int serverSD = conn->serverSD;
 
         int readReturn = read(serverSD, readBuffer, bufferSize);
-        if (checkNegErrSSL(theProxy, slot, index, readReturn, 2)) return;
+        if ((readReturn == -1 && errno == EAGAIN) || 
+                checkPendingClose(theProxy, SD, readReturn)) {
+                releaseRelayBuffer(theProxy, conn);
+                return;
+        }
+        if (checkNegErrSSL(theProxy, SD, readReturn, 2)) return;
         readBuffer[readReturn] = '\0';
 
-        if (checkNegOneErrSSL(theProxy, slot, index, clientSD, 3)) return;
+        if (checkNegOneErrSSL(theProxy, SD, clientSD, 3)) return;
+
+        if (!writeTunnelData(theProxy, SD, clientSD, readBuffer, 
+                readReturn)) return;
+
+        // a read that didn't fill the buffer emptied the socket
+        if (readReturn < bufferSize) {
+                releaseRelayBuffer(theProxy, conn);
+        }
+}
+
+
+/*****************************************************************************
+*                             ZERO COPY SENDING
+******************************************************************************/
+
+
+/*
+ * name:      enableZerocopy
+ * purpose:   turns on SO_ZEROCOPY for a tunnel socket so large writes to it 
+ *            can be sent straight from the relay buffer with MSG_ZEROCOPY
+ * arguments: the struct of the connection owning the socket, the socket
+ * returns:   none
+ * effects:   sets the zerocopyEnabled field if the kernel supports it
+ */
+void enableZerocopy(connectionInfo *conn, int SD)
+{
+        DEBUG_PRINT("FUNCTION: enableZerocopy\n");
+        int opt = 1;
+        int returnVal = setsockopt(SD, SOL_SOCKET, SO_ZEROCOPY, &opt, 
+                sizeof(opt));
+        conn->zerocopyEnabled = (returnVal == 0);
+        conn->zerocopySends = 0;
+}
+
 
+/*
+ * name:      getTunnelBuffer
+ * purpose:   gets the buffer a tunnel connection reads into, a mapped one if 
+ *            its peer is sent to with MSG_ZEROCOPY
+ * arguments: the proxy instance, the connection struct, the size needed
+ * returns:   the buffer, or NULL if it couldn't be allocated
+ * effects:   none
+ */
+char *getTunnelBuffer(proxy *theProxy, connectionInfo *conn, int size)
+{
+        connectionInfo *peer = getPeerConnection(theProxy, conn);
+        if (peer != NULL && peer->zerocopyEnabled) {
+                return getMappedRelayBuffer(theProxy, conn, size);
+        }
+        return getRelayBuffer(theProxy, conn, size);
+}
+
+
+/*
+ * name:      writeTunnelData
+ * purpose:   writes a relayed buffer to the peer socket without blocking, 
+ *            queuing whatever the peer can't take yet. Buffers above the 
+ *            threshold are sent with MSG_ZEROCOPY and kept on the peer's 
+ *            pending list until the kernel reports them as completed
+ * arguments: the proxy instance, the connection's socket descriptor, the socket 
+ *            to write to, the buffer and its length
+ * returns:   true if the write succeeded, false if the connection was removed
+ * effects:   the buffer is the connection's relay buffer, which is handed on 
+ *            to the output queue or the pending list if it is still needed
+ */
+bool writeTunnelData(proxy *theProxy, int SD, int writeSD, 
+        char *buffer, int length)
+{
+        DEBUG_PRINT("FUNCTION: writeTunnelData\n");
+        connectionInfo *conn = theProxy->connTable[SD];
+        connectionInfo *peer = getPeerConnection(theProxy, conn);
+
+        // keep the byte order, the data goes behind what is already queued
+        if (conn->outputBytes > 0) {
+                appendOutputChunk(theProxy, conn, takeRelayBuffer(conn), 0, 
+                        length);
+                setOutputState(theProxy, conn);
+                return true;
+        }
+
+        bool zerocopy = (peer != NULL) && peer->zerocopyEnabled && 
+                (length >= ZEROCOPY_THRESHOLD) && isMappedBuffer(buffer);
+        if (zerocopy) {
+                // free what the kernel is done with before queuing more
+                reapZerocopyCompletions(theProxy, peer, writeSD);
+                zerocopy = peer->zerocopyEnabled;
+        }
+
+        int zerocopySends = 0;
         int totalSent = 0;
-        while (totalSent < readReturn) {
-                int writeReturn = write(clientSD, readBuffer + totalSent, 
-                        readReturn - totalSent);
-                if (checkNegErrSSL(theProxy, slot, index, writeReturn, 4)) return;
+        while (totalSent < length) {
+                int flags = zerocopy ? MSG_ZEROCOPY : 0;
+                int writeReturn = send(writeSD, buffer + totalSent, 
+                        length - totalSent, flags);
+
+                if (writeReturn == -1 && errno == EAGAIN) {
+                        break;
+                }
+
+                // out of pinned memory, copy the rest of this buffer
+                if (writeReturn == -1 && zerocopy && errno == ENOBUFS) {
+                        zerocopy = false;
+                        continue;
+                }
+                if (checkNegErrSSL(theProxy, SD, writeReturn, 4)) return false;
+                if (zerocopy) {
+                        zerocopySends++;
+                }
                 totalSent += writeReturn;
         }
 
-        free(readBuffer);
+        if (zerocopySends == 0) {
+                if (totalSent < length) {
+                        appendOutputChunk(theProxy, conn, takeRelayBuffer(conn), 
+                                totalSent, length);
+                        setOutputState(theProxy, conn);
+                }
+                return true;
+        }
+
+        // the kernel numbers zerocopy sends per socket, remember the last one 
+        // that still references this buffer
+        zerocopyBuffer *pending = 
+                allocObject(&theProxy->slabs->zerocopyBuffers);
+        peer->zerocopySends += zerocopySends;
+        pending->buffer = takeRelayBuffer(conn);
+        pending->lastSend = peer->zerocopySends - 1;
+        pending->next = NULL;
+
+        if (peer->zerocopyTail == NULL) {
+                peer->zerocopyHead = pending;
+        }
+        else {
+                peer->zerocopyTail->next = pending;
+        }
+        peer->zerocopyTail = pending;
+
+        // the kernel still owns the buffer, so queue a copy of the rest
+        if (totalSent < length) {
+                return queueOutputData(theProxy, SD, buffer + totalSent, 
+                        length - totalSent);
+        }
+        return true;
+}
+
+
+/*
+ * name:      checkZerocopyEvent
+ * purpose:   checks if the current event on this connection's socket is a 
+ *            zerocopy completion rather than data to relay, and if so reaps 
+ *            the completions from the socket's error queue
+ * arguments: the proxy instance, the connection's socket descriptor
+ * returns:   true if the event only carried completions, false if the socket 
+ *            should still be read
+ * effects:   frees the completed zerocopy buffers
+ */
+bool checkZerocopyEvent(proxy *theProxy, int SD)
+{
+        if (theProxy->numReady == 0) {
+                return false;
+        }
+        uint32_t events = theProxy->readyEvents[theProxy->currEvent].events;
+        if (!(events & EPOLLERR)) {
+                return false;
+        }
+
+        connectionInfo *conn = theProxy->connTable[SD];
+        reapZerocopyCompletions(theProxy, conn, SD);
+        if (events & (EPOLLIN | EPOLLHUP)) {
+                return false;
+        }
+
+        // the completions may already have been reaped by a send, so only 
+        // read the socket if it holds a real error to report
+        int socketError = 0;
+        socklen_t errorLength = sizeof(socketError);
+        getsockopt(SD, SOL_SOCKET, SO_ERROR, &socketError, &errorLength);
+        return socketError == 0;
+}
+
+
+/*
+ * name:      reapZerocopyCompletions
+ * purpose:   reads the zerocopy completion notifications queued on a socket's 
+ *            error queue without blocking
+ * arguments: the proxy instance, the struct of the connection owning the 
+ *            socket, the socket
+ * returns:   true if any completion was read, false otherwise
+ * effects:   frees the completed buffers and turns zerocopy off for the 
+ *            socket if the kernel had to copy the data anyway
+ */
+bool reapZerocopyCompletions(proxy *theProxy, connectionInfo *conn, int SD)
+{
+        DEBUG_PRINT("FUNCTION: reapZerocopyCompletions\n");
+        bool reaped = false;
+        char control[128];
+
+        while (true) {
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                if (recvmsg(SD, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+                        break;
+                }
+
+                struct cmsghdr *cmsg;
+                for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; 
+                        cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                        bool isIPv4 = (cmsg->cmsg_level == SOL_IP) && 
+                                (cmsg->cmsg_type == IP_RECVERR);
+                        bool isIPv6 = (cmsg->cmsg_level == SOL_IPV6) && 
+                                (cmsg->cmsg_type == IPV6_RECVERR);
+                        if (!isIPv4 && !isIPv6) {
+                                continue;
+                        }
+
+                        struct sock_extended_err *err = 
+                                (struct sock_extended_err *)CMSG_DATA(cmsg);
+                        if (err->ee_errno != 0 || 
+                                err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                                continue;
+                        }
+
+                        // copying sends are cheaper than pinning pages that 
+                        // get copied anyway, as happens over loopback
+                        if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && 
+                                conn->zerocopyEnabled) {
+                                INFO_PRINT("Zerocopy sends to %d were copied, "
+                                        "copying instead\n", SD);
+                                conn->zerocopyEnabled = false;
+                        }
+                        releaseZerocopyBuffers(theProxy, conn, err->ee_data);
+                        reaped = true;
+                }
+        }
+
+        return reaped;
+}
+
+
+/*
+ * name:      releaseZerocopyBuffers
+ * purpose:   frees the pending zerocopy buffers whose last send is covered by 
+ *            a completion notification
+ * arguments: the proxy instance, the connection struct, the last completed 
+ *            send number
+ * returns:   none
+ * effects:   none
+ */
+void releaseZerocopyBuffers(proxy *theProxy, connectionInfo *conn, 
+        unsigned int lastDone)
+{
+        while (conn->zerocopyHead != NULL && 
+                (int)(conn->zerocopyHead->lastSend - lastDone) <= 0) {
+                zerocopyBuffer *done = conn->zerocopyHead;
+                conn->zerocopyHead = done->next;
+                freeBuffer(theProxy, done->buffer);
+                freeObject(&theProxy->slabs->zerocopyBuffers, done);
+        }
+        if (conn->zerocopyHead == NULL) {
+                conn->zerocopyTail = NULL;
+        }
+}
+
+
+
+/*****************************************************************************
+*                              RESET FUNCTIONS
+******************************************************************************/
+
+
+/*
+ * name:      closeSplicePipe
+ * purpose:   closes the splice pipe of a connection if it has one
+ * arguments: the connection struct
+ * returns:   none
+ * effects:   resets the pipe struct fields
+ */
+void closeSplicePipe(connectionInfo *conn)
+{
+        if (conn->pipeRead != -1) {
+                close(conn->pipeRead);
+                close(conn->pipeWrite);
+        }
+        conn->pipeRead = -1;
+        conn->pipeWrite = -1;
+        conn->pipeBytes = 0;
+}
+
+
+/*
+ * name:      freeZerocopyBuffers
+ * purpose:   frees all zerocopy buffers still pending on a connection. The 
+ *            kernel may not be done sending them, so they are unmapped 
+ *            rather than kept, and their pages can't be handed out again
+ * arguments: the proxy instance, the connection struct
+ * returns:   none
+ * effects:   resets the zerocopy struct fields
+ */
+void freeZerocopyBuffers(proxy *theProxy, connectionInfo *conn)
+{
+        while (conn->zerocopyHead != NULL) {
+                zerocopyBuffer *pending = conn->zerocopyHead;
+                conn->zerocopyHead = pending->next;
+                dropBuffer(pending->buffer);
+                freeObject(&theProxy->slabs->zerocopyBuffers, pending);
+        }
+        conn->zerocopyTail = NULL;
+        conn->zerocopyEnabled = false;
+        conn->zerocopySends = 0;
 }
@@ -0,0 +1,773 @@
+/*****************************************************************************
+ *
+ *      uring.c
+ *
+ *      Isabel Muste (imuste01)
+ *      Marti Zentmaier (mzentm01)
+ *
+ *      11/10/2024
+ *
+ *      CS 112 Final Project
+ *
+ *      Contains the optional io_uring backend for relaying tunnel traffic.
+ *      Both sockets of a tunnel get a multishot receive that fills buffers
+ *      from a ring registered with the kernel, and every receive completion
+ *      queues a send of that same buffer to the peer, so no data is copied
+ *      and one io_uring_enter call covers many sends and receives. The ring
+ *      descriptor is registered with the worker's epoll loop, which wakes
+ *      up whenever completions are waiting.
+ *
+ *
+ *****************************************************************************/
+
+#include "proxy.h"
+#include "logging.h"
+
+#define URING_RECV 1
+#define URING_SEND 2
+
+#define URING_ENTRIES 1024
+#define URING_NUM_BUFS 512
+#define URING_BUF_SIZE 16384
+#define URING_BUF_GROUP 0
+
+
+/*
+ * name:      uringUserData
+ * purpose:   packs the operation, buffer ID and socket of a request into the
+ *            user data that is returned with its completion
+ * arguments: the operation, the buffer ID, the socket descriptor
+ * returns:   the packed user data
+ * effects:   none
+ */
+static __u64 uringUserData(int op, int bufID, int SD)
+{
+        return ((__u64)op << 56) | ((__u64)(bufID & 0xffff) << 32)
+                | (__u32)SD;
+}
+
+
+
+/*****************************************************************************
+*                               URING SETUP
+******************************************************************************/
+
+
+/*
+ * name:      initializeUring
+ * purpose:   creates the io_uring instance of a worker, maps its rings and
+ *            registers the receive buffers. On kernels without io_uring (or
+ *            without provided buffer rings) the worker keeps using the epoll
+ *            readiness loop for its tunnels
+ * arguments: the proxy instance
+ * returns:   true if the io_uring backend is in use, false otherwise
+ * effects:   populates the uring field of the proxy
+ */
+bool initializeUring(proxy *theProxy)
+{
+        DEBUG_PRINT("FUNCTION: initializeUring\n");
+        uringInfo *uring = calloc(1, sizeof(uringInfo));
+        checkFatalNull(uring);
+
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(struct io_uring_params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+
+        uring->ringFD = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        if (uring->ringFD < 0) {
+                INFO_PRINT("io_uring unavailable, using epoll for tunnels\n");
+                free(uring);
+                return false;
+        }
+
+        // map the submission ring, completion ring and submission entries
+        size_t sqSize = params.sq_off.array +
+                params.sq_entries * sizeof(unsigned);
+        size_t cqSize = params.cq_off.cqes +
+                params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                sqSize = cqSize = (sqSize > cqSize) ? sqSize : cqSize;
+        }
+
+        char *sqRing = mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, uring->ringFD, IORING_OFF_SQ_RING);
+        char *cqRing = sqRing;
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+        && sqRing != MAP_FAILED) {
+                cqRing = mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->ringFD,
+                        IORING_OFF_CQ_RING);
+        }
+        uring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                uring->ringFD, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED
+        || uring->sqes == MAP_FAILED) {
+                ERROR_PRINT("Failed to map the io_uring rings\n");
+                close(uring->ringFD);
+                free(uring);
+                return false;
+        }
+
+        uring->sqHead = (unsigned *)(sqRing + params.sq_off.head);
+        uring->sqTail = (unsigned *)(sqRing + params.sq_off.tail);
+        uring->sqMask = *(unsigned *)(sqRing + params.sq_off.ring_mask);
+        uring->sqEntries = params.sq_entries;
+        uring->sqArray = (unsigned *)(sqRing + params.sq_off.array);
+        uring->pendingSubmit = 0;
+
+        uring->cqHead = (unsigned *)(cqRing + params.cq_off.head);
+        uring->cqTail = (unsigned *)(cqRing + params.cq_off.tail);
+        uring->cqMask = *(unsigned *)(cqRing + params.cq_off.ring_mask);
+        uring->cqes = (struct io_uring_cqe *)(cqRing + params.cq_off.cqes);
+
+        if (!setupUringBuffers(uring)) {
+                INFO_PRINT("io_uring buffer rings unsupported, using epoll\n");
+                close(uring->ringFD);
+                free(uring);
+                return false;
+        }
+
+        uring->conns = NULL;
+        uring->numConns = 0;
+        uring->starvedList = NULL;
+        uring->numStarved = 0;
+        uring->recvSupported = true;
+
+        theProxy->uring = uring;
+        addToEventLoop(theProxy, uring->ringFD, EPOLLIN);
+        return true;
+}
+
+
+/*
+ * name:      setupUringBuffers
+ * purpose:   allocates the receive buffers and registers them with the
+ *            kernel as a provided buffer ring for the multishot receives
+ * arguments: the io_uring instance
+ * returns:   true if the buffers were registered, false otherwise
+ * effects:   none
+ */
+bool setupUringBuffers(uringInfo *uring)
+{
+        DEBUG_PRINT("FUNCTION: setupUringBuffers\n");
+        uring->numBufs = URING_NUM_BUFS;
+        uring->bufSize = URING_BUF_SIZE;
+
+        size_t ringSize = uring->numBufs * sizeof(struct io_uring_buf);
+        uring->bufRing = mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (uring->bufRing == MAP_FAILED) {
+                return false;
+        }
+
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+        reg.ring_addr = (__u64)(unsigned long)uring->bufRing;
+        reg.ring_entries = uring->numBufs;
+        reg.bgid = URING_BUF_GROUP;
+        int returnVal = syscall(__NR_io_uring_register, uring->ringFD,
+                IORING_REGISTER_PBUF_RING, &reg, 1);
+        if (returnVal < 0) {
+                munmap(uring->bufRing, ringSize);
+                return false;
+        }
+
+        uring->bufBase = malloc((size_t)uring->numBufs * uring->bufSize);
+        uring->bufLength = malloc(uring->numBufs * sizeof(int));
+        uring->bufOffset = malloc(uring->numBufs * sizeof(int));
+        uring->bufNext = malloc(uring->numBufs * sizeof(int));
+        checkFatalNull(uring->bufBase);
+        checkFatalNull(uring->bufLength);
+        checkFatalNull(uring->bufOffset);
+        checkFatalNull(uring->bufNext);
+
+        // hand every buffer to the kernel
+        uring->bufRing->tail = 0;
+        for (int i = 0; i < uring->numBufs; i++) {
+                recycleUringBuffer(uring, i);
+        }
+        return true;
+}
+
+
+
+/*****************************************************************************
+*                               RING ACCESS
+******************************************************************************/
+
+
+/*
+ * name:      getUringSQE
+ * purpose:   gets the next free submission queue entry, submitting queued
+ *            entries first if the submission ring is full
+ * arguments: the io_uring instance
+ * returns:   the cleared submission queue entry, or NULL if the ring is still
+ *            full because the submit failed
+ * effects:   advances the submission ring tail
+ */
+struct io_uring_sqe *getUringSQE(uringInfo *uring)
+{
+        unsigned tail = *uring->sqTail;
+        unsigned head = __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+        if (tail - head >= uring->sqEntries) {
+                submitUring(uring);
+                head = __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+                if (tail - head >= uring->sqEntries) {
+                        ERROR_PRINT("io_uring submission ring is full\n");
+                        return NULL;
+                }
+        }
+
+        unsigned index = tail & uring->sqMask;
+        struct io_uring_sqe *sqe = &uring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        uring->sqArray[index] = index;
+
+        __atomic_store_n(uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+        uring->pendingSubmit++;
+        return sqe;
+}
+
+
+/*
+ * name:      submitUring
+ * purpose:   submits every queued submission entry to the kernel with a
+ *            single io_uring_enter call
+ * arguments: the io_uring instance
+ * returns:   none
+ * effects:   none
+ */
+void submitUring(uringInfo *uring)
+{
+        while (uring->pendingSubmit > 0) {
+                int returnVal = syscall(__NR_io_uring_enter, uring->ringFD,
+                        uring->pendingSubmit, 0, 0, NULL, 0);
+                if (returnVal < 0) {
+                        if (errno == EINTR || errno == EAGAIN
+                        || errno == EBUSY) {
+                                continue;
+                        }
+                        ERROR_PRINT("io_uring_enter failed\n");
+                        return;
+                }
+                uring->pendingSubmit -= returnVal;
+        }
+}
+
+
+/*
+ * name:      reapUringCompletions
+ * purpose:   handles every completion waiting on the ring of the worker and
+ *            submits the sends and receives they queued
+ * arguments: the proxy instance
+ * returns:   none
+ * effects:   none
+ */
+void reapUringCompletions(proxy *theProxy)
+{
+        DEBUG_PRINT("FUNCTION: reapUringCompletions\n");
+        uringInfo *uring = theProxy->uring;
+
+        unsigned head = *uring->cqHead;
+        unsigned tail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+                struct io_uring_cqe cqe = uring->cqes[head & uring->cqMask];
+                head++;
+                __atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+
+                int op = (int)(cqe.user_data >> 56);
+                int bufID = (int)((cqe.user_data >> 32) & 0xffff);
+                int SD = (int)(cqe.user_data & 0xffffffff);
+                if (op == URING_RECV) {
+                        handleUringRecv(theProxy, SD, &cqe);
+                }
+                else if (op == URING_SEND) {
+                        handleUringSend(theProxy, SD, bufID, &cqe);
+                }
+
+                if (head == tail) {
+                        tail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+                }
+        }
+
+        submitUring(uring);
+}
+
+
+
+/*****************************************************************************
+*                             TUNNEL RELAYING
+******************************************************************************/
+
+
+/*
+ * name:      startUringRelay
+ * purpose:   moves a tunnel whose server connection is set up from the epoll
+ *            loop onto the io_uring instance and arms its receives
+ * arguments: the proxy instance, the client and server socket descriptors
+ * returns:   none
+ * effects:   the sockets no longer generate epoll events
+ */
+void startUringRelay(proxy *theProxy, int clientSD, int serverSD)
+{
+        DEBUG_PRINT("FUNCTION: startUringRelay\n");
+        uringInfo *uring = theProxy->uring;
+
+        removeFromEventLoop(theProxy, clientSD);
+        removeFromEventLoop(theProxy, serverSD);
+
+        uringConn *client = getUringConn(uring, clientSD);
+        uringConn *server = getUringConn(uring, serverSD);
+        memset(client, 0, sizeof(uringConn));
+        memset(server, 0, sizeof(uringConn));
+
+        client->peerSD = serverSD;
+        client->isClient = true;
+        client->active = true;
+        client->queueHead = client->queueTail = -1;
+
+        server->peerSD = clientSD;
+        server->isClient = false;
+        server->active = true;
+        server->queueHead = server->queueTail = -1;
+
+        if (!armUringRecv(uring, clientSD) || !armUringRecv(uring, serverSD)) {
+                closeUringRelay(theProxy, clientSD);
+                return;
+        }
+        submitUring(uring);
+}
+
+
+/*
+ * name:      getUringConn
+ * purpose:   gets the relay state of a socket, growing the table of relay
+ *            states if the descriptor is larger than any seen before
+ * arguments: the io_uring instance, the socket descriptor
+ * returns:   the relay state of the socket
+ * effects:   none
+ */
+uringConn *getUringConn(uringInfo *uring, int SD)
+{
+        if (SD >= uring->numConns) {
+                int newSize = (uring->numConns == 0) ? 1024 : uring->numConns;
+                while (newSize <= SD) {
+                        newSize *= 2;
+                }
+
+                uring->conns = realloc(uring->conns, newSize * sizeof(uringConn));
+                checkFatalNull(uring->conns);
+                memset(uring->conns + uring->numConns, 0,
+                        (newSize - uring->numConns) * sizeof(uringConn));
+
+                uring->starvedList = realloc(uring->starvedList,
+                        newSize * sizeof(int));
+                checkFatalNull(uring->starvedList);
+                uring->numConns = newSize;
+        }
+
+        return &uring->conns[SD];
+}
+
+
+/*
+ * name:      armUringRecv
+ * purpose:   queues a multishot receive on a socket which keeps producing
+ *            completions into the registered buffers until it is stopped
+ * arguments: the io_uring instance, the socket descriptor
+ * returns:   true if the receive was queued, false if there was no free
+ *            submission entry
+ * effects:   none
+ */
+bool armUringRecv(uringInfo *uring, int SD)
+{
+        uringConn *conn = getUringConn(uring, SD);
+        struct io_uring_sqe *sqe = getUringSQE(uring);
+        if (sqe == NULL) {
+                return false;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = SD;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->user_data = uringUserData(URING_RECV, 0, SD);
+
+        conn->recvArmed = true;
+        conn->starved = false;
+        conn->pendingOps++;
+        return true;
+}
+
+
+/*
+ * name:      sendNextUringBuffer
+ * purpose:   queues a send of the first buffer waiting for a socket. Only one
+ *            send per socket is in flight so the stream stays in order
+ * arguments: the io_uring instance, the destination socket descriptor
+ * returns:   false if a send was due but there was no free submission entry,
+ *            true otherwise
+ * effects:   none
+ */
+bool sendNextUringBuffer(uringInfo *uring, int SD)
+{
+        uringConn *conn = getUringConn(uring, SD);
+        int bufID = conn->queueHead;
+        if (conn->sending || conn->closing || bufID == -1) {
+                return true;
+        }
+
+        struct io_uring_sqe *sqe = getUringSQE(uring);
+        if (sqe == NULL) {
+                return false;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = SD;
+        sqe->addr = (__u64)(unsigned long)(uring->bufBase +
+                (size_t)bufID * uring->bufSize + uring->bufOffset[bufID]);
+        sqe->len = uring->bufLength[bufID] - uring->bufOffset[bufID];
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = uringUserData(URING_SEND, bufID, SD);
+
+        conn->sending = true;
+        conn->pendingOps++;
+        return true;
+}
+
+
+/*
+ * name:      handleUringRecv
+ * purpose:   handles a receive completion by queueing the filled buffer to be
+ *            sent to the peer socket, half closing the tunnel on EOF or
+ *            closing it on an error
+ * arguments: the proxy instance, the socket that was read, the completion
+ * returns:   none
+ * effects:   none
+ */
+void handleUringRecv(proxy *theProxy, int SD, struct io_uring_cqe *cqe)
+{
+        uringInfo *uring = theProxy->uring;
+        uringConn *conn = getUringConn(uring, SD);
+        conn->lastActivity = theProxy->loopTime;
+
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                conn->recvArmed = false;
+                conn->pendingOps--;
+        }
+
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                int bufID = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                if (conn->closing) {
+                        recycleUringBuffer(uring, bufID);
+                        finishUringRelay(theProxy, SD);
+                        return;
+                }
+
+                // append the buffer to the send queue of the peer
+                uringConn *peer = getUringConn(uring, conn->peerSD);
+                uring->bufLength[bufID] = cqe->res;
+                uring->bufOffset[bufID] = 0;
+                uring->bufNext[bufID] = -1;
+                if (peer->queueTail == -1) {
+                        peer->queueHead = bufID;
+                }
+                else {
+                        uring->bufNext[peer->queueTail] = bufID;
+                }
+                peer->queueTail = bufID;
+                if (!sendNextUringBuffer(uring, conn->peerSD)) {
+                        closeUringRelay(theProxy, SD);
+                        return;
+                }
+
+                // the multishot receive may stop, e.g. on a full CQ ring
+                if (!conn->recvArmed && !armUringRecv(uring, SD)) {
+                        closeUringRelay(theProxy, SD);
+                }
+                return;
+        }
+
+        if (cqe->res == -ENOBUFS) {
+                // every buffer is in flight, rearm once one is returned
+                if (!conn->closing && !conn->recvArmed && !conn->starved) {
+                        conn->starved = true;
+                        uring->starvedList[uring->numStarved++] = SD;
+                }
+                finishUringRelay(theProxy, SD);
+                return;
+        }
+
+        if (cqe->res == 0 && !conn->closing) {
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                        recycleUringBuffer(uring,
+                                cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                handleUringEOF(theProxy, SD);
+                return;
+        }
+
+        if (cqe->res == -EINVAL && !conn->closing) {
+                // multishot receives are unsupported on this kernel
+                uring->recvSupported = false;
+                returnUringConnToEpoll(theProxy, SD);
+                return;
+        }
+
+        if (!conn->closing) {
+                closeUringRelay(theProxy, SD);
+                return;
+        }
+        finishUringRelay(theProxy, SD);
+}
+
+
+/*
+ * name:      handleUringEOF
+ * purpose:   handles a socket that finished sending by no longer reading it
+ *            and passing the EOF on to the peer once the data queued for the
+ *            peer is sent. The other direction keeps relaying until it ends
+ *            too
+ * arguments: the proxy instance, the socket that reached EOF
+ * returns:   none
+ * effects:   none
+ */
+void handleUringEOF(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION: handleUringEOF\n");
+        uringInfo *uring = theProxy->uring;
+        uringConn *conn = getUringConn(uring, SD);
+        conn->readDone = true;
+        conn->starved = false;
+
+        getUringConn(uring, conn->peerSD)->peerReadDone = true;
+        shutdownUringWrite(theProxy, conn->peerSD);
+}
+
+
+/*
+ * name:      shutdownUringWrite
+ * purpose:   shuts down the sending side of a socket whose peer reached EOF
+ *            once nothing is queued for it anymore, and closes the tunnel
+ *            when both directions are finished
+ * arguments: the proxy instance, the destination socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void shutdownUringWrite(proxy *theProxy, int SD)
+{
+        uringInfo *uring = theProxy->uring;
+        uringConn *conn = getUringConn(uring, SD);
+        if (!conn->peerReadDone || conn->writeDone || conn->sending
+        || conn->queueHead != -1) {
+                return;
+        }
+
+        shutdown(SD, SHUT_WR);
+        conn->writeDone = true;
+        if (getUringConn(uring, conn->peerSD)->writeDone) {
+                closeUringRelay(theProxy, SD);
+        }
+}
+
+
+/*
+ * name:      handleUringSend
+ * purpose:   handles a send completion by resending the rest of a short send
+ *            or returning the buffer and sending the next queued one
+ * arguments: the proxy instance, the destination socket, the buffer ID, the
+ *            completion
+ * returns:   none
+ * effects:   none
+ */
+void handleUringSend(proxy *theProxy, int SD, int bufID,
+        struct io_uring_cqe *cqe)
+{
+        uringInfo *uring = theProxy->uring;
+        uringConn *conn = getUringConn(uring, SD);
+        conn->sending = false;
+        conn->pendingOps--;
+        conn->lastActivity = theProxy->loopTime;
+
+        if (cqe->res > 0 && !conn->closing) {
+                uring->bufOffset[bufID] += cqe->res;
+                if (uring->bufOffset[bufID] < uring->bufLength[bufID]) {
+                        if (!sendNextUringBuffer(uring, SD)) {
+                                closeUringRelay(theProxy, SD);
+                        }
+                        return;
+                }
+        }
+
+        // the buffer is done, take it off the queue and give it back
+        conn->queueHead = uring->bufNext[bufID];
+        if (conn->queueHead == -1) {
+                conn->queueTail = -1;
+        }
+        recycleUringBuffer(uring, bufID);
+        rearmStarvedUringConns(uring);
+
+        if (cqe->res <= 0 && !conn->closing) {
+                closeUringRelay(theProxy, SD);
+                return;
+        }
+        if (conn->closing) {
+                finishUringRelay(theProxy, SD);
+                return;
+        }
+        if (!sendNextUringBuffer(uring, SD)) {
+                closeUringRelay(theProxy, SD);
+                return;
+        }
+        shutdownUringWrite(theProxy, SD);
+}
+
+
+
+/*****************************************************************************
+*                             BUFFER HANDLING
+******************************************************************************/
+
+
+/*
+ * name:      recycleUringBuffer
+ * purpose:   gives a buffer back to the kernel's provided buffer ring so a
+ *            multishot receive can fill it again
+ * arguments: the io_uring instance, the buffer ID
+ * returns:   none
+ * effects:   advances the buffer ring tail
+ */
+void recycleUringBuffer(uringInfo *uring, int bufID)
+{
+        unsigned short tail = uring->bufRing->tail;
+        struct io_uring_buf *buf =
+                &uring->bufRing->bufs[tail & (uring->numBufs - 1)];
+        buf->addr = (__u64)(unsigned long)(uring->bufBase +
+                (size_t)bufID * uring->bufSize);
+        buf->len = uring->bufSize;
+        buf->bid = bufID;
+
+        __atomic_store_n(&uring->bufRing->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * name:      rearmStarvedUringConns
+ * purpose:   rearms the receives that stopped because no buffer was free.
+ *            Sockets whose receive can't be queued yet stay on the list
+ * arguments: the io_uring instance
+ * returns:   none
+ * effects:   none
+ */
+void rearmStarvedUringConns(uringInfo *uring)
+{
+        int numLeft = 0;
+        for (int i = 0; i < uring->numStarved; i++) {
+                int SD = uring->starvedList[i];
+                uringConn *conn = getUringConn(uring, SD);
+                if (conn->active && conn->starved && !conn->closing
+                && !conn->recvArmed && !conn->readDone
+                && !armUringRecv(uring, SD)) {
+                        uring->starvedList[numLeft++] = SD;
+                        continue;
+                }
+                conn->starved = false;
+        }
+        uring->numStarved = numLeft;
+}
+
+
+
+/*****************************************************************************
+*                             RESET FUNCTIONS
+******************************************************************************/
+
+
+/*
+ * name:      closeUringRelay
+ * purpose:   starts closing a tunnel after an error, or once both directions
+ *            reached EOF, by shutting down both sockets, which completes
+ *            their outstanding receives and sends
+ * arguments: the proxy instance, either socket of the tunnel
+ * returns:   none
+ * effects:   none
+ */
+void closeUringRelay(proxy *theProxy, int SD)
+{
+        DEBUG_PRINT("FUNCTION: closeUringRelay\n");
+        uringInfo *uring = theProxy->uring;
+        int sockets[2] = { SD, getUringConn(uring, SD)->peerSD };
+
+        for (int i = 0; i < 2; i++) {
+                uringConn *conn = getUringConn(uring, sockets[i]);
+                conn->closing = true;
+                shutdown(sockets[i], SHUT_RDWR);
+
+                // buffers that were never sent can go back right away
+                int bufID = conn->queueHead;
+                if (conn->sending && bufID != -1) {
+                        bufID = uring->bufNext[bufID];
+                        uring->bufNext[conn->queueHead] = -1;
+                        conn->queueTail = conn->queueHead;
+                }
+                else {
+                        conn->queueHead = conn->queueTail = -1;
+                }
+                while (bufID != -1) {
+                        int nextID = uring->bufNext[bufID];
+                        recycleUringBuffer(uring, bufID);
+                        bufID = nextID;
+                }
+        }
+
+        finishUringRelay(theProxy, SD);
+}
+
+
+/*
+ * name:      finishUringRelay
+ * purpose:   removes a closing tunnel once neither socket has an operation
+ *            in flight, so its descriptors can safely be closed and reused
+ * arguments: the proxy instance, either socket of the tunnel
+ * returns:   none
+ * effects:   closes both sockets and frees their table entries
+ */
+void finishUringRelay(proxy *theProxy, int SD)
+{
+        uringInfo *uring = theProxy->uring;
+        uringConn *conn = getUringConn(uring, SD);
+        if (!conn->active || !conn->closing) {
+                return;
+        }
+
+        uringConn *peer = getUringConn(uring, conn->peerSD);
+        if (conn->pendingOps > 0 || peer->pendingOps > 0) {
+                return;
+        }
+
+        int clientSD = conn->isClient ? SD : conn->peerSD;
+        conn->active = false;
+        peer->active = false;
+
+        if (getClient(theProxy, clientSD) != NULL) {
+                removeClient(theProxy, clientSD);
+        }
+}
+
+
+/*
+ * name:      returnUringConnToEpoll
+ * purpose:   hands a socket back to the epoll readiness loop when the kernel
+ *            cannot run multishot receives on it
+ * arguments: the proxy instance, the socket descriptor
+ * returns:   none
+ * effects:   none
+ */
+void returnUringConnToEpoll(proxy *theProxy, int SD)
+{
+        INFO_PRINT("Multishot receive unsupported, using epoll for tunnels\n");
+        uringConn *conn = getUringConn(theProxy->uring, SD);
+        conn->active = false;
+        addToEventLoop(theProxy, SD, EPOLLIN);
+}